@@ -29,6 +29,13 @@ open(MH, "Murmur.h");
 
 sub func($$\@\@\@) {
   my ($class, $func, $wrapargs, $callargs, $implargs) = @_;
+
+  # Calls on a booted server run on that server's thread. Starting, stopping
+  # and deleting servers stays on the main thread.
+  my $route = "";
+  if (($class eq "Server") && ($func !~ /^(isRunning|start|stop|delete|id)$/)) {
+    $route = ", QString::fromStdString(current.id.name).toInt()";
+  }
   
 
   print I qq'
@@ -58,7 +65,7 @@ void ::Murmur::${class}I::${func}_async('. join(", ", @{$wrapargs}).qq') {
 		}
 	}
 #endif
-	ExecEvent *ie = new ExecEvent(boost::bind(&impl_${class}_$func, ' . join(", ", @${callargs}).qq'));
+	ExecEvent *ie = new ExecEvent(boost::bind(&impl_${class}_$func, ' . join(", ", @${callargs}).qq')$route);
 	QCoreApplication::instance()->postEvent(mi, ie);
 }
 ';
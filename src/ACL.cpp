@@ -58,14 +58,37 @@ ChanACL::ChanACL(Channel *chan) : QObject(chan) {
 
 #ifdef MURMUR
 
-bool ChanACL::hasPermission(ServerUser *p, Channel *chan, QFlags<Perm> perm, ACLCache *cache) {
-	Permissions granted = effectivePermissions(p, chan, cache);
+ChanACL::Compiled::Compiled(const Channel *chan) {
+	bInheritACL = chan->bInheritACL;
+	qvEntries.reserve(chan->qlACL.count());
+
+	foreach(const ChanACL *acl, chan->qlACL) {
+		Entry e;
+		e.iUserId = acl->iUserId;
+		e.grGroup = Group::Reference(acl->qsGroup);
+		e.bApplyHere = acl->bApplyHere;
+		e.bApplySubs = acl->bApplySubs;
+		e.pAllow = acl->pAllow;
+		e.pDeny = acl->pDeny;
+		qvEntries << e;
+	}
+}
+
+ChanACL::CacheStats::CacheStats() {
+	uiHits = uiMisses = 0;
+}
+
+bool ChanACL::hasPermission(ServerUser *p, Channel *chan, QFlags<Perm> perm, ACLCache *cache, CompiledCache *compiled, CacheStats *stats) {
+	Permissions granted = effectivePermissions(p, chan, cache, compiled, stats);
 
 	return ((granted & perm) != None);
 }
 
 // Return effective permissions.
-QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan, ACLCache *cache) {
+// If compiled is given, the pre-parsed ACL lists of chan and its parents are
+// taken from (and added to) it; otherwise they're built for this call only.
+// If stats is given, lookups in cache are counted there.
+QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan, ACLCache *cache, CompiledCache *compiled, CacheStats *stats) {
 	// Superuser
 	if (p->iId == 0) {
 		return static_cast<Permissions>(All &~ (Speak|Whisper));
@@ -80,9 +103,14 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 	}
 
 	if (granted & Cached) {
+		if (stats)
+			++stats->uiHits;
 		return granted;
 	}
 
+	if (stats)
+		++stats->uiMisses;
+
 	QStack<Channel *> chanstack;
 	Channel *ch = chan;
 
@@ -98,38 +126,48 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 
 	bool traverse = true;
 	bool write = false;
-	ChanACL *acl;
+	QList<Compiled *> scratch;
 
 	while (! chanstack.isEmpty()) {
 		ch = chanstack.pop();
-		if (! ch->bInheritACL)
+
+		const Compiled *cc = compiled ? compiled->value(ch) : NULL;
+		if (! cc) {
+			Compiled *nc = new Compiled(ch);
+			if (compiled)
+				compiled->insert(ch, nc);
+			else
+				scratch << nc;
+			cc = nc;
+		}
+
+		if (! cc->bInheritACL)
 			granted = def;
 
-		foreach(acl, ch->qlACL) {
-			bool matchUser = (acl->iUserId != -1) && (acl->iUserId == p->iId);
-			bool matchGroup = Group::isMember(chan, ch, acl->qsGroup, p);
-			if (matchUser || matchGroup) {
-				if (acl->pAllow & Traverse)
+		foreach(const Compiled::Entry &e, cc->qvEntries) {
+			bool matchUser = (e.iUserId != -1) && (e.iUserId == p->iId);
+			if (matchUser || Group::isMember(chan, ch, e.grGroup, p)) {
+				if (e.pAllow & Traverse)
 					traverse = true;
-				if (acl->pDeny & Traverse)
+				if (e.pDeny & Traverse)
 					traverse = false;
-				if (acl->pAllow & Write)
+				if (e.pAllow & Write)
 					write = true;
-				if (acl->pDeny & Write)
+				if (e.pDeny & Write)
 					write = false;
-				if (ch->iId == 0 && chan == ch && acl->bApplyHere) {
-					if (acl->pAllow & Kick)
+				if (ch->iId == 0 && chan == ch && e.bApplyHere) {
+					if (e.pAllow & Kick)
 						granted |= Kick;
-					if (acl->pAllow & Ban)
+					if (e.pAllow & Ban)
 						granted |= Ban;
-					if (acl->pAllow & Register)
+					if (e.pAllow & Register)
 						granted |= Register;
-					if (acl->pAllow & SelfRegister)
+					if (e.pAllow & SelfRegister)
 						granted |= SelfRegister;
 				}
-				if ((ch==chan && acl->bApplyHere) || (ch!=chan && acl->bApplySubs)) {
-					granted |= (acl->pAllow & ~(Kick|Ban|Register|SelfRegister|Cached));
-					granted &= ~acl->pDeny;
+				if ((ch==chan && e.bApplyHere) || (ch!=chan && e.bApplySubs)) {
+					granted |= (e.pAllow & ~(Kick|Ban|Register|SelfRegister|Cached));
+					granted &= ~e.pDeny;
 				}
 			}
 		}
@@ -139,6 +177,8 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 		}
 	}
 
+	qDeleteAll(scratch);
+
 	if (granted & Write) {
 		granted |= Traverse|Enter|MuteDeafen|Move|MakeChannel|LinkChannel|TextMessage|MakeTempChannel;
 		if (chan->iId == 0)
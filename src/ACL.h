@@ -33,6 +33,11 @@
 
 #include <QtCore/QHash>
 #include <QtCore/QObject>
+#include <QtCore/QVector>
+
+#ifdef MURMUR
+#include "Group.h"
+#endif
 
 class Channel;
 class User;
@@ -72,6 +77,34 @@ class ChanACL : public QObject {
 		typedef QHash<Channel *, Permissions> ChanCache;
 		typedef QHash<User *, ChanCache * > ACLCache;
 
+#ifdef MURMUR
+		// The ACL list of a single channel, copied out of the ChanACL objects
+		// with group names pre-parsed. Shared by every user evaluated against
+		// the channel and dropped whenever the channel's ACLs change.
+		struct Compiled {
+			struct Entry {
+				int iUserId;
+				Group::Reference grGroup;
+				bool bApplyHere;
+				bool bApplySubs;
+				Permissions pAllow;
+				Permissions pDeny;
+			};
+			bool bInheritACL;
+			QVector<Entry> qvEntries;
+			Compiled(const Channel *c);
+		};
+		typedef QHash<const Channel *, Compiled *> CompiledCache;
+
+		// Lookups answered from an ACLCache and ones that had to be
+		// computed. Guarded by whatever guards the cache.
+		struct CacheStats {
+			quint64 uiHits;
+			quint64 uiMisses;
+			CacheStats();
+		};
+#endif
+
 		Channel *c;
 		bool bApplyHere;
 		bool bApplySubs;
@@ -85,8 +118,8 @@ class ChanACL : public QObject {
 
 		ChanACL(Channel *c);
 #ifdef MURMUR
-		static bool hasPermission(ServerUser *p, Channel *c, QFlags<Perm> perm, ACLCache *cache);
-		static QFlags<Perm> effectivePermissions(ServerUser *p, Channel *c, ACLCache *cache);
+		static bool hasPermission(ServerUser *p, Channel *c, QFlags<Perm> perm, ACLCache *cache, CompiledCache *compiled = NULL, CacheStats *stats = NULL);
+		static QFlags<Perm> effectivePermissions(ServerUser *p, Channel *c, ACLCache *cache, CompiledCache *compiled = NULL, CacheStats *stats = NULL);
 #else
 		static QString whatsThis(Perm p);
 #endif
@@ -31,6 +31,7 @@
 #ifndef MUMBLE_CHANNEL_H_
 #define MUMBLE_CHANNEL_H_
 
+#include <QtCore/QAtomicInt>
 #include <QtCore/QHash>
 #include <QtCore/QList>
 #include <QtCore/QObject>
@@ -68,6 +69,12 @@ class Channel : public QObject {
 
 		bool bInheritACL;
 
+#ifdef MURMUR
+		// Changes whenever who hears normal speech in this channel may have
+		// changed: its users, its links or their ACLs. See Server::speakFanout.
+		QAtomicInt qaiFanout;
+#endif
+
 		Channel(int id, const QString &name, QObject *p = NULL);
 		~Channel();
 
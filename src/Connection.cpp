@@ -39,6 +39,7 @@
 
 #include "Connection.h"
 #include "Message.h"
+#include "MessageFrame.h"
 #include "Mumble.pb.h"
 
 
@@ -123,6 +124,10 @@ void Connection::resetActivityTime() {
  * and emits it as a message so it can be handled by the corresponding message handler
  * routine.
  *
+ * Payloads are read into a buffer owned by the connection and reused for the next
+ * message, so framing doesn't allocate per message. Receivers that keep a copy of
+ * the QByteArray share it until the next read detaches the buffer again.
+ *
  * @see QSslSocket::readyRead()
  * @see void ServerHandler::message(unsigned int msgType, const QByteArray &qbaMsg)
  * @see void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *u)
@@ -131,31 +136,44 @@ void Connection::socketRead() {
 	while (true) {
 		qint64 iAvailable = qtsSocket->bytesAvailable();
 		if (iPacketLength == -1) {
-			if (iAvailable < 6)
+			if (iAvailable < MessageFrame::HeaderSize)
 				return;
 
-			unsigned char a_ucBuffer[6];
+			unsigned char a_ucBuffer[MessageFrame::HeaderSize];
 
-			qtsSocket->read(reinterpret_cast<char *>(a_ucBuffer), 6);
-			uiType = qFromBigEndian<quint16>(&a_ucBuffer[0]);
-			iPacketLength = qFromBigEndian<quint32>(&a_ucBuffer[2]);
-			iAvailable -= 6;
+			qtsSocket->read(reinterpret_cast<char *>(a_ucBuffer), MessageFrame::HeaderSize);
+			MessageFrame::readHeader(a_ucBuffer, uiType, iPacketLength);
+			iAvailable -= MessageFrame::HeaderSize;
 		}
 
 		if ((iPacketLength == -1) || (iAvailable < iPacketLength))
 			return;
 
-		if (iPacketLength > 0x7fffff) {
+		if ((iPacketLength < 0) || (iPacketLength > MessageFrame::MaxPayload)) {
 			qWarning() << "Host tried to send huge packet";
 			disconnectSocket(true);
 			return;
 		}
 
-		QByteArray qbaBuffer = qtsSocket->read(iPacketLength);
+		const int len = iPacketLength;
 		iPacketLength = -1;
-		iAvailable -= iPacketLength;
 
-		emit message(uiType, qbaBuffer);
+		if (len == 0) {
+			emit message(uiType, QByteArray());
+			continue;
+		}
+
+		if (qbaReadBuffer.capacity() < len)
+			qbaReadBuffer.reserve(len);
+		qbaReadBuffer.resize(len);
+		qtsSocket->read(qbaReadBuffer.data(), len);
+
+		emit message(uiType, qbaReadBuffer);
+
+		// Big messages (textures, long text) are rare; don't hold on to
+		// up to MaxPayload bytes per connection because of one.
+		if (len > ReadBufferKeep)
+			qbaReadBuffer.clear();
 	}
 }
 
@@ -177,14 +195,13 @@ void Connection::socketDisconnected() {
 
 void Connection::messageToNetwork(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache) {
 	int len = msg.ByteSize();
-	if (len > 0x7fffff)
+	if (len > MessageFrame::MaxPayload)
 		return;
-	cache.resize(len + 6);
+	cache.resize(len + MessageFrame::HeaderSize);
 	unsigned char *uc = reinterpret_cast<unsigned char *>(cache.data());
-	qToBigEndian<quint16>(msgType, & uc[0]);
-	qToBigEndian<quint32>(len, & uc[2]);
+	MessageFrame::writeHeader(uc, msgType, len);
 
-	msg.SerializeToArray(uc + 6, len);
+	msg.SerializeWithCachedSizesToArray(uc + MessageFrame::HeaderSize);
 }
 
 void Connection::sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache) {
@@ -196,11 +213,51 @@ void Connection::sendMessage(const ::google::protobuf::Message &msg, unsigned in
 }
 
 void Connection::sendMessage(const QByteArray &qbaMsg) {
-	if (! qbaMsg.isEmpty())
+	if (! qbaMsg.isEmpty()) {
+		flushQueued();
 		qtsSocket->write(qbaMsg);
+	}
+}
+
+void Connection::sendMessage(const char *data, int len) {
+	if (len > 0) {
+		flushQueued();
+		qtsSocket->write(data, len);
+	}
+}
+
+void Connection::sendMessage(const MessageFrame &frame) {
+	sendMessage(frame.constData(), frame.size());
+}
+
+// Queued messages are held back until flushQueued(), so that a burst of
+// them goes out in one write. Anything sent directly flushes the queue
+// first, which keeps messages in the order they were produced.
+void Connection::queueMessage(const char *data, int len) {
+	if (len > 0)
+		qbaQueued.append(data, len);
+}
+
+void Connection::flushQueued() {
+	if (qbaQueued.isEmpty())
+		return;
+
+	qtsSocket->write(qbaQueued);
+	qbaQueued.clear();
+}
+
+bool Connection::hasQueued() const {
+	return ! qbaQueued.isEmpty();
+}
+
+// Bytes accepted by sendMessage() that the kernel has not taken yet.
+qint64 Connection::bytesToWrite() const {
+	return qbaQueued.size() + qtsSocket->bytesToWrite() + qtsSocket->encryptedBytesToWrite();
 }
 
 void Connection::forceFlush() {
+	flushQueued();
+
 	if (qtsSocket->state() != QAbstractSocket::ConnectedState)
 		return;
 
@@ -223,10 +280,13 @@ void Connection::disconnectSocket(bool force) {
 		return;
 	}
 
-	if (force)
+	if (force) {
+		qbaQueued.clear();
 		qtsSocket->abort();
-	else
+	} else {
+		flushQueued();
 		qtsSocket->disconnectFromHost();
+	}
 }
 
 QHostAddress Connection::peerAddress() const {
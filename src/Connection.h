@@ -52,6 +52,8 @@ class Message;
 }
 }
 
+class MessageFrame;
+
 class Connection : public QObject {
 	private:
 		Q_OBJECT
@@ -65,6 +67,10 @@ class Connection : public QObject {
 #endif
 		unsigned int uiType;
 		int iPacketLength;
+		// Reused for every message read. Kept at its size for messages up
+		// to ReadBufferKeep bytes, released after anything larger.
+		QByteArray qbaReadBuffer;
+		QByteArray qbaQueued;
 #ifdef Q_OS_WIN
 		static HANDLE hQoS;
 		DWORD dwFlow;
@@ -82,11 +88,19 @@ class Connection : public QObject {
 		void message(unsigned int type, const QByteArray &);
 		void handleSslErrors(const QList<QSslError> &);
 	public:
+		enum { ReadBufferKeep = 64 * 1024 };
+
 		Connection(QObject *parent, QSslSocket *qtsSocket);
 		~Connection();
 		static void messageToNetwork(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache);
 		void sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache);
 		void sendMessage(const QByteArray &qbaMsg);
+		void sendMessage(const char *data, int len);
+		void sendMessage(const MessageFrame &frame);
+		void queueMessage(const char *data, int len);
+		void flushQueued();
+		bool hasQueued() const;
+		qint64 bytesToWrite() const;
 		void disconnectSocket(bool force=false);
 		void forceFlush();
 		int activityTime() const;
@@ -43,10 +43,25 @@
 
 #include "Net.h"
 
+// AES-NI intrinsics are compiled per function, so the rest of the file does
+// not require a CPU with AES-NI; hasAESNI() decides at runtime.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define USE_AESNI
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define USE_AESNI
+#define AESNI_TARGET
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
 CryptState::CryptState() {
 	for (int i=0;i<0x100;i++)
 		decrypt_history[i] = 0;
 	bInit = false;
+	bAESNI = false;
 	uiGood=uiLate=uiLost=uiResync=0;
 	uiRemoteGood=uiRemoteLate=uiRemoteLost=uiRemoteResync=0;
 }
@@ -59,8 +74,7 @@ void CryptState::genKey() {
 	RAND_bytes(raw_key, AES_BLOCK_SIZE);
 	RAND_bytes(encrypt_iv, AES_BLOCK_SIZE);
 	RAND_bytes(decrypt_iv, AES_BLOCK_SIZE);
-	AES_set_encrypt_key(raw_key, 128, &encrypt_key);
-	AES_set_decrypt_key(raw_key, 128, &decrypt_key);
+	setupKeys();
 	bInit = true;
 }
 
@@ -68,8 +82,7 @@ void CryptState::setKey(const unsigned char *rkey, const unsigned char *eiv, con
 	memcpy(raw_key, rkey, AES_BLOCK_SIZE);
 	memcpy(encrypt_iv, eiv, AES_BLOCK_SIZE);
 	memcpy(decrypt_iv, div, AES_BLOCK_SIZE);
-	AES_set_encrypt_key(raw_key, 128, &encrypt_key);
-	AES_set_decrypt_key(raw_key, 128, &decrypt_key);
+	setupKeys();
 	bInit = true;
 }
 
@@ -230,10 +243,238 @@ static void inline ZERO(keyblock &block) {
 		block[i]=0;
 }
 
+#ifdef USE_AESNI
+#define AESNI_LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))
+#define AESNI_STORE(p, v) _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v)
+#define AESNI_EXPAND(k, rcon) aesni_expand(k, _mm_aeskeygenassist_si128(k, rcon))
+
+AESNI_TARGET static inline __m128i aesni_expand(__m128i key, __m128i gen) {
+	gen = _mm_shuffle_epi32(gen, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, gen);
+}
+
+AESNI_TARGET static void aesni_setkey(const unsigned char *raw, unsigned char *enc, unsigned char *dec) {
+	__m128i k[11];
+
+	k[0] = AESNI_LOAD(raw);
+	k[1] = AESNI_EXPAND(k[0], 0x01);
+	k[2] = AESNI_EXPAND(k[1], 0x02);
+	k[3] = AESNI_EXPAND(k[2], 0x04);
+	k[4] = AESNI_EXPAND(k[3], 0x08);
+	k[5] = AESNI_EXPAND(k[4], 0x10);
+	k[6] = AESNI_EXPAND(k[5], 0x20);
+	k[7] = AESNI_EXPAND(k[6], 0x40);
+	k[8] = AESNI_EXPAND(k[7], 0x80);
+	k[9] = AESNI_EXPAND(k[8], 0x1b);
+	k[10] = AESNI_EXPAND(k[9], 0x36);
+
+	// The decryption schedule is the reversed encryption schedule, with
+	// InvMixColumns applied to the inner round keys.
+	for (int i=0;i<11;i++)
+		AESNI_STORE(enc + i * AES_BLOCK_SIZE, k[i]);
+	AESNI_STORE(dec, k[10]);
+	for (int i=1;i<10;i++)
+		AESNI_STORE(dec + i * AES_BLOCK_SIZE, _mm_aesimc_si128(k[10-i]));
+	AESNI_STORE(dec + 10 * AES_BLOCK_SIZE, k[0]);
+}
+
+AESNI_TARGET static inline void aesni_loadkey(__m128i *k, const unsigned char *key) {
+	for (int i=0;i<11;i++)
+		k[i] = AESNI_LOAD(key + i * AES_BLOCK_SIZE);
+}
+
+AESNI_TARGET static inline __m128i aesni_encrypt(__m128i b, const __m128i *k) {
+	b = _mm_xor_si128(b, k[0]);
+	for (int r=1;r<10;r++)
+		b = _mm_aesenc_si128(b, k[r]);
+	return _mm_aesenclast_si128(b, k[10]);
+}
+
+AESNI_TARGET static inline __m128i aesni_decrypt(__m128i b, const __m128i *k) {
+	b = _mm_xor_si128(b, k[0]);
+	for (int r=1;r<10;r++)
+		b = _mm_aesdec_si128(b, k[r]);
+	return _mm_aesdeclast_si128(b, k[10]);
+}
+
+// Four independent blocks per round keep the AES units busy; a single
+// block would stall on the latency of every aesenc.
+AESNI_TARGET static inline void aesni_encrypt4(__m128i *b, const __m128i *k) {
+	for (int i=0;i<4;i++)
+		b[i] = _mm_xor_si128(b[i], k[0]);
+	for (int r=1;r<10;r++)
+		for (int i=0;i<4;i++)
+			b[i] = _mm_aesenc_si128(b[i], k[r]);
+	for (int i=0;i<4;i++)
+		b[i] = _mm_aesenclast_si128(b[i], k[10]);
+}
+
+AESNI_TARGET static inline void aesni_decrypt4(__m128i *b, const __m128i *k) {
+	for (int i=0;i<4;i++)
+		b[i] = _mm_xor_si128(b[i], k[0]);
+	for (int r=1;r<10;r++)
+		for (int i=0;i<4;i++)
+			b[i] = _mm_aesdec_si128(b[i], k[r]);
+	for (int i=0;i<4;i++)
+		b[i] = _mm_aesdeclast_si128(b[i], k[10]);
+}
+
+// Same construction as the generic ocb_encrypt() below. Deltas are still
+// advanced with S2() on a keyblock so both paths produce identical output.
+AESNI_TARGET static void ocb_encrypt_aesni(const unsigned char *ekey, const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	__m128i k[11];
+	__m128i b[4], d[4];
+	keyblock delta, tmp;
+	unsigned char buf[AES_BLOCK_SIZE];
+
+	aesni_loadkey(k, ekey);
+
+	// Initialize
+	AESNI_STORE(delta, aesni_encrypt(AESNI_LOAD(nonce), k));
+	__m128i checksum = _mm_setzero_si128();
+
+	while (len > 4 * AES_BLOCK_SIZE) {
+		for (int i=0;i<4;i++) {
+			S2(delta);
+			d[i] = AESNI_LOAD(delta);
+			__m128i p = AESNI_LOAD(plain + i * AES_BLOCK_SIZE);
+			checksum = _mm_xor_si128(checksum, p);
+			b[i] = _mm_xor_si128(p, d[i]);
+		}
+		aesni_encrypt4(b, k);
+		for (int i=0;i<4;i++)
+			AESNI_STORE(encrypted + i * AES_BLOCK_SIZE, _mm_xor_si128(b[i], d[i]));
+		len -= 4 * AES_BLOCK_SIZE;
+		plain += 4 * AES_BLOCK_SIZE;
+		encrypted += 4 * AES_BLOCK_SIZE;
+	}
+
+	while (len > AES_BLOCK_SIZE) {
+		S2(delta);
+		d[0] = AESNI_LOAD(delta);
+		__m128i p = AESNI_LOAD(plain);
+		checksum = _mm_xor_si128(checksum, p);
+		AESNI_STORE(encrypted, _mm_xor_si128(aesni_encrypt(_mm_xor_si128(p, d[0]), k), d[0]));
+		len -= AES_BLOCK_SIZE;
+		plain += AES_BLOCK_SIZE;
+		encrypted += AES_BLOCK_SIZE;
+	}
+
+	S2(delta);
+	ZERO(tmp);
+	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
+	__m128i pad = aesni_encrypt(_mm_xor_si128(AESNI_LOAD(tmp), AESNI_LOAD(delta)), k);
+	AESNI_STORE(buf, pad);
+	memcpy(buf, plain, len);
+	__m128i t = AESNI_LOAD(buf);
+	checksum = _mm_xor_si128(checksum, t);
+	AESNI_STORE(buf, _mm_xor_si128(pad, t));
+	memcpy(encrypted, buf, len);
+
+	S3(delta);
+	AESNI_STORE(tag, aesni_encrypt(_mm_xor_si128(AESNI_LOAD(delta), checksum), k));
+}
+
+AESNI_TARGET static void ocb_decrypt_aesni(const unsigned char *ekey, const unsigned char *dkey, const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	__m128i k[11], dk[11];
+	__m128i b[4], d[4];
+	keyblock delta, tmp;
+	unsigned char buf[AES_BLOCK_SIZE];
+
+	aesni_loadkey(k, ekey);
+	aesni_loadkey(dk, dkey);
+
+	// Initialize
+	AESNI_STORE(delta, aesni_encrypt(AESNI_LOAD(nonce), k));
+	__m128i checksum = _mm_setzero_si128();
+
+	while (len > 4 * AES_BLOCK_SIZE) {
+		for (int i=0;i<4;i++) {
+			S2(delta);
+			d[i] = AESNI_LOAD(delta);
+			b[i] = _mm_xor_si128(AESNI_LOAD(encrypted + i * AES_BLOCK_SIZE), d[i]);
+		}
+		aesni_decrypt4(b, dk);
+		for (int i=0;i<4;i++) {
+			__m128i p = _mm_xor_si128(b[i], d[i]);
+			checksum = _mm_xor_si128(checksum, p);
+			AESNI_STORE(plain + i * AES_BLOCK_SIZE, p);
+		}
+		len -= 4 * AES_BLOCK_SIZE;
+		plain += 4 * AES_BLOCK_SIZE;
+		encrypted += 4 * AES_BLOCK_SIZE;
+	}
+
+	while (len > AES_BLOCK_SIZE) {
+		S2(delta);
+		d[0] = AESNI_LOAD(delta);
+		__m128i p = _mm_xor_si128(aesni_decrypt(_mm_xor_si128(AESNI_LOAD(encrypted), d[0]), dk), d[0]);
+		checksum = _mm_xor_si128(checksum, p);
+		AESNI_STORE(plain, p);
+		len -= AES_BLOCK_SIZE;
+		plain += AES_BLOCK_SIZE;
+		encrypted += AES_BLOCK_SIZE;
+	}
+
+	S2(delta);
+	ZERO(tmp);
+	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
+	__m128i pad = aesni_encrypt(_mm_xor_si128(AESNI_LOAD(tmp), AESNI_LOAD(delta)), k);
+	memset(buf, 0, AES_BLOCK_SIZE);
+	memcpy(buf, encrypted, len);
+	__m128i t = _mm_xor_si128(AESNI_LOAD(buf), pad);
+	checksum = _mm_xor_si128(checksum, t);
+	AESNI_STORE(buf, t);
+	memcpy(plain, buf, len);
+
+	S3(delta);
+	AESNI_STORE(tag, aesni_encrypt(_mm_xor_si128(AESNI_LOAD(delta), checksum), k));
+}
+#endif
+
+bool CryptState::hasAESNI() {
+#if defined(USE_AESNI) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#elif defined(USE_AESNI)
+	unsigned int eax, ebx, ecx, edx;
+	if (! __get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & (1 << 25)) != 0;
+#else
+	return false;
+#endif
+}
+
+void CryptState::setupKeys() {
+	AES_set_encrypt_key(raw_key, 128, &encrypt_key);
+	AES_set_decrypt_key(raw_key, 128, &decrypt_key);
+
+#ifdef USE_AESNI
+	static const bool aesni = hasAESNI();
+	bAESNI = aesni;
+	if (bAESNI)
+		aesni_setkey(raw_key, aesni_encrypt_key, aesni_decrypt_key);
+#else
+	bAESNI = false;
+#endif
+}
+
 #define AESencrypt(src,dst,key) AES_encrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
 #define AESdecrypt(src,dst,key) AES_decrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
 
 void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+#ifdef USE_AESNI
+	if (bAESNI) {
+		ocb_encrypt_aesni(aesni_encrypt_key, plain, encrypted, len, nonce, tag);
+		return;
+	}
+#endif
+
 	keyblock checksum, delta, tmp, pad;
 
 	// Initialize
@@ -268,6 +509,13 @@ void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypte
 }
 
 void CryptState::ocb_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+#ifdef USE_AESNI
+	if (bAESNI) {
+		ocb_decrypt_aesni(aesni_encrypt_key, aesni_decrypt_key, encrypted, plain, len, nonce, tag);
+		return;
+	}
+#endif
+
 	keyblock checksum, delta, tmp, pad;
 
 	// Initialize
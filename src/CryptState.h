@@ -56,6 +56,10 @@ class CryptState {
 
 		AES_KEY	encrypt_key;
 		AES_KEY decrypt_key;
+		// Round keys for the AES-NI code path, valid if bAESNI is set.
+		unsigned char aesni_encrypt_key[11 * AES_BLOCK_SIZE];
+		unsigned char aesni_decrypt_key[11 * AES_BLOCK_SIZE];
+		bool bAESNI;
 		Timer tLastGood;
 		Timer tLastRequest;
 		bool bInit;
@@ -65,6 +69,8 @@ class CryptState {
 		void genKey();
 		void setKey(const unsigned char *rkey, const unsigned char *eiv, const unsigned char *div);
 		void setDecryptIV(const unsigned char *iv);
+		void setupKeys();
+		static bool hasAESNI();
 
 		void ocb_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag);
 		void ocb_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag);
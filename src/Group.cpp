@@ -121,148 +121,185 @@ QSet<QString> Group::groupNames(Channel *chan) {
 	return m;
 }
 
-#define RET_FALSE (invert ? true : false)
-#define RET_TRUE (invert ? false : true)
-
-bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUser *pl) {
-	Channel *p;
-	Channel *c;
-	Group *g;
+Group::Reference::Reference(const QString &name) {
+	kKind = Empty;
+	bInvert = false;
+	bACLChannel = false;
+	iMinPath = 0;
+	iMinDesc = 1;
+	iMaxDesc = 1000;
 
-	bool m = false;
-	bool invert = false;
 	bool token = false;
 	bool hash = false;
-	c = curChan;
-
-	while (true) {
-		if (name.isEmpty())
-			return false;
-
-		if (name.startsWith(QChar::fromLatin1('!'))) {
-			invert = true;
-			name = name.remove(0,1);
-			continue;
-		}
-
-		if (name.startsWith(QChar::fromLatin1('~'))) {
-			c = aclChan;
-			name = name.remove(0,1);
-			continue;
-		}
-
-		if (name.startsWith(QChar::fromLatin1('#'))) {
+	int i = 0;
+
+	while (i < name.length()) {
+		const QChar c = name.at(i);
+		if (c == QLatin1Char('!'))
+			bInvert = true;
+		else if (c == QLatin1Char('~'))
+			bACLChannel = true;
+		else if (c == QLatin1Char('#'))
 			token = true;
-			name = name.remove(0,1);
-			continue;
-		}
-		if (name.startsWith(QChar::fromLatin1('$'))) {
+		else if (c == QLatin1Char('$'))
 			hash = true;
-			name = name.remove(0,1);
-			continue;
-		}
-
-		break;
+		else
+			break;
+		++i;
 	}
 
+	qsName = name.mid(i);
+	if (qsName.isEmpty())
+		return;
+
 	if (token)
-		m = pl->qslAccessTokens.contains(name, Qt::CaseInsensitive);
+		kKind = Token;
 	else if (hash)
-		m = pl->qsHash == name;
-	else if (name == QLatin1String("none"))
-		m = false;
-	else if (name == QLatin1String("all"))
-		m = true;
-	else if (name == QLatin1String("auth"))
-		m = (pl->iId >= 0);
-	else if (name == QLatin1String("strong"))
-		m = pl->bVerified;
-	else if (name == QLatin1String("in"))
-		m = (pl->cChannel == c);
-	else if (name == QLatin1String("out"))
-		m = !(pl->cChannel == c);
-	else if (name.startsWith(QLatin1String("sub"))) {
-		name = name.remove(0,4);
-		int mindesc = 1;
-		int maxdesc = 1000;
-		int minpath = 0;
-		QStringList args = name.split(QLatin1String(","));
+		kKind = Hash;
+	else if (qsName == QLatin1String("none"))
+		kKind = None;
+	else if (qsName == QLatin1String("all"))
+		kKind = All;
+	else if (qsName == QLatin1String("auth"))
+		kKind = Auth;
+	else if (qsName == QLatin1String("strong"))
+		kKind = Strong;
+	else if (qsName == QLatin1String("in"))
+		kKind = In;
+	else if (qsName == QLatin1String("out"))
+		kKind = Out;
+	else if (qsName.startsWith(QLatin1String("sub"))) {
+		kKind = Sub;
+		QStringList args = qsName.mid(4).split(QLatin1String(","));
 		switch (args.count()) {
 			default:
 			case 3:
-				maxdesc = args[2].isEmpty() ? maxdesc : args[2].toInt();
+				iMaxDesc = args[2].isEmpty() ? iMaxDesc : args[2].toInt();
 			case 2:
-				mindesc = args[1].isEmpty() ? mindesc : args[1].toInt();
+				iMinDesc = args[1].isEmpty() ? iMinDesc : args[1].toInt();
 			case 1:
-				minpath = args[0].isEmpty() ? minpath : args[0].toInt();
+				iMinPath = args[0].isEmpty() ? iMinPath : args[0].toInt();
 			case 0:
 				break;
 		}
-
-		Channel *home = pl->cChannel;
-		QList<Channel *> playerChain;
-		QList<Channel *> groupChain;
-
-		p = home;
-		while (p) {
-			playerChain.prepend(p);
-			p = p->cParent;
-		}
-
-		p = curChan;
-		while (p) {
-			groupChain.prepend(p);
-			p = p->cParent;
-		}
-
-		int cofs = groupChain.indexOf(c);
-		Q_ASSERT(cofs != -1);
-
-		cofs += minpath;
-
-		if (cofs >= groupChain.count()) {
-			return RET_FALSE;
-		} else if (cofs < 0) {
-			cofs = 0;
-		}
-
-		Channel *needed = groupChain[cofs];
-		if (playerChain.indexOf(needed) == -1) {
-			return RET_FALSE;
-		}
-
-		int mindepth = cofs + mindesc;
-		int maxdepth = cofs + maxdesc;
-
-		int pdepth = playerChain.count() - 1;
-
-		m = (pdepth >= mindepth) && (pdepth <= maxdepth);
 	} else {
-		QStack<Group *> s;
+		kKind = Named;
+	}
+}
 
-		p = c;
+bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUser *pl) {
+	return isMember(curChan, aclChan, Reference(name), pl);
+}
 
-		while (p) {
-			g = p->qhGroups.value(name);
+#define RET_FALSE (invert ? true : false)
+#define RET_TRUE (invert ? false : true)
 
-			if (g) {
-				if ((p != c) && ! g->bInheritable)
-					break;
-				s.push(g);
-				if (! g->bInherit)
-					break;
-			}
+bool Group::isMember(Channel *curChan, Channel *aclChan, const Reference &ref, ServerUser *pl) {
+	Channel *p;
+	Channel *c;
+	Group *g;
 
-			p = p->cParent;
-		}
+	bool m = false;
+	const bool invert = ref.bInvert;
+	const QString &name = ref.qsName;
+	c = ref.bACLChannel ? aclChan : curChan;
 
-		while (! s.isEmpty()) {
-			g = s.pop();
-			if (g->qsAdd.contains(pl->iId) || g->qsTemporary.contains(pl->iId) || g->qsTemporary.contains(- static_cast<int>(pl->uiSession)))
-				m = true;
-			if (g->qsRemove.contains(pl->iId))
-				m = false;
-		}
+	switch (ref.kKind) {
+		case Reference::Empty:
+			return false;
+		case Reference::Token:
+			m = pl->qslAccessTokens.contains(name, Qt::CaseInsensitive);
+			break;
+		case Reference::Hash:
+			m = pl->qsHash == name;
+			break;
+		case Reference::None:
+			m = false;
+			break;
+		case Reference::All:
+			m = true;
+			break;
+		case Reference::Auth:
+			m = (pl->iId >= 0);
+			break;
+		case Reference::Strong:
+			m = pl->bVerified;
+			break;
+		case Reference::In:
+			m = (pl->cChannel == c);
+			break;
+		case Reference::Out:
+			m = !(pl->cChannel == c);
+			break;
+		case Reference::Sub: {
+				Channel *home = pl->cChannel;
+				QList<Channel *> playerChain;
+				QList<Channel *> groupChain;
+
+				p = home;
+				while (p) {
+					playerChain.prepend(p);
+					p = p->cParent;
+				}
+
+				p = curChan;
+				while (p) {
+					groupChain.prepend(p);
+					p = p->cParent;
+				}
+
+				int cofs = groupChain.indexOf(c);
+				Q_ASSERT(cofs != -1);
+
+				cofs += ref.iMinPath;
+
+				if (cofs >= groupChain.count()) {
+					return RET_FALSE;
+				} else if (cofs < 0) {
+					cofs = 0;
+				}
+
+				Channel *needed = groupChain[cofs];
+				if (playerChain.indexOf(needed) == -1) {
+					return RET_FALSE;
+				}
+
+				int mindepth = cofs + ref.iMinDesc;
+				int maxdepth = cofs + ref.iMaxDesc;
+
+				int pdepth = playerChain.count() - 1;
+
+				m = (pdepth >= mindepth) && (pdepth <= maxdepth);
+			}
+			break;
+		case Reference::Named: {
+				QStack<Group *> s;
+
+				p = c;
+
+				while (p) {
+					g = p->qhGroups.value(name);
+
+					if (g) {
+						if ((p != c) && ! g->bInheritable)
+							break;
+						s.push(g);
+						if (! g->bInherit)
+							break;
+					}
+
+					p = p->cParent;
+				}
+
+				while (! s.isEmpty()) {
+					g = s.pop();
+					if (g->qsAdd.contains(pl->iId) || g->qsTemporary.contains(pl->iId) || g->qsTemporary.contains(- static_cast<int>(pl->uiSession)))
+						m = true;
+					if (g->qsRemove.contains(pl->iId))
+						m = false;
+				}
+			}
+			break;
 	}
 	return invert ? !m : m;
 }
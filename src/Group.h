@@ -32,6 +32,7 @@
 #define MUMBLE_GROUP_H_
 
 #include <QtCore/QSet>
+#include <QtCore/QString>
 
 class Channel;
 class User;
@@ -51,11 +52,26 @@ class Group {
 		Group(Channel *assoc, const QString &name);
 
 #ifdef MURMUR
+		// A group name as used in ACLs and whisper targets, with the
+		// !~#$ prefixes and the built-in names resolved up front.
+		struct Reference {
+			enum Kind { Empty, Named, Token, Hash, None, All, Auth, Strong, In, Out, Sub };
+			Kind kKind;
+			bool bInvert;
+			bool bACLChannel;
+			int iMinPath;
+			int iMinDesc;
+			int iMaxDesc;
+			QString qsName;
+			Reference(const QString &name = QString());
+		};
+
 		QSet<int> members();
 		static QSet<QString> groupNames(Channel *c);
 		static Group *getGroup(Channel *c, QString name);
 
 		static bool isMember(Channel *c, Channel *aclChan, QString name, ServerUser *);
+		static bool isMember(Channel *c, Channel *aclChan, const Reference &ref, ServerUser *);
 #endif
 };
 
@@ -0,0 +1,100 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MESSAGEFRAME_H_
+#define MUMBLE_MESSAGEFRAME_H_
+
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QtEndian>
+#include <google/protobuf/message.h>
+
+/*
+ * TCP control messages are framed as a 16 bit type and a 32 bit payload
+ * length, both big endian, followed by the protobuf payload.
+ *
+ * A MessageFrame holds one encoded frame in a buffer that is kept between
+ * messages, so encoding only allocates when a message is larger than any
+ * encoded into the same frame before. Broadcasts encode once and hand the
+ * same bytes to every recipient.
+ */
+
+class MessageFrame {
+	private:
+		Q_DISABLE_COPY(MessageFrame)
+	protected:
+		QVarLengthArray<char, 1024> qvaData;
+	public:
+		enum { HeaderSize = 6, MaxPayload = 0x7fffff };
+
+		MessageFrame() {
+		}
+
+		static void writeHeader(unsigned char *header, unsigned int msgType, int len) {
+			qToBigEndian<quint16>(static_cast<quint16>(msgType), &header[0]);
+			qToBigEndian<quint32>(static_cast<quint32>(len), &header[2]);
+		}
+
+		static void readHeader(const unsigned char *header, unsigned int &msgType, int &len) {
+			msgType = qFromBigEndian<quint16>(&header[0]);
+			len = static_cast<int>(qFromBigEndian<quint32>(&header[2]));
+		}
+
+		// Returns false, leaving the frame empty, if the message is too large to send.
+		bool encode(const ::google::protobuf::Message &msg, unsigned int msgType) {
+			int len = msg.ByteSize();
+			if (len > MaxPayload) {
+				qvaData.resize(0);
+				return false;
+			}
+			qvaData.resize(len + HeaderSize);
+			unsigned char *uc = reinterpret_cast<unsigned char *>(qvaData.data());
+			writeHeader(uc, msgType, len);
+			msg.SerializeWithCachedSizesToArray(uc + HeaderSize);
+			return true;
+		}
+
+		void clear() {
+			qvaData.resize(0);
+		}
+
+		const char *constData() const {
+			return qvaData.constData();
+		}
+
+		int size() const {
+			return qvaData.size();
+		}
+
+		bool isEmpty() const {
+			return qvaData.isEmpty();
+		}
+};
+
+#endif
@@ -0,0 +1,96 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "AttemptLimiter.h"
+
+AttemptLimiter::AttemptLimiter(int sets) {
+	int n = 1;
+	while (n < sets)
+		n <<= 1;
+	iSetMask = n - 1;
+	qvSlots.resize(n * Ways);
+	clear();
+}
+
+void AttemptLimiter::clear() {
+	for (int i=0;i<qvSlots.count();++i)
+		qvSlots[i].bUsed = false;
+}
+
+int AttemptLimiter::capacity() const {
+	return qvSlots.count();
+}
+
+quint32 AttemptLimiter::attempt(const HostAddress &addr, quint64 now, quint64 window) {
+	if (window == 0)
+		window = 1;
+	const quint64 w = now / window;
+
+	Slot *set = qvSlots.data() + (qHash(addr) & iSetMask) * Ways;
+	Slot *s = NULL;
+	Slot *victim = set;
+	for (int i=0;i<Ways;++i) {
+		if (set[i].bUsed && (set[i].haAddress == addr)) {
+			s = set + i;
+			break;
+		}
+		// Replace a free slot if there is one, else the one that was active
+		// longest ago, and among those the one with the fewest attempts, so
+		// that one-off addresses in a flood push out each other rather than
+		// an address that keeps coming back.
+		if (! victim->bUsed)
+			continue;
+		if (! set[i].bUsed)
+			victim = set + i;
+		else if ((set[i].uiWindow < victim->uiWindow) || ((set[i].uiWindow == victim->uiWindow) && (set[i].uiCurrent < victim->uiCurrent)))
+			victim = set + i;
+	}
+
+	if (! s) {
+		s = victim;
+		s->haAddress = addr;
+		s->uiWindow = w;
+		s->uiCurrent = 0;
+		s->uiPrevious = 0;
+		s->bUsed = true;
+	}
+
+	if (s->uiWindow != w) {
+		s->uiPrevious = (s->uiWindow + 1 == w) ? s->uiCurrent : 0;
+		s->uiCurrent = 0;
+		s->uiWindow = w;
+	}
+	++s->uiCurrent;
+
+	const quint64 remaining = window - (now % window);
+	return s->uiCurrent + static_cast<quint32>((static_cast<quint64>(s->uiPrevious) * remaining) / window);
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_ATTEMPTLIMITER_H_
+#define MUMBLE_MURMUR_ATTEMPTLIMITER_H_
+
+#include <QtCore/QVector>
+
+#include "Net.h"
+
+// Counts connection attempts per address over a sliding window, in a fixed
+// amount of memory. Each address gets a counter for the current and the
+// previous window; the sliding count is the current one plus the share of
+// the previous one the window still overlaps. Addresses are kept in a set
+// associative table, and a new address replaces the least recently active
+// one in its set, so a flood from many addresses can't grow it.
+class AttemptLimiter {
+	protected:
+		struct Slot {
+			HostAddress haAddress;
+			quint64 uiWindow;
+			quint32 uiCurrent;
+			quint32 uiPrevious;
+			bool bUsed;
+		};
+		enum { Ways = 4 };
+
+		QVector<Slot> qvSlots;
+		int iSetMask;
+	public:
+		// sets is rounded up to a power of two.
+		AttemptLimiter(int sets = 4096);
+		// Records an attempt at now (microseconds, monotonic) and returns the
+		// number of attempts within the last window, this one included.
+		quint32 attempt(const HostAddress &addr, quint64 now, quint64 window);
+		void clear();
+		int capacity() const;
+};
+
+#endif
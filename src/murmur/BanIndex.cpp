@@ -0,0 +1,140 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "BanIndex.h"
+
+#include <algorithm>
+#include <functional>
+
+static inline int addressBit(const HostAddress &ha, int i) {
+	return (ha.qip6.c[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+BanIndex::BanIndex() {
+	rebuild(QList<Ban>());
+}
+
+int BanIndex::node(int parent, int bit) {
+	int n = qvNodes.at(parent).iChild[bit];
+	if (n == -1) {
+		Node nn;
+		nn.iChild[0] = nn.iChild[1] = -1;
+		nn.iBans = 0;
+		n = qvNodes.count();
+		qvNodes.append(nn);
+		qvNodes[parent].iChild[bit] = n;
+	}
+	return n;
+}
+
+void BanIndex::rebuild(const QList<Ban> &bans) {
+	qvNodes.clear();
+	qvEntries.clear();
+	qvExpiry.clear();
+	qhHashes.clear();
+
+	Node root;
+	root.iChild[0] = root.iChild[1] = -1;
+	root.iBans = 0;
+	qvNodes.append(root);
+
+	qvEntries.reserve(bans.count());
+
+	// Bans that already expired are indexed too, so that the next expire()
+	// hands them back for removal from the list.
+	foreach(const Ban &ban, bans) {
+		int n = 0;
+		const int bits = qBound(0, ban.iMask, 128);
+		for (int i=0;i<bits;++i)
+			n = node(n, addressBit(ban.haAddress, i));
+		++qvNodes[n].iBans;
+
+		Entry e;
+		e.ban = ban;
+		e.iNode = n;
+		e.bExpired = false;
+		qvEntries.append(e);
+
+		if (! ban.qsHash.isEmpty())
+			++qhHashes[ban.qsHash];
+
+		if (ban.iDuration > 0)
+			qvExpiry.append(QPair<uint, int>(ban.qdtStart.toTime_t() + ban.iDuration, qvEntries.count() - 1));
+	}
+
+	std::make_heap(qvExpiry.begin(), qvExpiry.end(), std::greater<QPair<uint, int> >());
+	qvNodes.squeeze();
+}
+
+// Same as checking HostAddress::match() against every ban.
+bool BanIndex::match(const HostAddress &addr) const {
+	const Node *nodes = qvNodes.constData();
+	int n = 0;
+	for (int i=0; ; ++i) {
+		if (nodes[n].iBans > 0)
+			return true;
+		if (i == 128)
+			return false;
+		n = nodes[n].iChild[addressBit(addr, i)];
+		if (n == -1)
+			return false;
+	}
+}
+
+bool BanIndex::matchHash(const QString &hash) const {
+	return qhHashes.value(hash) > 0;
+}
+
+QList<Ban> BanIndex::expire(uint now) {
+	QList<Ban> expired;
+
+	while (! qvExpiry.isEmpty() && (qvExpiry.first().first < now)) {
+		std::pop_heap(qvExpiry.begin(), qvExpiry.end(), std::greater<QPair<uint, int> >());
+		Entry &e = qvEntries[qvExpiry.last().second];
+		qvExpiry.pop_back();
+
+		e.bExpired = true;
+		--qvNodes[e.iNode].iBans;
+		if (! e.ban.qsHash.isEmpty()) {
+			QHash<QString, int>::iterator i = qhHashes.find(e.ban.qsHash);
+			if (--i.value() <= 0)
+				qhHashes.erase(i);
+		}
+		expired << e.ban;
+	}
+
+	return expired;
+}
+
+int BanIndex::nodes() const {
+	return qvNodes.count();
+}
@@ -0,0 +1,81 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_BANINDEX_H_
+#define MUMBLE_MURMUR_BANINDEX_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "Net.h"
+
+// Lookup structure for a server's ban list. Address bans live in a binary
+// trie over the 128 bit address (IPv4 as v4-mapped IPv6, like HostAddress),
+// so checking a connection walks at most 128 nodes no matter how many bans
+// there are. Timed bans are kept in a min-heap by expiry, so expiring them
+// only touches the ones that are due.
+//
+// The index is built from Server::qlBans and has to be rebuilt whenever
+// that list is replaced or edited; expire() is the only in-place change.
+class BanIndex {
+	protected:
+		struct Node {
+			qint32 iChild[2];
+			// Bans ending at this node that haven't expired.
+			qint32 iBans;
+		};
+		struct Entry {
+			Ban ban;
+			qint32 iNode;
+			bool bExpired;
+		};
+
+		QVector<Node> qvNodes;
+		QVector<Entry> qvEntries;
+		// (expiry in seconds since the epoch, entry), smallest expiry first.
+		QVector<QPair<uint, int> > qvExpiry;
+		QHash<QString, int> qhHashes;
+
+		int node(int parent, int bit);
+	public:
+		BanIndex();
+		void rebuild(const QList<Ban> &bans);
+		bool match(const HostAddress &addr) const;
+		bool matchHash(const QString &hash) const;
+		// Marks the bans that expired before now (UTC seconds since the
+		// epoch) and returns them.
+		QList<Ban> expire(uint now);
+		int nodes() const;
+};
+
+#endif
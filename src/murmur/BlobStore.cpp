@@ -0,0 +1,234 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "BlobStore.h"
+
+#include "LegacyTexture.h"
+#include "Message.h"
+#include "Meta.h"
+#include "Mumble.pb.h"
+
+BlobStore::BlobStore() {
+	iBytes = 0;
+	iTrimFloor = 0;
+	uiClock = 0;
+	uiHits = uiMisses = uiEvicted = 0;
+}
+
+BlobStore::~BlobStore() {
+	qDeleteAll(qhEntries);
+}
+
+// Returns the existing entry for hash, or a new empty one. Call with
+// qmStore held.
+BlobStore::Entry *BlobStore::insert(const QByteArray &hash) {
+	Entry *e = qhEntries.value(hash);
+	if (e) {
+		++uiHits;
+	} else {
+		++uiMisses;
+		e = new Entry();
+		e->bLegacy = e->bLegacySame = false;
+		e->iCost = 0;
+		qhEntries.insert(hash, e);
+	}
+	e->uiLastUse = ++uiClock;
+	return e;
+}
+
+void BlobStore::account(Entry *e) {
+	int cost = e->qbaData.size() + e->qsText.size() * static_cast<int>(sizeof(QChar)) + e->qbaLegacy.size();
+	for (int i=0;i<FieldCount;++i)
+		cost += e->qbaField[i].size();
+
+	iBytes += cost - e->iCost;
+	e->iCost = cost;
+
+	if ((iBytes > Meta::mp.iBlobCache * 1024LL * 1024LL) && (iBytes > iTrimFloor))
+		trim();
+}
+
+bool BlobStore::isCold(const Entry *e) {
+	if (! e->qsText.isNull())
+		return e->qsText.isDetached();
+	return e->qbaData.isDetached();
+}
+
+// Drops cold entries, oldest first, until the store fits its budget. If
+// what is still in use alone exceeds the budget, don't rescan until the
+// store has grown by another eighth of it.
+void BlobStore::trim() {
+	const qint64 budget = Meta::mp.iBlobCache * 1024LL * 1024LL;
+
+	QList<QPair<quint64, QByteArray> > cold;
+	QHash<QByteArray, Entry *>::const_iterator i;
+	for (i = qhEntries.constBegin(); i != qhEntries.constEnd(); ++i)
+		if (isCold(i.value()))
+			cold << QPair<quint64, QByteArray>(i.value()->uiLastUse, i.key());
+	qSort(cold);
+
+	for (int j=0; (j < cold.count()) && (iBytes > budget); ++j) {
+		Entry *e = qhEntries.take(cold.at(j).second);
+		iBytes -= e->iCost;
+		++uiEvicted;
+		delete e;
+	}
+
+	iTrimFloor = (iBytes > budget) ? (iBytes + budget / 8) : 0;
+}
+
+QByteArray BlobStore::intern(const QByteArray &hash, const QByteArray &data) {
+	QMutexLocker lock(&qmStore);
+
+	Entry *e = insert(hash);
+	if (! e->qbaData.isNull())
+		return e->qbaData;
+
+	e->qbaData = data;
+	// account() may trim, so don't touch e afterwards.
+	QByteArray res = e->qbaData;
+	account(e);
+	return res;
+}
+
+QString BlobStore::intern(const QByteArray &hash, const QString &text) {
+	QMutexLocker lock(&qmStore);
+
+	Entry *e = insert(hash);
+	if (! e->qsText.isNull())
+		return e->qsText;
+
+	e->qsText = text;
+	QString res = e->qsText;
+	account(e);
+	return res;
+}
+
+bool BlobStore::find(const QByteArray &hash, QByteArray &data) {
+	QMutexLocker lock(&qmStore);
+
+	Entry *e = qhEntries.value(hash);
+	if (! e || e->qbaData.isNull())
+		return false;
+
+	++uiHits;
+	e->uiLastUse = ++uiClock;
+	data = e->qbaData;
+	return true;
+}
+
+// The serialized form of a single UserState or ChannelState field holding
+// this blob, built on first use. Returns an empty array if the blob isn't
+// in the store.
+QByteArray BlobStore::field(const QByteArray &hash, Field f) {
+	QMutexLocker lock(&qmStore);
+
+	Entry *e = qhEntries.value(hash);
+	if (! e)
+		return QByteArray();
+
+	e->uiLastUse = ++uiClock;
+
+	if (e->qbaField[f].isEmpty()) {
+		std::string out;
+		switch (f) {
+			case UserTexture: {
+					if (e->qbaData.isNull())
+						return QByteArray();
+					MumbleProto::UserState mpus;
+					mpus.set_texture(blob(e->qbaData));
+					mpus.SerializeToString(&out);
+				}
+				break;
+			case UserComment: {
+					if (e->qsText.isNull())
+						return QByteArray();
+					MumbleProto::UserState mpus;
+					mpus.set_comment(u8(e->qsText));
+					mpus.SerializeToString(&out);
+				}
+				break;
+			case ChannelDescription: {
+					if (e->qsText.isNull())
+						return QByteArray();
+					MumbleProto::ChannelState mpcs;
+					mpcs.set_description(u8(e->qsText));
+					mpcs.SerializeToString(&out);
+				}
+				break;
+			default:
+				return QByteArray();
+		}
+		e->qbaField[f] = QByteArray(out.data(), static_cast<int>(out.size()));
+		QByteArray res = e->qbaField[f];
+		account(e);
+		return res;
+	}
+	return e->qbaField[f];
+}
+
+// Returns texture converted with LegacyTexture::toLegacy(), cached on the entry
+// for hash. The conversion runs without qmStore held.
+QByteArray BlobStore::legacyTexture(const QByteArray &hash, const QByteArray &texture) {
+	{
+		QMutexLocker lock(&qmStore);
+		Entry *e = qhEntries.value(hash);
+		if (e && e->bLegacy) {
+			e->uiLastUse = ++uiClock;
+			return e->bLegacySame ? e->qbaData : e->qbaLegacy;
+		}
+	}
+
+	QByteArray legacy = LegacyTexture::toLegacy(texture);
+
+	QMutexLocker lock(&qmStore);
+	Entry *e = qhEntries.value(hash);
+	if (e && ! e->bLegacy) {
+		// Don't hold a second reference to qbaData, or it would never be cold.
+		e->bLegacySame = (legacy.constData() == e->qbaData.constData());
+		if (! e->bLegacySame)
+			e->qbaLegacy = legacy;
+		e->bLegacy = true;
+		account(e);
+	}
+	return legacy;
+}
+
+void BlobStore::getStatistics(QMap<QString, qint64> &stats) const {
+	QMutexLocker lock(&qmStore);
+
+	stats.insert(QLatin1String("blob.entries"), qhEntries.count());
+	stats.insert(QLatin1String("blob.bytes"), iBytes);
+	stats.insert(QLatin1String("blob.hits"), static_cast<qint64>(uiHits));
+	stats.insert(QLatin1String("blob.misses"), static_cast<qint64>(uiMisses));
+	stats.insert(QLatin1String("blob.evicted"), static_cast<qint64>(uiEvicted));
+}
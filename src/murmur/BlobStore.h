@@ -0,0 +1,97 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_BLOBSTORE_H_
+#define MUMBLE_MURMUR_BLOBSTORE_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+
+// Process wide store for the large per-user and per-channel blobs: textures,
+// comments and channel descriptions. Blobs are keyed by the SHA1 that the
+// protocol already uses for the *_hash fields, so the same avatar or comment
+// template on any number of users and virtual servers is kept once.
+//
+// Holders keep ordinary implicitly shared copies, which is the refcount.
+// An entry whose data nobody else holds is cold; cold entries stay around
+// as a cache and are dropped least recently used first once the store
+// grows past MetaParams::iBlobCache. Everything in here can be rebuilt
+// from the database, so nothing needs to be written out on eviction.
+class BlobStore {
+	private:
+		Q_DISABLE_COPY(BlobStore)
+	public:
+		// Pre-serialized protobuf fields, ready to be appended to a
+		// message that carries only the session or channel id.
+		enum Field { UserTexture, UserComment, ChannelDescription, FieldCount };
+	protected:
+		struct Entry {
+			QByteArray qbaData;
+			QString qsText;
+			QByteArray qbaField[FieldCount];
+			// The texture in the format of clients before 1.2.2, if bLegacy;
+			// empty with bLegacySame if that is qbaData itself.
+			QByteArray qbaLegacy;
+			bool bLegacy;
+			bool bLegacySame;
+			int iCost;
+			quint64 uiLastUse;
+		};
+
+		mutable QMutex qmStore;
+		QHash<QByteArray, Entry *> qhEntries;
+		qint64 iBytes;
+		qint64 iTrimFloor;
+		quint64 uiClock;
+		quint64 uiHits;
+		quint64 uiMisses;
+		quint64 uiEvicted;
+
+		Entry *insert(const QByteArray &hash);
+		void account(Entry *e);
+		void trim();
+		static bool isCold(const Entry *e);
+	public:
+		BlobStore();
+		~BlobStore();
+
+		QByteArray intern(const QByteArray &hash, const QByteArray &data);
+		QString intern(const QByteArray &hash, const QString &text);
+		bool find(const QByteArray &hash, QByteArray &data);
+		QByteArray field(const QByteArray &hash, Field f);
+		QByteArray legacyTexture(const QByteArray &hash, const QByteArray &texture);
+
+		void getStatistics(QMap<QString, qint64> &stats) const;
+};
+
+#endif
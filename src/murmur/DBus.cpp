@@ -376,6 +376,11 @@ void MurmurDBus::getPlayerState(unsigned int session, const QDBusMessage &msg, P
 	pi = PlayerInfo(pUser);
 }
 
+void MurmurDBus::getPlayerBandwidth(unsigned int session, const QDBusMessage &msg, QList<int> &bytes, QList<int> &dropped) {
+	PLAYER_SETUP;
+	pUser->bwr.history(bytes, dropped);
+}
+
 void MurmurDBus::setPlayerState(const PlayerInfo &npi, const QDBusMessage &msg) {
 	PLAYER_SETUP_VAR(npi.session);
 	CHANNEL_SETUP_VAR(npi.channel);
@@ -536,7 +541,7 @@ void MurmurDBus::setACL(int id, const QList<ACLInfo> &acls, const QList<GroupInf
 		a->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(cChannel);
 	server->updateChannel(cChannel);
 }
 
@@ -866,7 +871,9 @@ void MetaDBus::setConf(int server_id, const QString &key, const QString &value,
 	} else {
 		ServerDB::setConf(server_id, key, value);
 		Server *s = meta->qhServers.value(server_id);
-		if (s)
+		if (s && (s->thread() != thread()))
+			QCoreApplication::instance()->postEvent(s, new ExecEvent(boost::bind(&Server::setLiveConf, s, key, value)));
+		else if (s)
 			s->setLiveConf(key, value);
 	}
 }
@@ -891,6 +898,19 @@ void MetaDBus::getLog(int server_id, int min_offset, int max_offset, const QDBus
 	}
 }
 
+void MetaDBus::getStatistics(int server_id, const QDBusMessage &msg, ConfigMap &values) {
+	Server *s = meta->qhServers.value(server_id);
+	if (! s) {
+		MurmurDBus::qdbc.send(msg.createErrorReply("net.sourceforge.mumble.Error.booted", "Server not booted"));
+	} else {
+		values.clear();
+		QMap<QString, qint64> stats = s->getStatistics();
+		QMap<QString, qint64>::const_iterator i;
+		for (i=stats.constBegin();i != stats.constEnd(); ++i)
+			values.insert(i.key(), QString::number(i.value()));
+	}
+}
+
 void MetaDBus::getDefaultConf(ConfigMap &values) {
 	values = Meta::mp.qmConfig;
 }
@@ -186,6 +186,7 @@ class MurmurDBus : public QDBusAbstractAdaptor {
 
 		void kickPlayer(unsigned int session, const QString &reason, const QDBusMessage &);
 		void getPlayerState(unsigned int session, const QDBusMessage &, PlayerInfo &state);
+		void getPlayerBandwidth(unsigned int session, const QDBusMessage &, QList<int> &bytes, QList<int> &dropped);
 		void setPlayerState(const PlayerInfo &state, const QDBusMessage &);
 		void sendMessage(unsigned int session, const QString &text, const QDBusMessage &);
 
@@ -250,6 +251,7 @@ class MetaDBus : public QDBusAbstractAdaptor {
 		void setConf(int server_id, const QString &key, const QString &value, const QDBusMessage &);
 		void setSuperUserPassword(int server_id, const QString &pw, const QDBusMessage &);
 		void getLog(int server_id, int min_offset, int max_offset, const QDBusMessage &, QList<LogEntry> &entries);
+		void getStatistics(int server_id, const QDBusMessage &, ConfigMap &values);
 		void getVersion(int &major, int &minor, int &patch, QString &string);
 		void quit();
 	signals:
@@ -0,0 +1,136 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "Histogram.h"
+
+Histogram::Histogram() {
+	for (int i=0;i<=Buckets;++i)
+		uiBucket[i] = 0;
+	uiSum = 0;
+}
+
+quint64 Histogram::bound(int bucket) {
+	return 16ULL << bucket;
+}
+
+void Histogram::add(quint64 usec) {
+	int b = 0;
+	while ((b < Buckets) && (usec > bound(b)))
+		++b;
+	++uiBucket[b];
+	uiSum += usec;
+}
+
+void Histogram::merge(const Histogram &other) {
+	for (int i=0;i<=Buckets;++i)
+		uiBucket[i] += other.uiBucket[i];
+	uiSum += other.uiSum;
+}
+
+quint64 Histogram::count() const {
+	quint64 n = 0;
+	for (int i=0;i<=Buckets;++i)
+		n += uiBucket[i];
+	return n;
+}
+
+LatencyHistogram::LatencyHistogram() {
+	for (int i=0;i<Buckets;++i)
+		uiBucket[i] = 0;
+	uiSum = uiMax = 0;
+}
+
+// Values below 2*SubBuckets get a bucket each. Above that, r is how far the
+// value has to be shifted down to fall into [SubBuckets, 2*SubBuckets), and
+// each r gets the SubBuckets buckets following the previous one's.
+void LatencyHistogram::add(quint64 usec) {
+	int r = 0;
+	while ((usec >> r) >= 2 * SubBuckets)
+		++r;
+	const int idx = qMin(static_cast<int>(r * SubBuckets + (usec >> r)), static_cast<int>(Buckets) - 1);
+
+	++uiBucket[idx];
+	uiSum += usec;
+	if (usec > uiMax)
+		uiMax = usec;
+}
+
+quint64 LatencyHistogram::upperBound(int bucket) {
+	if (bucket < 2 * SubBuckets)
+		return bucket;
+	const int r = bucket / SubBuckets - 1;
+	const quint64 sub = bucket % SubBuckets + SubBuckets;
+	return ((sub + 1) << r) - 1;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+	for (int i=0;i<Buckets;++i)
+		uiBucket[i] += other.uiBucket[i];
+	uiSum += other.uiSum;
+	uiMax = qMax(uiMax, other.uiMax);
+}
+
+LatencyHistogram LatencyHistogram::since(const LatencyHistogram &earlier) const {
+	LatencyHistogram delta;
+	for (int i=0;i<Buckets;++i) {
+		delta.uiBucket[i] = (uiBucket[i] > earlier.uiBucket[i]) ? uiBucket[i] - earlier.uiBucket[i] : 0;
+		if (delta.uiBucket[i])
+			delta.uiMax = qMin(upperBound(i), uiMax);
+	}
+	delta.uiSum = (uiSum > earlier.uiSum) ? uiSum - earlier.uiSum : 0;
+	return delta;
+}
+
+quint64 LatencyHistogram::count() const {
+	quint64 n = 0;
+	for (int i=0;i<Buckets;++i)
+		n += uiBucket[i];
+	return n;
+}
+
+quint64 LatencyHistogram::percentile(double q) const {
+	const quint64 total = count();
+	if (total == 0)
+		return 0;
+
+	quint64 target = static_cast<quint64>(q * static_cast<double>(total) + 0.5);
+	if (target < 1)
+		target = 1;
+
+	quint64 n = 0;
+	for (int i=0;i<Buckets;++i) {
+		n += uiBucket[i];
+		if (n >= target)
+			return qMin(upperBound(i), uiMax);
+	}
+	return uiMax;
+}
@@ -0,0 +1,77 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_HISTOGRAM_H_
+#define MUMBLE_MURMUR_HISTOGRAM_H_
+
+#include <QtCore/QtGlobal>
+
+// Latency histogram in microseconds, with power of two buckets from 16us
+// up to half a second. An instance is only ever written by one thread, so
+// recording is a couple of plain increments; scrapes add up copies the
+// writing thread hands over.
+struct Histogram {
+	enum { Buckets = 16 };
+	quint64 uiBucket[Buckets + 1];
+	quint64 uiSum;
+
+	Histogram();
+	void add(quint64 usec);
+	void merge(const Histogram &);
+	quint64 count() const;
+	// Upper bound of the given bucket, in microseconds.
+	static quint64 bound(int bucket);
+};
+
+// Latency histogram for percentiles, after HdrHistogram: every power of two
+// range of microseconds is split into SubBuckets linear buckets, so values
+// are kept with a relative error of at most 1/SubBuckets (exact below 16us)
+// from 0 up to about 16 seconds, in a fixed array. Single writer, like
+// Histogram.
+struct LatencyHistogram {
+	enum { SubBits = 3, SubBuckets = 1 << SubBits, Ranges = 22, Buckets = SubBuckets * Ranges };
+	quint64 uiBucket[Buckets];
+	quint64 uiSum;
+	quint64 uiMax;
+
+	LatencyHistogram();
+	void add(quint64 usec);
+	void merge(const LatencyHistogram &);
+	// What was recorded after earlier, an older copy of this histogram.
+	// uiMax becomes the top of the highest bucket that grew.
+	LatencyHistogram since(const LatencyHistogram &earlier) const;
+	quint64 count() const;
+	// Smallest value (in microseconds, up to bucket resolution) that the
+	// given fraction of recorded values doesn't exceed.
+	quint64 percentile(double q) const;
+	static quint64 upperBound(int bucket);
+};
+
+#endif
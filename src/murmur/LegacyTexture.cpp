@@ -0,0 +1,314 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "LegacyTexture.h"
+
+#include <zlib.h>
+
+static QMutex qmStats;
+// Legacy textures stored as PNG, and their size before and after.
+static quint64 uiConverted = 0;
+static quint64 uiConvertedIn = 0;
+static quint64 uiConvertedOut = 0;
+// PNGs turned back into the legacy format for old clients.
+static quint64 uiTranscoded = 0;
+
+static const uchar pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static quint32 crc32(const uchar *data, int len, quint32 crc = 0xffffffff) {
+	for (int i=0;i<len;++i) {
+		crc ^= data[i];
+		for (int k=0;k<8;++k)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+	return crc;
+}
+
+static void appendChunk(QByteArray &png, const char *type, const QByteArray &data) {
+	uchar be[4];
+	qToBigEndian<quint32>(data.size(), be);
+	png.append(reinterpret_cast<const char *>(be), 4);
+
+	int start = png.size();
+	png.append(type, 4);
+	png.append(data);
+
+	quint32 crc = ~crc32(reinterpret_cast<const uchar *>(png.constData()) + start, png.size() - start);
+	qToBigEndian<quint32>(crc, be);
+	png.append(reinterpret_cast<const char *>(be), 4);
+}
+
+static inline int paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = qAbs(p - a);
+	int pb = qAbs(p - b);
+	int pc = qAbs(p - c);
+	if ((pa <= pb) && (pa <= pc))
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+// Inflates a zlib stream into exactly expected bytes. Textures come from
+// clients, so the output is never allowed to grow past that; a stream that
+// doesn't end there is rejected rather than followed.
+static bool inflateExact(const uchar *data, int len, int expected, QByteArray &out) {
+	if ((len <= 0) || (expected <= 0))
+		return false;
+
+	out.resize(expected);
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+
+	zs.next_in = const_cast<Bytef *>(data);
+	zs.avail_in = static_cast<uInt>(len);
+	zs.next_out = reinterpret_cast<Bytef *>(out.data());
+	zs.avail_out = static_cast<uInt>(expected);
+
+	int ret = inflate(&zs, Z_FINISH);
+	const bool ok = (ret == Z_STREAM_END) && (zs.total_out == static_cast<uLong>(expected));
+	inflateEnd(&zs);
+
+	if (! ok)
+		out.clear();
+	return ok;
+}
+
+bool LegacyTexture::isLegacy(const QByteArray &texture) {
+	return (texture.length() >= 4) && (qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(texture.constData())) == RawSize);
+}
+
+// Crops the way the client does before showing a legacy texture: to the
+// bottom right-most pixels that have alpha, measured from the top left
+// corner. Textures the client would treat specially (nothing visible, or
+// alpha everywhere) are left alone.
+QByteArray LegacyTexture::encodePNG(const QByteArray &raw) {
+	const uchar *src = reinterpret_cast<const uchar *>(raw.constData());
+
+	int width = 0;
+	int height = 0;
+	for (int y=0;y<Height;++y)
+		for (int x=0;x<Width;++x)
+			if (src[(y * Width + x) * 4 + 3]) {
+				if (x > width)
+					width = x;
+				if (y > height)
+					height = y;
+			}
+
+	if (! width || ! height || ((width == Width - 1) && (height == Height - 1)))
+		return QByteArray();
+
+	const int w = width + 1;
+	const int h = height + 1;
+	const int stride = w * 4;
+
+	// ARGB32 is stored B, G, R, A in memory. Rows use the Sub filter.
+	QByteArray rows;
+	rows.resize(h * (stride + 1));
+	uchar *out = reinterpret_cast<uchar *>(rows.data());
+	for (int y=0;y<h;++y) {
+		*out++ = 1;
+		const uchar *line = src + y * Width * 4;
+		uchar left[4] = { 0, 0, 0, 0 };
+		for (int x=0;x<w;++x) {
+			const uchar rgba[4] = { line[x*4+2], line[x*4+1], line[x*4], line[x*4+3] };
+			for (int i=0;i<4;++i) {
+				*out++ = static_cast<uchar>(rgba[i] - left[i]);
+				left[i] = rgba[i];
+			}
+		}
+	}
+
+	QByteArray ihdr;
+	ihdr.resize(13);
+	uchar *hd = reinterpret_cast<uchar *>(ihdr.data());
+	qToBigEndian<quint32>(w, hd);
+	qToBigEndian<quint32>(h, hd + 4);
+	hd[8] = 8;
+	hd[9] = 6;
+	hd[10] = hd[11] = hd[12] = 0;
+
+	// qCompress() is a zlib stream behind a 4 byte length.
+	QByteArray idat = qCompress(rows, 9).mid(4);
+
+	QByteArray png(reinterpret_cast<const char *>(pngSignature), 8);
+	appendChunk(png, "IHDR", ihdr);
+	appendChunk(png, "IDAT", idat);
+	appendChunk(png, "IEND", QByteArray());
+	return png;
+}
+
+// Reads non-interlaced 8 bit RGBA PNGs that fit in 600x60 into a zero
+// padded ARGB32 bitmap. That covers everything encodePNG writes.
+bool LegacyTexture::decodePNG(const QByteArray &png, QByteArray &raw) {
+	const uchar *p = reinterpret_cast<const uchar *>(png.constData());
+	const uchar *end = p + png.size();
+
+	if ((png.size() < 8) || (memcmp(p, pngSignature, 8) != 0))
+		return false;
+	p += 8;
+
+	int w = 0, h = 0;
+	QByteArray idat;
+	bool done = false;
+
+	while (! done && (end - p >= 12)) {
+		quint32 len = qFromBigEndian<quint32>(p);
+		if (len > static_cast<quint32>(end - p - 12))
+			return false;
+		const uchar *type = p + 4;
+		const uchar *data = p + 8;
+
+		if (memcmp(type, "IHDR", 4) == 0) {
+			if (len != 13)
+				return false;
+			w = static_cast<int>(qFromBigEndian<quint32>(data));
+			h = static_cast<int>(qFromBigEndian<quint32>(data + 4));
+			if ((data[8] != 8) || (data[9] != 6) || data[10] || data[11] || data[12])
+				return false;
+			if ((w <= 0) || (h <= 0) || (w > Width) || (h > Height))
+				return false;
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			idat.append(reinterpret_cast<const char *>(data), len);
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			done = true;
+		}
+		p += len + 12;
+	}
+
+	if (! done || ! w || idat.isEmpty())
+		return false;
+
+	const int stride = w * 4;
+	const int expected = h * (stride + 1);
+
+	QByteArray rows;
+	if (! inflateExact(reinterpret_cast<const uchar *>(idat.constData()), idat.size(), expected, rows))
+		return false;
+
+	uchar *cur = reinterpret_cast<uchar *>(rows.data());
+	const uchar *prev = NULL;
+	for (int y=0;y<h;++y) {
+		const int filter = *cur++;
+		for (int i=0;i<stride;++i) {
+			const int a = (i >= 4) ? cur[i-4] : 0;
+			const int b = prev ? prev[i] : 0;
+			const int c = (prev && (i >= 4)) ? prev[i-4] : 0;
+			switch (filter) {
+				case 0:
+					break;
+				case 1:
+					cur[i] = static_cast<uchar>(cur[i] + a);
+					break;
+				case 2:
+					cur[i] = static_cast<uchar>(cur[i] + b);
+					break;
+				case 3:
+					cur[i] = static_cast<uchar>(cur[i] + ((a + b) >> 1));
+					break;
+				case 4:
+					cur[i] = static_cast<uchar>(cur[i] + paeth(a, b, c));
+					break;
+				default:
+					return false;
+			}
+		}
+		prev = cur;
+		cur += stride;
+	}
+
+	raw = QByteArray(RawSize, 0);
+	uchar *dst = reinterpret_cast<uchar *>(raw.data());
+	const uchar *src = reinterpret_cast<const uchar *>(rows.constData());
+	for (int y=0;y<h;++y) {
+		const uchar *line = src + y * (stride + 1) + 1;
+		uchar *out = dst + y * Width * 4;
+		for (int x=0;x<w;++x) {
+			out[x*4] = line[x*4+2];
+			out[x*4+1] = line[x*4+1];
+			out[x*4+2] = line[x*4];
+			out[x*4+3] = line[x*4+3];
+		}
+	}
+	return true;
+}
+
+QByteArray LegacyTexture::canonical(const QByteArray &texture) {
+	QByteArray raw;
+	if (texture.size() == RawSize)
+		raw = texture;
+	else if (! isLegacy(texture))
+		return texture;
+	else if (! inflateExact(reinterpret_cast<const uchar *>(texture.constData()) + 4, texture.size() - 4, RawSize, raw))
+		return texture;
+
+	QByteArray png = encodePNG(raw);
+	if (png.isEmpty())
+		return (texture.size() == RawSize) ? qCompress(raw) : texture;
+
+	QMutexLocker lock(&qmStats);
+	++uiConverted;
+	uiConvertedIn += texture.size();
+	uiConvertedOut += png.size();
+	return png;
+}
+
+QByteArray LegacyTexture::toLegacy(const QByteArray &texture) {
+	if (isLegacy(texture))
+		return texture;
+	if (texture.size() == RawSize)
+		return qCompress(texture);
+
+	QByteArray raw;
+	if (! decodePNG(texture, raw))
+		return QByteArray();
+
+	QByteArray legacy = qCompress(raw);
+
+	QMutexLocker lock(&qmStats);
+	++uiTranscoded;
+	return legacy;
+}
+
+void LegacyTexture::getStatistics(QMap<QString, qint64> &stats) {
+	QMutexLocker lock(&qmStats);
+
+	stats.insert(QLatin1String("texture.converted"), static_cast<qint64>(uiConverted));
+	stats.insert(QLatin1String("texture.converted.inbytes"), static_cast<qint64>(uiConvertedIn));
+	stats.insert(QLatin1String("texture.converted.outbytes"), static_cast<qint64>(uiConvertedOut));
+	stats.insert(QLatin1String("texture.transcoded"), static_cast<qint64>(uiTranscoded));
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_LEGACYTEXTURE_H_
+#define MUMBLE_MURMUR_LEGACYTEXTURE_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QMap>
+#include <QtCore/QString>
+
+// Clients before 1.2.2 send and expect textures as a qCompress()ed 600x60
+// ARGB32 bitmap. Newer clients turn those into a PNG of the area that has
+// any alpha before showing them, so the server does the same once when a
+// texture arrives and keeps only the PNG. Old clients get the bitmap back,
+// rebuilt from the PNG on demand; callers cache that (BlobStore).
+//
+// Murmur doesn't link QtGui, so this carries its own minimal PNG writer
+// and a reader for 8 bit RGBA images. Both formats are inflated with zlib
+// directly, never past the size the image should have, so a small upload
+// can't make the server allocate more than that.
+class LegacyTexture {
+	public:
+		enum { Width = 600, Height = 60, RawSize = Width * Height * 4 };
+
+		static bool isLegacy(const QByteArray &texture);
+		// Legacy textures, compressed or raw, become a PNG when that is
+		// lossless for both kinds of clients. Anything else is returned as is.
+		static QByteArray canonical(const QByteArray &texture);
+		// The texture in the legacy format, or an empty array if old
+		// clients can't show it.
+		static QByteArray toLegacy(const QByteArray &texture);
+
+		static void getStatistics(QMap<QString, qint64> &stats);
+	protected:
+		static QByteArray encodePNG(const QByteArray &raw);
+		static bool decodePNG(const QByteArray &png, QByteArray &raw);
+};
+
+#endif
@@ -34,8 +34,11 @@
 #include "User.h"
 #include "Channel.h"
 #include "ACL.h"
+#include "BlobStore.h"
 #include "Group.h"
+#include "LegacyTexture.h"
 #include "Message.h"
+#include "Meta.h"
 #include "ServerDB.h"
 #include "Connection.h"
 #include "Server.h"
@@ -110,7 +113,6 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	MSG_SETUP(ServerUser::Connected);
 
 	Channel *root = qhChannels.value(0);
-	Channel *c;
 
 	uSource->qsName = u8(msg.username());
 
@@ -225,49 +227,8 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		sendTextMessage(NULL, uSource, false, QLatin1String("<strong>WARNING:</strong> Your client doesn't support the CELT codec, you won't be able to talk to or hear most clients. Please make sure your client was built with CELT support."));
 	}
 
-	// Transmit channel tree
-	QQueue<Channel *> q;
-	QSet<Channel *> chans;
-	q << root;
-	MumbleProto::ChannelState mpcs;
-	while (! q.isEmpty()) {
-		c = q.dequeue();
-		chans.insert(c);
-
-		mpcs.Clear();
-
-		mpcs.set_channel_id(c->iId);
-		if (c->cParent)
-			mpcs.set_parent(c->cParent->iId);
-		if (c->iId == 0)
-			mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
-		else
-			mpcs.set_name(u8(c->qsName));
-
-		mpcs.set_position(c->iPosition);
-
-		if ((uSource->uiVersion >= 0x010202) && ! c->qbaDescHash.isEmpty())
-			mpcs.set_description_hash(blob(c->qbaDescHash));
-		else if (! c->qsDesc.isEmpty())
-			mpcs.set_description(u8(c->qsDesc));
-
-		sendMessage(uSource, mpcs);
-
-		foreach(c, c->qlChannels)
-			q.enqueue(c);
-	}
-
-	// Transmit links
-	foreach(c, chans) {
-		if (c->qhLinks.count() > 0) {
-			mpcs.Clear();
-			mpcs.set_channel_id(c->iId);
-
-			foreach(Channel *l, c->qhLinks.keys())
-				mpcs.add_links(l->iId);
-			sendMessage(uSource, mpcs);
-		}
-	}
+	// Transmit channel tree and links
+	uSource->sendMessage(joinTree(uSource->uiVersion >= 0x010202));
 
 	// Transmit user profile
 	MumbleProto::UserState mpus;
@@ -316,58 +277,17 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 
 	sendAll(mpus, 0x010202);
 
-	if ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4))
-		mpus.set_texture(blob(uSource->qbaTexture));
+	const QByteArray &legacy = legacyTexture(uSource);
+	if (! legacy.isEmpty())
+		mpus.set_texture(blob(legacy));
 	if (! uSource->qsComment.isEmpty())
 		mpus.set_comment(u8(uSource->qsComment));
 	sendAll(mpus, ~ 0x010202);
 
 	// Transmit other users profiles
-	foreach(ServerUser *u, qhUsers) {
-		if (u->sState != ServerUser::Authenticated)
-			continue;
-
-		if (u == uSource)
-			continue;
-
-		mpus.Clear();
-		mpus.set_session(u->uiSession);
-		mpus.set_name(u8(u->qsName));
-		if (u->iId >= 0)
-			mpus.set_user_id(u->iId);
-		if (uSource->uiVersion >= 0x010202) {
-			if (! u->qbaTextureHash.isEmpty())
-				mpus.set_texture_hash(blob(u->qbaTextureHash));
-			else if (! u->qbaTexture.isEmpty())
-				mpus.set_texture(blob(u->qbaTexture));
-		} else if ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4)) {
-			mpus.set_texture(blob(u->qbaTexture));
-		}
-		if (u->cChannel->iId != 0)
-			mpus.set_channel_id(u->cChannel->iId);
-		if (u->bDeaf)
-			mpus.set_deaf(true);
-		else if (u->bMute)
-			mpus.set_mute(true);
-		if (u->bSuppress)
-			mpus.set_suppress(true);
-		if (u->bPrioritySpeaker)
-			mpus.set_priority_speaker(true);
-		if (u->bRecording)
-			mpus.set_recording(true);
-		if (u->bSelfDeaf)
-			mpus.set_self_deaf(true);
-		else if (u->bSelfMute)
-			mpus.set_self_mute(true);
-		if ((uSource->uiVersion >= 0x010202) && ! u->qbaCommentHash.isEmpty())
-			mpus.set_comment_hash(blob(u->qbaCommentHash));
-		else if (! u->qsComment.isEmpty())
-			mpus.set_comment(u8(u->qsComment));
-		if (! u->qsHash.isEmpty())
-			mpus.set_hash(u8(u->qsHash));
-
-		sendMessage(uSource, mpus);
-	}
+	QByteArray qbaUsers;
+	appendJoinUsers(qbaUsers, uSource);
+	uSource->sendMessage(qbaUsers);
 
 	// Send syncronisation packet
 	MumbleProto::ServerSync mpss;
@@ -380,7 +300,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		mpss.set_permissions(ChanACL::All);
 	} else {
 		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(uSource, root, ChanACL::Enter, &acCache);
+		ChanACL::hasPermission(uSource, root, ChanACL::Enter, &acCache, &ccCompiled, &csACL);
 		mpss.set_permissions(acCache.value(uSource)->value(root));
 	}
 
@@ -471,8 +391,7 @@ void Server::msgUDPTunnel(ServerUser *uSource, MumbleProto::UDPTunnel &msg) {
 	int len = static_cast<int>(str.length());
 	if (len < 1)
 		return;
-	QReadLocker rl(&qrwlUsers);
-	processMsg(uSource, str.data(), len);
+	processMsg(uSource, str.data(), len, vcControl);
 }
 
 void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
@@ -598,7 +517,7 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 	bool bBroadcast = false;
 
 	if (msg.has_texture()) {
-		QByteArray qba = blob(msg.texture());
+		QByteArray qba = LegacyTexture::canonical(blob(msg.texture()));
 		if (pDstServerUser->iId > 0) {
 			// For registered users store the texture we just received in the database
 			if (! setTexture(pDstServerUser->iId, qba)) {
@@ -729,15 +648,17 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 
 	if (bBroadcast) {
 		// Texture handling for clients < 1.2.2.
-		// Send the texture data in the message.
-		if (msg.has_texture() && (pDstServerUser->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(pDstServerUser->qbaTexture.constData())) != 600 * 60 * 4)) {
-			// This is a new style texture, don't send it because the client doesn't handle it correctly / crashes.
-			msg.clear_texture();
+		// Send the texture data in the legacy format, or nothing if it can't
+		// be converted; new style textures crash these clients.
+		if (msg.has_texture()) {
+			const QByteArray &legacy = legacyTexture(pDstServerUser);
+			if (legacy.isEmpty() && ! pDstServerUser->qbaTexture.isEmpty())
+				msg.clear_texture();
+			else
+				msg.set_texture(blob(legacy));
 			sendAll(msg, ~ 0x010202);
 			msg.set_texture(blob(pDstServerUser->qbaTexture));
 		} else {
-			// This is an old style texture, empty texture or there was no texture in this packet,
-			// send the message unchanged.
 			sendAll(msg, ~ 0x010202);
 		}
 
@@ -911,7 +832,7 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			a->pDeny=ChanACL::None;
 			a->pAllow=ChanACL::Write | ChanACL::Traverse;
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 		updateChannel(c);
 
@@ -963,12 +884,8 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			if (p == c->cParent)
 				return;
 
-			Channel *ip = p;
-			while (ip) {
-				if (ip == c)
-					return;
-				ip = ip->cParent;
-			}
+			if (currentSnapshot()->qspChannels->isInSubtree(c, p))
+				return;
 
 			if (p->bTemporary) {
 				PERM_DENIED_TYPE(TemporaryChannel);
@@ -1035,6 +952,10 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 
 			c->cParent->removeChannel(c);
 			p->addChannel(c);
+
+			invalidateChannelIndex();
+			clearMovedACLCache(c);
+			refreshTargetCache(NULL, QSet<const Channel *>() << p);
 		}
 		if (! qsName.isNull()) {
 			log(uSource, QString("Renamed channel %1 to %2").arg(QString(*c),
@@ -1090,7 +1011,6 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 	TextMessage tm; // for signal userTextMessage
 
 	QSet<ServerUser *> users;
-	QQueue<Channel *> q;
 
 	QString text = u8(msg.message());
 	bool changed = false;
@@ -1122,7 +1042,7 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 		if (! c)
 			return;
 
-		if (! ChanACL::hasPermission(uSource, c, ChanACL::TextMessage, &acCache)) {
+		if (! hasPermission(uSource, c, ChanACL::TextMessage)) {
 			PERM_DENIED(uSource, c, ChanACL::TextMessage);
 			return;
 		}
@@ -1140,23 +1060,41 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 		if (! c)
 			return;
 
-		if (! ChanACL::hasPermission(uSource, c, ChanACL::TextMessage, &acCache)) {
+		if (! hasPermission(uSource, c, ChanACL::TextMessage)) {
 			PERM_DENIED(uSource, c, ChanACL::TextMessage);
 			return;
 		}
 
-		q.enqueue(c);
-
 		tm.qlTrees.append(id);
 	}
 
-	while (! q.isEmpty()) {
-		Channel *c = q.dequeue();
-		if (ChanACL::hasPermission(uSource, c, ChanACL::TextMessage, &acCache)) {
-			foreach(Channel *sub, c->qlChannels)
-				q.enqueue(sub);
-			foreach(User *p, c->qlUsers)
-				users.insert(static_cast<ServerUser *>(p));
+	if (msg.tree_id_size() > 0) {
+		// Walk each tree as a range of the channel index, skipping the
+		// subtree of any channel the sender may not write to. Channels
+		// already walked for an earlier tree are skipped as a whole.
+		const ChannelIndex &ci = *currentSnapshot()->qspChannels;
+		QBitArray visited(ci.qvChannels.count());
+		for (int i=0;i<msg.tree_id_size(); ++i) {
+			int root = ci.position(qhChannels.value(msg.tree_id(i)));
+			if (root == -1)
+				continue;
+			int pos = root;
+			while (pos < ci.qvEnd.at(root)) {
+				if (visited.testBit(pos)) {
+					pos = ci.qvEnd.at(pos);
+					continue;
+				}
+				visited.setBit(pos);
+
+				Channel *c = ci.qvChannels.at(pos);
+				if (! hasPermission(uSource, c, ChanACL::TextMessage)) {
+					pos = ci.qvEnd.at(pos);
+					continue;
+				}
+				foreach(User *p, c->qlUsers)
+					users.insert(static_cast<ServerUser *>(p));
+				++pos;
+			}
 		}
 	}
 
@@ -1164,7 +1102,7 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 		unsigned int session = msg.session(i);
 		ServerUser *u = qhUsers.value(session);
 		if (u) {
-			if (! ChanACL::hasPermission(uSource, u->cChannel, ChanACL::TextMessage, &acCache)) {
+			if (! hasPermission(uSource, u->cChannel, ChanACL::TextMessage)) {
 				PERM_DENIED(uSource, u->cChannel, ChanACL::TextMessage);
 				return;
 			}
@@ -1176,8 +1114,16 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 
 	users.remove(uSource);
 
+	// Encoded once; large fan-outs are spread over several event loop passes.
+	QList<unsigned int> sessions;
 	foreach(ServerUser *u, users)
-		sendMessage(u, msg);
+		sessions << u->uiSession;
+
+	if (! sessions.isEmpty()) {
+		QByteArray frame;
+		Connection::messageToNetwork(msg, MessageHandler::TextMessage, frame);
+		queueTextFanout(frame, sessions);
+	}
 
 	emit userTextMessage(uSource, tm);
 }
@@ -1324,7 +1270,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 			a->pAllow=static_cast<ChanACL::Permissions>(mpacl.grant()) & ChanACL::All;
 		}
 
-		clearACLCache();
+		clearACLCache(c);
 
 		if (! hasPermission(uSource, c, ChanACL::Write) && ((uSource->iId >= 0) || !uSource->qsHash.isEmpty())) {
 			a = new ChanACL(c);
@@ -1338,7 +1284,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 			a->pDeny=ChanACL::None;
 			a->pAllow=ChanACL::Write | ChanACL::Traverse;
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 
 		updateChannel(c);
@@ -1528,10 +1474,8 @@ void Server::msgVoiceTarget(ServerUser *uSource, MumbleProto::VoiceTarget &msg)
 	if ((target < 1) || (target >= 0x1f))
 		return;
 
-	QWriteLocker lock(&qrwlUsers);
-
-	uSource->qmTargetCache.remove(target);
-
+	// Voice threads only see targets through the snapshot, so qmTargets
+	// needs no lock.
 	int count = msg.targets_size();
 	if (count == 0) {
 		uSource->qmTargets.remove(target);
@@ -1562,6 +1506,13 @@ void Server::msgVoiceTarget(ServerUser *uSource, MumbleProto::VoiceTarget &msg)
 		else
 			uSource->qmTargets.insert(target, wt);
 	}
+
+	// Resolve it here rather than on the first whisper packet. A target
+	// that was cleared resolves to no one, which drops packets to it.
+	WhisperTargetCache cache;
+	resolveTarget(uSource, target, cache);
+	uSource->qmTargetCache.insert(target, cache);
+	publishSnapshot();
 }
 
 void Server::msgPermissionQuery(ServerUser *uSource, MumbleProto::PermissionQuery &msg) {
@@ -1668,6 +1619,8 @@ void Server::msgRequestBlob(ServerUser *uSource, MumbleProto::RequestBlob &msg)
 	int ncomments = msg.session_comment_size();
 	int ndescriptions = msg.channel_description_size();
 
+	// Blobs large enough to have a hash are in the blob store, which keeps
+	// them serialized; only the id is encoded per request.
 	if (ndescriptions) {
 		MumbleProto::ChannelState mpcs;
 		for (int i=0;i<ndescriptions;++i) {
@@ -1675,8 +1628,14 @@ void Server::msgRequestBlob(ServerUser *uSource, MumbleProto::RequestBlob &msg)
 			Channel *c = qhChannels.value(id);
 			if (c && ! c->qsDesc.isEmpty()) {
 				mpcs.set_channel_id(id);
-				mpcs.set_description(u8(c->qsDesc));
-				sendMessage(uSource, mpcs);
+				const QByteArray &field = c->qbaDescHash.isEmpty() ? QByteArray() : meta->bsBlobs->field(c->qbaDescHash, BlobStore::ChannelDescription);
+				if (! field.isEmpty()) {
+					mpcs.clear_description();
+					sendProtoMessage(uSource, mpcs, MessageHandler::ChannelState, field);
+				} else {
+					mpcs.set_description(u8(c->qsDesc));
+					sendMessage(uSource, mpcs);
+				}
 			}
 		}
 	}
@@ -1687,8 +1646,14 @@ void Server::msgRequestBlob(ServerUser *uSource, MumbleProto::RequestBlob &msg)
 			ServerUser *su = qhUsers.value(session);
 			if (su && ! su->qbaTexture.isEmpty()) {
 				mpus.set_session(session);
-				mpus.set_texture(blob(su->qbaTexture));
-				sendMessage(uSource, mpus);
+				const QByteArray &field = su->qbaTextureHash.isEmpty() ? QByteArray() : meta->bsBlobs->field(su->qbaTextureHash, BlobStore::UserTexture);
+				if (! field.isEmpty()) {
+					mpus.clear_texture();
+					sendProtoMessage(uSource, mpus, MessageHandler::UserState, field);
+				} else {
+					mpus.set_texture(blob(su->qbaTexture));
+					sendMessage(uSource, mpus);
+				}
 			}
 		}
 		if (ntextures)
@@ -1698,8 +1663,14 @@ void Server::msgRequestBlob(ServerUser *uSource, MumbleProto::RequestBlob &msg)
 			ServerUser *su = qhUsers.value(session);
 			if (su && ! su->qsComment.isEmpty()) {
 				mpus.set_session(session);
-				mpus.set_comment(u8(su->qsComment));
-				sendMessage(uSource, mpus);
+				const QByteArray &field = su->qbaCommentHash.isEmpty() ? QByteArray() : meta->bsBlobs->field(su->qbaCommentHash, BlobStore::UserComment);
+				if (! field.isEmpty()) {
+					mpus.clear_comment();
+					sendProtoMessage(uSource, mpus, MessageHandler::UserState, field);
+				} else {
+					mpus.set_comment(u8(su->qsComment));
+					sendMessage(uSource, mpus);
+				}
 			}
 		}
 	}
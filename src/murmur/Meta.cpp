@@ -32,6 +32,7 @@
 
 #include "Meta.h"
 
+#include "BlobStore.h"
 #include "Connection.h"
 #include "Net.h"
 #include "ServerDB.h"
@@ -50,6 +51,7 @@ MetaParams::MetaParams() {
 	usPort = DEFAULT_MUMBLE_PORT;
 	iTimeout = 30;
 	iMaxBandwidth = 72000;
+	iMaxBandwidthBurst = 1000;
 	iMaxUsers = 1000;
 	iMaxUsersPerChannel = 0;
 	iMaxTextMessageLength = 5000;
@@ -76,6 +78,19 @@ MetaParams::MetaParams() {
 	iBanTimeframe = 120;
 	iBanTime = 300;
 
+	iUDPBatchSize = 1;
+	iVoiceThreads = 1;
+
+	iTLSThreads = 2;
+	iTLSPending = 256;
+	iTLSPerAddress = 4;
+	iTLSTimeout = 10;
+
+	iControlThreads = 0;
+
+	iBlobCache = 64;
+	bVoiceTrace = false;
+
 #ifdef Q_OS_UNIX
 	uiUid = uiGid = 0;
 #endif
@@ -263,6 +278,7 @@ void MetaParams::read(QString fname) {
 	iMaxImageMessageLength = typeCheckedFromSettings("imagemessagelength", iMaxImageMessageLength);
 	bAllowHTML = typeCheckedFromSettings("allowhtml", bAllowHTML);
 	iMaxBandwidth = typeCheckedFromSettings("bandwidth", iMaxBandwidth);
+	iMaxBandwidthBurst = qBound(20, typeCheckedFromSettings("bandwidthburst", iMaxBandwidthBurst), 60000);
 	iDefaultChan = typeCheckedFromSettings("defaultchannel", iDefaultChan);
 	bRememberChan = typeCheckedFromSettings("rememberchannel", bRememberChan);
 	iMaxUsers = typeCheckedFromSettings("users", iMaxUsers);
@@ -284,6 +300,7 @@ void MetaParams::read(QString fname) {
 	qsIceSecretRead = typeCheckedFromSettings("icesecret", qsIceSecretRead);
 	qsIceSecretRead = typeCheckedFromSettings("icesecretread", qsIceSecretRead);
 	qsIceSecretWrite = typeCheckedFromSettings("icesecretwrite", qsIceSecretRead);
+	qsMetrics = typeCheckedFromSettings("metrics", qsMetrics);
 
 	iLogDays = typeCheckedFromSettings("logdays", iLogDays);
 
@@ -303,6 +320,19 @@ void MetaParams::read(QString fname) {
 	iBanTimeframe = typeCheckedFromSettings("autobanTimeframe", iBanTimeframe);
 	iBanTime = typeCheckedFromSettings("autobanTime", iBanTime);
 
+	iUDPBatchSize = qBound(1, typeCheckedFromSettings("udpbatchsize", iUDPBatchSize), 64);
+	iVoiceThreads = qBound(1, typeCheckedFromSettings("voicethreads", iVoiceThreads), 64);
+
+	iTLSThreads = qBound(1, typeCheckedFromSettings("tlsthreads", iTLSThreads), 64);
+	iTLSPending = qMax(1, typeCheckedFromSettings("tlspending", iTLSPending));
+	iTLSPerAddress = qMax(1, typeCheckedFromSettings("tlsperaddress", iTLSPerAddress));
+	iTLSTimeout = qMax(1, typeCheckedFromSettings("tlstimeout", iTLSTimeout));
+
+	iControlThreads = qBound(0, typeCheckedFromSettings("controlthreads", iControlThreads), 64);
+
+	iBlobCache = qMax(0, typeCheckedFromSettings("blobcache", iBlobCache));
+	bVoiceTrace = typeCheckedFromSettings("voicetrace", bVoiceTrace);
+
 	qvSuggestVersion = MumbleVersion::getRaw(qsSettings->value("suggestVersion").toString());
 	if (qvSuggestVersion.toUInt() == 0)
 		qvSuggestVersion = QVariant();
@@ -458,6 +488,7 @@ void MetaParams::read(QString fname) {
 	qmConfig.insert(QLatin1String("textmessagelength"), QString::number(iMaxTextMessageLength));
 	qmConfig.insert(QLatin1String("allowhtml"), bAllowHTML ? QLatin1String("true") : QLatin1String("false"));
 	qmConfig.insert(QLatin1String("bandwidth"),QString::number(iMaxBandwidth));
+	qmConfig.insert(QLatin1String("bandwidthburst"),QString::number(iMaxBandwidthBurst));
 	qmConfig.insert(QLatin1String("users"),QString::number(iMaxUsers));
 	qmConfig.insert(QLatin1String("defaultchannel"),QString::number(iDefaultChan));
 	qmConfig.insert(QLatin1String("rememberchannel"),bRememberChan ? QLatin1String("true") : QLatin1String("false"));
@@ -479,9 +510,14 @@ void MetaParams::read(QString fname) {
 	qmConfig.insert(QLatin1String("suggestpushtotalk"), qvSuggestPushToTalk.isNull() ? QString() : qvSuggestPushToTalk.toString());
 	qmConfig.insert(QLatin1String("opusthreshold"), QString::number(iOpusThreshold));
 	qmConfig.insert(QLatin1String("channelnestinglimit"), QString::number(iChannelNestingLimit));
+	qmConfig.insert(QLatin1String("voicethreads"), QString::number(iVoiceThreads));
 }
 
 Meta::Meta() {
+	hpHandshakes = NULL;
+	iBansPrune = 1024;
+	bsBlobs = new BlobStore();
+
 #ifdef Q_OS_WIN
 	QOS_VERSION qvVer;
 	qvVer.MajorVersion = 1;
@@ -503,6 +539,8 @@ Meta::Meta() {
 }
 
 Meta::~Meta() {
+	delete bsBlobs;
+
 #ifdef Q_OS_WIN
 	if (hQoS) {
 		QOSCloseHandle(hQoS);
@@ -527,14 +565,35 @@ bool Meta::boot(int srvnum) {
 		return false;
 	if (! ServerDB::serverExists(srvnum))
 		return false;
+
+	// Created on first boot rather than in the constructor, as main() may
+	// still fork() to daemonize after constructing Meta.
+	if (! hpHandshakes)
+		hpHandshakes = new HandshakePool(this);
+
 	Server *s = new Server(srvnum, this);
 	if (! s->bValid) {
 		delete s;
 		return false;
 	}
-	qhServers.insert(srvnum, s);
+	{
+		QWriteLocker wl(&qrwlServers);
+		qhServers.insert(srvnum, s);
+	}
 	emit started(s);
 
+	// Hand the server's sockets, timers and RPC objects over to a control
+	// thread, sharded by server number. Its children (including anything
+	// attached by the started() listeners above) move along with it.
+	if (mp.iControlThreads > 0) {
+		while (qlControlThreads.count() < mp.iControlThreads) {
+			QThread *t = new QThread(this);
+			t->start();
+			qlControlThreads << t;
+		}
+		s->moveControlThread(qlControlThreads.at(srvnum % qlControlThreads.count()));
+	}
+
 #ifdef Q_OS_UNIX
 	unsigned int sockets = 19; // Base
 	foreach(s, qhServers) {
@@ -565,20 +624,45 @@ bool Meta::boot(int srvnum) {
 	return true;
 }
 
+Server *Meta::getServer(int srvnum) {
+	QReadLocker rl(&qrwlServers);
+	return qhServers.value(srvnum);
+}
+
 void Meta::kill(int srvnum) {
-	Server *s = qhServers.take(srvnum);
+	Server *s;
+	{
+		QWriteLocker wl(&qrwlServers);
+		s = qhServers.take(srvnum);
+	}
 	if (!s)
 		return;
+	s->returnToMainThread();
 	emit stopped(s);
 	delete s;
 }
 
 void Meta::killAll() {
-	foreach(Server *s, qhServers) {
+	QHash<int, Server *> servers;
+	{
+		QWriteLocker wl(&qrwlServers);
+		servers.swap(qhServers);
+	}
+	foreach(Server *s, servers) {
+		s->returnToMainThread();
 		emit stopped(s);
 		delete s;
 	}
-	qhServers.clear();
+	stopControlThreads();
+}
+
+void Meta::stopControlThreads() {
+	foreach(QThread *t, qlControlThreads) {
+		t->quit();
+		t->wait();
+		delete t;
+	}
+	qlControlThreads.clear();
 }
 
 bool Meta::banCheck(const QHostAddress &addr) {
@@ -588,21 +672,31 @@ bool Meta::banCheck(const QHostAddress &addr) {
 	if (addr.toIPv4Address() == ((128U << 24) | (39U << 16) | (114U << 8) | 1U))
 		return false;
 
-	if (qhBans.contains(addr)) {
-		Timer t = qhBans.value(addr);
-		if (t.elapsed() < (1000000ULL * mp.iBanTime))
-			return true;
-		qhBans.remove(addr);
-	}
+	QMutexLocker lock(&qmBans);
 
-	QList<Timer> &ql = qhAttempts[addr];
+	const HostAddress ha(addr);
+	const quint64 now = tUptime.elapsed();
 
-	ql.append(Timer());
-	while (! ql.isEmpty() && (ql.at(0).elapsed() > (1000000ULL * mp.iBanTimeframe)))
-		ql.removeFirst();
+	QHash<HostAddress, quint64>::iterator i = qhBans.find(ha);
+	if (i != qhBans.end()) {
+		if (now < i.value())
+			return true;
+		qhBans.erase(i);
+	}
 
-	if (ql.count() > mp.iBanTries) {
-		qhBans.insert(addr, Timer());
+	if (alAttempts.attempt(ha, now, 1000000ULL * mp.iBanTimeframe) > static_cast<quint32>(mp.iBanTries)) {
+		qhBans.insert(ha, now + 1000000ULL * mp.iBanTime);
+
+		// Bans are only removed when their address comes back, so sweep
+		// out the expired ones whenever the table has doubled.
+		if (qhBans.count() > iBansPrune) {
+			for (i = qhBans.begin(); i != qhBans.end(); )
+				if (now >= i.value())
+					i = qhBans.erase(i);
+				else
+					++i;
+			iBansPrune = qMax(1024, qhBans.count() * 2);
+		}
 		return true;
 	}
 	return false;
@@ -33,6 +33,8 @@
 
 #include <QtCore/QDir>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QReadWriteLock>
 #include <QtCore/QUrl>
 #include <QtCore/QVariant>
 #include <QtNetwork/QHostAddress>
@@ -42,10 +44,14 @@
 #include <windows.h>
 #endif
 
+#include "AttemptLimiter.h"
 #include "Timer.h"
 
+class BlobStore;
+class HandshakePool;
 class Server;
 class QSettings;
+class QThread;
 
 class MetaParams {
 public:
@@ -55,6 +61,7 @@ public:
 	unsigned short usPort;
 	int iTimeout;
 	int iMaxBandwidth;
+	int iMaxBandwidthBurst;
 	int iMaxUsers;
 	int iMaxUsersPerChannel;
 	int iDefaultChan;
@@ -72,6 +79,19 @@ public:
 	int iBanTimeframe;
 	int iBanTime;
 
+	int iUDPBatchSize;
+	int iVoiceThreads;
+
+	int iTLSThreads;
+	int iTLSPending;
+	int iTLSPerAddress;
+	int iTLSTimeout;
+
+	int iControlThreads;
+
+	int iBlobCache;
+	bool bVoiceTrace;
+
 	QString qsDatabase;
 	QString qsDBDriver;
 	QString qsDBUserName;
@@ -93,6 +113,7 @@ public:
 	QString qsPid;
 	QString qsIceEndpoint;
 	QString qsIceSecretRead, qsIceSecretWrite;
+	QString qsMetrics;
 
 	QString qsRegName;
 	QString qsRegPassword;
@@ -137,11 +158,21 @@ class Meta : public QObject {
 		Q_DISABLE_COPY(Meta);
 	public:
 		static MetaParams mp;
+		// Only modified from the main thread; other threads read it through
+		// getServer(), which takes qrwlServers.
 		QHash<int, Server *> qhServers;
-		QHash<QHostAddress, QList<Timer> > qhAttempts;
-		QHash<QHostAddress, Timer> qhBans;
+		QReadWriteLock qrwlServers;
+		// Connection attempts and the resulting temporary bans (expiry in
+		// tUptime microseconds), both guarded by qmBans.
+		AttemptLimiter alAttempts;
+		QHash<HostAddress, quint64> qhBans;
+		int iBansPrune;
+		QMutex qmBans;
+		QList<QThread *> qlControlThreads;
 		QString qsOS, qsOSVersion;
 		Timer tUptime;
+		HandshakePool *hpHandshakes;
+		BlobStore *bsBlobs;
 
 #ifdef Q_OS_WIN
 		static HANDLE hQoS;
@@ -151,9 +182,11 @@ class Meta : public QObject {
 		~Meta();
 		void bootAll();
 		bool boot(int);
+		Server *getServer(int);
 		bool banCheck(const QHostAddress &);
 		void kill(int);
 		void killAll();
+		void stopControlThreads();
 		void getOSInfo();
 		void connectListener(QObject *);
 		static void getVersion(int &major, int &minor, int &patch, QString &string);
@@ -0,0 +1,381 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "Metrics.h"
+
+#include "CryptState.h"
+#include "Meta.h"
+#include "Server.h"
+#include "ServerDB.h"
+
+VoiceCounters::VoiceCounters() {
+	uiPacketsIn = uiBytesIn = 0;
+	uiPacketsRelayed = uiBytesRelayed = 0;
+	uiDecryptFailed = uiBandwidthDropped = 0;
+	uiTunnelIn = 0;
+	uiStamp = 0;
+}
+
+void VoiceCounters::merge(const VoiceCounters &other) {
+	uiPacketsIn += other.uiPacketsIn;
+	uiBytesIn += other.uiBytesIn;
+	uiPacketsRelayed += other.uiPacketsRelayed;
+	uiBytesRelayed += other.uiBytesRelayed;
+	uiDecryptFailed += other.uiDecryptFailed;
+	uiBandwidthDropped += other.uiBandwidthDropped;
+	uiTunnelIn += other.uiTunnelIn;
+	lhQueue.merge(other.lhQueue);
+	lhRelay.merge(other.lhRelay);
+}
+
+CryptCounters::CryptCounters() {
+	uiGood = uiLate = uiLost = uiResync = 0;
+}
+
+void CryptCounters::add(const CryptState &cs) {
+	uiGood += cs.uiGood;
+	uiLate += cs.uiLate;
+	uiLost += cs.uiLost;
+	uiResync += cs.uiResync;
+}
+
+void CryptCounters::merge(const CryptCounters &other) {
+	uiGood += other.uiGood;
+	uiLate += other.uiLate;
+	uiLost += other.uiLost;
+	uiResync += other.uiResync;
+}
+
+MetricSet::Family &MetricSet::family(const char *name, const char *type, const char *help) {
+	const QByteArray key(name);
+	QHash<QByteArray, Family>::iterator i = qhFamilies.find(key);
+	if (i == qhFamilies.end()) {
+		Family f;
+		f.cType = type;
+		f.cHelp = help;
+		i = qhFamilies.insert(key, f);
+		qlOrder << key;
+	}
+	return i.value();
+}
+
+void MetricSet::sample(QByteArray &out, const char *name, const char *suffix, const QByteArray &labels, const QByteArray &value) {
+	out += name;
+	out += suffix;
+	if (! labels.isEmpty()) {
+		out += '{';
+		out += labels;
+		out += '}';
+	}
+	out += ' ';
+	out += value;
+	out += '\n';
+}
+
+void MetricSet::counter(const char *name, const char *help, const QByteArray &labels, quint64 value) {
+	sample(family(name, "counter", help).qbaSamples, name, "", labels, QByteArray::number(value));
+}
+
+void MetricSet::gauge(const char *name, const char *help, const QByteArray &labels, qint64 value) {
+	sample(family(name, "gauge", help).qbaSamples, name, "", labels, QByteArray::number(value));
+}
+
+// Buckets are cumulative and in seconds, as the format expects.
+void MetricSet::histogram(const char *name, const char *help, const QByteArray &labels, const Histogram &h) {
+	QByteArray &out = family(name, "histogram", help).qbaSamples;
+	const QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+
+	quint64 n = 0;
+	for (int i=0;i<Histogram::Buckets;++i) {
+		n += h.uiBucket[i];
+		sample(out, name, "_bucket", prefix + "le=\"" + QByteArray::number(static_cast<double>(Histogram::bound(i)) / 1000000.0, 'g', 6) + '"', QByteArray::number(n));
+	}
+	n += h.uiBucket[Histogram::Buckets];
+	sample(out, name, "_bucket", prefix + "le=\"+Inf\"", QByteArray::number(n));
+	sample(out, name, "_sum", labels, QByteArray::number(static_cast<double>(h.uiSum) / 1000000.0, 'g', 12));
+	sample(out, name, "_count", labels, QByteArray::number(n));
+}
+
+// Cumulative buckets at the top of every power of two range, so scrapers
+// can take percentiles over any window with rate(). The last bucket also
+// holds everything beyond the range, so it only shows up as +Inf.
+void MetricSet::histogram(const char *name, const char *help, const QByteArray &labels, const LatencyHistogram &h) {
+	QByteArray &out = family(name, "histogram", help).qbaSamples;
+	const QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+
+	quint64 n = 0;
+	for (int i=0;i<LatencyHistogram::Buckets - 1;++i) {
+		n += h.uiBucket[i];
+		if ((i >= LatencyHistogram::SubBuckets) && ((i % LatencyHistogram::SubBuckets) == LatencyHistogram::SubBuckets - 1))
+			sample(out, name, "_bucket", prefix + "le=\"" + QByteArray::number(static_cast<double>(LatencyHistogram::upperBound(i)) / 1000000.0, 'g', 6) + '"', QByteArray::number(n));
+	}
+	n += h.uiBucket[LatencyHistogram::Buckets - 1];
+	sample(out, name, "_bucket", prefix + "le=\"+Inf\"", QByteArray::number(n));
+	sample(out, name, "_sum", labels, QByteArray::number(static_cast<double>(h.uiSum) / 1000000.0, 'g', 12));
+	sample(out, name, "_count", labels, QByteArray::number(n));
+}
+
+void MetricSet::merge(const MetricSet &other) {
+	foreach(const QByteArray &key, other.qlOrder) {
+		const Family &f = other.qhFamilies.value(key);
+		family(key.constData(), f.cType, f.cHelp).qbaSamples += f.qbaSamples;
+	}
+}
+
+QByteArray MetricSet::render() const {
+	QByteArray out;
+	foreach(const QByteArray &key, qlOrder) {
+		const Family &f = qhFamilies.value(key);
+		out += "# HELP " + key + ' ' + f.cHelp + '\n';
+		out += "# TYPE " + key + ' ' + f.cType + '\n';
+		out += f.qbaSamples;
+	}
+	return out;
+}
+
+QByteArray MetricSet::label(const char *name, const QString &value) {
+	QByteArray v = value.toUtf8();
+	v.replace('\\', "\\\\");
+	v.replace('"', "\\\"");
+	v.replace('\n', "\\n");
+	return QByteArray(name) + "=\"" + v + '"';
+}
+
+MetricsScrape::MetricsScrape(MetricsServer *ms, int request) : qpServer(ms), iRequest(request) {
+}
+
+// Runs on whichever thread dropped the last reference.
+MetricsScrape::~MetricsScrape() {
+	if (qpServer)
+		QMetaObject::invokeMethod(qpServer, "reply", Qt::QueuedConnection, Q_ARG(int, iRequest), Q_ARG(QByteArray, msMetrics.render()));
+}
+
+void MetricsScrape::add(const MetricSet &ms) {
+	QMutexLocker lock(&qmMetrics);
+	msMetrics.merge(ms);
+}
+
+// Scrapers are few and local; anything beyond this is dropped.
+static const int MAX_CONNECTIONS = 32;
+static const int MAX_REQUEST = 8192;
+// Time a connection gets to send its request and take the response.
+static const quint64 CONNECTION_TIMEOUT = 5000000ULL;
+
+MetricsServer::MetricsServer(const QString &endpoint, QObject *p) : QObject(p) {
+	qtsServer = NULL;
+	qlsServer = NULL;
+	iNextScrape = 0;
+
+	qtTimeout = new QTimer(this);
+	qtTimeout->setInterval(1000);
+	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(timeout()));
+
+	if (endpoint.startsWith(QLatin1Char('/'))) {
+		qlsServer = new QLocalServer(this);
+		QLocalServer::removeServer(endpoint);
+		if (! qlsServer->listen(endpoint)) {
+			qWarning("Metrics: Failed to listen on \"%s\": %s", qPrintable(endpoint), qPrintable(qlsServer->errorString()));
+			return;
+		}
+		connect(qlsServer, SIGNAL(newConnection()), this, SLOT(newLocalConnection()));
+	} else {
+		QString host = QLatin1String("127.0.0.1");
+		QString port = endpoint;
+		const int colon = endpoint.lastIndexOf(QLatin1Char(':'));
+		if (colon >= 0) {
+			host = endpoint.left(colon);
+			port = endpoint.mid(colon + 1);
+			if (host.startsWith(QLatin1Char('[')) && host.endsWith(QLatin1Char(']')))
+				host = host.mid(1, host.length() - 2);
+		}
+
+		QHostAddress addr;
+		bool ok = false;
+		const quint16 portnum = port.toUShort(&ok);
+		if (! ok || ! addr.setAddress(host)) {
+			qWarning("Metrics: Invalid endpoint \"%s\"", qPrintable(endpoint));
+			return;
+		}
+
+		qtsServer = new QTcpServer(this);
+		if (! qtsServer->listen(addr, portnum)) {
+			qWarning("Metrics: Failed to listen on \"%s\": %s", qPrintable(endpoint), qPrintable(qtsServer->errorString()));
+			return;
+		}
+		connect(qtsServer, SIGNAL(newConnection()), this, SLOT(newTcpConnection()));
+	}
+	qWarning("Metrics: Endpoint \"%s\" running", qPrintable(endpoint));
+}
+
+bool MetricsServer::isListening() const {
+	return (qtsServer && qtsServer->isListening()) || (qlsServer && qlsServer->isListening());
+}
+
+void MetricsServer::newTcpConnection() {
+	while (QTcpSocket *sock = qtsServer->nextPendingConnection()) {
+		connect(sock, SIGNAL(disconnected()), this, SLOT(connectionClosed()));
+		accept(sock);
+	}
+}
+
+void MetricsServer::newLocalConnection() {
+	while (QLocalSocket *sock = qlsServer->nextPendingConnection()) {
+		connect(sock, SIGNAL(disconnected()), this, SLOT(connectionClosed()));
+		accept(sock);
+	}
+}
+
+void MetricsServer::accept(QIODevice *dev) {
+	if (qhConnections.count() >= MAX_CONNECTIONS) {
+		dev->close();
+		dev->deleteLater();
+		return;
+	}
+	connect(dev, SIGNAL(readyRead()), this, SLOT(readRequest()));
+	qhRequests.insert(dev, QByteArray());
+	qhConnections.insert(dev, meta->tUptime.elapsed());
+	if (! qtTimeout->isActive())
+		qtTimeout->start();
+	if (dev->bytesAvailable() > 0)
+		readRequest();
+}
+
+// Forgets dev, whether it closed or timed out. A scrape still running for
+// it finds the QPointer cleared.
+void MetricsServer::drop(QIODevice *dev) {
+	qhRequests.remove(dev);
+	qhConnections.remove(dev);
+	if (qhConnections.isEmpty())
+		qtTimeout->stop();
+	dev->deleteLater();
+}
+
+void MetricsServer::connectionClosed() {
+	QIODevice *dev = qobject_cast<QIODevice *>(sender());
+	if (! dev)
+		return;
+	drop(dev);
+}
+
+void MetricsServer::timeout() {
+	const quint64 now = meta->tUptime.elapsed();
+
+	foreach(QIODevice *dev, qhConnections.keys()) {
+		if (now - qhConnections.value(dev) < CONNECTION_TIMEOUT)
+			continue;
+		disconnect(dev, NULL, this, NULL);
+		if (QAbstractSocket *sock = qobject_cast<QAbstractSocket *>(dev))
+			sock->abort();
+		else if (QLocalSocket *sock = qobject_cast<QLocalSocket *>(dev))
+			sock->abort();
+		drop(dev);
+	}
+}
+
+void MetricsServer::readRequest() {
+	QIODevice *dev = qobject_cast<QIODevice *>(sender());
+	if (! dev)
+		return;
+
+	QHash<QIODevice *, QByteArray>::iterator i = qhRequests.find(dev);
+	if (i == qhRequests.end()) {
+		// Already answered or being answered.
+		dev->readAll();
+		return;
+	}
+
+	i.value() += dev->readAll();
+	QByteArray &req = i.value();
+
+	if (! req.contains("\r\n\r\n") && ! req.contains("\n\n")) {
+		if (req.size() > MAX_REQUEST) {
+			qhRequests.erase(i);
+			respond(dev, "431 Request Header Fields Too Large", QByteArray());
+		}
+		return;
+	}
+
+	QList<QByteArray> line = req.left(req.indexOf('\n')).trimmed().split(' ');
+	qhRequests.erase(i);
+
+	if ((line.count() < 2) || (line.at(0) != "GET")) {
+		respond(dev, "405 Method Not Allowed", QByteArray());
+		return;
+	}
+
+	QByteArray path = line.at(1);
+	const int query = path.indexOf('?');
+	if (query >= 0)
+		path.truncate(query);
+
+	if (path == "/metrics")
+		scrape(dev);
+	else
+		respond(dev, "404 Not Found", QByteArray());
+}
+
+void MetricsServer::respond(QIODevice *dev, const char *status, const QByteArray &body) {
+	QByteArray out = QByteArray("HTTP/1.0 ") + status + "\r\n";
+	out += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+	out += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+	out += "Connection: close\r\n\r\n";
+	out += body;
+	dev->write(out);
+	// Pending data is still sent before the connection goes down.
+	dev->close();
+}
+
+// Process wide metrics are filled in right here; per server ones are added
+// by Server::collectMetrics() on each server's own control thread.
+void MetricsServer::scrape(QIODevice *dev) {
+	const int id = ++iNextScrape;
+	qhScrapes.insert(id, dev);
+
+	MetricSet ms;
+	ms.gauge("murmur_servers", "Number of booted virtual servers.", QByteArray(), meta->qhServers.count());
+	ms.gauge("murmur_uptime_seconds", "Time since murmur was started.", QByteArray(), static_cast<qint64>(meta->tUptime.elapsed() / 1000000ULL));
+
+	Histogram h;
+	ServerDB::getQueryTime(h);
+	ms.histogram("murmur_db_query_duration_seconds", "Time taken by database queries, on any thread.", QByteArray(), h);
+
+	QSharedPointer<MetricsScrape> msp(new MetricsScrape(this, id));
+	msp->add(ms);
+	foreach(Server *s, meta->qhServers)
+		QCoreApplication::instance()->postEvent(s, new ExecEvent(boost::bind(&Server::collectMetrics, s, msp)));
+}
+
+void MetricsServer::reply(int request, const QByteArray &body) {
+	QPointer<QIODevice> dev = qhScrapes.take(request);
+	if (dev && qhConnections.contains(dev))
+		respond(dev, "200 OK", body);
+}
@@ -0,0 +1,168 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_METRICS_H_
+#define MUMBLE_MURMUR_METRICS_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QIODevice>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QString>
+
+#include "Histogram.h"
+
+class CryptState;
+class QLocalServer;
+class QTcpServer;
+class QTimer;
+
+// Voice path counters. Each voice thread has its own set, and the control
+// thread one more for voice tunneled over TCP; nothing else writes them, so
+// they need no locking. Other threads only read the copy a voice thread
+// publishes (VoiceThreadState::published()), which may be slightly stale.
+struct VoiceCounters {
+	quint64 uiPacketsIn;
+	quint64 uiBytesIn;
+	quint64 uiPacketsRelayed;
+	quint64 uiBytesRelayed;
+	quint64 uiDecryptFailed;
+	quint64 uiBandwidthDropped;
+	quint64 uiTunnelIn;
+
+	// Receive time (wall clock microseconds) of the datagram being relayed,
+	// or 0 unless voice tracing is on; see MetaParams::bVoiceTrace.
+	quint64 uiStamp;
+	// Time datagrams spent in the socket buffer, and from receipt to each
+	// datagram sent on.
+	LatencyHistogram lhQueue;
+	LatencyHistogram lhRelay;
+
+	VoiceCounters();
+	void merge(const VoiceCounters &);
+};
+
+// Sum of the CryptState packet statistics of a number of users.
+struct CryptCounters {
+	quint64 uiGood;
+	quint64 uiLate;
+	quint64 uiLost;
+	quint64 uiResync;
+
+	CryptCounters();
+	void add(const CryptState &);
+	void merge(const CryptCounters &);
+};
+
+// Metric families in the Prometheus text exposition format. Samples are
+// grouped by family, so sets built separately (say, one per virtual server)
+// can be merged and still render to a valid exposition.
+class MetricSet {
+	protected:
+		struct Family {
+			const char *cType;
+			const char *cHelp;
+			QByteArray qbaSamples;
+		};
+		QList<QByteArray> qlOrder;
+		QHash<QByteArray, Family> qhFamilies;
+
+		Family &family(const char *name, const char *type, const char *help);
+		static void sample(QByteArray &out, const char *name, const char *suffix, const QByteArray &labels, const QByteArray &value);
+	public:
+		void counter(const char *name, const char *help, const QByteArray &labels, quint64 value);
+		void gauge(const char *name, const char *help, const QByteArray &labels, qint64 value);
+		void histogram(const char *name, const char *help, const QByteArray &labels, const Histogram &h);
+		void histogram(const char *name, const char *help, const QByteArray &labels, const LatencyHistogram &h);
+		void merge(const MetricSet &);
+		QByteArray render() const;
+
+		// name="value", escaped; join several with ','.
+		static QByteArray label(const char *name, const QString &value);
+};
+
+// Opt-in HTTP endpoint for the metrics, see MetaParams::qsMetrics. Listens on
+// a TCP address or, for endpoints starting with a '/', a local socket, and
+// answers GET /metrics. Lives on the main thread.
+class MetricsServer : public QObject {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(MetricsServer)
+	protected:
+		QTcpServer *qtsServer;
+		QLocalServer *qlsServer;
+		// Request bytes read so far, until the header is complete.
+		QHash<QIODevice *, QByteArray> qhRequests;
+		QHash<int, QPointer<QIODevice> > qhScrapes;
+		int iNextScrape;
+		// Every open connection and when it was accepted (Meta::tUptime),
+		// so ones that stall are dropped instead of holding a slot forever.
+		QHash<QIODevice *, quint64> qhConnections;
+		QTimer *qtTimeout;
+
+		void drop(QIODevice *);
+		void accept(QIODevice *);
+		void respond(QIODevice *, const char *status, const QByteArray &body);
+		void scrape(QIODevice *);
+	public:
+		MetricsServer(const QString &endpoint, QObject *parent = NULL);
+		bool isListening() const;
+	public slots:
+		void reply(int request, const QByteArray &body);
+	protected slots:
+		void newTcpConnection();
+		void newLocalConnection();
+		void readRequest();
+		void connectionClosed();
+		void timeout();
+};
+
+// A single request for the metrics. Every booted server adds its part on its
+// own control thread; once the last reference is dropped the result goes
+// back to the MetricsServer. Servers stopped before getting to it simply
+// don't show up.
+class MetricsScrape {
+	private:
+		Q_DISABLE_COPY(MetricsScrape)
+	protected:
+		QMutex qmMetrics;
+		MetricSet msMetrics;
+		QPointer<MetricsServer> qpServer;
+		int iRequest;
+	public:
+		MetricsScrape(MetricsServer *, int request);
+		~MetricsScrape();
+		void add(const MetricSet &);
+};
+
+#endif
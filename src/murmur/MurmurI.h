@@ -182,6 +182,13 @@ namespace Murmur {
 			virtual void getUptime_async(const ::Murmur::AMD_Server_getUptimePtr&,
 			                             const Ice::Current&);
 
+			virtual void getStatistics_async(const ::Murmur::AMD_Server_getStatisticsPtr&,
+			                                 const Ice::Current&);
+
+			virtual void getBandwidthHistory_async(const ::Murmur::AMD_Server_getBandwidthHistoryPtr&,
+			                                       ::Ice::Int,
+			                                       const Ice::Current&);
+
 			virtual void ice_ping(const Ice::Current&) const;
 	};
 
@@ -261,8 +261,17 @@ MurmurIce::~MurmurIce() {
 }
 
 void MurmurIce::customEvent(QEvent *evt) {
-	if (evt->type() == EXEC_QEVENT)
-		static_cast<ExecEvent *>(evt)->execute();
+	if (evt->type() != EXEC_QEVENT)
+		return;
+
+	ExecEvent *ee = static_cast<ExecEvent *>(evt);
+
+	// Calls for a server running on a control thread are run on that thread.
+	MurmurIceRelay *r = (ee->iServer >= 0) ? getRelay(ee->iServer) : NULL;
+	if (r && (r->thread() != thread()))
+		QCoreApplication::instance()->postEvent(r, new ExecEvent(ee->function()));
+	else
+		ee->execute();
 }
 
 void MurmurIce::badMetaProxy(const ::Murmur::MetaCallbackPrx &prx) {
@@ -276,8 +285,10 @@ void MurmurIce::badServerProxy(const ::Murmur::ServerCallbackPrx &prx, const ::S
 }
 
 void MurmurIce::badAuthenticator(::Server *server) {
-	server->disconnectAuthenticator(this);
-	const ::Murmur::ServerAuthenticatorPrx &prx = qmServerAuthenticator.value(server->iServerNum);
+	MurmurIceRelay *r = getRelay(server->iServerNum);
+	if (r)
+		server->disconnectAuthenticator(r);
+	const ::Murmur::ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	server->log(QString("Ice Authenticator %1 failed").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	removeServerAuthenticator(server);
 	removeServerUpdatingAuthenticator(server);
@@ -297,6 +308,7 @@ void MurmurIce::removeMetaCallback(const ::Murmur::MetaCallbackPrx& prx) {
 }
 
 void MurmurIce::addServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx) {
+	QMutexLocker lock(&qmCallbacks);
 	QList< ::Murmur::ServerCallbackPrx >& cbList = qmServerCallbacks[server->iServerNum];
 
 	if (!cbList.contains(prx)) {
@@ -306,19 +318,27 @@ void MurmurIce::addServerCallback(const ::Server* server, const ::Murmur::Server
 }
 
 void MurmurIce::removeServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx) {
+	QMutexLocker lock(&qmCallbacks);
 	if (qmServerCallbacks[server->iServerNum].removeAll(prx)) {
 		server->log(QString("Removed Ice ServerCallback %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	}
 }
 
 void MurmurIce::removeServerCallbacks(const ::Server* server) {
+	QMutexLocker lock(&qmCallbacks);
 	if (qmServerCallbacks.contains(server->iServerNum)) {
 		server->log(QString("Removed all Ice ServerCallbacks"));
 		qmServerCallbacks.remove(server->iServerNum);
 	}
 }
 
+const QList< ::Murmur::ServerCallbackPrx> MurmurIce::getServerCallbacks(const ::Server* server) const {
+	QMutexLocker lock(&qmCallbacks);
+	return qmServerCallbacks.value(server->iServerNum);
+}
+
 void MurmurIce::addServerContextCallback(const ::Server* server, int session_id, const QString& action, const ::Murmur::ServerContextCallbackPrx& prx) {
+	QMutexLocker lock(&qmCallbacks);
 	QMap<QString, ::Murmur::ServerContextCallbackPrx>& callbacks = qmServerContextCallbacks[server->iServerNum][session_id];
 
 	if (!callbacks.contains(action) || callbacks[action] != prx) {
@@ -328,16 +348,19 @@ void MurmurIce::addServerContextCallback(const ::Server* server, int session_id,
 }
 
 const QMap< int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > MurmurIce::getServerContextCallbacks(const ::Server* server) const {
-	return qmServerContextCallbacks[server->iServerNum];
+	QMutexLocker lock(&qmCallbacks);
+	return qmServerContextCallbacks.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerContextCallback(const ::Server* server, int session_id, const QString& action) {
+	QMutexLocker lock(&qmCallbacks);
 	if (qmServerContextCallbacks[server->iServerNum][session_id].remove(action)) {
 		server->log(QString("Removed Ice ServerContextCallback for session %1, action %2").arg(session_id).arg(action));
 	}
 }
 
 void MurmurIce::setServerAuthenticator(const ::Server* server, const ::Murmur::ServerAuthenticatorPrx& prx) {
+	QMutexLocker lock(&qmCallbacks);
 	if (prx != qmServerAuthenticator[server->iServerNum]) {
 		server->log(QString("Set Ice Authenticator to %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 		qmServerAuthenticator[server->iServerNum] = prx;
@@ -345,16 +368,20 @@ void MurmurIce::setServerAuthenticator(const ::Server* server, const ::Murmur::S
 }
 
 const ::Murmur::ServerAuthenticatorPrx MurmurIce::getServerAuthenticator(const ::Server* server) const {
-	return qmServerAuthenticator[server->iServerNum];
+	QMutexLocker lock(&qmCallbacks);
+	return qmServerAuthenticator.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerAuthenticator(const ::Server* server) {
-	if (qmServerAuthenticator.remove(server->iServerNum)) {
-		server->log(QString("Removed Ice Authenticator %1").arg(QString::fromStdString(communicator->proxyToString(getServerAuthenticator(server)))));
+	QMutexLocker lock(&qmCallbacks);
+	if (qmServerAuthenticator.contains(server->iServerNum)) {
+		const ::Murmur::ServerAuthenticatorPrx prx = qmServerAuthenticator.take(server->iServerNum);
+		server->log(QString("Removed Ice Authenticator %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	}
 }
 
 void MurmurIce::setServerUpdatingAuthenticator(const ::Server* server, const ::Murmur::ServerUpdatingAuthenticatorPrx& prx) {
+	QMutexLocker lock(&qmCallbacks);
 	if (prx != qmServerUpdatingAuthenticator[server->iServerNum]) {
 		server->log(QString("Set Ice UpdatingAuthenticator to %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 		qmServerUpdatingAuthenticator[server->iServerNum] = prx;
@@ -362,16 +389,23 @@ void MurmurIce::setServerUpdatingAuthenticator(const ::Server* server, const ::M
 }
 
 const ::Murmur::ServerUpdatingAuthenticatorPrx MurmurIce::getServerUpdatingAuthenticator(const ::Server* server) const {
-	return qmServerUpdatingAuthenticator[server->iServerNum];
+	QMutexLocker lock(&qmCallbacks);
+	return qmServerUpdatingAuthenticator.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerUpdatingAuthenticator(const ::Server* server) {
+	QMutexLocker lock(&qmCallbacks);
 	if (qmServerUpdatingAuthenticator.contains(server->iServerNum)) {
-		server->log(QString("Removed Ice UpdatingAuthenticator %1").arg(QString::fromStdString(communicator->proxyToString(getServerUpdatingAuthenticator(server)))));
-		qmServerUpdatingAuthenticator.remove(server->iServerNum);
+		const ::Murmur::ServerUpdatingAuthenticatorPrx prx = qmServerUpdatingAuthenticator.take(server->iServerNum);
+		server->log(QString("Removed Ice UpdatingAuthenticator %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	}
 }
 
+MurmurIceRelay *MurmurIce::getRelay(int server_id) const {
+	QMutexLocker lock(&qmCallbacks);
+	return qmRelays.value(server_id);
+}
+
 static ServerPrx idToProxy(int id, const Ice::ObjectAdapterPtr &adapter) {
 	Ice::Identity ident;
 	ident.category = "s";
@@ -381,8 +415,11 @@ static ServerPrx idToProxy(int id, const Ice::ObjectAdapterPtr &adapter) {
 }
 
 void MurmurIce::started(::Server *s) {
-	s->connectListener(mi);
-	connect(s, SIGNAL(contextAction(const User *, const QString &, unsigned int, int)), this, SLOT(contextAction(const User *, const QString &, unsigned int, int)));
+	MurmurIceRelay *r = new MurmurIceRelay(s);
+	{
+		QMutexLocker lock(&qmCallbacks);
+		qmRelays.insert(s->iServerNum, r);
+	}
 
 	const QList< ::Murmur::MetaCallbackPrx> &qlList = qlMetaCallbacks;
 
@@ -399,6 +436,20 @@ void MurmurIce::started(::Server *s) {
 }
 
 void MurmurIce::stopped(::Server *s) {
+	MurmurIceRelay *r;
+	{
+		QMutexLocker lock(&qmCallbacks);
+		r = qmRelays.take(s->iServerNum);
+		qmServerContextCallbacks.remove(s->iServerNum);
+	}
+	// The server is back on the main thread by now. Calls that were still
+	// queued for it get answered (with ServerBootedException) rather than
+	// dropped.
+	if (r) {
+		QCoreApplication::sendPostedEvents(r, EXEC_QEVENT);
+		delete r;
+	}
+
 	removeServerCallbacks(s);
 	removeServerAuthenticator(s);
 	removeServerUpdatingAuthenticator(s);
@@ -417,10 +468,9 @@ void MurmurIce::stopped(::Server *s) {
 	}
 }
 
-void MurmurIce::userConnected(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::userConnected(::Server *s, const ::User *p) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -437,12 +487,15 @@ void MurmurIce::userConnected(const ::User *p) {
 	}
 }
 
-void MurmurIce::userDisconnected(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::userDisconnected(::Server *s, const ::User *p) {
 
-	qmServerContextCallbacks[s->iServerNum].remove(p->uiSession);
+	{
+		QMutexLocker lock(&qmCallbacks);
+		if (qmServerContextCallbacks.contains(s->iServerNum))
+			qmServerContextCallbacks[s->iServerNum].remove(p->uiSession);
+	}
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -459,10 +512,9 @@ void MurmurIce::userDisconnected(const ::User *p) {
 	}
 }
 
-void MurmurIce::userStateChanged(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::userStateChanged(::Server *s, const ::User *p) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -479,10 +531,9 @@ void MurmurIce::userStateChanged(const ::User *p) {
 	}
 }
 
-void MurmurIce::userTextMessage(const ::User *p, const ::TextMessage &message) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::userTextMessage(::Server *s, const ::User *p, const ::TextMessage &message) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -502,10 +553,9 @@ void MurmurIce::userTextMessage(const ::User *p, const ::TextMessage &message) {
 	}
 }
 
-void MurmurIce::channelCreated(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::channelCreated(::Server *s, const ::Channel *c) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -522,10 +572,9 @@ void MurmurIce::channelCreated(const ::Channel *c) {
 	}
 }
 
-void MurmurIce::channelRemoved(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::channelRemoved(::Server *s, const ::Channel *c) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -542,10 +591,9 @@ void MurmurIce::channelRemoved(const ::Channel *c) {
 	}
 }
 
-void MurmurIce::channelStateChanged(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+void MurmurIce::channelStateChanged(::Server *s, const ::Channel *c) {
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -562,23 +610,15 @@ void MurmurIce::channelStateChanged(const ::Channel *c) {
 	}
 }
 
-void MurmurIce::contextAction(const ::User *pSrc, const QString &action, unsigned int session, int iChannel) {
-	::Server *s = qobject_cast< ::Server *> (sender());
-
-	QMap<int, QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > > &qmAll = qmServerContextCallbacks;
-	if (! qmAll.contains(s->iServerNum))
-		return;
-
-	QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > &qmServer = qmAll[s->iServerNum];
-	if (! qmServer.contains(pSrc->uiSession))
-		return;
-
-	QMap<QString, ::Murmur::ServerContextCallbackPrx> &qmUser = qmServer[pSrc->uiSession];
-	if (! qmUser.contains(action))
+void MurmurIce::contextAction(::Server *s, const ::User *pSrc, const QString &action, unsigned int session, int iChannel) {
+	::Murmur::ServerContextCallbackPrx prx;
+	{
+		QMutexLocker lock(&qmCallbacks);
+		prx = qmServerContextCallbacks.value(s->iServerNum).value(pSrc->uiSession).value(action);
+	}
+	if (! prx)
 		return;
 
-	const ::Murmur::ServerContextCallbackPrx &prx = qmUser[action];
-
 	::Murmur::User mp;
 	userToUser(pSrc, mp);
 
@@ -598,9 +638,7 @@ void MurmurIce::contextAction(const ::User *pSrc, const QString &action, unsigne
 	}
 }
 
-void MurmurIce::idToNameSlot(QString &name, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::idToName(::Server *server, QString &name, int id) {
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
 		name = u8(prx->idToName(id));
@@ -608,9 +646,7 @@ void MurmurIce::idToNameSlot(QString &name, int id) {
 		badAuthenticator(server);
 	}
 }
-void MurmurIce::idToTextureSlot(QByteArray &qba, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::idToTexture(::Server *server, QByteArray &qba, int id) {
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
 		const ::Murmur::Texture &tex = prx->idToTexture(id);
@@ -624,9 +660,7 @@ void MurmurIce::idToTextureSlot(QByteArray &qba, int id) {
 	}
 }
 
-void MurmurIce::nameToIdSlot(int &id, const QString &name) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::nameToId(::Server *server, int &id, const QString &name) {
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
 		id = prx->nameToId(u8(name));
@@ -635,9 +669,7 @@ void MurmurIce::nameToIdSlot(int &id, const QString &name) {
 	}
 }
 
-void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::authenticate(::Server *server, int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	::std::string newname;
 	::Murmur::GroupNameList groups;
@@ -671,9 +703,7 @@ void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const
 	}
 }
 
-void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::registerUser(::Server *server, int &res, const QMap<int, QString> &info) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -688,9 +718,7 @@ void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
 	}
 }
 
-void MurmurIce::unregisterUserSlot(int &res, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::unregisterUser(::Server *server, int &res, int id) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -701,9 +729,7 @@ void MurmurIce::unregisterUserSlot(int &res, int id) {
 	}
 }
 
-void MurmurIce::getRegistrationSlot(int &res, int id, QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::getRegistration(::Server *server, int &res, int id, QMap<int, QString> &info) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -720,9 +746,7 @@ void MurmurIce::getRegistrationSlot(int &res, int id, QMap<int, QString> &info)
 	}
 }
 
-void  MurmurIce::getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &m) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::getRegisteredUsers(::Server *server, const QString &filter, QMap<int, QString> &m) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -740,9 +764,7 @@ void  MurmurIce::getRegisteredUsersSlot(const QString &filter, QMap<int, QString
 		m.insert((*i).first, u8((*i).second));
 }
 
-void MurmurIce::setInfoSlot(int &res, int id, const QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::setInfo(::Server *server, int &res, int id, const QMap<int, QString> &info) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -757,9 +779,7 @@ void MurmurIce::setInfoSlot(int &res, int id, const QMap<int, QString> &info) {
 	}
 }
 
-void MurmurIce::setTextureSlot(int &res, int id, const QByteArray &texture) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
+void MurmurIce::setTexture(::Server *server, int &res, int id, const QByteArray &texture) {
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
 		return;
@@ -777,12 +797,95 @@ void MurmurIce::setTextureSlot(int &res, int id, const QByteArray &texture) {
 	}
 }
 
+MurmurIceRelay::MurmurIceRelay(::Server *s) : QObject(s) {
+	server = s;
+	s->connectListener(this);
+	connect(s, SIGNAL(contextAction(const User *, const QString &, unsigned int, int)), this, SLOT(contextAction(const User *, const QString &, unsigned int, int)));
+}
+
+void MurmurIceRelay::customEvent(QEvent *evt) {
+	if (evt->type() == EXEC_QEVENT)
+		static_cast<ExecEvent *>(evt)->execute();
+}
+
+void MurmurIceRelay::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
+	mi->authenticate(server, res, uname, sessionId, certlist, certhash, certstrong, pw);
+}
+
+void MurmurIceRelay::registerUserSlot(int &res, const QMap<int, QString> &info) {
+	mi->registerUser(server, res, info);
+}
+
+void MurmurIceRelay::unregisterUserSlot(int &res, int id) {
+	mi->unregisterUser(server, res, id);
+}
+
+void MurmurIceRelay::getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &res) {
+	mi->getRegisteredUsers(server, filter, res);
+}
+
+void MurmurIceRelay::getRegistrationSlot(int &res, int id, QMap<int, QString> &info) {
+	mi->getRegistration(server, res, id, info);
+}
+
+void MurmurIceRelay::setInfoSlot(int &res, int id, const QMap<int, QString> &info) {
+	mi->setInfo(server, res, id, info);
+}
+
+void MurmurIceRelay::setTextureSlot(int &res, int id, const QByteArray &texture) {
+	mi->setTexture(server, res, id, texture);
+}
+
+void MurmurIceRelay::nameToIdSlot(int &res, const QString &name) {
+	mi->nameToId(server, res, name);
+}
+
+void MurmurIceRelay::idToNameSlot(QString &res, int id) {
+	mi->idToName(server, res, id);
+}
+
+void MurmurIceRelay::idToTextureSlot(QByteArray &res, int id) {
+	mi->idToTexture(server, res, id);
+}
+
+void MurmurIceRelay::userStateChanged(const ::User *p) {
+	mi->userStateChanged(server, p);
+}
+
+void MurmurIceRelay::userTextMessage(const ::User *p, const ::TextMessage &message) {
+	mi->userTextMessage(server, p, message);
+}
+
+void MurmurIceRelay::userConnected(const ::User *p) {
+	mi->userConnected(server, p);
+}
+
+void MurmurIceRelay::userDisconnected(const ::User *p) {
+	mi->userDisconnected(server, p);
+}
+
+void MurmurIceRelay::channelStateChanged(const ::Channel *c) {
+	mi->channelStateChanged(server, c);
+}
+
+void MurmurIceRelay::channelCreated(const ::Channel *c) {
+	mi->channelCreated(server, c);
+}
+
+void MurmurIceRelay::channelRemoved(const ::Channel *c) {
+	mi->channelRemoved(server, c);
+}
+
+void MurmurIceRelay::contextAction(const ::User *pSrc, const QString &action, unsigned int session, int iChannel) {
+	mi->contextAction(server, pSrc, action, session, iChannel);
+}
+
 Ice::ObjectPtr ServerLocator::locate(const Ice::Current &, Ice::LocalObjectPtr &) {
 	return iopServer;
 }
 
 #define FIND_SERVER \
-	::Server *server = meta->qhServers.value(server_id);
+	::Server *server = meta->getServer(server_id);
 
 #define NEED_SERVER_EXISTS \
 	FIND_SERVER \
@@ -882,8 +985,10 @@ static void impl_Server_removeCallback(const Murmur::AMD_Server_removeCallbackPt
 static void impl_Server_setAuthenticator(const ::Murmur::AMD_Server_setAuthenticatorPtr& cb, int server_id, const ::Murmur::ServerAuthenticatorPrx &aptr) {
 	NEED_SERVER;
 
-	if (mi->getServerAuthenticator(server))
-		server->disconnectAuthenticator(mi);
+	MurmurIceRelay *relay = mi->getRelay(server_id);
+
+	if (mi->getServerAuthenticator(server) && relay)
+		server->disconnectAuthenticator(relay);
 
 	::Murmur::ServerAuthenticatorPrx prx;
 
@@ -899,8 +1004,8 @@ static void impl_Server_setAuthenticator(const ::Murmur::AMD_Server_setAuthentic
 		return;
 	}
 
-	if (prx)
-		server->connectAuthenticator(mi);
+	if (prx && relay)
+		server->connectAuthenticator(relay);
 
 	cb->ice_response();
 }
@@ -1385,7 +1490,7 @@ static void impl_Server_setACL(const ::Murmur::AMD_Server_setACLPtr cb, int serv
 		acl->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(channel);
 	server->updateChannel(channel);
 	cb->ice_response();
 }
@@ -1534,9 +1639,14 @@ static void impl_Server_setTexture(const ::Murmur::AMD_Server_setTexturePtr cb,
 		if (user) {
 			MumbleProto::UserState mpus;
 			mpus.set_session(user->uiSession);
-			mpus.set_texture(blob(user->qbaTexture));
 
-			server->sendAll(mpus, ~0x010202);
+			const QByteArray &legacy = server->legacyTexture(user);
+			if (! legacy.isEmpty() || user->qbaTexture.isEmpty()) {
+				mpus.set_texture(blob(legacy));
+				server->sendAll(mpus, ~0x010202);
+			}
+
+			mpus.set_texture(blob(user->qbaTexture));
 			if (! user->qbaTextureHash.isEmpty()) {
 				mpus.clear_texture();
 				mpus.set_texture_hash(blob(user->qbaTextureHash));
@@ -1554,6 +1664,38 @@ static void impl_Server_getUptime(const ::Murmur::AMD_Server_getUptimePtr cb, in
 	cb->ice_response(static_cast<int>(server->tUptime.elapsed()/1000000LL));
 }
 
+#define ACCESS_Server_getStatistics_READ
+static void impl_Server_getStatistics(const ::Murmur::AMD_Server_getStatisticsPtr cb, int server_id) {
+	NEED_SERVER;
+
+	::Murmur::StatisticsMap sm;
+
+	QMap<QString, qint64> values = server->getStatistics();
+	QMap<QString, qint64>::const_iterator i;
+	for (i=values.constBegin();i != values.constEnd(); ++i) {
+		sm[u8(i.key())] = i.value();
+	}
+	cb->ice_response(sm);
+}
+
+#define ACCESS_Server_getBandwidthHistory_READ
+static void impl_Server_getBandwidthHistory(const ::Murmur::AMD_Server_getBandwidthHistoryPtr cb, int server_id, ::Ice::Int session) {
+	NEED_SERVER;
+	NEED_PLAYER;
+
+	QList<int> bytes, dropped;
+	user->bwr.history(bytes, dropped);
+
+	::Murmur::BandwidthHistory bh;
+	foreach(int v, bytes)
+		bh.bytes.push_back(v);
+	foreach(int v, dropped)
+		bh.dropped.push_back(v);
+	bh.droppedFrames = static_cast< ::Ice::Long>(user->bwr.uiDroppedFrames);
+
+	cb->ice_response(bh);
+}
+
 static void impl_Server_addUserToGroup(const ::Murmur::AMD_Server_addUserToGroupPtr cb, int server_id, ::Ice::Int channelid,  ::Ice::Int session,  const ::std::string& group) {
 	NEED_SERVER;
 	NEED_PLAYER;
@@ -46,6 +46,8 @@ class Server;
 class User;
 struct TextMessage;
 
+class MurmurIceRelay;
+
 class MurmurIce : public QObject {
 		friend class MurmurLocker;
 		Q_OBJECT;
@@ -58,10 +60,14 @@ class MurmurIce : public QObject {
 		void badServerProxy(const ::Murmur::ServerCallbackPrx &prx, const ::Server* server);
 		void badAuthenticator(::Server *);
 		QList< ::Murmur::MetaCallbackPrx> qlMetaCallbacks;
+		// Servers may run on control threads of their own, so everything
+		// below is shared between threads and guarded by qmCallbacks.
+		mutable QMutex qmCallbacks;
 		QMap<int, QList< ::Murmur::ServerCallbackPrx> > qmServerCallbacks;
 		QMap<int, QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > > qmServerContextCallbacks;
 		QMap<int, ::Murmur::ServerAuthenticatorPrx> qmServerAuthenticator;
 		QMap<int, ::Murmur::ServerUpdatingAuthenticatorPrx> qmServerUpdatingAuthenticator;
+		QMap<int, MurmurIceRelay *> qmRelays;
 	public:
 		Ice::CommunicatorPtr communicator;
 		Ice::ObjectAdapterPtr adapter;
@@ -73,6 +79,7 @@ class MurmurIce : public QObject {
 		void addServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx);
 		void removeServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx);
 		void removeServerCallbacks(const ::Server* server);
+		const QList< ::Murmur::ServerCallbackPrx> getServerCallbacks(const ::Server* server) const;
 		void addServerContextCallback(const ::Server* server, int session_id, const QString& action, const ::Murmur::ServerContextCallbackPrx& prx);
 		const QMap< int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > getServerContextCallbacks(const ::Server* server) const;
 		void removeServerContextCallback(const ::Server* server, int session_id, const QString& action);
@@ -82,11 +89,48 @@ class MurmurIce : public QObject {
 		void setServerUpdatingAuthenticator(const ::Server* server, const ::Murmur::ServerUpdatingAuthenticatorPrx& prx);
 		const ::Murmur::ServerUpdatingAuthenticatorPrx getServerUpdatingAuthenticator(const ::Server* server) const;
 		void removeServerUpdatingAuthenticator(const ::Server* server);
+		MurmurIceRelay *getRelay(int server_id) const;
+
+		void authenticate(::Server *, int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
+		void registerUser(::Server *, int &res, const QMap<int, QString> &);
+		void unregisterUser(::Server *, int &res, int id);
+		void getRegisteredUsers(::Server *, const QString &filter, QMap<int, QString> &res);
+		void getRegistration(::Server *, int &, int, QMap<int, QString> &);
+		void setInfo(::Server *, int &, int, const QMap<int, QString> &);
+		void setTexture(::Server *, int &res, int id, const QByteArray &texture);
+		void nameToId(::Server *, int &res, const QString &name);
+		void idToName(::Server *, QString &res, int id);
+		void idToTexture(::Server *, QByteArray &res, int id);
+
+		void userStateChanged(::Server *, const User *p);
+		void userTextMessage(::Server *, const User *p, const TextMessage &);
+		void userConnected(::Server *, const User *p);
+		void userDisconnected(::Server *, const User *p);
+
+		void channelStateChanged(::Server *, const Channel *c);
+		void channelCreated(::Server *, const Channel *c);
+		void channelRemoved(::Server *, const Channel *c);
+
+		void contextAction(::Server *, const User *, const QString &, unsigned int, int);
 
 	public slots:
 		void started(Server *);
 		void stopped(Server *);
+};
 
+// One per booted server, living on the same thread as the server. Receives
+// the server's signals and the Ice calls routed to it, and runs them there
+// on behalf of MurmurIce.
+class MurmurIceRelay : public QObject {
+		Q_OBJECT;
+		Q_DISABLE_COPY(MurmurIceRelay);
+	protected:
+		::Server *server;
+		void customEvent(QEvent *evt);
+	public:
+		MurmurIceRelay(::Server *);
+
+	public slots:
 		void authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
 		void registerUserSlot(int &res, const QMap<int, QString> &);
 		void unregisterUserSlot(int &res, int id);
@@ -118,12 +118,8 @@ bool Server::setChannelState(Channel *cChannel, Channel *cParent, const QString
 	}
 
 	if ((cParent != cChannel) && (cParent != cChannel->cParent)) {
-		Channel *p = cParent;
-		while (p) {
-			if (p == cChannel)
-				return false;
-			p = p->cParent;
-		}
+		if (currentSnapshot()->qspChannels->isInSubtree(cChannel, cParent))
+			return false;
 
 		if (!canNest(cParent, cChannel)) {
 			return false;
@@ -132,6 +128,10 @@ bool Server::setChannelState(Channel *cChannel, Channel *cParent, const QString
 		cChannel->cParent->removeChannel(cChannel);
 		cParent->addChannel(cChannel);
 
+		invalidateChannelIndex();
+		clearMovedACLCache(cChannel);
+		refreshTargetCache(NULL, QSet<const Channel *>() << cParent);
+
 		mpcs.set_parent(cParent->iId);
 
 		updated = true;
@@ -34,8 +34,10 @@
 #include "Server.h"
 
 #include "ACL.h"
+#include "BlobStore.h"
 #include "Connection.h"
 #include "Group.h"
+#include "LegacyTexture.h"
 #include "User.h"
 #include "Channel.h"
 #include "Message.h"
@@ -43,6 +45,7 @@
 #include "PacketDataStream.h"
 #include "ServerDB.h"
 #include "ServerUser.h"
+#include "TextValidator.h"
 
 #ifdef USE_BONJOUR
 #include "BonjourServer.h"
@@ -55,6 +58,386 @@
 
 #define UDP_PACKET_SIZE 1024
 
+// Length of one turn of the voice latency window, see Server::getStatistics.
+static const int LATENCY_WINDOW_MSEC = 60000;
+
+// How often retired snapshots are checked again while a voice thread still
+// holds an older epoch.
+static const int SNAPSHOT_RECLAIM_MSEC = 100;
+// How long a voice thread waits for a peer registration it asked for before
+// asking again.
+static const quint64 PEER_RETRY_USEC = 1000000ULL;
+
+#if defined(Q_OS_LINUX) && defined(MSG_WAITFORONE)
+#define USE_MMSG
+#endif
+
+#if defined(Q_OS_LINUX) && defined(SO_REUSEPORT)
+#define USE_VOICE_THREADS
+#endif
+
+#if defined(Q_OS_LINUX) && defined(SO_TIMESTAMPNS)
+#define USE_VOICE_TRACE
+#endif
+
+#ifdef Q_OS_LINUX
+#ifdef USE_VOICE_TRACE
+#define UDP_CONTROL_SIZE (CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo))) + CMSG_SPACE(sizeof(struct timespec)))
+#else
+#define UDP_CONTROL_SIZE CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))
+#endif
+#endif
+
+#ifdef USE_VOICE_TRACE
+// Wall clock in microseconds; SO_TIMESTAMPNS stamps datagrams with the same clock.
+static inline quint64 traceClock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return static_cast<quint64>(ts.tv_sec) * 1000000ULL + static_cast<quint64>(ts.tv_nsec) / 1000ULL;
+}
+
+// Returns the kernel receive time of msg, or 0 if there is none, and strips
+// it from the control data: ping replies send the received msg back out, and
+// sendmsg() refuses SCM_TIMESTAMPNS. Only the packet info is kept.
+static quint64 takeTimestamp(struct msghdr *msg) {
+	quint64 stamp = 0;
+	struct cmsghdr *keep = NULL;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			stamp = static_cast<quint64>(ts.tv_sec) * 1000000ULL + static_cast<quint64>(ts.tv_nsec) / 1000ULL;
+		} else if (! keep) {
+			keep = cmsg;
+		}
+	}
+
+	if (keep) {
+		const size_t len = keep->cmsg_len;
+		if (reinterpret_cast<u_char *>(keep) != msg->msg_control)
+			memmove(msg->msg_control, keep, len);
+		msg->msg_controllen = CMSG_SPACE(len - CMSG_LEN(0));
+	} else {
+		msg->msg_controllen = 0;
+	}
+	return stamp;
+}
+
+// Called for each datagram before it is processed; received is when the
+// receive call returned.
+static inline void traceReceived(VoiceCounters &vc, struct msghdr *msg, quint64 received) {
+	const quint64 stamp = takeTimestamp(msg);
+	if (stamp && (stamp <= received)) {
+		vc.lhQueue.add(received - stamp);
+		vc.uiStamp = stamp;
+	} else {
+		vc.uiStamp = received;
+	}
+}
+
+static inline void traceSent(VoiceCounters &vc, quint64 stamp, quint64 now) {
+	if (now >= stamp)
+		vc.lhRelay.add(now - stamp);
+}
+#endif
+
+UDPBatchStats::UDPBatchStats() {
+	uiRecvCalls = uiRecvPackets = uiRecvMax = 0;
+	uiSendCalls = uiSendPackets = uiSendMax = 0;
+}
+
+VoiceStats::VoiceStats() {
+	uiTunnelPackets = uiTunnelDropped = 0;
+}
+
+VoiceThreadState::VoiceThreadState() {
+	uiTunnelPackets = uiTunnelDropped = 0;
+	bUnpublished = false;
+}
+
+void VoiceThreadState::publish(bool force) {
+	if (! force && (tPublished.elapsed() < PublishMsec * 1000ULL)) {
+		bUnpublished = true;
+		return;
+	}
+
+	// A reader holds the lock only to copy the counters out; rather than
+	// wait for it, try again after the next batch.
+	if (force) {
+		qmPublished.lock();
+	} else if (! qmPublished.tryLock()) {
+		bUnpublished = true;
+		return;
+	}
+	vsPublished.ubsStats = ubsStats;
+	vsPublished.uiTunnelPackets = uiTunnelPackets;
+	vsPublished.uiTunnelDropped = uiTunnelDropped;
+	vsPublished.vcCounters = vcCounters;
+	qmPublished.unlock();
+
+	tPublished.restart();
+	bUnpublished = false;
+}
+
+int VoiceThreadState::publishTimeout() const {
+	if (! bUnpublished)
+		return -1;
+	quint64 elapsed = tPublished.elapsed() / 1000ULL;
+	return (elapsed >= PublishMsec) ? 0 : static_cast<int>(PublishMsec - elapsed);
+}
+
+VoiceStats VoiceThreadState::published() const {
+	QMutexLocker lock(&qmPublished);
+	return vsPublished;
+}
+
+#ifdef USE_MMSG
+// Receive buffers for recvmmsg(). Each datagram buffer is offset by 4 bytes from
+// an 8-byte boundary, so the payload following the crypt header is aligned.
+struct UDPRecvBatch {
+	unsigned int uiSize;
+	struct mmsghdr *mmsg;
+	struct iovec *iov;
+	struct sockaddr_storage *addr;
+	char *data;
+	u_char *control;
+
+	UDPRecvBatch(unsigned int size);
+	~UDPRecvBatch();
+	char *buffer(unsigned int i) const;
+	void reset(unsigned int i);
+};
+
+UDPRecvBatch::UDPRecvBatch(unsigned int size) : uiSize(size) {
+	mmsg = new struct mmsghdr[uiSize];
+	iov = new struct iovec[uiSize];
+	addr = new struct sockaddr_storage[uiSize];
+	data = new char[uiSize * (UDP_PACKET_SIZE + 8)];
+	control = new u_char[uiSize * UDP_CONTROL_SIZE];
+
+	for (unsigned int i=0;i<uiSize;++i)
+		reset(i);
+}
+
+UDPRecvBatch::~UDPRecvBatch() {
+	delete [] mmsg;
+	delete [] iov;
+	delete [] addr;
+	delete [] data;
+	delete [] control;
+}
+
+char *UDPRecvBatch::buffer(unsigned int i) const {
+	return data + i * (UDP_PACKET_SIZE + 8) + 4;
+}
+
+void UDPRecvBatch::reset(unsigned int i) {
+	struct msghdr &msg = mmsg[i].msg_hdr;
+
+	iov[i].iov_base = buffer(i);
+	iov[i].iov_len = UDP_PACKET_SIZE;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = reinterpret_cast<struct sockaddr *>(&addr[i]);
+	msg.msg_namelen = sizeof(struct sockaddr_storage);
+	msg.msg_iov = &iov[i];
+	msg.msg_iovlen = 1;
+	msg.msg_control = control + i * UDP_CONTROL_SIZE;
+	msg.msg_controllen = UDP_CONTROL_SIZE;
+	mmsg[i].msg_len = 0;
+}
+
+// Outgoing datagrams for one UDP socket, collected while the voice thread
+// processes a receive batch and written with a single sendmmsg().
+struct UDPSendBatch {
+	int iSocket;
+	unsigned int uiCount;
+	unsigned int uiSize;
+	struct mmsghdr *mmsg;
+	struct iovec *iov;
+	struct sockaddr_storage *addr;
+	char *data;
+	u_char *control;
+	// Receive time of the datagram each one relays, for voice tracing.
+	quint64 *stamp;
+
+	UDPSendBatch(int sock, unsigned int size);
+	~UDPSendBatch();
+	bool queue(const struct msghdr *msg, quint64 recvstamp);
+	void flush(UDPBatchStats &stats, VoiceCounters &vc);
+};
+
+UDPSendBatch::UDPSendBatch(int sock, unsigned int size) : iSocket(sock), uiCount(0), uiSize(size) {
+	mmsg = new struct mmsghdr[uiSize];
+	iov = new struct iovec[uiSize];
+	addr = new struct sockaddr_storage[uiSize];
+	data = new char[uiSize * (UDP_PACKET_SIZE + 8)];
+	control = new u_char[uiSize * UDP_CONTROL_SIZE];
+	stamp = new quint64[uiSize];
+}
+
+UDPSendBatch::~UDPSendBatch() {
+	delete [] mmsg;
+	delete [] iov;
+	delete [] addr;
+	delete [] data;
+	delete [] control;
+	delete [] stamp;
+}
+
+// Copies msg into the next free slot. Returns true once the batch is full
+// and has to be flushed before anything else can be queued.
+bool UDPSendBatch::queue(const struct msghdr *msg, quint64 recvstamp) {
+	size_t len = msg->msg_iov[0].iov_len;
+	if ((len > UDP_PACKET_SIZE + 8) || (msg->msg_controllen > UDP_CONTROL_SIZE)) {
+		::sendmsg(iSocket, msg, 0);
+		return false;
+	}
+
+	unsigned int i = uiCount++;
+	stamp[i] = recvstamp;
+	struct msghdr &hdr = mmsg[i].msg_hdr;
+	char *buffer = data + i * (UDP_PACKET_SIZE + 8);
+	u_char *cdata = control + i * UDP_CONTROL_SIZE;
+
+	memcpy(buffer, msg->msg_iov[0].iov_base, len);
+	memcpy(&addr[i], msg->msg_name, msg->msg_namelen);
+	memcpy(cdata, msg->msg_control, msg->msg_controllen);
+
+	iov[i].iov_base = buffer;
+	iov[i].iov_len = len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_name = reinterpret_cast<struct sockaddr *>(&addr[i]);
+	hdr.msg_namelen = msg->msg_namelen;
+	hdr.msg_iov = &iov[i];
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = cdata;
+	hdr.msg_controllen = msg->msg_controllen;
+
+	return (uiCount == uiSize);
+}
+
+void UDPSendBatch::flush(UDPBatchStats &stats, VoiceCounters &vc) {
+	unsigned int sent = 0;
+
+	while (sent < uiCount) {
+		int ret = ::sendmmsg(iSocket, mmsg + sent, uiCount - sent, 0);
+		if (ret <= 0) {
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			// The first remaining datagram was refused; drop it and carry on with the rest.
+			++sent;
+			continue;
+		}
+		++stats.uiSendCalls;
+		stats.uiSendPackets += ret;
+		if (static_cast<quint64>(ret) > stats.uiSendMax)
+			stats.uiSendMax = ret;
+		sent += ret;
+	}
+
+#ifdef USE_VOICE_TRACE
+	quint64 now = 0;
+	for (unsigned int i = 0; i < uiCount; ++i) {
+		if (! stamp[i])
+			continue;
+		if (! now)
+			now = traceClock();
+		traceSent(vc, stamp[i], now);
+	}
+#else
+	Q_UNUSED(vc);
+#endif
+	uiCount = 0;
+}
+#endif
+
+VoiceThread::VoiceThread(Server *srv) : QThread(srv), s(srv), bValid(false) {
+	aiNotify[0] = aiNotify[1] = -1;
+
+#ifdef USE_VOICE_THREADS
+	foreach(int primary, s->qlUdpSocket) {
+		sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		if (getsockname(primary, reinterpret_cast<struct sockaddr *>(&addr), &len) != 0)
+			return;
+
+		int sock = ::socket(addr.ss_family, SOCK_DGRAM, 0);
+		if (sock == INVALID_SOCKET)
+			return;
+		qlUdpSocket << sock;
+
+		int sockopt = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)))
+			return;
+		sockopt = 1;
+		setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &sockopt, sizeof(sockopt));
+		sockopt = 1;
+		setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt));
+#ifdef USE_VOICE_TRACE
+		if (Meta::mp.bVoiceTrace) {
+			sockopt = 1;
+			setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &sockopt, sizeof(sockopt));
+		}
+#endif
+
+		if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR)
+			return;
+
+		// Use the same traffic class as the server's primary socket.
+		int val;
+		socklen_t optlen = sizeof(val);
+		if (getsockopt(primary, IPPROTO_IP, IP_TOS, &val, &optlen) == 0)
+			setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val));
+		optlen = sizeof(val);
+		if (getsockopt(primary, SOL_SOCKET, SO_PRIORITY, &val, &optlen) == 0)
+			setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, aiNotify) != 0)
+		return;
+
+	bValid = true;
+#endif
+}
+
+VoiceThread::~VoiceThread() {
+	stopThread();
+
+#ifdef Q_OS_UNIX
+	foreach(int sock, qlUdpSocket)
+		close(sock);
+
+	if (aiNotify[0] >= 0)
+		close(aiNotify[0]);
+	if (aiNotify[1] >= 0)
+		close(aiNotify[1]);
+#endif
+}
+
+void VoiceThread::run() {
+	s->run();
+}
+
+void VoiceThread::startThread() {
+	if (! isRunning())
+		start(QThread::HighestPriority);
+}
+
+void VoiceThread::stopThread() {
+	if (isRunning()) {
+#ifdef Q_OS_UNIX
+		unsigned char val = 0;
+		if (::write(aiNotify[1], &val, 1) != 1)
+			qWarning("VoiceThread: Failed to signal voice thread");
+#endif
+		wait();
+	}
+}
+
 LogEmitter::LogEmitter(QObject *p) : QObject(p) {
 };
 
@@ -62,14 +445,19 @@ void LogEmitter::addLogEntry(const QString &msg) {
 	emit newLogEntry(msg);
 };
 
-ExecEvent::ExecEvent(boost::function<void ()> f) : QEvent(static_cast<QEvent::Type>(EXEC_QEVENT)) {
+ExecEvent::ExecEvent(boost::function<void ()> f, int server) : QEvent(static_cast<QEvent::Type>(EXEC_QEVENT)) {
 	func = f;
+	iServer = server;
 }
 
 void ExecEvent::execute() {
 	func();
 }
 
+const boost::function<void ()> &ExecEvent::function() const {
+	return func;
+}
+
 SslServer::SslServer(QObject *p) : QTcpServer(p) {
 }
 
@@ -85,6 +473,210 @@ QSslSocket *SslServer::nextPendingSSLConnection() {
 	return qlSockets.takeFirst();
 }
 
+HandshakeWorker::HandshakeWorker() : QObject() {
+	qtTimeout = new QTimer(this);
+	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(checkTimeout()));
+}
+
+void HandshakeWorker::start(QSslSocket *sock) {
+	if (! qtTimeout->isActive())
+		qtTimeout->start(1000);
+
+	qhStarted.insert(sock, Timer());
+	qhVerified.insert(sock, true);
+
+	connect(sock, SIGNAL(encrypted()), this, SLOT(encrypted()));
+	connect(sock, SIGNAL(sslErrors(const QList<QSslError> &)), this, SLOT(sslErrors(const QList<QSslError> &)));
+	connect(sock, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+
+	sock->startServerEncryption();
+}
+
+void HandshakeWorker::encrypted() {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	if (! sock || ! qhStarted.contains(sock))
+		return;
+
+	disconnect(sock, NULL, this, NULL);
+	qhStarted.remove(sock);
+
+	// Not from within the socket's own signal; finish on the next pass.
+	QMetaObject::invokeMethod(this, "release", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock), Q_ARG(bool, true), Q_ARG(QString, QString()));
+}
+
+// Hands the socket back to the main thread. Failed sockets are closed here
+// and deleted by the pool, which keeps the pointer unique until then.
+void HandshakeWorker::release(QSslSocket *sock, bool ok, const QString &reason) {
+	bool verified = qhVerified.take(sock);
+	if (! ok)
+		sock->abort();
+	sock->moveToThread(QCoreApplication::instance()->thread());
+	emit finished(sock, ok, verified, reason);
+}
+
+void HandshakeWorker::sslErrors(const QList<QSslError> &errors) {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	if (! sock || ! qhStarted.contains(sock))
+		return;
+
+	bool verified = true;
+	QString reason;
+	if (Server::checkSslErrors(errors, verified, reason)) {
+		qhVerified.insert(sock, verified);
+		sock->ignoreSslErrors();
+	} else {
+		fail(sock, reason);
+	}
+}
+
+void HandshakeWorker::socketError(QAbstractSocket::SocketError) {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	if (! sock || ! qhStarted.contains(sock))
+		return;
+	fail(sock, sock->errorString());
+}
+
+void HandshakeWorker::checkTimeout() {
+	const quint64 limit = Meta::mp.iTLSTimeout * 1000000ULL;
+	foreach(QSslSocket *sock, qhStarted.keys()) {
+		if (qhStarted.value(sock).elapsed() > limit)
+			fail(sock, QLatin1String("Handshake timed out"));
+	}
+	if (qhStarted.isEmpty())
+		qtTimeout->stop();
+}
+
+void HandshakeWorker::fail(QSslSocket *sock, const QString &reason) {
+	disconnect(sock, NULL, this, NULL);
+	qhStarted.remove(sock);
+	QMetaObject::invokeMethod(this, "release", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock), Q_ARG(bool, false), Q_ARG(QString, reason));
+}
+
+HandshakePool::HandshakePool(QObject *p) : QObject(p) {
+	qRegisterMetaType<QSslSocket *>("QSslSocket *");
+
+	for (int i = 0; i < Meta::mp.iTLSThreads; ++i) {
+		QThread *thread = new QThread(this);
+		HandshakeWorker *worker = new HandshakeWorker();
+		worker->moveToThread(thread);
+		connect(worker, SIGNAL(finished(QSslSocket *, bool, bool, const QString &)), this, SLOT(finished(QSslSocket *, bool, bool, const QString &)), Qt::QueuedConnection);
+		connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+		thread->start();
+
+		qlThreads << thread;
+		qlWorkers << worker;
+		qlLoad << 0;
+	}
+}
+
+HandshakePool::~HandshakePool() {
+	foreach(QThread *thread, qlThreads) {
+		thread->quit();
+		thread->wait();
+	}
+}
+
+int HandshakePool::pending() const {
+	QMutexLocker lock(&qmPending);
+	return qhPending.count();
+}
+
+// Takes ownership of sock. Returns false, leaving sock with the caller, if
+// the address or the pool as a whole already has too many handshakes in
+// flight. Called on the thread of the accepting server.
+bool HandshakePool::start(Server *s, QSslSocket *sock, const HostAddress &ha, const QString &peer) {
+	QMutexLocker lock(&qmPending);
+
+	if (qhPending.count() >= Meta::mp.iTLSPending)
+		return false;
+	if (qhPerAddress.value(ha) >= Meta::mp.iTLSPerAddress)
+		return false;
+
+	int best = 0;
+	for (int i = 1; i < qlLoad.count(); ++i)
+		if (qlLoad.at(i) < qlLoad.at(best))
+			best = i;
+
+	Pending p;
+	p.s = s;
+	p.ha = ha;
+	p.qsPeer = peer;
+	p.iThread = best;
+	qhPending.insert(sock, p);
+	++qhPerAddress[ha];
+	++qlLoad[best];
+
+	sock->setParent(NULL);
+	sock->moveToThread(qlThreads.at(best));
+	QMetaObject::invokeMethod(qlWorkers.at(best), "start", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock));
+	return true;
+}
+
+// Called when a server stops; its handshakes still in flight are dropped on
+// completion, and those already handed to it are closed here.
+void HandshakePool::forget(Server *s) {
+	QMutexLocker lock(&qmPending);
+
+	QHash<QSslSocket *, Pending>::iterator i;
+	for (i = qhPending.begin(); i != qhPending.end(); ++i)
+		if (i.value().s == s)
+			i.value().s = NULL;
+
+	QHash<QSslSocket *, Server *>::iterator j = qhDelivering.begin();
+	while (j != qhDelivering.end()) {
+		if (j.value() == s) {
+			j.key()->deleteLater();
+			j = qhDelivering.erase(j);
+		} else {
+			++j;
+		}
+	}
+}
+
+void HandshakePool::finished(QSslSocket *sock, bool ok, bool verified, const QString &reason) {
+	Pending p;
+	{
+		QMutexLocker lock(&qmPending);
+
+		QHash<QSslSocket *, Pending>::iterator i = qhPending.find(sock);
+		if (i == qhPending.end())
+			return;
+
+		p = i.value();
+		qhPending.erase(i);
+		--qlLoad[p.iThread];
+		if (--qhPerAddress[p.ha] <= 0)
+			qhPerAddress.remove(p.ha);
+
+		if (p.s)
+			qhDelivering.insert(sock, p.s);
+	}
+
+	if (p.s && (p.s->thread() != thread())) {
+		sock->moveToThread(p.s->thread());
+		QCoreApplication::instance()->postEvent(p.s, new ExecEvent(boost::bind(&HandshakePool::deliver, this, sock, p.ha, p.qsPeer, ok, verified, reason)));
+	} else {
+		deliver(sock, p.ha, p.qsPeer, ok, verified, reason);
+	}
+}
+
+// Runs on the thread of the server the socket belongs to.
+void HandshakePool::deliver(QSslSocket *sock, const HostAddress &ha, const QString &peer, bool ok, bool verified, const QString &reason) {
+	Server *s;
+	{
+		QMutexLocker lock(&qmPending);
+		s = qhDelivering.take(sock);
+	}
+
+	if (s)
+		s->handshakeFinished(sock, ha, peer, ok, verified, reason);
+
+	if (! ok || ! s) {
+		sock->abort();
+		sock->deleteLater();
+	}
+}
+
 Server::Server(int snum, QObject *p) : QThread(p) {
 	bValid = true;
 	iServerNum = snum;
@@ -105,6 +697,40 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 
 	qnamNetwork = NULL;
 
+	bBroadcastFlush = false;
+	uiBroadcastMessages = uiBroadcastWrites = 0;
+
+	bTextFanout = false;
+	uiTextDropped = 0;
+	qtTextRetry = new QTimer(this);
+	qtTextRetry->setSingleShot(true);
+	connect(qtTextRetry, SIGNAL(timeout()), this, SLOT(processTextFanout()));
+
+	qtLatencyWindow = NULL;
+	if (Meta::mp.bVoiceTrace) {
+		qtLatencyWindow = new QTimer(this);
+		connect(qtLatencyWindow, SIGNAL(timeout()), this, SLOT(rotateLatencyWindow()));
+		qtLatencyWindow->start(LATENCY_WINDOW_MSEC);
+	}
+
+	// Registered user lookups (name, id, certificate hash) are cached LRU
+	// with a fixed bound, so servers with large user tables don't grow
+	// these without limit.
+	qhUserNameCache.setMaxCost(10000);
+	qhUserIDCache.setMaxCost(10000);
+	qhUserHashCache.setMaxCost(10000);
+	qhUserTextureCache.setMaxCost(10000);
+
+	// Epoch 0 marks a voice thread as idle, so start counting at 1.
+	qaiSnapshotEpoch.fetchAndStoreOrdered(1);
+	qaiFanoutGeneration.fetchAndStoreOrdered(1);
+	qtReclaim = new QTimer(this);
+	qtReclaim->setSingleShot(true);
+	connect(qtReclaim, SIGNAL(timeout()), this, SLOT(reclaimSnapshots()));
+	bSnapshotPending = false;
+	bChannelIndexDirty = true;
+	rebuildSnapshot();
+
 	readParams();
 	initialize();
 
@@ -146,6 +772,20 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 		if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt)))
 			log(QString("Failed to set IPV6_RECVPKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
 #endif
+#ifdef USE_VOICE_TRACE
+		if (Meta::mp.bVoiceTrace) {
+			sockopt = 1;
+			if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set SO_TIMESTAMPNS for %1").arg(addressToString(ss->serverAddress(), usPort)));
+		}
+#endif
+#ifdef USE_VOICE_THREADS
+		if (iVoiceThreads > 1) {
+			sockopt = 1;
+			if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set SO_REUSEPORT for %1").arg(addressToString(ss->serverAddress(), usPort)));
+		}
+#endif
 #else
 #ifndef SIO_UDP_CONNRESET
 #define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
@@ -194,6 +834,26 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	if (! bValid)
 		return;
 
+#ifdef USE_VOICE_THREADS
+	for (int i=1;i<iVoiceThreads;++i) {
+		VoiceThread *vt = new VoiceThread(this);
+		if (! vt->bValid) {
+			log("Failed to create UDP sockets for additional voice thread");
+			delete vt;
+			break;
+		}
+		// Pings may be sharded to these sockets while the voice threads are stopped.
+		foreach(int sock, vt->qlUdpSocket) {
+			QSocketNotifier *qsn = new QSocketNotifier(sock, QSocketNotifier::Read, this);
+			connect(qsn, SIGNAL(activated(int)), this, SLOT(udpActivated(int)));
+			qlUdpNotifier << qsn;
+		}
+		qlVoiceThreads << vt;
+	}
+	if (! qlVoiceThreads.isEmpty())
+		log(QString("Routing voice with %1 threads").arg(qlVoiceThreads.count() + 1));
+#endif
+
 #ifdef Q_OS_UNIX
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, aiNotify) != 0) {
 		log("Failed to create notify socket");
@@ -204,7 +864,6 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
 
-	connect(this, SIGNAL(tcpTransmit(QByteArray, unsigned int)), this, SLOT(tcpTransmitData(QByteArray, unsigned int)), Qt::QueuedConnection);
 	connect(this, SIGNAL(reqSync(unsigned int)), this, SLOT(doSync(unsigned int)));
 
 	for (int i=1;i<iMaxUsers*2;++i)
@@ -215,6 +874,7 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	getBans();
 	readChannels();
 	readLinks();
+	invalidateChannelIndex();
 	initializeCert();
 
 	int major, minor, patch;
@@ -241,6 +901,8 @@ void Server::startThread() {
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(false);
 		start(QThread::HighestPriority);
+		foreach(VoiceThread *vt, qlVoiceThreads)
+			vt->startThread();
 #ifdef Q_OS_LINUX
 		// QThread::HighestPriority == Same as everything else...
 		int policy;
@@ -272,12 +934,38 @@ void Server::stopThread() {
 #endif
 		wait();
 
+		foreach(VoiceThread *vt, qlVoiceThreads)
+			vt->stopThread();
+
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(true);
 	}
 	qtTimeout->stop();
 }
 
+// Must be called from the thread the server currently lives on. Children
+// (listen sockets, users, timers, RPC adaptors) follow along; the few
+// QObjects held by value or without a parent are moved explicitly.
+void Server::moveControlThread(QThread *t) {
+	moveToThread(t);
+	qtTick.moveToThread(t);
+#ifdef USE_BONJOUR
+	if (bsRegistration)
+		bsRegistration->moveToThread(t);
+#endif
+}
+
+// Brings a server back from its control thread so it can be torn down on the
+// main thread. Blocks until the control thread has let go of it.
+void Server::returnToMainThread() {
+	if (thread() != QCoreApplication::instance()->thread())
+		QMetaObject::invokeMethod(this, "moveToMainThread", Qt::BlockingQueuedConnection);
+}
+
+void Server::moveToMainThread() {
+	moveControlThread(QCoreApplication::instance()->thread());
+}
+
 Server::~Server() {
 #ifdef USE_BONJOUR
 	removeBonjour();
@@ -285,9 +973,25 @@ Server::~Server() {
 
 	stopThread();
 
+	meta->hpHandshakes->forget(this);
+
 	foreach(QSocketNotifier *qsn, qlUdpNotifier)
 		delete qsn;
 
+	qDeleteAll(qlVoiceThreads);
+	qlVoiceThreads.clear();
+
+	// The voice threads are gone. Retired users are still our children and
+	// go with us, but removed channels have been unparented.
+	delete qapSnapshot.fetchAndStoreOrdered(NULL);
+	foreach(const RetiredSnapshot &rs, qlRetiredSnapshots) {
+		delete rs.usSnapshot;
+		qDeleteAll(rs.qlChannels);
+	}
+	qlRetiredSnapshots.clear();
+	qDeleteAll(qlRetiringChannels);
+	qlRetiringChannels.clear();
+
 #ifdef Q_OS_UNIX
 	foreach(int s, qlUdpSocket)
 		close(s);
@@ -312,6 +1016,7 @@ void Server::readParams() {
 	usPort = static_cast<unsigned short>(Meta::mp.usPort + iServerNum - 1);
 	iTimeout = Meta::mp.iTimeout;
 	iMaxBandwidth = Meta::mp.iMaxBandwidth;
+	iMaxBandwidthBurst = Meta::mp.iMaxBandwidthBurst;
 	iMaxUsers = Meta::mp.iMaxUsers;
 	iMaxUsersPerChannel = Meta::mp.iMaxUsersPerChannel;
 	iMaxTextMessageLength = Meta::mp.iMaxTextMessageLength;
@@ -336,6 +1041,7 @@ void Server::readParams() {
 	qvSuggestPushToTalk = Meta::mp.qvSuggestPushToTalk;
 	iOpusThreshold = Meta::mp.iOpusThreshold;
 	iChannelNestingLimit = Meta::mp.iChannelNestingLimit;
+	iVoiceThreads = Meta::mp.iVoiceThreads;
 
 	QString qsHost = getConf("host", QString()).toString();
 	if (! qsHost.isEmpty()) {
@@ -368,6 +1074,7 @@ void Server::readParams() {
 	usPort = static_cast<unsigned short>(getConf("port", usPort).toUInt());
 	iTimeout = getConf("timeout", iTimeout).toInt();
 	iMaxBandwidth = getConf("bandwidth", iMaxBandwidth).toInt();
+	iMaxBandwidthBurst = qBound(20, getConf("bandwidthburst", iMaxBandwidthBurst).toInt(), 60000);
 	iMaxUsers = getConf("users", iMaxUsers).toInt();
 	iMaxUsersPerChannel = getConf("usersperchannel", iMaxUsersPerChannel).toInt();
 	iMaxTextMessageLength = getConf("textmessagelength", iMaxTextMessageLength).toInt();
@@ -402,6 +1109,8 @@ void Server::readParams() {
 
 	iChannelNestingLimit = getConf("channelnestinglimit", iChannelNestingLimit).toInt();
 
+	iVoiceThreads = qBound(1, getConf("voicethreads", iVoiceThreads).toInt(), 64);
+
 	qrUserName=QRegExp(getConf("username", qrUserName.pattern()).toString());
 	qrChannelName=QRegExp(getConf("channelname", qrChannelName.pattern()).toString());
 }
@@ -421,6 +1130,8 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 			mpsc.set_max_bandwidth(length);
 			sendAll(mpsc);
 		}
+	} else if (key == "bandwidthburst") {
+		iMaxBandwidthBurst = i ? qBound(20, i, 60000) : Meta::mp.iMaxBandwidthBurst;
 	} else if (key == "users") {
 		int newmax = i ? i : Meta::mp.iMaxUsers;
 		if (iMaxUsers == newmax)
@@ -475,6 +1186,7 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		QString text = !v.isNull() ? v : Meta::mp.qsRegName;
 		if (text != qsRegName) {
 			qsRegName = text;
+			invalidateJoinChannel(0);
 			if (! qsRegName.isEmpty()) {
 				MumbleProto::ChannelState mpcs;
 				mpcs.set_channel_id(0);
@@ -554,7 +1266,7 @@ void Server::udpActivated(int socket) {
 	iov[0].iov_base = encrypt;
 	iov[0].iov_len = UDP_PACKET_SIZE;
 
-	u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
+	u_char controldata[UDP_CONTROL_SIZE];
 
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name = reinterpret_cast<struct sockaddr *>(&from);
@@ -588,6 +1300,9 @@ void Server::udpActivated(int socket) {
 #ifdef Q_OS_LINUX
 		// There will be space for only one header, and the only data we have asked for is the incoming
 		// address. So we can reuse most of the same msg and control data.
+#ifdef USE_VOICE_TRACE
+		takeTimestamp(&msg);
+#endif
 		iov[0].iov_len = 6 * sizeof(quint32);
 		::sendmsg(sock, &msg, 0);
 #else
@@ -596,30 +1311,188 @@ void Server::udpActivated(int socket) {
 	}
 }
 
-void Server::run() {
-	qint32 len;
-#if defined(__LP64__)
-	char encbuff[UDP_PACKET_SIZE+8];
-	char *encrypt = encbuff + 4;
-#else
-	char encrypt[UDP_PACKET_SIZE];
-#endif
-	char buffer[UDP_PACKET_SIZE];
+bool Server::preparePingReply(char *data, int len) {
+	quint32 *ping = reinterpret_cast<quint32 *>(data);
+
+	if ((len != 12) || (*ping != 0) || ! bAllowPing)
+		return false;
+
+	ping[0] = uiVersionBlob;
+	// 1 and 2 will be the timestamp, which we return unmodified.
+	ping[3] = qToBigEndian(static_cast<quint32>(currentSnapshot()->iUsers));
+	ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
+	ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+
+	return true;
+}
+
+#ifdef Q_OS_UNIX
+void Server::processDatagram(int sock, const char *encrypt, int len, const struct sockaddr_storage &from, VoiceThreadState *vts) {
+#else
+void Server::processDatagram(SOCKET sock, const char *encrypt, int len, const struct sockaddr_storage &from, VoiceThreadState *vts) {
+#endif
+	char buffer[UDP_PACKET_SIZE];
+
+	++vts->vcCounters.uiPacketsIn;
+	vts->vcCounters.uiBytesIn += len;
+
+	const UserSnapshot *snap = currentSnapshot();
+
+	quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<const sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<const sockaddr_in *>(&from)->sin_port);
+	const HostAddress &ha = HostAddress(from);
+
+	const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
+
+	ServerUser *u = snap->qhPeerUsers.value(key);
+	if (u) {
+		if (! vts->qhPendingPeers.isEmpty())
+			vts->qhPendingPeers.remove(key);
+		if (! checkDecrypt(u, encrypt, buffer, len)) {
+			++vts->vcCounters.uiDecryptFailed;
+			return;
+		}
+	} else {
+		// Unknown peer. The user stays valid until this batch is done, but
+		// the tables may only be changed by the main thread. It is asked to
+		// register the peer once; until a snapshot has it, packets from
+		// the same address go to the user found the first time.
+		const QList<ServerUser *> candidates = snap->qhHostUsers.value(ha);
+		ServerUser *tried = NULL;
+
+		QHash<QPair<HostAddress, quint16>, VoiceThreadState::PendingPeer>::iterator p = vts->qhPendingPeers.find(key);
+		if (p != vts->qhPendingPeers.end()) {
+			foreach(ServerUser *usr, candidates) {
+				if (usr->uiSession == p.value().uiSession) {
+					tried = usr;
+					break;
+				}
+			}
+			if (tried && checkDecrypt(tried, encrypt, buffer, len)) {
+				u = tried;
+				if (p.value().tPosted.isElapsed(PEER_RETRY_USEC))
+					QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::registerPeer, this, u->uiSession, sock, from)));
+			} else {
+				vts->qhPendingPeers.erase(p);
+			}
+		}
+
+		if (! u) {
+			foreach(ServerUser *usr, candidates) {
+				if ((usr != tried) && usr->csCrypt.isValid() && checkDecrypt(usr, encrypt, buffer, len)) {
+					u = usr;
+					// Entries of peers that went quiet are only dropped
+					// when they send again; don't let those pile up.
+					if (vts->qhPendingPeers.count() >= 1024)
+						vts->qhPendingPeers.clear();
+					VoiceThreadState::PendingPeer pp;
+					pp.uiSession = u->uiSession;
+					vts->qhPendingPeers.insert(key, pp);
+					QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::registerPeer, this, u->uiSession, sock, from)));
+					break;
+				}
+			}
+		}
+		if (! u) {
+			++vts->vcCounters.uiDecryptFailed;
+			return;
+		}
+	}
+	len -= 4;
+
+	MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
+
+	switch (msgType) {
+		case MessageHandler::UDPVoiceSpeex:
+		case MessageHandler::UDPVoiceCELTAlpha:
+		case MessageHandler::UDPVoiceCELTBeta:
+			if (bOpus)
+				break;
+		case MessageHandler::UDPVoiceOpus: {
+				u->bUdp = true;
+				processMsg(u, buffer, len, vts->vcCounters);
+				break;
+			}
+		case MessageHandler::UDPPing: {
+				QByteArray qba;
+				sendMessage(u, buffer, len, qba, true);
+			}
+	}
+}
+
+#ifdef Q_OS_UNIX
+void Server::registerPeer(unsigned int uiSession, int sock, const struct sockaddr_storage &from) {
+#else
+void Server::registerPeer(unsigned int uiSession, SOCKET sock, const struct sockaddr_storage &from) {
+#endif
+	ServerUser *u = qhUsers.value(uiSession);
+	if (! u)
+		return;
+
+	quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<const sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<const sockaddr_in *>(&from)->sin_port);
+	const HostAddress &ha = HostAddress(from);
+	const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
+
+	if (qhPeerUsers.value(key) == u)
+		return;
+
+	{
+		QWriteLocker wl(&qrwlUsers);
+		// Set the address before the socket; sendMessage() on a voice thread
+		// only uses the address once the socket is valid.
+		memcpy(& u->saiUdpAddress, &from, sizeof(from));
+		u->sUdpSocket = sock;
+		qhHostUsers[ha].remove(u);
+		qhPeerUsers.insert(key, u);
+	}
+
+	publishSnapshot();
+}
+
+void Server::run() {
+	qint32 len;
+#if defined(__LP64__)
+	char encbuff[UDP_PACKET_SIZE+8];
+	char *encrypt = encbuff + 4;
+#else
+	char encrypt[UDP_PACKET_SIZE];
+#endif
 
 	sockaddr_storage from;
+	VoiceThreadState *vts = currentVoiceThreadState();
+#ifdef USE_VOICE_TRACE
+	const bool trace = Meta::mp.bVoiceTrace;
+#endif
+
+#ifdef Q_OS_UNIX
+	// Additional voice threads run this same loop on their own sockets.
+	VoiceThread *vt = qobject_cast<VoiceThread *>(QThread::currentThread());
+	const QList<int> &sockets = vt ? vt->qlUdpSocket : qlUdpSocket;
+	const int notify = vt ? vt->aiNotify[0] : aiNotify[0];
+	int nfds = sockets.count();
+#else
 	int nfds = qlUdpSocket.count();
+#endif
+
+#ifdef USE_MMSG
+	UDPRecvBatch *urb = NULL;
+	if (Meta::mp.iUDPBatchSize > 1) {
+		urb = new UDPRecvBatch(Meta::mp.iUDPBatchSize);
+		foreach(int s, sockets)
+			vts->qlSendBatch << new UDPSendBatch(s, Meta::mp.iUDPBatchSize);
+	}
+#endif
 
 #ifdef Q_OS_UNIX
 	socklen_t fromlen;
 	STACKVAR(struct pollfd, fds, nfds+1);
 
 	for (int i=0;i<nfds;++i) {
-		fds[i].fd = qlUdpSocket.at(i);
+		fds[i].fd = sockets.at(i);
 		fds[i].events = POLLIN;
 		fds[i].revents = 0;
 	}
 
-	fds[nfds].fd=aiNotify[0];
+	fds[nfds].fd=notify;
 	fds[nfds].events = POLLIN;
 	fds[nfds].revents = 0;
 #else
@@ -637,9 +1510,14 @@ void Server::run() {
 	++nfds;
 
 	while (bRunning) {
+		leaveSnapshot(vts);
+		vts->publish();
 #ifdef Q_OS_UNIX
-		int pret = poll(fds, nfds, -1);
-		if (pret <= 0) {
+		int pret = poll(fds, nfds, vts->publishTimeout());
+		enterSnapshot(vts);
+		if (pret == 0)
+			continue;
+		if (pret < 0) {
 			if (errno == EINTR)
 				continue;
 			qCritical("poll failure");
@@ -650,7 +1528,7 @@ void Server::run() {
 		if (fds[nfds - 1].revents) {
 			// Drain pipe
 			unsigned char val;
-			while (::recv(aiNotify[0], &val, 1, MSG_DONTWAIT) == 1) {};
+			while (::recv(notify, &val, 1, MSG_DONTWAIT) == 1) {};
 			break;
 		}
 
@@ -666,7 +1544,11 @@ void Server::run() {
 #else
 		{
 			{
-				DWORD ret = WaitForMultipleObjects(nfds, events, FALSE, INFINITE);
+				int timeout = vts->publishTimeout();
+				DWORD ret = WaitForMultipleObjects(nfds, events, FALSE, (timeout < 0) ? INFINITE : static_cast<DWORD>(timeout));
+				enterSnapshot(vts);
+				if (ret == WAIT_TIMEOUT)
+					continue;
 				if (ret == (WAIT_OBJECT_0 + nfds - 1)) {
 					break;
 				}
@@ -678,6 +1560,54 @@ void Server::run() {
 				SOCKET sock = fds[ret - WAIT_OBJECT_0];
 #endif
 
+#ifdef USE_MMSG
+				if (urb) {
+					int count = ::recvmmsg(sock, urb->mmsg, urb->uiSize, MSG_TRUNC | MSG_DONTWAIT, NULL);
+					if (count > 0) {
+						++vts->ubsStats.uiRecvCalls;
+						vts->ubsStats.uiRecvPackets += count;
+						if (static_cast<quint64>(count) > vts->ubsStats.uiRecvMax)
+							vts->ubsStats.uiRecvMax = count;
+
+#ifdef USE_VOICE_TRACE
+						const quint64 received = trace ? traceClock() : 0;
+#endif
+						for (int j=0;j<count;++j) {
+							len = static_cast<qint32>(urb->mmsg[j].msg_len);
+							char *data = urb->buffer(j);
+#ifdef USE_VOICE_TRACE
+							if (trace)
+								traceReceived(vts->vcCounters, &urb->mmsg[j].msg_hdr, received);
+#endif
+
+							// 4 bytes crypt header + type + session
+							if ((len >= 5) && (len <= UDP_PACKET_SIZE)) {
+								if (preparePingReply(data, len)) {
+									urb->iov[j].iov_len = 6 * sizeof(quint32);
+									::sendmsg(sock, &urb->mmsg[j].msg_hdr, 0);
+								} else {
+									processDatagram(sock, data, len, urb->addr[j], vts);
+								}
+							}
+							urb->reset(j);
+						}
+						flushSendBatches(vts);
+#ifdef USE_VOICE_TRACE
+						vts->vcCounters.uiStamp = 0;
+#endif
+					} else if ((count < 0) && (errno == ENOSYS)) {
+						qWarning("Server: recvmmsg() not supported by kernel, disabling batched UDP I/O");
+						flushSendBatches(vts);
+						qDeleteAll(vts->qlSendBatch);
+						vts->qlSendBatch.clear();
+						delete urb;
+						urb = NULL;
+					}
+					fds[i].revents = 0;
+					continue;
+				}
+#endif
+
 				fromlen = sizeof(from);
 #ifdef Q_OS_WIN
 				len=::recvfrom(sock, encrypt, UDP_PACKET_SIZE, 0, reinterpret_cast<struct sockaddr *>(&from), &fromlen);
@@ -689,7 +1619,7 @@ void Server::run() {
 				iov[0].iov_base = encrypt;
 				iov[0].iov_len = UDP_PACKET_SIZE;
 
-				u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
+				u_char controldata[UDP_CONTROL_SIZE];
 
 				memset(&msg, 0, sizeof(msg));
 				msg.msg_name = reinterpret_cast<struct sockaddr *>(&from);
@@ -700,6 +1630,10 @@ void Server::run() {
 				msg.msg_controllen = sizeof(controldata);
 
 				len=static_cast<quint32>(::recvmsg(sock, &msg, MSG_TRUNC));
+#ifdef USE_VOICE_TRACE
+				if (trace && (len != SOCKET_ERROR))
+					traceReceived(vts->vcCounters, &msg, traceClock());
+#endif
 #else
 				len=static_cast<qint32>(::recvfrom(sock, encrypt, UDP_PACKET_SIZE, MSG_TRUNC, reinterpret_cast<struct sockaddr *>(&from), &fromlen));
 #endif
@@ -715,17 +1649,7 @@ void Server::run() {
 					continue;
 				}
 
-				QReadLocker rl(&qrwlUsers);
-
-				quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
-
-				if ((len == 12) && (*ping == 0) && bAllowPing) {
-					ping[0] = uiVersionBlob;
-					// 1 and 2 will be the timestamp, which we return unmodified.
-					ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
-					ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
-					ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
-
+				if (preparePingReply(encrypt, len)) {
 #ifdef Q_OS_LINUX
 					iov[0].iov_len = 6 * sizeof(quint32);
 					::sendmsg(sock, &msg, 0);
@@ -735,70 +1659,25 @@ void Server::run() {
 					continue;
 				}
 
-
-				quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from)->sin_port);
-				const HostAddress &ha = HostAddress(from);
-
-				const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
-
-				ServerUser *u = qhPeerUsers.value(key);
-				if (u) {
-					if (! checkDecrypt(u, encrypt, buffer, len)) {
-						continue;
-					}
-				} else {
-					// Unknown peer
-					foreach(ServerUser *usr, qhHostUsers.value(ha)) {
-						if (usr->csCrypt.isValid() && checkDecrypt(usr, encrypt, buffer, len)) {
-							// Every time we relock, reverify users' existance.
-							// The main thread might delete the user while the lock isn't held.
-							unsigned int uiSession = usr->uiSession;
-							rl.unlock();
-							qrwlUsers.lockForWrite();
-							if (qhUsers.contains(uiSession)) {
-								u = usr;
-								u->sUdpSocket = sock;
-								memcpy(& u->saiUdpAddress, &from, sizeof(from));
-								qhHostUsers[from].remove(u);
-								qhPeerUsers.insert(key, u);
-								qrwlUsers.unlock();
-								rl.relock();
-								if (! qhUsers.contains(uiSession))
-									u = NULL;
-							}
-							break;
-						}
-					}
-					if (! u) {
-						continue;
-					}
-				}
-				len -= 4;
-
-				MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
-
-				switch (msgType) {
-					case MessageHandler::UDPVoiceSpeex:
-					case MessageHandler::UDPVoiceCELTAlpha:
-					case MessageHandler::UDPVoiceCELTBeta:
-						if (bOpus)
-							break;
-					case MessageHandler::UDPVoiceOpus: {
-							u->bUdp = true;
-							processMsg(u, buffer, len);
-							break;
-						}
-					case MessageHandler::UDPPing: {
-							QByteArray qba;
-							sendMessage(u, buffer, len, qba, true);
-						}
-				}
+				processDatagram(sock, encrypt, len, from, vts);
+				flushTunnels(vts);
+#ifdef USE_VOICE_TRACE
+				vts->vcCounters.uiStamp = 0;
+#endif
 #ifdef Q_OS_UNIX
 				fds[i].revents = 0;
 #endif
 			}
 		}
 	}
+	leaveSnapshot(vts);
+#ifdef USE_MMSG
+	flushSendBatches(vts);
+	qDeleteAll(vts->qlSendBatch);
+	vts->qlSendBatch.clear();
+	delete urb;
+#endif
+	vts->publish(true);
 #ifdef Q_OS_WIN
 	for (int i=0;i<nfds-1;++i) {
 		::WSAEventSelect(fds[i], NULL, 0);
@@ -808,6 +1687,8 @@ void Server::run() {
 }
 
 bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsigned int len) {
+	QMutexLocker l(&u->qmCrypt);
+
 	if (u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt), reinterpret_cast<unsigned char *>(plain), len))
 		return true;
 
@@ -828,7 +1709,10 @@ void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &c
 #else
 		STACKVAR(char, buffer, len+4);
 #endif
-		u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer), len);
+		{
+			QMutexLocker l(&u->qmCrypt);
+			u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer), len);
+		}
 #ifdef Q_OS_WIN
 		DWORD dwFlow = 0;
 		if (Meta::hQoS)
@@ -872,8 +1756,28 @@ void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &c
 			pktinfo->ipi_spec_dst.s_addr = tcpha.hash[3];
 		}
 
+		VoiceThreadState *vts = currentVoiceThreadState();
+#ifdef USE_MMSG
+		// Only voice threads batch; processMsg() is also called from the
+		// main thread for TCP tunneled voice, which has to send immediately.
+		if (vts && ! vts->qlSendBatch.isEmpty()) {
+			foreach(UDPSendBatch *usb, vts->qlSendBatch) {
+				if (usb->iSocket == u->sUdpSocket) {
+					if (usb->queue(&msg, vts->vcCounters.uiStamp))
+						usb->flush(vts->ubsStats, vts->vcCounters);
+					return;
+				}
+			}
+		}
+#endif
 
 		::sendmsg(u->sUdpSocket, &msg, 0);
+#ifdef USE_VOICE_TRACE
+		if (vts && vts->vcCounters.uiStamp)
+			traceSent(vts->vcCounters, vts->vcCounters.uiStamp, traceClock());
+#else
+		Q_UNUSED(vts);
+#endif
 #else
 		::sendto(u->sUdpSocket, buffer, len+4, 0, reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress), (u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 #endif
@@ -883,27 +1787,529 @@ void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &c
 #else
 #endif
 	} else {
-		if (cache.isEmpty())
-			cache = QByteArray(data, len);
-		emit tcpTransmit(cache,u->uiSession);
+		Q_UNUSED(cache);
+
+		VoiceThreadState *vts = currentVoiceThreadState();
+		if (! u->trTunnel.push(data, len)) {
+			if (vts)
+				++vts->uiTunnelDropped;
+			return;
+		}
+		if (vts)
+			++vts->uiTunnelPackets;
+
+		// Only the first packet since the last drain needs to wake the main thread.
+		if (u->trTunnel.qaiScheduled.testAndSetOrdered(0, 1)) {
+			if (vts)
+				vts->qlTunnelPending.append(u->uiSession);
+			else
+				QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::drainTunnels, this, QList<unsigned int>() << u->uiSession)));
+		}
+	}
+}
+
+void Server::flushSendBatches(VoiceThreadState *vts) {
+#ifdef USE_MMSG
+	foreach(UDPSendBatch *usb, vts->qlSendBatch)
+		if (usb->uiCount)
+			usb->flush(vts->ubsStats, vts->vcCounters);
+#endif
+	flushTunnels(vts);
+}
+
+void Server::flushTunnels(VoiceThreadState *vts) {
+	if (vts->qlTunnelPending.isEmpty())
+		return;
+
+	QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::drainTunnels, this, vts->qlTunnelPending)));
+	vts->qlTunnelPending.clear();
+}
+
+void Server::drainTunnels(const QList<unsigned int> &sessions) {
+	foreach(unsigned int id, sessions) {
+		ServerUser *u = qhUsers.value(id);
+		if (! u)
+			continue;
+
+		// Clear first, so packets queued while we write schedule another drain.
+		u->trTunnel.qaiScheduled.fetchAndStoreOrdered(0);
+
+		const char *data;
+		int len;
+		bool wrote = false;
+		while ((len = u->trTunnel.pending(data)) > 0) {
+			u->sendMessage(data, len);
+			u->trTunnel.consume(len);
+			wrote = true;
+		}
+		if (wrote)
+			u->forceFlush();
+	}
+}
+
+VoiceThreadState *Server::currentVoiceThreadState() {
+	QThread *t = QThread::currentThread();
+	if (t == this)
+		return &vtsMain;
+
+	VoiceThread *vt = qobject_cast<VoiceThread *>(t);
+	if (vt && (vt->parent() == this))
+		return &vt->vts;
+
+	return NULL;
+}
+
+const UserSnapshot *Server::currentSnapshot() {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+	return qapSnapshot.loadAcquire();
+#else
+	return qapSnapshot.fetchAndAddAcquire(0);
+#endif
+}
+
+// Voice threads call enterSnapshot() when they wake up to handle datagrams
+// and leaveSnapshot() before they block again. Pointers taken from a snapshot
+// may only be used in between.
+void Server::enterSnapshot(VoiceThreadState *vts) {
+	vts->qaiEpoch.fetchAndStoreOrdered(qaiSnapshotEpoch.fetchAndAddOrdered(0));
+}
+
+void Server::leaveSnapshot(VoiceThreadState *vts) {
+	vts->qaiEpoch.fetchAndStoreRelease(0);
+}
+
+// Returns the oldest epoch a voice thread is still working in, or 0 if all
+// of them are idle.
+int Server::oldestSnapshotEpoch() {
+	int oldest = vtsMain.qaiEpoch.fetchAndAddOrdered(0);
+	foreach(VoiceThread *vt, qlVoiceThreads) {
+		int epoch = vt->vts.qaiEpoch.fetchAndAddOrdered(0);
+		if (epoch && (! oldest || (epoch < oldest)))
+			oldest = epoch;
+	}
+	return oldest;
+}
+
+ChannelIndex::ChannelIndex(Channel *root) {
+	if (root)
+		add(root, -1, 0);
+}
+
+// Appends c and its subtree in depth first order and returns the height of
+// the subtree.
+int ChannelIndex::add(Channel *c, int parent, int level) {
+	int pos = qvChannels.count();
+
+	qvChannels << c;
+	qvParent << parent;
+	qvFirstChild << -1;
+	qvNextSibling << -1;
+	qvEnd << pos + 1;
+	qvLevel << level;
+	qvHeight << 0;
+	qhPosition.insert(c, pos);
+
+	int height = 0;
+	int prev = -1;
+	foreach(Channel *child, c->qlChannels) {
+		int cpos = qvChannels.count();
+		if (prev == -1)
+			qvFirstChild[pos] = cpos;
+		else
+			qvNextSibling[prev] = cpos;
+		prev = cpos;
+		height = qMax(height, add(child, pos, level + 1) + 1);
+	}
+
+	qvEnd[pos] = qvChannels.count();
+	qvHeight[pos] = height;
+	return height;
+}
+
+int ChannelIndex::position(const Channel *c) const {
+	return qhPosition.value(c, -1);
+}
+
+// True if c is root or one of its descendants.
+bool ChannelIndex::isInSubtree(const Channel *root, const Channel *c) const {
+	int r = position(root);
+	int p = position(c);
+	return (r != -1) && (p != -1) && (p >= r) && (p < qvEnd.at(r));
+}
+
+QList<ServerUser *> UserSnapshot::channelUsers(const Channel *c) const {
+	int pos = qspChannels->position(c);
+	if (pos == -1)
+		return QList<ServerUser *>();
+	return qvChannelUsers.at(pos);
+}
+
+// Call after adding, moving or removing channels. The control thread reads
+// the ChannelIndex of the current snapshot as well, so this rebuilds right
+// away instead of waiting for the event loop.
+void Server::invalidateChannelIndex() {
+	bChannelIndexDirty = true;
+	rebuildSnapshot();
+}
+
+// Call after changing the users, their channels or peer addresses. All such
+// changes made while handling one event share a single rebuild.
+void Server::publishSnapshot() {
+	if (bSnapshotPending)
+		return;
+	bSnapshotPending = true;
+	QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::flushSnapshot, this)));
+}
+
+void Server::flushSnapshot() {
+	if (bSnapshotPending)
+		rebuildSnapshot();
+}
+
+void Server::rebuildSnapshot() {
+	bSnapshotPending = false;
+
+	const UserSnapshot *cur = currentSnapshot();
+
+	UserSnapshot *snap = new UserSnapshot();
+	snap->iUsers = qhUsers.count();
+	snap->qhPeerUsers = qhPeerUsers;
+	snap->qhHostUsers = qhHostUsers;
+
+	if (bChannelIndexDirty || ! cur) {
+		snap->qspChannels = QSharedPointer<const ChannelIndex>(new ChannelIndex(qhChannels.value(0)));
+		bChannelIndexDirty = false;
+	} else {
+		snap->qspChannels = cur->qspChannels;
+	}
+
+	snap->qvChannelUsers.resize(snap->qspChannels->qvChannels.count());
+	foreach(ServerUser *u, qhUsers) {
+		int pos = snap->qspChannels->position(u->cChannel);
+		if (pos != -1)
+			snap->qvChannelUsers[pos].append(u);
+	}
+
+	// Only speakers hearing a channel whose users, links or ACLs changed
+	// rebuild their fan-out. The others hand on the array they had.
+	for (int i=0;i<snap->qvChannelUsers.count();++i) {
+		Channel *c = snap->qspChannels->qvChannels.at(i);
+		if (! cur || (cur->channelUsers(c) != snap->qvChannelUsers.at(i)))
+			bumpFanout(c);
+	}
+
+	foreach(ServerUser *u, qhUsers) {
+		if ((u->sState != ServerUser::Authenticated) || ! u->cChannel)
+			continue;
+		if (! speakFanoutValid(u, u->cChannel))
+			speakFanout(u, u->cChannel, snap);
+		snap->qhSpeak.insert(u, u->qvSpeakCache);
+		if (! u->qmTargetCache.isEmpty())
+			snap->qhTargets.insert(u, u->qmTargetCache);
+	}
+
+	RetiredSnapshot rs;
+	rs.usSnapshot = qapSnapshot.fetchAndStoreOrdered(snap);
+	rs.iEpoch = qaiSnapshotEpoch.fetchAndAddOrdered(1) + 1;
+	rs.qlUsers = qlRetiringUsers;
+	rs.qlChannels = qlRetiringChannels;
+	qlRetiringUsers.clear();
+	qlRetiringChannels.clear();
+	if (rs.usSnapshot || ! rs.qlUsers.isEmpty() || ! rs.qlChannels.isEmpty())
+		qlRetiredSnapshots.append(rs);
+
+	// Targets requested against the old snapshot are in this one, so a
+	// miss from now on is new and may be requested again.
+	foreach(unsigned int session, qlTargetRequests) {
+		ServerUser *u = qhUsers.value(session);
+		if (u)
+			u->trqTargets.clear();
+	}
+	qlTargetRequests.clear();
+
+	reclaimSnapshots();
+}
+
+// Frees what was retired before the oldest epoch a voice thread is still in,
+// and checks again later while anything is left.
+void Server::reclaimSnapshots() {
+	int oldest = oldestSnapshotEpoch();
+	while (! qlRetiredSnapshots.isEmpty() && (! oldest || (qlRetiredSnapshots.first().iEpoch <= oldest))) {
+		RetiredSnapshot rs = qlRetiredSnapshots.takeFirst();
+		delete rs.usSnapshot;
+		foreach(ServerUser *u, rs.qlUsers) {
+			ccRetired.add(u->csCrypt);
+			u->deleteLater();
+		}
+		qDeleteAll(rs.qlChannels);
+	}
+
+	if (qlRetiredSnapshots.isEmpty())
+		qtReclaim->stop();
+	else if (! qtReclaim->isActive())
+		qtReclaim->start(SNAPSHOT_RECLAIM_MSEC);
+}
+
+// Frees a disconnected user once no voice thread can still hold a pointer to
+// it. It must already be gone from qhUsers and the other user tables.
+void Server::retireUser(ServerUser *u) {
+	qlRetiringUsers << u;
+	publishSnapshot();
+}
+
+// Same for a channel that has been taken out of the tree.
+void Server::retireChannel(Channel *c) {
+	qlRetiringChannels << c;
+	publishSnapshot();
+}
+
+int Server::fanoutGeneration(Channel *c) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+	return c->qaiFanout.loadAcquire();
+#else
+	return c->qaiFanout.fetchAndAddAcquire(0);
+#endif
+}
+
+// Makes speakers whose fan-out includes c rebuild it with the next
+// snapshot. Generations come from one server wide counter, so a channel
+// allocated where a deleted one used to be can't match a generation
+// recorded for the old one.
+void Server::bumpFanout(Channel *c) {
+	c->qaiFanout.fetchAndStoreOrdered(qaiFanoutGeneration.fetchAndAddOrdered(1) + 1);
+}
+
+// Same, for changes the snapshot doesn't see itself, like links and ACLs.
+void Server::invalidateFanout(Channel *c) {
+	bumpFanout(c);
+	publishSnapshot();
+}
+
+// Same for c and every channel linked to it, directly or not. Call before
+// removing a link and after adding one, so both sides are covered.
+void Server::invalidateLinkedFanout(Channel *c) {
+	foreach(Channel *l, c->allLinks())
+		invalidateFanout(l);
+}
+
+// Works out who hears normal speech from u in c, into u->qvSpeakCache,
+// using the users of snap. u->qlSpeakDeps gets c and the linked channels u
+// may speak in, with their fan-out generation. A change to the links or
+// ACLs of any of them invalidates c as well, so c is always checked first
+// and the others are only looked at while it holds. Only called by the main
+// thread while it builds a snapshot, so nothing here changes underneath.
+void Server::speakFanout(ServerUser *u, Channel *c, const UserSnapshot *snap) {
+	SpeakDeps &deps = u->qlSpeakDeps;
+	deps.clear();
+	deps << SpeakDep(c, fanoutGeneration(c));
+
+	if (! c->qhLinks.isEmpty()) {
+		QSet<Channel *> chans = c->allLinks();
+		chans.remove(c);
+
+		QMutexLocker qml(&qmCache);
+
+		foreach(Channel *l, chans) {
+			int generation = fanoutGeneration(l);
+			if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache, &ccCompiled, &csACL))
+				deps << SpeakDep(l, generation);
+		}
+	}
+
+	u->qvSpeakCache.clear();
+	foreach(const SpeakDep &d, deps)
+		foreach(ServerUser *pDst, snap->channelUsers(d.first))
+			u->qvSpeakCache.append(pDst);
+}
+
+bool Server::speakFanoutValid(ServerUser *u, Channel *c) {
+	const SpeakDeps &deps = u->qlSpeakDeps;
+	if (deps.isEmpty() || (deps.first().first != c))
+		return false;
+	foreach(const SpeakDep &d, deps)
+		if (fanoutGeneration(d.first) != d.second)
+			return false;
+	return true;
+}
+
+// Adds up the voice latency histograms of all voice threads. They are
+// read without synchronization, like the other voice counters.
+void Server::voiceLatency(LatencyHistogram &queue, LatencyHistogram &relay) const {
+	const VoiceStats voice = vtsMain.published();
+	queue = voice.vcCounters.lhQueue;
+	relay = voice.vcCounters.lhRelay;
+	foreach(const VoiceThread *vt, qlVoiceThreads) {
+		const VoiceStats vs = vt->vts.published();
+		queue.merge(vs.vcCounters.lhQueue);
+		relay.merge(vs.vcCounters.lhRelay);
 	}
 }
 
+void Server::rotateLatencyWindow() {
+	lhQueueWindow[0] = lhQueueWindow[1];
+	lhRelayWindow[0] = lhRelayWindow[1];
+	voiceLatency(lhQueueWindow[1], lhRelayWindow[1]);
+}
+
+static void insertLatency(QMap<QString, qint64> &stats, const QString &prefix, const LatencyHistogram &h) {
+	const quint64 count = h.count();
+	if (count == 0)
+		return;
+	stats.insert(prefix + QLatin1String(".count"), static_cast<qint64>(count));
+	stats.insert(prefix + QLatin1String(".p50"), static_cast<qint64>(h.percentile(0.5)));
+	stats.insert(prefix + QLatin1String(".p90"), static_cast<qint64>(h.percentile(0.9)));
+	stats.insert(prefix + QLatin1String(".p99"), static_cast<qint64>(h.percentile(0.99)));
+	stats.insert(prefix + QLatin1String(".p999"), static_cast<qint64>(h.percentile(0.999)));
+	stats.insert(prefix + QLatin1String(".max"), static_cast<qint64>(h.uiMax));
+}
+
+QMap<QString, qint64> Server::getStatistics() const {
+	QMap<QString, qint64> stats;
+
+	const VoiceStats voice = vtsMain.published();
+	UDPBatchStats ubs = voice.ubsStats;
+	quint64 tunnelPackets = voice.uiTunnelPackets;
+	quint64 tunnelDropped = voice.uiTunnelDropped;
+	foreach(const VoiceThread *vt, qlVoiceThreads) {
+		const VoiceStats vs = vt->vts.published();
+		tunnelPackets += vs.uiTunnelPackets;
+		tunnelDropped += vs.uiTunnelDropped;
+		ubs.uiRecvCalls += vs.ubsStats.uiRecvCalls;
+		ubs.uiRecvPackets += vs.ubsStats.uiRecvPackets;
+		ubs.uiRecvMax = qMax(ubs.uiRecvMax, vs.ubsStats.uiRecvMax);
+		ubs.uiSendCalls += vs.ubsStats.uiSendCalls;
+		ubs.uiSendPackets += vs.ubsStats.uiSendPackets;
+		ubs.uiSendMax = qMax(ubs.uiSendMax, vs.ubsStats.uiSendMax);
+	}
+
+	stats.insert(QLatin1String("voice.threads"), qlVoiceThreads.count() + 1);
+	stats.insert(QLatin1String("udp.recv.calls"), static_cast<qint64>(ubs.uiRecvCalls));
+	stats.insert(QLatin1String("udp.recv.packets"), static_cast<qint64>(ubs.uiRecvPackets));
+	stats.insert(QLatin1String("udp.recv.maxbatch"), static_cast<qint64>(ubs.uiRecvMax));
+	stats.insert(QLatin1String("udp.send.calls"), static_cast<qint64>(ubs.uiSendCalls));
+	stats.insert(QLatin1String("udp.send.packets"), static_cast<qint64>(ubs.uiSendPackets));
+	stats.insert(QLatin1String("udp.send.maxbatch"), static_cast<qint64>(ubs.uiSendMax));
+	stats.insert(QLatin1String("tunnel.packets"), static_cast<qint64>(tunnelPackets));
+	stats.insert(QLatin1String("tunnel.dropped"), static_cast<qint64>(tunnelDropped));
+
+	// Voice tracing, in microseconds, over the last one to two minutes; only
+	// present with voicetrace enabled.
+	if (qtLatencyWindow) {
+		LatencyHistogram queue, relay;
+		voiceLatency(queue, relay);
+		insertLatency(stats, QLatin1String("voice.queue"), queue.since(lhQueueWindow[0]));
+		insertLatency(stats, QLatin1String("voice.relay"), relay.since(lhRelayWindow[0]));
+	}
+
+	stats.insert(QLatin1String("broadcast.messages"), static_cast<qint64>(uiBroadcastMessages));
+	stats.insert(QLatin1String("broadcast.writes"), static_cast<qint64>(uiBroadcastWrites));
+
+	int textPending = 0;
+	foreach(const TextFanout &tf, qqTextFanout)
+		textPending += tf.qlSessions.count() - tf.iNext;
+	stats.insert(QLatin1String("text.pending"), textPending);
+	stats.insert(QLatin1String("text.backlog"), qsTextBacklog.count());
+	stats.insert(QLatin1String("text.dropped"), static_cast<qint64>(uiTextDropped));
+
+	stats.insert(QLatin1String("bans.count"), qlBans.count());
+	stats.insert(QLatin1String("bans.nodes"), biBans.nodes());
+
+	stats.insert(QLatin1String("tls.pending"), meta->hpHandshakes->pending());
+	meta->bsBlobs->getStatistics(stats);
+	LegacyTexture::getStatistics(stats);
+	ServerDB::dbwWorker->getStatistics(stats);
+
+	return stats;
+}
+
+static const char *messageTypeName(int type) {
+	switch (type) {
+#define MUMBLE_MH_MSG(x) case MessageHandler:: x : return #x;
+			MUMBLE_MH_ALL
+#undef MUMBLE_MH_MSG
+	}
+	return "Unknown";
+}
+
+// Adds this server's part to a metrics scrape; run on the control thread.
+// Voice thread counters come from the copies the threads publish, so every
+// sum and count pair is from the same moment.
+void Server::collectMetrics(QSharedPointer<MetricsScrape> ms) {
+	MetricSet m;
+	const QByteArray server = MetricSet::label("server", QString::number(iServerNum));
+
+	const VoiceStats voice = vtsMain.published();
+	VoiceCounters vc = voice.vcCounters;
+	vc.merge(vcControl);
+	quint64 tunnelPackets = voice.uiTunnelPackets;
+	quint64 tunnelDropped = voice.uiTunnelDropped;
+	foreach(const VoiceThread *vt, qlVoiceThreads) {
+		const VoiceStats vs = vt->vts.published();
+		vc.merge(vs.vcCounters);
+		tunnelPackets += vs.uiTunnelPackets;
+		tunnelDropped += vs.uiTunnelDropped;
+	}
+
+	CryptCounters cc = ccRetired;
+	foreach(const ServerUser *u, qhUsers)
+		cc.add(u->csCrypt);
+
+	ChanACL::CacheStats acl;
+	{
+		QMutexLocker qml(&qmCache);
+		acl = csACL;
+	}
+
+	m.gauge("murmur_users", "Number of connected users.", server, qhUsers.count());
+	m.counter("murmur_voice_packets_received_total", "UDP datagrams received, pings excluded.", server, vc.uiPacketsIn);
+	m.counter("murmur_voice_bytes_received_total", "Size of the UDP datagrams received, pings excluded.", server, vc.uiBytesIn);
+	m.counter("murmur_voice_packets_relayed_total", "Voice packets sent on to listeners, over UDP or the TCP tunnel.", server, vc.uiPacketsRelayed);
+	m.counter("murmur_voice_bytes_relayed_total", "Payload size of the voice packets sent on to listeners.", server, vc.uiBytesRelayed);
+	m.counter("murmur_voice_decrypt_failures_total", "UDP datagrams that could not be decrypted.", server, vc.uiDecryptFailed);
+	m.counter("murmur_voice_bandwidth_dropped_total", "Voice packets dropped for exceeding the bandwidth limit.", server, vc.uiBandwidthDropped);
+	m.counter("murmur_tunnel_packets_received_total", "Voice packets received over the TCP tunnel.", server, vc.uiTunnelIn);
+	m.counter("murmur_tunnel_packets_sent_total", "Voice packets sent over the TCP tunnel.", server, tunnelPackets);
+	m.counter("murmur_tunnel_packets_dropped_total", "Voice packets dropped because a user's tunnel queue was full.", server, tunnelDropped);
+
+	m.counter("murmur_crypt_good_packets_total", "Voice packets decrypted in order.", server, cc.uiGood);
+	m.counter("murmur_crypt_late_packets_total", "Voice packets decrypted out of order.", server, cc.uiLate);
+	m.gauge("murmur_crypt_lost_packets", "Voice packets presumed lost; goes down again when they turn up late.", server, static_cast<qint64>(cc.uiLost));
+	m.counter("murmur_crypt_resyncs_total", "Crypt resynchronizations requested by clients.", server, cc.uiResync);
+
+	if (vc.lhQueue.count())
+		m.histogram("murmur_voice_queue_latency_seconds", "Time from the kernel receiving a UDP datagram to the server reading it.", server, vc.lhQueue);
+	if (vc.lhRelay.count())
+		m.histogram("murmur_voice_relay_latency_seconds", "Time from the kernel receiving a voice packet to each copy being sent on over UDP.", server, vc.lhRelay);
+
+	m.counter("murmur_acl_cache_hits_total", "Permission checks answered from the ACL cache.", server, acl.uiHits);
+	m.counter("murmur_acl_cache_misses_total", "Permission checks that had to be computed.", server, acl.uiMisses);
+
+	for (int i=0;i<MessageTypes;++i) {
+		if (hMessageTime[i].count() == 0)
+			continue;
+		m.histogram("murmur_message_duration_seconds", "Time taken to handle a control message, by type.", server + ',' + MetricSet::label("type", QLatin1String(messageTypeName(i))), hMessageTime[i]);
+	}
+
+	ms->add(m);
+}
+
 #define SENDTO \
 		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
-			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
+			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) { \
 				sendMessage(pDst, buffer, len, qba); \
-			else \
+				vc.uiBytesRelayed += len; \
+			} else { \
 				sendMessage(pDst, buffer, len - poslen, qba_npos); \
+				vc.uiBytesRelayed += len - poslen; \
+			} \
+			++vc.uiPacketsRelayed; \
 		}
 
-void Server::processMsg(ServerUser *u, const char *data, int len) {
+void Server::processMsg(ServerUser *u, const char *data, int len, VoiceCounters &vc) {
 	if (u->sState != ServerUser::Authenticated || u->bMute || u->bSuppress || u->bSelfMute)
 		return;
 
-	User *p;
 	BandwidthRecord *bw = & u->bwr;
-	Channel *c = u->cChannel;
 	QByteArray qba, qba_npos;
 	unsigned int counter;
 	char buffer[UDP_PACKET_SIZE];
@@ -917,8 +2323,9 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 	int packetsize = 20 + 8 + 4 + len;
 
 	// Check the voice data rate limit.
-	if (! bw->addFrame(packetsize, iMaxBandwidth/8)) {
+	if (! bw->addFrame(packetsize, iMaxBandwidth/8, iMaxBandwidthBurst)) {
 		// Suppress packet.
+		++vc.uiBandwidthDropped;
 		return;
 	}
 
@@ -953,111 +2360,181 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 		return;
 	} else if (target == 0) { // Normal speech
 		buffer[0] = static_cast<char>(type | 0);
-		foreach(p, c->qlUsers) {
-			ServerUser *pDst = static_cast<ServerUser *>(p);
+
+		// Worked out by the main thread when it published the snapshot.
+		// Read in place, so this takes no lock and no reference.
+		const UserSnapshot *snap = currentSnapshot();
+		QHash<const ServerUser *, ServerUser::SpeakCache>::const_iterator i = snap->qhSpeak.constFind(u);
+		if (i == snap->qhSpeak.constEnd())
+			return;
+
+		const ServerUser::SpeakCache &fanout = i.value();
+		for (int j=0;j<fanout.count();++j) {
+			ServerUser *pDst = fanout.at(j);
 			SENDTO;
 		}
+	} else { // Whisper
+		// Resolved by the main thread. A target it hasn't got to yet is
+		// requested once and dropped until a snapshot has it.
+		const UserSnapshot *snap = currentSnapshot();
+		const WhisperTargetCache *cache = NULL;
+
+		QHash<const ServerUser *, QMap<int, WhisperTargetCache> >::const_iterator t = snap->qhTargets.constFind(u);
+		if (t != snap->qhTargets.constEnd()) {
+			QMap<int, WhisperTargetCache>::const_iterator i = t.value().constFind(target);
+			if (i != t.value().constEnd())
+				cache = &i.value();
+		}
+
+		if (! cache) {
+			requestTarget(u, target);
+			return;
+		}
+
+		const QSet<ServerUser *> &channel = cache->qsChannel;
+		const QSet<ServerUser *> &direct = cache->qsDirect;
+		QSet<ServerUser *>::const_iterator i;
+
+		if (! channel.isEmpty()) {
+			buffer[0] = static_cast<char>(type | 1);
+			for (i = channel.constBegin(); i != channel.constEnd(); ++i) {
+				ServerUser *pDst = *i;
+				SENDTO;
+			}
+			if (! direct.isEmpty()) {
+				qba.clear();
+				qba_npos.clear();
+			}
+		}
+		if (! direct.isEmpty()) {
+			buffer[0] = static_cast<char>(type | 2);
+			for (i = direct.constBegin(); i != direct.constEnd(); ++i) {
+				ServerUser *pDst = *i;
+				SENDTO;
+			}
+		}
+	}
+}
+
+// Called by a voice thread for a whisper target missing from the snapshot.
+void Server::requestTarget(ServerUser *u, int target) {
+	if (u->trqTargets.request(target))
+		QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::fillTarget, this, u->uiSession, target)));
+}
 
-		if (! c->qhLinks.isEmpty()) {
-			QSet<Channel *> chans = c->allLinks();
-			chans.remove(c);
+// Resolves a target a voice thread asked for. Targets that aren't set get
+// an empty entry, so packets to them are dropped without asking again.
+void Server::fillTarget(unsigned int session, int target) {
+	ServerUser *u = qhUsers.value(session);
+	if (! u)
+		return;
 
-			QMutexLocker qml(&qmCache);
+	if (! u->qmTargetCache.contains(target)) {
+		WhisperTargetCache cache;
+		resolveTarget(u, target, cache);
+		u->qmTargetCache.insert(target, cache);
+	}
+
+	// The request is cleared once the result is published.
+	qlTargetRequests << session;
+	publishSnapshot();
+}
+
+// Works out who hears whisper target of u, and which channels and sessions
+// that depends on. Only called by the main thread; voice threads use the
+// results published in the snapshot.
+void Server::resolveTarget(ServerUser *u, int target, WhisperTargetCache &cache) {
+	User *p;
+
+	const WhisperTarget &wt = u->qmTargets.value(target);
+	if (! wt.qlChannels.isEmpty()) {
+		QMutexLocker qml(&qmCache);
 
-			foreach(Channel *l, chans) {
-				if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
-					foreach(p, l->qlUsers) {
-						ServerUser *pDst = static_cast<ServerUser *>(p);
-						SENDTO;
+		foreach(const WhisperTarget::Channel &wtc, wt.qlChannels) {
+			Channel *wc = qhChannels.value(wtc.iId);
+			if (wc) {
+				cache.qsChannels.insert(wc);
+
+				bool link = wtc.bLinks && ! wc->qhLinks.isEmpty();
+				bool dochildren = wtc.bChildren && ! wc->qlChannels.isEmpty();
+				bool group = ! wtc.qsGroup.isEmpty();
+				if (!link && !dochildren && ! group) {
+					// Common case
+					if (ChanACL::hasPermission(u, wc, ChanACL::Whisper, &acCache, &ccCompiled, &csACL)) {
+						foreach(p, wc->qlUsers) {
+							cache.qsChannel.insert(static_cast<ServerUser *>(p));
+						}
 					}
-				}
-			}
-		}
-	} else if (u->qmTargets.contains(target)) { // Whisper
-		QSet<ServerUser *> channel;
-		QSet<ServerUser *> direct;
-
-		if (u->qmTargetCache.contains(target)) {
-			const ServerUser::TargetCache &cache = u->qmTargetCache.value(target);
-			channel = cache.first;
-			direct = cache.second;
-		} else {
-			const WhisperTarget &wt = u->qmTargets.value(target);
-			if (! wt.qlChannels.isEmpty()) {
-				QMutexLocker qml(&qmCache);
-
-				foreach(const WhisperTarget::Channel &wtc, wt.qlChannels) {
-					Channel *wc = qhChannels.value(wtc.iId);
-					if (wc) {
-						bool link = wtc.bLinks && ! wc->qhLinks.isEmpty();
-						bool dochildren = wtc.bChildren && ! wc->qlChannels.isEmpty();
-						bool group = ! wtc.qsGroup.isEmpty();
-						if (!link && !dochildren && ! group) {
-							// Common case
-							if (ChanACL::hasPermission(u, wc, ChanACL::Whisper, &acCache)) {
-								foreach(p, wc->qlUsers) {
-									channel.insert(static_cast<ServerUser *>(p));
-								}
-							}
-						} else {
-							QSet<Channel *> channels;
-							if (link)
-								channels = wc->allLinks();
-							else
-								channels.insert(wc);
-							if (dochildren)
-								channels.unite(wc->allChildren());
-							const QString &redirect = u->qmWhisperRedirect.value(wtc.qsGroup);
-							const QString &qsg = redirect.isEmpty() ? wtc.qsGroup : redirect;
-							foreach(Channel *tc, channels) {
-								if (ChanACL::hasPermission(u, tc, ChanACL::Whisper, &acCache)) {
-									foreach(p, tc->qlUsers) {
-										ServerUser *su = static_cast<ServerUser *>(p);
-										if (! group || Group::isMember(tc, tc, qsg, su)) {
-											channel.insert(su);
-										}
-									}
+				} else {
+					QSet<Channel *> channels;
+					if (link)
+						channels = wc->allLinks();
+					else
+						channels.insert(wc);
+					if (dochildren) {
+						const ChannelIndex &ci = *currentSnapshot()->qspChannels;
+						int pos = ci.position(wc);
+						if (pos != -1)
+							for (int i = pos + 1; i < ci.qvEnd.at(pos); ++i)
+								channels.insert(ci.qvChannels.at(i));
+					}
+					const QString &redirect = u->qmWhisperRedirect.value(wtc.qsGroup);
+					const QString &qsg = redirect.isEmpty() ? wtc.qsGroup : redirect;
+					const Group::Reference grg(qsg);
+					foreach(Channel *tc, channels) {
+						cache.qsChannels.insert(tc);
+						if (ChanACL::hasPermission(u, tc, ChanACL::Whisper, &acCache, &ccCompiled, &csACL)) {
+							foreach(p, tc->qlUsers) {
+								ServerUser *su = static_cast<ServerUser *>(p);
+								if (! group || Group::isMember(tc, tc, grg, su)) {
+									cache.qsChannel.insert(su);
 								}
 							}
 						}
 					}
 				}
 			}
+		}
+	}
 
-			foreach(unsigned int id, wt.qlSessions) {
-				ServerUser *pDst = qhUsers.value(id);
-				if (pDst && ChanACL::hasPermission(u, pDst->cChannel, ChanACL::Whisper, &acCache) && ! channel.contains(pDst))
-					direct.insert(pDst);
-			}
+	if (! wt.qlSessions.isEmpty()) {
+		QMutexLocker qml(&qmCache);
 
-			int uiSession = u->uiSession;
-			qrwlUsers.unlock();
-			qrwlUsers.lockForWrite();
+		foreach(unsigned int id, wt.qlSessions) {
+			cache.qsSessions.insert(id);
 
-			if (qhUsers.contains(uiSession))
-				u->qmTargetCache.insert(target, ServerUser::TargetCache(channel, direct));
-			qrwlUsers.unlock();
-			qrwlUsers.lockForRead();
-			if (! qhUsers.contains(uiSession))
-				return;
-		}
-		if (! channel.isEmpty()) {
-			buffer[0] = static_cast<char>(type | 1);
-			foreach(ServerUser *pDst, channel) {
-				SENDTO;
-			}
-			if (! direct.isEmpty()) {
-				qba.clear();
-				qba_npos.clear();
-			}
+			ServerUser *pDst = qhUsers.value(id);
+			if (! pDst)
+				continue;
+
+			cache.qsChannels.insert(pDst->cChannel);
+			if (ChanACL::hasPermission(u, pDst->cChannel, ChanACL::Whisper, &acCache, &ccCompiled, &csACL) && ! cache.qsChannel.contains(pDst))
+				cache.qsDirect.insert(pDst);
 		}
-		if (! direct.isEmpty()) {
-			buffer[0] = static_cast<char>(type | 2);
-			foreach(ServerUser *pDst, direct) {
-				SENDTO;
+	}
+}
+
+// Rebuilds every cached whisper target that depends on the user or channels
+// given, plus all targets of that user. The voice threads keep using the old
+// entries until the next snapshot is published. Only the main thread reads
+// or writes qmTargetCache, so this needs no lock.
+void Server::refreshTargetCache(User *changed, const QSet<const Channel *> &channels) {
+	bool stale = false;
+
+	foreach(ServerUser *u, qhUsers) {
+		QMap<int, WhisperTargetCache>::iterator i;
+		for (i = u->qmTargetCache.begin(); i != u->qmTargetCache.end(); ++i) {
+			if ((u == changed) || i.value().dependsOn(changed, channels)) {
+				WhisperTargetCache cache;
+				resolveTarget(u, i.key(), cache);
+				i.value() = cache;
+				stale = true;
 			}
 		}
 	}
+
+	if (stale)
+		publishSnapshot();
 }
 
 void Server::log(ServerUser *u, const QString &str) const {
@@ -1077,6 +2554,8 @@ void Server::newClient() {
 	SslServer *ss = qobject_cast<SslServer *>(sender());
 	if (! ss)
 		return;
+	// Rejecting one connection mustn't leave the rest of the backlog
+	// waiting for the next newConnection().
 	forever {
 		QSslSocket *sock = ss->nextPendingSSLConnection();
 		if (! sock)
@@ -1088,28 +2567,23 @@ void Server::newClient() {
 			log(QString("Ignoring connection: %1 (Global ban)").arg(addressToString(sock->peerAddress(), sock->peerPort())));
 			sock->disconnectFromHost();
 			sock->deleteLater();
-			return;
+			continue;
 		}
 
 		HostAddress ha(adr);
 
-		QList<Ban> tmpBans = qlBans;
-		foreach(const Ban &ban, qlBans) {
-			if (ban.isExpired())
-				tmpBans.removeOne(ban);
-		}
-		if (qlBans.count() != tmpBans.count()) {
-			qlBans = tmpBans;
+		const QList<Ban> expired = biBans.expire(QDateTime::currentDateTime().toUTC().toTime_t());
+		if (! expired.isEmpty()) {
+			foreach(const Ban &ban, expired)
+				qlBans.removeOne(ban);
 			saveBans();
 		}
 
-		foreach(const Ban &ban, qlBans) {
-			if (ban.haAddress.match(ha, ban.iMask)) {
-				log(QString("Ignoring connection: %1 (Server ban)").arg(addressToString(sock->peerAddress(), sock->peerPort())));
-				sock->disconnectFromHost();
-				sock->deleteLater();
-				return;
-			}
+		if (biBans.match(ha)) {
+			log(QString("Ignoring connection: %1 (Server ban)").arg(addressToString(sock->peerAddress(), sock->peerPort())));
+			sock->disconnectFromHost();
+			sock->deleteLater();
+			continue;
 		}
 
 		sock->setPrivateKey(qskKey);
@@ -1121,40 +2595,71 @@ void Server::newClient() {
 			log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
 			sock->disconnectFromHost();
 			sock->deleteLater();
-			return;
+			continue;
 		}
 
-		ServerUser *u = new ServerUser(this, sock);
-		u->uiSession = qqIds.dequeue();
-		u->haAddress = ha;
-		HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+		sock->setProtocol(QSsl::TlsV1_0);
+#else
+		sock->setProtocol(QSsl::TlsV1);
+#endif
 
-		{
-			QWriteLocker wl(&qrwlUsers);
-			qhUsers.insert(u->uiSession, u);
-			qhHostUsers[ha].insert(u);
+		const QString peer = addressToString(sock->peerAddress(), sock->peerPort());
+		if (! meta->hpHandshakes->start(this, sock, ha, peer)) {
+			log(QString("Ignoring connection: %1 (Too many pending handshakes)").arg(peer));
+			sock->abort();
+			sock->deleteLater();
+			continue;
 		}
+	}
+}
 
-		connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
-		connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
-		connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
-		connect(u, SIGNAL(encrypted()), this, SLOT(encrypted()));
+// The ServerUser only comes into existence once the handshake has completed,
+// so a flood of slow or failing handshakes never touches qhUsers, the session
+// pool or the voice snapshot.
+void Server::handshakeFinished(QSslSocket *sock, const HostAddress &ha, const QString &peer, bool ok, bool verified, const QString &reason) {
+	if (! ok) {
+		log(QString("Connection %1 failed TLS handshake: %2").arg(peer, reason));
+		return;
+	}
 
-		log(u, QString("New connection: %1").arg(addressToString(sock->peerAddress(), sock->peerPort())));
+	if (qqIds.isEmpty()) {
+		log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
+		sock->abort();
+		sock->deleteLater();
+		return;
+	}
 
-		u->setToS();
+	ServerUser *u = new ServerUser(this, sock);
+	u->uiSession = qqIds.dequeue();
+	u->haAddress = ha;
+	u->bVerified = verified;
+	HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
 
-#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
-		sock->setProtocol(QSsl::TlsV1_0);
-#else
-		sock->setProtocol(QSsl::TlsV1);
-#endif
-		sock->startServerEncryption();
+	{
+		QWriteLocker wl(&qrwlUsers);
+		qhUsers.insert(u->uiSession, u);
+		qhHostUsers[ha].insert(u);
 	}
+	publishSnapshot();
+
+	connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
+	connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
+	connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
+
+	log(u, QString("New connection: %1").arg(peer));
+
+	u->setToS();
+
+	encrypted(u);
+
+	// Anything the client sent right behind the handshake was buffered on
+	// the worker thread and won't raise readyRead() again.
+	if (sock->bytesAvailable() > 0)
+		QMetaObject::invokeMethod(u, "socketRead", Qt::QueuedConnection);
 }
 
-void Server::encrypted() {
-	ServerUser *uSource = qobject_cast<ServerUser *>(sender());
+void Server::encrypted(ServerUser *uSource) {
 	int major, minor, patch;
 	QString release;
 
@@ -1199,20 +2704,17 @@ void Server::encrypted() {
 			log(uSource, QString::fromUtf8("Strong certificate for %1 <%2> (signed by %3)").arg(subject).arg(uSource->qslEmail.join(", ")).arg(issuer));
 		}
 
-		foreach(const Ban &ban, qlBans) {
-			if (ban.qsHash == uSource->qsHash) {
-				log(uSource, QString("Certificate hash is banned."));
-				uSource->disconnectSocket();
-			}
+		if (biBans.matchHash(uSource->qsHash)) {
+			log(uSource, QString("Certificate hash is banned."));
+			uSource->disconnectSocket();
 		}
 	}
 }
 
-void Server::sslError(const QList<QSslError> &errors) {
-	ServerUser *u = qobject_cast<ServerUser *>(sender());
-	if (!u)
-		return;
-
+// Returns false if the errors are fatal. Errors that merely mean the client
+// certificate can't be trusted clear verified instead. Called from the
+// handshake threads.
+bool Server::checkSslErrors(const QList<QSslError> &errors, bool &verified, QString &reason) {
 	bool ok = true;
 	foreach(QSslError e, errors) {
 		switch (e.error()) {
@@ -1226,18 +2728,29 @@ void Server::sslError(const QList<QSslError> &errors) {
 			case QSslError::HostNameMismatch:
 			case QSslError::CertificateNotYetValid:
 			case QSslError::CertificateExpired:
-				u->bVerified = false;
+				verified = false;
 				break;
 			default:
-				log(u, QString("SSL Error: %1").arg(e.errorString()));
+				if (ok)
+					reason = QString("SSL Error: %1").arg(e.errorString());
 				ok = false;
 		}
 	}
+	return ok;
+}
+
+void Server::sslError(const QList<QSslError> &errors) {
+	ServerUser *u = qobject_cast<ServerUser *>(sender());
+	if (!u)
+		return;
 
-	if (ok)
+	QString reason;
+	if (checkSslErrors(errors, u->bVerified, reason)) {
 		u->proceedAnyway();
-	else
+	} else {
+		log(u, reason);
 		u->disconnectSocket(true);
+	}
 }
 
 void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &reason) {
@@ -1275,6 +2788,7 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		if (old)
 			old->removeUser(u);
 	}
+	publishSnapshot();
 
 	if (old && old->bTemporary && old->qlUsers.isEmpty())
 		QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::removeChannel, this, old->iId)));
@@ -1285,9 +2799,13 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 	if (u->sState == ServerUser::Authenticated) {
 		clearTempGroups(u); // Also clears ACL cache
 		recheckCodecVersions(); // Maybe can choose a better codec now
+	} else {
+		// Other users may still whisper to this session directly.
+		refreshTargetCache(u, QSet<const Channel *>());
 	}
 
-	u->deleteLater();
+	// A voice thread might still be sending to this user.
+	retireUser(u);
 
 	if (qhUsers.isEmpty())
 		stopThread();
@@ -1307,9 +2825,8 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 		if (l < 2)
 			return;
 
-		QReadLocker rl(&qrwlUsers);
-
 		u->bUdp = false;
+		++vcControl.uiTunnelIn;
 
 		const char *buffer = qbaMsg.constData();
 
@@ -1322,7 +2839,7 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 				if (bOpus)
 					break;
 			case MessageHandler::UDPVoiceOpus:
-				processMsg(u, buffer, l);
+				processMsg(u, buffer, l, vcControl);
 				break;
 			default:
 				break;
@@ -1355,9 +2872,14 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 	}
 #endif
 
+	Timer t;
+
 	switch (uiType) {
 			MUMBLE_MH_ALL
 	}
+
+	if (uiType < MessageTypes)
+		hMessageTime[uiType].add(t.elapsed());
 }
 
 void Server::checkTimeout() {
@@ -1375,23 +2897,6 @@ void Server::checkTimeout() {
 		u->disconnectSocket(true);
 }
 
-void Server::tcpTransmitData(QByteArray a, unsigned int id) {
-	Connection *c = qhUsers.value(id);
-	if (c) {
-		QByteArray qba;
-		int len = a.size();
-
-		qba.resize(len + 6);
-		unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
-		* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(MessageHandler::UDPTunnel));
-		* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-		memcpy(uc + 6, a.constData(), len);
-
-		c->sendMessage(qba);
-		c->forceFlush();
-	}
-}
-
 void Server::doSync(unsigned int id) {
 	ServerUser *u = qhUsers.value(id);
 	if (u) {
@@ -1402,20 +2907,369 @@ void Server::doSync(unsigned int id) {
 }
 
 void Server::sendProtoMessage(ServerUser *u, const ::google::protobuf::Message &msg, unsigned int msgType) {
-	QByteArray cache;
-	u->sendMessage(msg, msgType, cache);
+	if (mfSend.encode(msg, msgType))
+		u->sendMessage(mfSend);
 }
 
 void Server::sendProtoAll(const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int version) {
 	sendProtoExcept(NULL, msg, msgType, version);
 }
 
+// Sends msg with an already serialized field appended, such as one from
+// BlobStore::field(). Protobuf merges concatenated messages, so this is the
+// same as sending msg with that field set.
+void Server::sendProtoMessage(ServerUser *u, const ::google::protobuf::Message &msg, unsigned int msgType, const QByteArray &field) {
+	const int len = msg.ByteSize();
+	if (len + field.size() > MessageFrame::MaxPayload)
+		return;
+
+	QByteArray frame;
+	frame.resize(MessageFrame::HeaderSize + len + field.size());
+	unsigned char *uc = reinterpret_cast<unsigned char *>(frame.data());
+	MessageFrame::writeHeader(uc, msgType, len + field.size());
+	msg.SerializeWithCachedSizesToArray(uc + MessageFrame::HeaderSize);
+	memcpy(uc + MessageFrame::HeaderSize + len, field.constData(), field.size());
+	u->sendMessage(frame);
+}
+
 void Server::sendProtoExcept(ServerUser *u, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int version) {
-	QByteArray cache;
+	invalidateJoinState(msg, msgType);
+
+	switch (msgType) {
+		case MessageHandler::UserState:
+		case MessageHandler::UserRemove:
+		case MessageHandler::ChannelRemove:
+			if (! qqTextFanout.isEmpty() || ! qsTextBacklog.isEmpty())
+				flushPendingText();
+			break;
+		default:
+			break;
+	}
+
+	// Encoded on first use, then the same bytes are queued for every
+	// recipient. Each version filter sees its own subset of the queue, and
+	// direct sends flush a user's queue first, so ordering is unchanged.
+	mfSend.clear();
+
 	foreach(ServerUser *usr, qhUsers)
 		if ((usr != u) && (usr->sState == ServerUser::Authenticated))
-			if ((version == 0) || (usr->uiVersion >= version) || ((version & 0x80000000) && (usr->uiVersion < (~version))))
-				usr->sendMessage(msg, msgType, cache);
+			if ((version == 0) || (usr->uiVersion >= version) || ((version & 0x80000000) && (usr->uiVersion < (~version)))) {
+				if (mfSend.isEmpty() && ! mfSend.encode(msg, msgType))
+					return;
+				usr->queueMessage(mfSend.constData(), mfSend.size());
+				qsBroadcastPending.insert(usr->uiSession);
+				++uiBroadcastMessages;
+			}
+
+	if (! bBroadcastFlush && ! qsBroadcastPending.isEmpty()) {
+		bBroadcastFlush = true;
+		QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::flushBroadcasts, this)));
+	}
+}
+
+void Server::flushBroadcasts() {
+	bBroadcastFlush = false;
+
+	foreach(unsigned int id, qsBroadcastPending) {
+		ServerUser *u = qhUsers.value(id);
+		if (u && u->hasQueued()) {
+			u->flushQueued();
+			++uiBroadcastWrites;
+		}
+	}
+	qsBroadcastPending.clear();
+}
+
+TextFanout::TextFanout() : iNext(0) {
+}
+
+// Recipients handed to sockets per event loop pass.
+static const int TEXT_FANOUT_SLICE = 256;
+// A socket with more than this waiting to be written gets no new text
+// messages until it catches up.
+static const qint64 TEXT_CONGESTED_BYTES = 256 * 1024;
+// Bytes of text messages kept for a congested user before further ones are
+// dropped.
+static const qint64 TEXT_BACKLOG_BYTES = 128 * 1024;
+// How often congested users are retried once nothing else is pending.
+static const int TEXT_RETRY_MSEC = 100;
+
+void Server::queueTextFanout(const QByteArray &frame, const QList<unsigned int> &sessions) {
+	if (sessions.isEmpty())
+		return;
+
+	TextFanout tf;
+	tf.qbaFrame = frame;
+	tf.qlSessions = sessions;
+	qqTextFanout.enqueue(tf);
+
+	// Nothing ahead of us, so the first slice can go out right away.
+	if (qqTextFanout.count() == 1)
+		processTextFanout();
+}
+
+// Per user, text messages stay in order: once one is held back, the ones
+// after it queue up behind it.
+void Server::deliverText(ServerUser *u, const QByteArray &frame) {
+	if (u->qqText.isEmpty() && (u->bytesToWrite() < TEXT_CONGESTED_BYTES)) {
+		u->sendMessage(frame);
+		return;
+	}
+
+	if (u->iTextBytes + frame.size() > TEXT_BACKLOG_BYTES) {
+		++uiTextDropped;
+		return;
+	}
+
+	u->qqText.enqueue(frame);
+	u->iTextBytes += frame.size();
+	qsTextBacklog.insert(u->uiSession);
+}
+
+void Server::sendTextBacklog(ServerUser *u, bool force) {
+	while (! u->qqText.isEmpty() && (force || (u->bytesToWrite() < TEXT_CONGESTED_BYTES))) {
+		const QByteArray frame = u->qqText.dequeue();
+		u->iTextBytes -= frame.size();
+		u->sendMessage(frame);
+	}
+}
+
+// Text that is still queued must reach its recipients before they are told
+// that the sender or channel it refers to is gone, so this finishes every
+// pending fan-out and empties every backlog, congested or not. The backlogs
+// are bounded, so this is bounded too.
+void Server::flushPendingText() {
+	while (! qqTextFanout.isEmpty()) {
+		TextFanout &tf = qqTextFanout.head();
+		while (tf.iNext < tf.qlSessions.count()) {
+			ServerUser *u = qhUsers.value(tf.qlSessions.at(tf.iNext++));
+			if (u && (u->sState == ServerUser::Authenticated)) {
+				sendTextBacklog(u, true);
+				u->sendMessage(tf.qbaFrame);
+			}
+		}
+		qqTextFanout.dequeue();
+	}
+
+	foreach(unsigned int id, qsTextBacklog) {
+		ServerUser *u = qhUsers.value(id);
+		if (u)
+			sendTextBacklog(u, true);
+	}
+	qsTextBacklog.clear();
+	qtTextRetry->stop();
+}
+
+void Server::drainTextBacklog() {
+	QSet<unsigned int>::iterator i = qsTextBacklog.begin();
+	while (i != qsTextBacklog.end()) {
+		ServerUser *u = qhUsers.value(*i);
+		if (u)
+			sendTextBacklog(u, false);
+		if (! u || u->qqText.isEmpty())
+			i = qsTextBacklog.erase(i);
+		else
+			++i;
+	}
+}
+
+void Server::processTextFanout() {
+	bTextFanout = false;
+
+	drainTextBacklog();
+
+	int budget = TEXT_FANOUT_SLICE;
+	while ((budget > 0) && ! qqTextFanout.isEmpty()) {
+		TextFanout &tf = qqTextFanout.head();
+		while ((budget > 0) && (tf.iNext < tf.qlSessions.count())) {
+			ServerUser *u = qhUsers.value(tf.qlSessions.at(tf.iNext++));
+			if (u && (u->sState == ServerUser::Authenticated))
+				deliverText(u, tf.qbaFrame);
+			--budget;
+		}
+		if (tf.iNext >= tf.qlSessions.count())
+			qqTextFanout.dequeue();
+	}
+
+	if (! qqTextFanout.isEmpty()) {
+		if (! bTextFanout) {
+			bTextFanout = true;
+			QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::processTextFanout, this)));
+		}
+	} else if (! qsTextBacklog.isEmpty()) {
+		if (! qtTextRetry->isActive())
+			qtTextRetry->start(TEXT_RETRY_MSEC);
+	}
+}
+
+// Every visible change to a user or channel is broadcast, so this is where
+// the pre-encoded join state learns what went stale.
+void Server::invalidateJoinState(const ::google::protobuf::Message &msg, unsigned int msgType) {
+	switch (msgType) {
+		case MessageHandler::UserState: {
+				const MumbleProto::UserState &mpus = static_cast<const MumbleProto::UserState &>(msg);
+				ServerUser *u = qhUsers.value(mpus.session());
+				if (u)
+					for (int i=0;i<3;++i)
+						u->qbaJoinState[i].clear();
+			}
+			break;
+		case MessageHandler::ChannelState: {
+				const MumbleProto::ChannelState &mpcs = static_cast<const MumbleProto::ChannelState &>(msg);
+				invalidateJoinChannel(mpcs.channel_id());
+				for (int i=0;i<mpcs.links_size();++i)
+					invalidateJoinChannel(mpcs.links(i));
+				for (int i=0;i<mpcs.links_add_size();++i)
+					invalidateJoinChannel(mpcs.links_add(i));
+				for (int i=0;i<mpcs.links_remove_size();++i)
+					invalidateJoinChannel(mpcs.links_remove(i));
+			}
+			break;
+		case MessageHandler::ChannelRemove:
+			invalidateJoinChannel(static_cast<const MumbleProto::ChannelRemove &>(msg).channel_id());
+			break;
+		default:
+			break;
+	}
+}
+
+void Server::invalidateJoinChannel(int id) {
+	for (int i=0;i<2;++i) {
+		qhJoinChannel[i].remove(id);
+		qbaJoinTree[i].clear();
+	}
+	qhJoinLinks.remove(id);
+}
+
+// The channel tree and its links as sent to a joining client, encoded
+// breadth first from the root. Only channels that changed since the last
+// join are re-encoded.
+const QByteArray &Server::joinTree(bool hashes) {
+	QByteArray &tree = qbaJoinTree[hashes ? 1 : 0];
+	if (! tree.isEmpty())
+		return tree;
+
+	QHash<int, QByteArray> &states = qhJoinChannel[hashes ? 1 : 0];
+	QQueue<Channel *> q;
+	QList<Channel *> chans;
+	MumbleProto::ChannelState mpcs;
+
+	q << qhChannels.value(0);
+	while (! q.isEmpty()) {
+		Channel *c = q.dequeue();
+		chans << c;
+
+		QByteArray &frame = states[c->iId];
+		if (frame.isEmpty()) {
+			mpcs.Clear();
+
+			mpcs.set_channel_id(c->iId);
+			if (c->cParent)
+				mpcs.set_parent(c->cParent->iId);
+			if (c->iId == 0)
+				mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
+			else
+				mpcs.set_name(u8(c->qsName));
+
+			mpcs.set_position(c->iPosition);
+
+			if (hashes && ! c->qbaDescHash.isEmpty())
+				mpcs.set_description_hash(blob(c->qbaDescHash));
+			else if (! c->qsDesc.isEmpty())
+				mpcs.set_description(u8(c->qsDesc));
+
+			ServerUser::messageToNetwork(mpcs, MessageHandler::ChannelState, frame);
+		}
+		tree.append(frame);
+
+		foreach(Channel *sub, c->qlChannels)
+			q.enqueue(sub);
+	}
+
+	foreach(Channel *c, chans) {
+		if (c->qhLinks.count() > 0) {
+			QByteArray &frame = qhJoinLinks[c->iId];
+			if (frame.isEmpty()) {
+				mpcs.Clear();
+				mpcs.set_channel_id(c->iId);
+
+				foreach(Channel *l, c->qhLinks.keys())
+					mpcs.add_links(l->iId);
+				ServerUser::messageToNetwork(mpcs, MessageHandler::ChannelState, frame);
+			}
+			tree.append(frame);
+		}
+	}
+
+	return tree;
+}
+
+// Appends the UserState of every other authenticated user, as uSource
+// should see it, to out.
+void Server::appendJoinUsers(QByteArray &out, ServerUser *uSource) {
+	// 0: 1.2.2 and later get hashes. 1: older clients get textures in the
+	// old 600x60 format inline. 2: other old clients.
+	int kind;
+	if (uSource->uiVersion >= 0x010202)
+		kind = 0;
+	else if (! legacyTexture(uSource).isEmpty())
+		kind = 1;
+	else
+		kind = 2;
+
+	MumbleProto::UserState mpus;
+
+	foreach(ServerUser *u, qhUsers) {
+		if (u->sState != ServerUser::Authenticated)
+			continue;
+
+		if (u == uSource)
+			continue;
+
+		QByteArray &frame = u->qbaJoinState[kind];
+		if (frame.isEmpty()) {
+			mpus.Clear();
+			mpus.set_session(u->uiSession);
+			mpus.set_name(u8(u->qsName));
+			if (u->iId >= 0)
+				mpus.set_user_id(u->iId);
+			if (kind == 0) {
+				if (! u->qbaTextureHash.isEmpty())
+					mpus.set_texture_hash(blob(u->qbaTextureHash));
+				else if (! u->qbaTexture.isEmpty())
+					mpus.set_texture(blob(u->qbaTexture));
+			} else if (kind == 1) {
+				const QByteArray &legacy = legacyTexture(u);
+				if (! legacy.isEmpty())
+					mpus.set_texture(blob(legacy));
+			}
+			if (u->cChannel->iId != 0)
+				mpus.set_channel_id(u->cChannel->iId);
+			if (u->bDeaf)
+				mpus.set_deaf(true);
+			else if (u->bMute)
+				mpus.set_mute(true);
+			if (u->bSuppress)
+				mpus.set_suppress(true);
+			if (u->bPrioritySpeaker)
+				mpus.set_priority_speaker(true);
+			if (u->bRecording)
+				mpus.set_recording(true);
+			if (u->bSelfDeaf)
+				mpus.set_self_deaf(true);
+			else if (u->bSelfMute)
+				mpus.set_self_mute(true);
+			if ((kind == 0) && ! u->qbaCommentHash.isEmpty())
+				mpus.set_comment_hash(blob(u->qbaCommentHash));
+			else if (! u->qsComment.isEmpty())
+				mpus.set_comment(u8(u->qsComment));
+			if (! u->qsHash.isEmpty())
+				mpus.set_hash(u8(u->qsHash));
+
+			ServerUser::messageToNetwork(mpus, MessageHandler::UserState, frame);
+		}
+		out.append(frame);
+	}
 }
 
 void Server::removeChannel(int id) {
@@ -1425,16 +3279,47 @@ void Server::removeChannel(int id) {
 }
 
 void Server::removeChannel(Channel *chan, Channel *dest) {
-	Channel *c;
-	User *p;
+	QList<Channel *> removed;
 
 	if (dest == NULL)
 		dest = chan->cParent;
 
+	removeChannelTree(chan, dest, removed);
+
+	// The channel index and the caches are brought up to date once for the
+	// whole subtree, not once per removed channel.
+	invalidateChannelIndex();
+
+	QSet<const Channel *> gone;
+	foreach(Channel *c, removed)
+		gone.insert(c);
+	refreshTargetCache(NULL, gone);
+
+	{
+		QMutexLocker qml(&qmCache);
+		foreach(Channel *c, removed)
+			forgetACLCache(c);
+	}
+
+	foreach(Channel *c, removed)
+		retireChannel(c);
+}
+
+// Removes chan and its subtree, children first, moving their users towards
+// dest. The removed channels are appended to removed; the caller rebuilds
+// the channel index and frees them.
+void Server::removeChannelTree(Channel *chan, Channel *dest, QList<Channel *> &removed) {
+	Channel *c;
+	User *p;
+
+	// The cached link frames of the channels linked to this one list it.
+	foreach(Channel *l, chan->qhLinks.keys())
+		invalidateJoinChannel(l->iId);
+	invalidateLinkedFanout(chan);
 	chan->unlink(NULL);
 
 	foreach(c, chan->qlChannels) {
-		removeChannel(c, dest);
+		removeChannelTree(c, dest, removed);
 	}
 
 	foreach(p, chan->qlUsers) {
@@ -1463,14 +3348,15 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 		QWriteLocker wl(&qrwlUsers);
 		chan->cParent->removeChannel(chan);
 	}
-
-	delete chan;
+	removed << chan;
 }
 
 bool Server::unregisterUser(int id) {
 	if (! unregisterUserDB(id))
 		return false;
 
+	QList<Channel *> changed;
+
 	{
 		QMutexLocker lock(&qmCache);
 
@@ -1489,11 +3375,16 @@ bool Server::unregisterUser(int id) {
 				bool remrem = g->qsRemove.remove(id);
 				write = write || addrem || remrem;
 			}
-			if (write)
+			if (write) {
 				updateChannel(c);
+				changed << c;
+			}
 		}
 	}
 
+	foreach(Channel *c, changed)
+		clearACLCache(c);
+
 	foreach(ServerUser *u, qhUsers) {
 		if (u->iId == id) {
 			clearACLCache(u);
@@ -1519,7 +3410,8 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 		QWriteLocker wl(&qrwlUsers);
 		c->addUser(p);
 
-		bool mayspeak = ChanACL::hasPermission(static_cast<ServerUser *>(p), c, ChanACL::Speak, NULL);
+		QMutexLocker qml(&qmCache);
+		bool mayspeak = ChanACL::hasPermission(static_cast<ServerUser *>(p), c, ChanACL::Speak, NULL, &ccCompiled);
 		bool sup = p->bSuppress;
 
 		if (mayspeak == sup) {
@@ -1528,6 +3420,7 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 			mpus.set_suppress(p->bSuppress);
 		}
 	}
+	publishSnapshot();
 
 	clearACLCache(p);
 	setLastChannel(p);
@@ -1543,12 +3436,12 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 
 bool Server::hasPermission(ServerUser *p, Channel *c, QFlags<ChanACL::Perm> perm) {
 	QMutexLocker qml(&qmCache);
-	return ChanACL::hasPermission(p, c, perm, &acCache);
+	return ChanACL::hasPermission(p, c, perm, &acCache, &ccCompiled, &csACL);
 }
 
 QFlags<ChanACL::Perm> Server::effectivePermissions(ServerUser *p, Channel *c) {
 	QMutexLocker qml(&qmCache);
-	return ChanACL::effectivePermissions(p, c, &acCache);
+	return ChanACL::effectivePermissions(p, c, &acCache, &ccCompiled, &csACL);
 }
 
 void Server::sendClientPermission(ServerUser *u, Channel *c, bool forceupdate) {
@@ -1559,7 +3452,7 @@ void Server::sendClientPermission(ServerUser *u, Channel *c, bool forceupdate) {
 
 	{
 		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
+		ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache, &ccCompiled, &csACL);
 		perm = acCache.value(u)->value(c);
 	}
 
@@ -1593,7 +3486,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		if (! c) {
 			match = false;
 		} else {
-			ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
+			ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache, &ccCompiled, &csACL);
 			unsigned int perm = acCache.value(u)->value(c);
 			if (perm != i.value())
 				match = false;
@@ -1611,7 +3504,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		u->iLastPermissionCheck = c->iId;
 	}
 
-	ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
+	ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache, &ccCompiled, &csACL);
 	unsigned int perm = acCache.value(u)->value(c);
 	u->qmPermissionSent.insert(c->iId, perm);
 
@@ -1639,18 +3532,105 @@ void Server::clearACLCache(User *p) {
 				delete h;
 			acCache.clear();
 
+			qDeleteAll(ccCompiled);
+			ccCompiled.clear();
+
 			foreach(ServerUser *u, qhUsers)
 				if (u->sState == ServerUser::Authenticated)
 					flushClientPermissionCache(u, mppq);
 		}
 	}
 
+	if (p) {
+		refreshTargetCache(p, QSet<const Channel *>());
+
+		// Only p's own permissions changed, so only its fan-out can differ.
+		static_cast<ServerUser *>(p)->qlSpeakDeps.clear();
+		publishSnapshot();
+	} else {
+		// Resolved again rather than dropped, so whispers aren't lost
+		// while voice threads wait for them.
+		foreach(ServerUser *u, qhUsers) {
+			QMap<int, WhisperTargetCache>::iterator i;
+			for (i = u->qmTargetCache.begin(); i != u->qmTargetCache.end(); ++i) {
+				WhisperTargetCache cache;
+				resolveTarget(u, i.key(), cache);
+				i.value() = cache;
+			}
+		}
+
+		foreach(Channel *c, qhChannels)
+			invalidateFanout(c);
+	}
+}
+
+// Drop the cached permissions of c and everything below it, for use when
+// the ACLs, groups or position of c change. Users whose permissions
+// elsewhere in the tree are unaffected keep their cache.
+void Server::clearACLCache(Channel *c) {
+	MumbleProto::PermissionQuery mppq;
+
+	const ChannelIndex &ci = *currentSnapshot()->qspChannels;
+	int pos = ci.position(c);
+
+	QSet<const Channel *> subtree;
+	QSet<int> ids;
+	subtree.insert(c);
+	ids.insert(c->iId);
+	if (pos != -1)
+		for (int i = pos + 1; i < ci.qvEnd.at(pos); ++i) {
+			subtree.insert(ci.qvChannels.at(i));
+			ids.insert(ci.qvChannels.at(i)->iId);
+		}
+
 	{
-		QWriteLocker lock(&qrwlUsers);
+		QMutexLocker qml(&qmCache);
+
+		foreach(const Channel *sc, subtree)
+			forgetACLCache(sc);
+
+		// Permissions outside the subtree can't have changed, so only
+		// clients that were sent one for a channel inside it are checked.
+		foreach(ServerUser *u, qhUsers) {
+			if (u->sState != ServerUser::Authenticated)
+				continue;
 
-		foreach(ServerUser *u, qhUsers)
-			u->qmTargetCache.clear();
+			QMap<int, unsigned int>::const_iterator i;
+			for (i = u->qmPermissionSent.constBegin(); i != u->qmPermissionSent.constEnd(); ++i) {
+				if (ids.contains(i.key())) {
+					flushClientPermissionCache(u, mppq);
+					break;
+				}
+			}
+		}
 	}
+
+	refreshTargetCache(NULL, subtree);
+
+	// Speak permissions are only checked on linked channels.
+	foreach(const Channel *sc, subtree)
+		if (! sc->qhLinks.isEmpty())
+			invalidateLinkedFanout(const_cast<Channel *>(sc));
+}
+
+// For when c has been moved. Besides everything below c, the users in it
+// now sit somewhere else in the tree, and "sub" groups on channels outside
+// the subtree may take them in or leave them out, so their whole cache goes.
+void Server::clearMovedACLCache(Channel *c) {
+	clearACLCache(c);
+
+	const ChannelIndex &ci = *currentSnapshot()->qspChannels;
+	foreach(ServerUser *u, qhUsers)
+		if ((u->sState == ServerUser::Authenticated) && u->cChannel && ci.isInSubtree(c, u->cChannel))
+			clearACLCache(u);
+}
+
+// Remove every cache entry keyed on c. Assumes qmCache is held.
+void Server::forgetACLCache(const Channel *c) {
+	delete ccCompiled.take(c);
+
+	foreach(ChanACL::ChanCache *h, acCache)
+		h->remove(const_cast<Channel *>(c));
 }
 
 QString Server::addressToString(const QHostAddress &adr, unsigned short port) {
@@ -1763,20 +3743,36 @@ void Server::recheckCodecVersions(ServerUser *connectingUser) {
 	log(QString::fromLatin1("CELT codec switch %1 %2 (prefer %3) (Opus %4)").arg(iCodecAlpha,0,16).arg(iCodecBeta,0,16).arg(bPreferAlpha ? iCodecAlpha : iCodecBeta,0,16).arg(bOpus));
 }
 
+// Anything large enough to be sent by hash is shared through the blob
+// store, so identical blobs on different users and servers are kept once.
 void Server::hashAssign(QString &dest, QByteArray &hash, const QString &src) {
-	dest = src;
-	if (src.length() >= 128)
+	if (src.length() >= 128) {
 		hash = sha1(src);
-	else
+		dest = meta->bsBlobs->intern(hash, src);
+	} else {
+		dest = src;
 		hash = QByteArray();
+	}
 }
 
 void Server::hashAssign(QByteArray &dest, QByteArray &hash, const QByteArray &src) {
-	dest = src;
-	if (src.length() >= 128)
+	if (src.length() >= 128) {
 		hash = sha1(src);
-	else
+		dest = meta->bsBlobs->intern(hash, src);
+	} else {
+		dest = src;
 		hash = QByteArray();
+	}
+}
+
+// The texture of u as clients before 1.2.2 understand it, or an empty
+// array if they can't show it.
+QByteArray Server::legacyTexture(const ServerUser *u) {
+	if (u->qbaTexture.isEmpty())
+		return QByteArray();
+	if (! u->qbaTextureHash.isEmpty())
+		return meta->bsBlobs->legacyTexture(u->qbaTextureHash, u->qbaTexture);
+	return LegacyTexture::toLegacy(u->qbaTexture);
 }
 
 bool Server::isTextAllowed(QString &text, bool &changed) {
@@ -1826,41 +3822,19 @@ bool Server::isTextAllowed(QString &text, bool &changed) {
 		if (! text.contains(QLatin1Char('<')))
 			return false;
 
-		// Strip value from <img>s src attributes to check text-length only -
-		// we already ensured the img-length requirement is met
-		QString qsOut;
-		QXmlStreamReader qxsr(QString::fromLatin1("<document>%1</document>").arg(text));
-		QXmlStreamWriter qxsw(&qsOut);
-		while (! qxsr.atEnd()) {
-			switch (qxsr.readNext()) {
-				case QXmlStreamReader::Invalid:
-					return false;
-				case QXmlStreamReader::StartElement: {
-						if (qxsr.name() == QLatin1String("img")) {
-							qxsw.writeStartElement(qxsr.namespaceUri().toString(), qxsr.name().toString());
-							foreach(const QXmlStreamAttribute &a, qxsr.attributes())
-								if (a.name() != QLatin1String("src"))
-									qxsw.writeAttribute(a);
-						} else {
-							qxsw.writeCurrentToken(qxsr);
-						}
-					}
-					break;
-				default:
-					qxsw.writeCurrentToken(qxsr);
-					break;
-			}
-		}
-
-		length = qsOut.length();
-
-		return (length <= iMaxTextMessageLength);
+		// Count everything but <img> src values in one pass; the image
+		// limit was already checked above.
+		return TextValidator::check(text, iMaxTextMessageLength) == TextValidator::Valid;
 	}
 }
 
-bool Server::canNest(Channel *newParent, Channel *channel) const {
-	const int parentLevel = newParent ? newParent->getLevel() : -1;
-	const int channelDepth = channel ? channel->getDepth() : 0;
+bool Server::canNest(Channel *newParent, Channel *channel) {
+	const ChannelIndex &ci = *currentSnapshot()->qspChannels;
+	const int ppos = newParent ? ci.position(newParent) : -1;
+	const int cpos = channel ? ci.position(channel) : -1;
+
+	const int parentLevel = (ppos != -1) ? ci.qvLevel.at(ppos) : -1;
+	const int channelDepth = (cpos != -1) ? ci.qvHeight.at(cpos) : 0;
 
 	return (parentLevel + channelDepth) < iChannelNestingLimit;
 }
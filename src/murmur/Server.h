@@ -36,15 +36,19 @@
 # include <boost/function.hpp>
 #endif
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
 #include <QtCore/QEvent>
 #include <QtCore/QMutex>
 #include <QtCore/QTimer>
 #include <QtCore/QQueue>
 #include <QtCore/QReadWriteLock>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QStringList>
 #include <QtCore/QSocketNotifier>
 #include <QtCore/QThread>
 #include <QtCore/QUrl>
+#include <QtCore/QVector>
 #include <QtNetwork/QSslCertificate>
 #include <QtNetwork/QSslKey>
 #include <QtNetwork/QSslSocket>
@@ -54,17 +58,23 @@
 #endif
 
 #include "ACL.h"
+#include "BanIndex.h"
 #include "Message.h"
+#include "MessageFrame.h"
+#include "Metrics.h"
 #include "Mumble.pb.h"
 #include "Net.h"
 #include "User.h"
+#include "ServerUser.h"
 #include "Timer.h"
 
 class BonjourServer;
 class Channel;
 class PacketDataStream;
+class Server;
 class ServerUser;
 class User;
+struct WhisperTargetCache;
 class QNetworkAccessManager;
 
 struct TextMessage {
@@ -97,15 +107,233 @@ class SslServer : public QTcpServer {
 		SslServer(QObject *parent = NULL);
 };
 
+// Runs TLS server handshakes on one thread of the HandshakePool. Sockets are
+// moved to this object's thread for the duration of the handshake, and
+// moved back to the main thread before finished() is emitted.
+class HandshakeWorker : public QObject {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(HandshakeWorker)
+	protected:
+		QHash<QSslSocket *, Timer> qhStarted;
+		QHash<QSslSocket *, bool> qhVerified;
+		QTimer *qtTimeout;
+		void fail(QSslSocket *, const QString &reason);
+	public:
+		HandshakeWorker();
+	public slots:
+		void start(QSslSocket *);
+	protected slots:
+		void encrypted();
+		void sslErrors(const QList<QSslError> &);
+		void socketError(QAbstractSocket::SocketError);
+		void checkTimeout();
+		void release(QSslSocket *, bool ok, const QString &reason);
+	signals:
+		void finished(QSslSocket *, bool ok, bool verified, const QString &reason);
+};
+
+// Shared by all virtual servers, lives on the main thread. Admits new
+// connections against the per address and total handshake limits and spreads
+// them over the worker threads; completed handshakes are handed back to the
+// Server that accepted them, on whatever thread that server runs.
+class HandshakePool : public QObject {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(HandshakePool)
+	protected:
+		struct Pending {
+			Server *s;
+			HostAddress ha;
+			QString qsPeer;
+			int iThread;
+		};
+		QList<QThread *> qlThreads;
+		QList<HandshakeWorker *> qlWorkers;
+		QList<int> qlLoad;
+		QHash<QSslSocket *, Pending> qhPending;
+		QHash<HostAddress, int> qhPerAddress;
+		// Completed handshakes posted to a server on a control thread, but
+		// not yet picked up by it.
+		QHash<QSslSocket *, Server *> qhDelivering;
+		mutable QMutex qmPending;
+		void deliver(QSslSocket *, const HostAddress &, const QString &peer, bool ok, bool verified, const QString &reason);
+	public:
+		HandshakePool(QObject *parent = NULL);
+		~HandshakePool();
+		bool start(Server *, QSslSocket *, const HostAddress &, const QString &peer);
+		void forget(Server *);
+		int pending() const;
+	protected slots:
+		void finished(QSslSocket *, bool ok, bool verified, const QString &reason);
+};
+
 #define EXEC_QEVENT (QEvent::User + 959)
 
+// Counters for the batched UDP I/O of the voice thread. Only the voice thread
+// touches the live ones; other threads read the copy it publishes.
+struct UDPBatchStats {
+	quint64 uiRecvCalls;
+	quint64 uiRecvPackets;
+	quint64 uiRecvMax;
+	quint64 uiSendCalls;
+	quint64 uiSendPackets;
+	quint64 uiSendMax;
+	UDPBatchStats();
+};
+
+struct UDPSendBatch;
+
+// The counters of a voice thread that statistics are built from.
+struct VoiceStats {
+	UDPBatchStats ubsStats;
+	quint64 uiTunnelPackets;
+	quint64 uiTunnelDropped;
+	VoiceCounters vcCounters;
+	VoiceStats();
+};
+
+// State of a single voice thread. Apart from qaiEpoch and the published
+// counters, only that thread touches it.
+struct VoiceThreadState {
+	enum { PublishMsec = 100 };
+
+	// Outgoing datagram queues, one per UDP socket. Empty unless batched I/O is enabled.
+	QList<UDPSendBatch *> qlSendBatch;
+	UDPBatchStats ubsStats;
+	// Sessions whose TCP tunnel ring got its first packet during this batch.
+	QList<unsigned int> qlTunnelPending;
+	quint64 uiTunnelPackets;
+	quint64 uiTunnelDropped;
+	VoiceCounters vcCounters;
+	// Snapshot epoch seen when the current batch of datagrams started, or 0
+	// while the thread is blocked waiting for input. Written by the voice
+	// thread, read by the main thread to decide what may be freed.
+	QAtomicInt qaiEpoch;
+
+	// Unknown peers this thread matched to a user by trial decryption and
+	// asked the main thread to register, until a snapshot has them.
+	struct PendingPeer {
+		unsigned int uiSession;
+		Timer tPosted;
+	};
+	QHash<QPair<HostAddress, quint16>, PendingPeer> qhPendingPeers;
+
+	// Copy of the counters above for other threads, so they never read
+	// half-updated values. The voice thread refreshes it at most every
+	// PublishMsec while busy, and once more when it goes quiet.
+	mutable QMutex qmPublished;
+	VoiceStats vsPublished;
+	Timer tPublished;
+	bool bUnpublished;
+
+	VoiceThreadState();
+	// Voice thread only. Called after handling a batch of datagrams.
+	void publish(bool force = false);
+	// Voice thread only. How long to block waiting for input, in
+	// milliseconds, so that the last counters get published; -1 if there
+	// is nothing to publish.
+	int publishTimeout() const;
+	VoiceStats published() const;
+};
+
+// A text message encoded once and the sessions it still has to go to.
+// Server::processTextFanout works through these in order, a slice per pass.
+struct TextFanout {
+	QByteArray qbaFrame;
+	QList<unsigned int> qlSessions;
+	int iNext;
+	TextFanout();
+};
+
+// Flat copy of the channel tree, numbered in depth first order. The subtree
+// of the channel at position i is the range [i, qvEnd[i]), so "is c below p"
+// is a range check and everything below a channel is a linear scan.
+// Rebuilt by the main thread whenever channels are added, moved or removed.
+struct ChannelIndex {
+	QVector<Channel *> qvChannels;
+	QVector<int> qvParent;
+	QVector<int> qvFirstChild;
+	QVector<int> qvNextSibling;
+	QVector<int> qvEnd;
+	QVector<int> qvLevel;
+	QVector<int> qvHeight;
+	QHash<const Channel *, int> qhPosition;
+
+	ChannelIndex(Channel *root);
+	int position(const Channel *c) const;
+	bool isInSubtree(const Channel *root, const Channel *c) const;
+	private:
+		int add(Channel *c, int parent, int level);
+};
+
+// Read-only copy of the user tables the voice threads need to route a
+// datagram. The main thread publishes a new one whenever users connect,
+// disconnect, change channel or get a UDP peer address, or when links or
+// ACLs change who hears whom, so voice threads can look up senders and
+// listeners without taking qrwlUsers or checking permissions.
+struct UserSnapshot {
+	int iUsers;
+	QHash<QPair<HostAddress, quint16>, ServerUser *> qhPeerUsers;
+	QHash<HostAddress, QSet<ServerUser *> > qhHostUsers;
+	// Shared between snapshots until the channel tree changes.
+	QSharedPointer<const ChannelIndex> qspChannels;
+	// Users by ChannelIndex position.
+	QVector<QList<ServerUser *> > qvChannelUsers;
+	QList<ServerUser *> channelUsers(const Channel *c) const;
+	// Who hears normal speech from each authenticated user.
+	QHash<const ServerUser *, ServerUser::SpeakCache> qhSpeak;
+	// Copies of ServerUser::qmTargetCache, for users that have any.
+	QHash<const ServerUser *, QMap<int, WhisperTargetCache> > qhTargets;
+};
+
+// A snapshot replaced at iEpoch, together with the users and channels that
+// were gone by the time its successor was published. Voice threads that
+// entered an older epoch may still hold any of them, so they are freed
+// together once none of those threads is left.
+struct RetiredSnapshot {
+	int iEpoch;
+	UserSnapshot *usSnapshot;
+	QList<ServerUser *> qlUsers;
+	QList<Channel *> qlChannels;
+};
+
+class Server;
+
+// Additional voice thread of a virtual server. It owns one SO_REUSEPORT UDP
+// socket per bind address of the server, so the kernel shards incoming voice
+// by source address and port across all voice threads. Only available on Linux.
+class VoiceThread : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(VoiceThread)
+	protected:
+		Server *s;
+		void run();
+	public:
+		int aiNotify[2];
+		QList<int> qlUdpSocket;
+		VoiceThreadState vts;
+
+		bool bValid;
+
+		VoiceThread(Server *srv);
+		~VoiceThread();
+		void startThread();
+		void stopThread();
+};
+
 class ExecEvent : public QEvent {
 		Q_DISABLE_COPY(ExecEvent);
 	protected:
 		boost::function<void ()> func;
 	public:
-		ExecEvent(boost::function<void ()>);
+		// Virtual server the call is for, or -1. RPC layers use this to pass
+		// the call on to the thread that server runs on.
+		int iServer;
+		ExecEvent(boost::function<void ()>, int server = -1);
 		void execute();
+		const boost::function<void ()> &function() const;
 };
 
 class Server : public QThread {
@@ -130,6 +358,7 @@ class Server : public QThread {
 		unsigned short usPort;
 		int iTimeout;
 		int iMaxBandwidth;
+		int iMaxBandwidthBurst;
 		int iMaxUsers;
 		int iMaxUsersPerChannel;
 		int iDefaultChan;
@@ -141,6 +370,7 @@ class Server : public QThread {
 		QString qsPassword;
 		QString qsWelcomeText;
 		bool bCertRequired;
+		int iVoiceThreads;
 
 		QString qsRegName;
 		QString qsRegPassword;
@@ -195,19 +425,30 @@ class Server : public QThread {
 		void initializeCert();
 		const QString getDigest() const;
 
+		// TLS handshakes happen on the HandshakePool's threads.
+		static bool checkSslErrors(const QList<QSslError> &, bool &verified, QString &reason);
+		void handshakeFinished(QSslSocket *, const HostAddress &, const QString &peer, bool ok, bool verified, const QString &reason);
+		void encrypted(ServerUser *);
+
+		// Control thread handling, see MetaParams::iControlThreads.
+		void moveControlThread(QThread *);
+		void returnToMainThread();
+	protected slots:
+		void moveToMainThread();
+		void processTextFanout();
+		void rotateLatencyWindow();
+		void reclaimSnapshots();
+
 	public slots:
 		void newClient();
 		void connectionClosed(QAbstractSocket::SocketError, const QString &);
 		void sslError(const QList<QSslError> &);
 		void message(unsigned int, const QByteArray &, ServerUser *cCon = NULL);
 		void checkTimeout();
-		void tcpTransmitData(QByteArray, unsigned int);
 		void doSync(unsigned int);
-		void encrypted();
 		void udpActivated(int);
 	signals:
 		void reqSync(unsigned int);
-		void tcpTransmit(QByteArray, unsigned int id);
 	public:
 		int iServerNum;
 		QQueue<int> qqIds;
@@ -224,22 +465,114 @@ class Server : public QThread {
 		quint32 uiVersionBlob;
 		QList<QSocketNotifier *> qlUdpNotifier;
 
+		VoiceThreadState vtsMain;
+		QList<VoiceThread *> qlVoiceThreads;
+		VoiceThreadState *currentVoiceThreadState();
+
+		QAtomicPointer<UserSnapshot> qapSnapshot;
+		QAtomicInt qaiSnapshotEpoch;
+		QList<RetiredSnapshot> qlRetiredSnapshots;
+		QList<ServerUser *> qlRetiringUsers;
+		QList<Channel *> qlRetiringChannels;
+		QTimer *qtReclaim;
+		const UserSnapshot *currentSnapshot();
+		void enterSnapshot(VoiceThreadState *vts);
+		void leaveSnapshot(VoiceThreadState *vts);
+		int oldestSnapshotEpoch();
+		bool bChannelIndexDirty;
+		bool bSnapshotPending;
+		void invalidateChannelIndex();
+		void publishSnapshot();
+		void flushSnapshot();
+		void rebuildSnapshot();
+		void retireUser(ServerUser *u);
+		void retireChannel(Channel *c);
+
+		QAtomicInt qaiFanoutGeneration;
+		int fanoutGeneration(Channel *c);
+		void bumpFanout(Channel *c);
+		void invalidateFanout(Channel *c);
+		void invalidateLinkedFanout(Channel *c);
+		void speakFanout(ServerUser *u, Channel *c, const UserSnapshot *snap);
+		bool speakFanoutValid(ServerUser *u, Channel *c);
+		void resolveTarget(ServerUser *u, int target, WhisperTargetCache &cache);
+		void requestTarget(ServerUser *u, int target);
+		void fillTarget(unsigned int session, int target);
+		// Sessions whose target requests are cleared by the next snapshot.
+		QList<unsigned int> qlTargetRequests;
+		void refreshTargetCache(User *changed, const QSet<const Channel *> &channels);
+
 		QHash<unsigned int, ServerUser *> qhUsers;
 		QHash<QPair<HostAddress, quint16>, ServerUser *> qhPeerUsers;
 		QHash<HostAddress, QSet<ServerUser *> > qhHostUsers;
 		QHash<unsigned int, Channel *> qhChannels;
 		QReadWriteLock qrwlUsers;
 		ChanACL::ACLCache acCache;
+		ChanACL::CompiledCache ccCompiled;
+		ChanACL::CacheStats csACL;
 		QMutex qmCache;
-		QHash<int, QString> qhUserNameCache;
-		QHash<QString, int> qhUserIDCache;
+		// Pre-encoded ChannelState messages sent to joining clients, by
+		// channel id, for pre-1.2.2 clients ([0]) and later ones ([1]), and
+		// the whole tree assembled from them. Entries are dropped whenever a
+		// ChannelState or ChannelRemove for that channel is broadcast.
+		QHash<int, QByteArray> qhJoinChannel[2];
+		QHash<int, QByteArray> qhJoinLinks;
+		QByteArray qbaJoinTree[2];
+		const QByteArray &joinTree(bool hashes);
+		void appendJoinUsers(QByteArray &out, ServerUser *uSource);
+		void invalidateJoinChannel(int id);
+		void invalidateJoinState(const ::google::protobuf::Message &msg, unsigned int msgType);
+
+		// Bounded LRU caches of registered user lookups; see Server::Server().
+		QCache<int, QString> qhUserNameCache;
+		QCache<QString, int> qhUserIDCache;
+		QCache<QString, int> qhUserHashCache;
+		// The certificate hash cached for each user id, so a user's entry can
+		// be dropped without scanning qhUserHashCache. Entries the cache has
+		// since evicted linger until the index is pruned.
+		QHash<int, QString> qhUserHashIndex;
+		void cacheUserHash(const QString &hash, int id);
+		void forgetUserHash(int id);
+		// SHA1 of registered users' textures, empty for none; the data
+		// itself is looked up in Meta::bsBlobs.
+		QCache<int, QByteArray> qhUserTextureCache;
 
 		QList<Ban> qlBans;
+		// Rebuilt from qlBans by getBans() and saveBans().
+		BanIndex biBans;
 
-		void processMsg(ServerUser *u, const char *data, int len);
+		bool preparePingReply(char *data, int len);
+#ifdef Q_OS_UNIX
+		void processDatagram(int sock, const char *encrypt, int len, const struct sockaddr_storage &from, VoiceThreadState *vts);
+#else
+		void processDatagram(SOCKET sock, const char *encrypt, int len, const struct sockaddr_storage &from, VoiceThreadState *vts);
+#endif
+#ifdef Q_OS_UNIX
+		void registerPeer(unsigned int uiSession, int sock, const struct sockaddr_storage &from);
+#else
+		void registerPeer(unsigned int uiSession, SOCKET sock, const struct sockaddr_storage &from);
+#endif
+		void processMsg(ServerUser *u, const char *data, int len, VoiceCounters &vc);
 		void sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force = false);
+		void flushSendBatches(VoiceThreadState *vts);
+		void flushTunnels(VoiceThreadState *vts);
+		void drainTunnels(const QList<unsigned int> &sessions);
 		void run();
 
+		QMap<QString, qint64> getStatistics() const;
+
+		// Metrics kept on the control thread: tunneled voice, handling time
+		// per message type, and the crypt statistics of users who left.
+		enum { MessageTypes = 0
+#define MUMBLE_MH_MSG(x) + 1
+		        MUMBLE_MH_ALL
+#undef MUMBLE_MH_MSG
+		     };
+		VoiceCounters vcControl;
+		Histogram hMessageTime[MessageTypes];
+		CryptCounters ccRetired;
+		void collectMetrics(QSharedPointer<MetricsScrape> ms);
+
 		bool validateChannelName(const QString &name);
 		bool validateUserName(const QString &name);
 
@@ -250,10 +583,43 @@ class Server : public QThread {
 		void sendClientPermission(ServerUser *u, Channel *c, bool updatelast = false);
 		void flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQuery &mpqq);
 		void clearACLCache(User *p = NULL);
-
+		void clearACLCache(Channel *c);
+		void clearMovedACLCache(Channel *c);
+		void forgetACLCache(const Channel *c);
+
+		// Encoding buffer for sendProto*; only used on the server's own thread.
+		MessageFrame mfSend;
+
+		// Broadcasts are queued per recipient and written once per event
+		// loop pass, so a storm of state changes becomes one write per user.
+		QSet<unsigned int> qsBroadcastPending;
+		bool bBroadcastFlush;
+		quint64 uiBroadcastMessages;
+		quint64 uiBroadcastWrites;
+		void flushBroadcasts();
+
+		// Text message delivery, see msgTextMessage.
+		QQueue<TextFanout> qqTextFanout;
+		QSet<unsigned int> qsTextBacklog;
+		QTimer *qtTextRetry;
+		bool bTextFanout;
+		quint64 uiTextDropped;
+		void queueTextFanout(const QByteArray &frame, const QList<unsigned int> &sessions);
+		void deliverText(ServerUser *u, const QByteArray &frame);
+		void drainTextBacklog();
+		void sendTextBacklog(ServerUser *u, bool force);
+		void flushPendingText();
+
+		// Voice latency totals as of the last two turns of qtLatencyWindow,
+		// so getStatistics() can report percentiles over the last minute or
+		// two rather than since startup. Only kept with voicetrace enabled.
+		LatencyHistogram lhQueueWindow[2], lhRelayWindow[2];
+		QTimer *qtLatencyWindow;
+		void voiceLatency(LatencyHistogram &queue, LatencyHistogram &relay) const;
 		void sendProtoAll(const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
 		void sendProtoExcept(ServerUser *, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
 		void sendProtoMessage(ServerUser *, const ::google::protobuf::Message &msg, unsigned int msgType);
+		void sendProtoMessage(ServerUser *, const ::google::protobuf::Message &msg, unsigned int msgType, const QByteArray &field);
 
 		// sendAll sends a protobuf message to all users on the server whose version is either bigger than v or
 		// lower than ~v. If v == 0 the message is sent to everyone.
@@ -267,6 +633,7 @@ class Server : public QThread {
 
 		static void hashAssign(QString &destination, QByteArray &hash, const QString &str);
 		static void hashAssign(QByteArray &destination, QByteArray &hash, const QByteArray &source);
+		static QByteArray legacyTexture(const ServerUser *u);
 		bool isTextAllowed(QString &str, bool &changed);
 
 		void setLiveConf(const QString &key, const QString &value);
@@ -278,13 +645,14 @@ class Server : public QThread {
 
 		void removeChannel(int id);
 		void removeChannel(Channel *c, Channel *dest = NULL);
+		void removeChannelTree(Channel *c, Channel *dest, QList<Channel *> &removed);
 		void userEnterChannel(User *u, Channel *c, MumbleProto::UserState &mpus);
 		bool unregisterUser(int id);
 
 		Server(int snum, QObject *parent = NULL);
 		~Server();
 
-		bool canNest(Channel *newParent, Channel *channel = NULL) const;
+		bool canNest(Channel *newParent, Channel *channel = NULL);
 
 		// RPC functions. Implementation in RPC.cpp
 		void connectAuthenticator(QObject *p);
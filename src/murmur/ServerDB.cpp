@@ -33,10 +33,12 @@
 #include "ServerDB.h"
 
 #include "ACL.h"
+#include "BlobStore.h"
 #include "Channel.h"
 #include "Connection.h"
 #include "DBus.h"
 #include "Group.h"
+#include "LegacyTexture.h"
 #include "Meta.h"
 #include "Server.h"
 #include "ServerUser.h"
@@ -49,28 +51,82 @@
 #define SQLEXECBATCH() ServerDB::execBatch(query)
 #define SOFTEXEC() ServerDB::exec(query, QString(), false)
 
+// Only last channel updates and log lines are written behind (see
+// ServerDBWorker). Everything else here runs synchronously on the calling
+// server's control thread inside a TransactionHolder, and on SQLite waits
+// for qmSQLite while the worker commits a chunk. On the connect path that
+// is Server::authenticate, Server::getRegistration and
+// Server::getUserTexture; the first and last skip the database when their
+// caches have the answer.
 class TransactionHolder {
 	public:
 		QSqlQuery *qsqQuery;
+		QSqlDatabase *qsdDatabase;
+		QMutex *qmWrite;
 		TransactionHolder() {
-			ServerDB::db->transaction();
-			qsqQuery = new QSqlQuery();
+			lock();
+			qsdDatabase->transaction();
+			qsqQuery = new QSqlQuery(*qsdDatabase);
 		}
 
 		~TransactionHolder() {
 			qsqQuery->clear();
 			delete qsqQuery;
-			ServerDB::db->commit();
+			qsdDatabase->commit();
+			if (qmWrite)
+				qmWrite->unlock();
 		}
 		TransactionHolder(const TransactionHolder & other) {
-			ServerDB::db->transaction();
+			lock();
+			qsdDatabase->transaction();
 			qsqQuery = other.qsqQuery ? new QSqlQuery(*other.qsqQuery) : 0;
 		}
+	protected:
+		void lock() {
+			qmWrite = (ServerDB::dbwWorker && ServerDB::dbwWorker->bSQLite) ? &ServerDB::dbwWorker->qmSQLite : NULL;
+			if (qmWrite)
+				qmWrite->lock();
+			qsdDatabase = ServerDB::connection();
+		}
+};
+
+// A QSqlDatabase may only be used from the thread that opened it. Servers
+// running on control threads (see MetaParams::iControlThreads) each get a
+// connection of their own, closed again when the thread exits.
+class ThreadConnection {
+	public:
+		QString qsName;
+		QSqlDatabase qsdDatabase;
+		ThreadConnection(const QString &name) : qsName(name) {
+			qsdDatabase = ServerDB::addConnection(qsName);
+			if (! qsdDatabase.open())
+				qWarning("ServerDB: Failed to open connection %s: %s", qPrintable(qsName), qPrintable(qsdDatabase.lastError().text()));
+		}
+		~ThreadConnection() {
+			qsdDatabase.close();
+			qsdDatabase = QSqlDatabase();
+			QSqlDatabase::removeDatabase(qsName);
+		}
 };
 
+static QThreadStorage<ThreadConnection *> qtsConnection;
+static QAtomicInt qaiConnection;
+
+// Query latency for the metrics, from every thread that talks to the database.
+static Histogram hQueryTime;
+static QMutex qmQueryTime;
+
+static void recordQueryTime(const Timer &t) {
+	const quint64 usec = t.elapsed();
+	QMutexLocker lock(&qmQueryTime);
+	hQueryTime.add(usec);
+}
+
 QSqlDatabase *ServerDB::db = NULL;
+ServerDBWorker *ServerDB::dbwWorker = NULL;
 Timer ServerDB::tLogClean;
 QString ServerDB::qsUpgradeSuffix;
+QString ServerDB::qsDatabaseName;
 
 ServerDB::ServerDB() {
 	if (! QSqlDatabase::isDriverAvailable(Meta::mp.qsDBDriver)) {
@@ -216,6 +272,8 @@ ServerDB::ServerDB() {
 				SQLDO("DROP INDEX IF EXISTS `%1users_name`");
 				SQLDO("DROP INDEX IF EXISTS `%1users_id`");
 				SQLDO("DROP INDEX IF EXISTS `%1user_info_id`");
+				SQLDO("DROP INDEX IF EXISTS `%1users_name_nocase`");
+				SQLDO("DROP INDEX IF EXISTS `%1user_info_value`");
 				SQLDO("DROP INDEX IF EXISTS `%1groups_name_channels`");
 				SQLDO("DROP INDEX IF EXISTS `%1acl_channel_pri`");
 			}
@@ -465,17 +523,384 @@ ServerDB::ServerDB() {
 			SQLDO("UPDATE `%1meta` SET `value` = '5' WHERE `keystring` = 'version'");
 		}
 	}
+
+	if (version < 6) {
+		// Case insensitive name lookups and certificate hash / email lookups
+		// used to scan the users and user_info tables on every login.
+		qWarning("Adding login lookup indexes...");
+		if (Meta::mp.qsDBDriver == "QSQLITE") {
+			SQLDO("CREATE INDEX IF NOT EXISTS `%1users_name_nocase` ON `%1users` (`server_id`, `name` COLLATE NOCASE)");
+			SQLDO("CREATE INDEX IF NOT EXISTS `%1user_info_value` ON `%1user_info` (`server_id`, `key`, `value`)");
+		} else {
+			SQLDO("ALTER TABLE `%1users` ADD COLUMN `lname` varchar(255) AS (LOWER(`name`)) STORED");
+			SQLDO("CREATE INDEX `%1users_lname` ON `%1users` (`server_id`, `lname`)");
+			SQLDO("CREATE INDEX `%1user_info_value` ON `%1user_info` (`server_id`, `key`, `value`(64))");
+		}
+		SQLDO("UPDATE `%1meta` SET `value` = '6' WHERE `keystring` = 'version'");
+	}
 	query.clear();
+
+	qsDatabaseName = db->databaseName();
+	dbwWorker = new ServerDBWorker();
 }
 
 ServerDB::~ServerDB() {
+	dbwWorker->stop();
+	delete dbwWorker;
+	dbwWorker = NULL;
+
 	db->close();
 	delete db;
 	db = NULL;
 }
 
+QSqlDatabase *ServerDB::connection() {
+	if (QThread::currentThread() == QCoreApplication::instance()->thread())
+		return db;
+
+	if (! qtsConnection.hasLocalData())
+		qtsConnection.setLocalData(new ThreadConnection(QString::fromLatin1("murmur_thread_%1").arg(qaiConnection.fetchAndAddRelaxed(1))));
+	return &qtsConnection.localData()->qsdDatabase;
+}
+
+// Returns an unopened connection with the same parameters as the main one.
+QSqlDatabase ServerDB::addConnection(const QString &name) {
+	QSqlDatabase sdb = QSqlDatabase::addDatabase(Meta::mp.qsDBDriver, name);
+	sdb.setDatabaseName(qsDatabaseName);
+	if (Meta::mp.qsDBDriver != "QSQLITE") {
+		sdb.setHostName(Meta::mp.qsDBHostName);
+		sdb.setPort(Meta::mp.iDBPort);
+		sdb.setUserName(Meta::mp.qsDBUserName);
+		sdb.setPassword(Meta::mp.qsDBPassword);
+		sdb.setConnectOptions(Meta::mp.qsDBOpts);
+	}
+	return sdb;
+}
+
+const int ServerDBWorker::iLogCapacity;
+const int ServerDBWorker::iLogBatch;
+const int ServerDBWorker::iPurgeChunk;
+
+ServerDBWorker::ServerDBWorker() : qmSQLite(QMutex::Recursive) {
+	bStop = false;
+	bFlush = false;
+	bPurging = false;
+	uiQueued = uiWritten = 0;
+	uiLogWritten = uiLogDropped = uiLogPurged = 0;
+	qvLog.resize(iLogCapacity);
+	iLogHead = iLogCount = 0;
+	bSQLite = (Meta::mp.qsDBDriver == "QSQLITE");
+	qsConnection = QLatin1String("murmur_dbworker");
+}
+
+ServerDBWorker::~ServerDBWorker() {
+	stop();
+}
+
+// The thread is started on first use rather than in the constructor, as
+// main() may still fork() to daemonize after opening the database.
+void ServerDBWorker::enqueued() {
+	++uiQueued;
+	if (! isRunning())
+		start(QThread::LowPriority);
+	else if (qhLastChannel.count() + iLogCount >= iLogBatch)
+		qwcQueue.wakeAll();
+}
+
+void ServerDBWorker::setLastChannel(int server_id, int user_id, int channel_id) {
+	QMutexLocker lock(&qmQueue);
+	if (bStop)
+		return;
+	qhLastChannel.insert(qMakePair(server_id, user_id), channel_id);
+	enqueued();
+}
+
+void ServerDBWorker::forgetLastChannel(int server_id, int user_id) {
+	QMutexLocker lock(&qmQueue);
+	qhLastChannel.remove(qMakePair(server_id, user_id));
+}
+
+bool ServerDBWorker::lastChannel(int server_id, int user_id, int &channel_id) {
+	QMutexLocker lock(&qmQueue);
+	const QPair<int, int> key(server_id, user_id);
+
+	QHash<QPair<int, int>, int>::const_iterator i = qhLastChannel.constFind(key);
+	if (i == qhLastChannel.constEnd()) {
+		i = qhLastChannelWriting.constFind(key);
+		if (i == qhLastChannelWriting.constEnd())
+			return false;
+	}
+	channel_id = i.value();
+	return true;
+}
+
+// Log lines go into a fixed size ring. If the database can't keep up (say,
+// during a connection flood) the oldest pending lines are overwritten and
+// counted instead of letting the queue grow without bound.
+void ServerDBWorker::log(int server_id, const QString &msg) {
+	QMutexLocker lock(&qmQueue);
+	if (bStop)
+		return;
+	if (iLogCount == iLogCapacity) {
+		qvLog[iLogHead] = qMakePair(server_id, msg);
+		iLogHead = (iLogHead + 1) % iLogCapacity;
+		++uiLogDropped;
+	} else {
+		qvLog[(iLogHead + iLogCount) % iLogCapacity] = qMakePair(server_id, msg);
+		++iLogCount;
+	}
+	enqueued();
+}
+
+void ServerDBWorker::getStatistics(QMap<QString, qint64> &stats) {
+	QMutexLocker lock(&qmQueue);
+	stats.insert(QLatin1String("db.log.pending"), iLogCount);
+	stats.insert(QLatin1String("db.log.written"), static_cast<qint64>(uiLogWritten));
+	stats.insert(QLatin1String("db.log.dropped"), static_cast<qint64>(uiLogDropped));
+	stats.insert(QLatin1String("db.log.purged"), static_cast<qint64>(uiLogPurged));
+	stats.insert(QLatin1String("db.lastchannel.pending"), qhLastChannel.count());
+}
+
+// Blocks until everything queued before the call has been committed. Must not
+// be called while holding a TransactionHolder.
+void ServerDBWorker::flush() {
+	QMutexLocker lock(&qmQueue);
+	const quint64 target = uiQueued;
+	if (uiWritten >= target || ! isRunning())
+		return;
+	bFlush = true;
+	qwcQueue.wakeAll();
+	while (uiWritten < target && isRunning())
+		qwcWritten.wait(&qmQueue, 100);
+}
+
+void ServerDBWorker::stop() {
+	{
+		QMutexLocker lock(&qmQueue);
+		bStop = true;
+		qwcQueue.wakeAll();
+	}
+	wait();
+}
+
+void ServerDBWorker::run() {
+	{
+		QSqlDatabase wdb = ServerDB::addConnection(qsConnection);
+
+		QMutexLocker lock(&qmQueue);
+		forever {
+			// Give writes a second to coalesce unless someone is waiting on them.
+			if (! bStop && ! bFlush) {
+				if (qhLastChannel.isEmpty() && (iLogCount == 0) && ! bPurging)
+					qwcQueue.wait(&qmQueue);
+				else
+					qwcQueue.wait(&qmQueue, 1000);
+			}
+
+			const quint64 target = uiQueued;
+			QList<QPair<int, QString> > log;
+			log.reserve(iLogCount);
+			for (int i = 0; i < iLogCount; ++i) {
+				QPair<int, QString> &l = qvLog[(iLogHead + i) % iLogCapacity];
+				log << l;
+				l.second = QString();
+			}
+			iLogHead = iLogCount = 0;
+			qhLastChannelWriting.swap(qhLastChannel);
+			bFlush = false;
+
+			if ((Meta::mp.iLogDays > 0) && ! bPurging && ServerDB::tLogClean.isElapsed(3600ULL * 1000000ULL))
+				bPurging = true;
+
+			if (! log.isEmpty() || ! qhLastChannelWriting.isEmpty()) {
+				const QHash<QPair<int, int>, int> lastchannel = qhLastChannelWriting;
+				lock.unlock();
+				int written = write(wdb, lastchannel, log);
+				lock.relock();
+				qhLastChannelWriting.clear();
+				uiLogWritten += written;
+			}
+
+			uiWritten = target;
+			qwcWritten.wakeAll();
+
+			if (bStop && qhLastChannel.isEmpty() && (iLogCount == 0))
+				break;
+
+			// Expire old log entries one chunk per pass, each in its own
+			// short transaction, so neither the main connection nor new
+			// inserts are held up behind a large delete.
+			if (bPurging) {
+				lock.unlock();
+				int purged = purge(wdb);
+				lock.relock();
+				if (purged >= 0)
+					uiLogPurged += purged;
+				if (purged < iPurgeChunk)
+					bPurging = false;
+			}
+		}
+		lock.unlock();
+
+		wdb.close();
+	}
+	QSqlDatabase::removeDatabase(qsConnection);
+}
+
+// Failures are never fatal here; at worst a log line or last channel is lost.
+bool ServerDBWorker::prepare(QSqlQuery &query, const QString &str) {
+	const QString q = str.contains(QLatin1String("%1")) ? str.arg(Meta::mp.qsDBPrefix) : str;
+	if (query.prepare(q))
+		return true;
+	qWarning("ServerDB: Worker SQL Prepare Error [%s]: %s", qPrintable(q), qPrintable(query.lastError().text()));
+	return false;
+}
+
+bool ServerDBWorker::exec(QSqlQuery &query, bool batch) {
+	if (batch ? query.execBatch() : query.exec())
+		return true;
+	qWarning("ServerDB: Worker SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
+	return false;
+}
+
+bool ServerDBWorker::reconnect(QSqlDatabase &wdb) {
+	if (wdb.isOpen() || wdb.open())
+		return true;
+	qWarning("ServerDB: Worker failed to connect: %s", qPrintable(wdb.lastError().text()));
+	return false;
+}
+
+// Returns the number of log lines written. Every statement of at most
+// iLogBatch rows is committed on its own, and on SQLite qmSQLite is only
+// held for that one, so a transaction on the main connection never waits
+// for more than one chunk however large the backlog is.
+int ServerDBWorker::write(QSqlDatabase &wdb, const QHash<QPair<int, int>, int> &lastchannel, const QList<QPair<int, QString> > &log) {
+	if (! reconnect(wdb)) {
+		QMutexLocker lock(&qmQueue);
+		uiLogDropped += log.count();
+		return 0;
+	}
+
+	bool ok = true;
+	int written = 0;
+
+	if (! lastchannel.isEmpty()) {
+		QString qstr;
+		if (bSQLite)
+			qstr = QLatin1String("UPDATE `%1users` SET `lastchannel`=? WHERE `server_id` = ? AND `user_id` = ?");
+		else
+			qstr = QLatin1String("UPDATE `%1users` SET `lastchannel`=?, `last_active` = now() WHERE `server_id` = ? AND `user_id` = ?");
+
+		QHash<QPair<int, int>, int>::const_iterator i = lastchannel.constBegin();
+		while (ok && (i != lastchannel.constEnd())) {
+			QVariantList channels, servers, users;
+			for (int n = 0; (n < iLogBatch) && (i != lastchannel.constEnd()); ++n, ++i) {
+				channels << i.value();
+				servers << i.key().first;
+				users << i.key().second;
+			}
+
+			{
+				QMutexLocker serialize(bSQLite ? &qmSQLite : NULL);
+				wdb.transaction();
+				QSqlQuery query(wdb);
+				ok = prepare(query, qstr);
+				if (ok) {
+					query.addBindValue(channels);
+					query.addBindValue(servers);
+					query.addBindValue(users);
+					ok = exec(query, true);
+				}
+				query.clear();
+				wdb.commit();
+			}
+			yieldWriter();
+		}
+	}
+
+	// One multi-row INSERT per iLogBatch lines. The full size statement is
+	// prepared once and reused; only the tail gets a statement of its own.
+	if (! log.isEmpty()) {
+		QSqlQuery insert(wdb);
+		int prepared = 0;
+		int offset = 0;
+		while (offset < log.count()) {
+			const int rows = qMin(iLogBatch, log.count() - offset);
+			{
+				QMutexLocker serialize(bSQLite ? &qmSQLite : NULL);
+				if (rows != prepared) {
+					QString qstr = QLatin1String("INSERT INTO `%1slog` (`server_id`, `msg`) VALUES (?,?)");
+					for (int i = 1; i < rows; ++i)
+						qstr.append(QLatin1String(",(?,?)"));
+					if (! prepare(insert, qstr)) {
+						ok = false;
+						break;
+					}
+					prepared = rows;
+				}
+				wdb.transaction();
+				for (int i = offset; i < offset + rows; ++i) {
+					insert.addBindValue(log.at(i).first);
+					insert.addBindValue(log.at(i).second);
+				}
+				if (exec(insert))
+					written += rows;
+				else
+					ok = false;
+				wdb.commit();
+			}
+			offset += rows;
+			yieldWriter();
+		}
+		insert.clear();
+
+		if (written < log.count()) {
+			QMutexLocker lock(&qmQueue);
+			uiLogDropped += log.count() - written;
+		}
+	}
+
+	// Reconnect on the next batch in case the server went away under us.
+	if (! ok)
+		wdb.close();
+
+	return written;
+}
+
+// Between chunks, let a thread waiting on qmSQLite have it before the next
+// chunk takes it again.
+void ServerDBWorker::yieldWriter() {
+	if (bSQLite)
+		yieldCurrentThread();
+}
+
+// Deletes at most iPurgeChunk expired log entries. Returns the number of
+// rows removed, or -1 on error.
+int ServerDBWorker::purge(QSqlDatabase &wdb) {
+	if (! reconnect(wdb))
+		return -1;
+
+	QMutexLocker serialize(bSQLite ? &qmSQLite : NULL);
+
+	QString qstr;
+	if (bSQLite)
+		qstr = QString::fromLatin1("DELETE FROM `%1slog` WHERE `rowid` IN (SELECT `rowid` FROM `%1slog` WHERE `msgtime` < datetime('now','-%2 days') LIMIT %3)");
+	else
+		qstr = QString::fromLatin1("DELETE FROM `%1slog` WHERE `msgtime` < now() - INTERVAL %2 day LIMIT %3");
+
+	QSqlQuery query(wdb);
+	if (! prepare(query, qstr.arg(Meta::mp.qsDBPrefix, QString::number(Meta::mp.iLogDays), QString::number(iPurgeChunk))) || ! exec(query)) {
+		wdb.close();
+		return -1;
+	}
+	int purged = query.numRowsAffected();
+	query.clear();
+	return purged;
+}
+
 bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool warn) {
-	if (! db->isValid()) {
+	QSqlDatabase *sdb = connection();
+	if (! sdb->isValid()) {
 		qWarning("SQL [%s] rejected: Database is gone", qPrintable(str));
 		return false;
 	}
@@ -492,18 +917,18 @@ bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool wa
 	if (query.prepare(q)) {
 		return true;
 	} else {
-		db->close();
-		if (! db->open()) {
-			qFatal("Lost connection to SQL Database: Reconnect: %s", qPrintable(db->lastError().text()));
+		sdb->close();
+		if (! sdb->open()) {
+			qFatal("Lost connection to SQL Database: Reconnect: %s", qPrintable(sdb->lastError().text()));
 		}
-		query = QSqlQuery();
+		query = QSqlQuery(*sdb);
 		if (query.prepare(q)) {
 			qWarning("SQL Connection lost, reconnection OK");
 			return true;
 		}
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			*sdb = QSqlDatabase();
 			qFatal("SQL Prepare Error [%s]: %s", qPrintable(q), qPrintable(query.lastError().text()));
 		} else if (warn) {
 			qDebug("SQL Prepare Error [%s]: %s", qPrintable(q), qPrintable(query.lastError().text()));
@@ -515,12 +940,15 @@ bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool wa
 bool ServerDB::exec(QSqlQuery &query, const QString &str, bool fatal, bool warn) {
 	if (! str.isEmpty())
 		prepare(query, str, fatal, warn);
-	if (query.exec()) {
+	Timer t;
+	const bool ok = query.exec();
+	recordQueryTime(t);
+	if (ok) {
 		return true;
 	} else {
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			*connection() = QSqlDatabase();
 			qFatal("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
 		} else if (warn) {
 			qDebug("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
@@ -532,12 +960,15 @@ bool ServerDB::exec(QSqlQuery &query, const QString &str, bool fatal, bool warn)
 bool ServerDB::execBatch(QSqlQuery &query, const QString &str, bool fatal) {
 	if (! str.isEmpty())
 		prepare(query, str, fatal);
-	if (query.execBatch()) {
+	Timer t;
+	const bool ok = query.execBatch();
+	recordQueryTime(t);
+	if (ok) {
 		return true;
 	} else {
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			*connection() = QSqlDatabase();
 			qFatal("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
 		} else
 			qDebug("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
@@ -545,6 +976,11 @@ bool ServerDB::execBatch(QSqlQuery &query, const QString &str, bool fatal) {
 	}
 }
 
+void ServerDB::getQueryTime(Histogram &h) {
+	QMutexLocker lock(&qmQueryTime);
+	h.merge(hQueryTime);
+}
+
 void Server::initialize() {
 	TransactionHolder th;
 
@@ -690,6 +1126,7 @@ int Server::registerUser(const QMap<int, QString> &info) {
 	query.addBindValue(name);
 	SQLEXEC();
 	qhUserNameCache.remove(id);
+	qhUserTextureCache.remove(id);
 
 	setInfo(id, info);
 
@@ -707,6 +1144,8 @@ bool Server::unregisterUserDB(int id) {
 
 	qhUserIDCache.remove(info.value(ServerDB::User_Name));
 	qhUserNameCache.remove(id);
+	forgetUserHash(id);
+	qhUserTextureCache.remove(id);
 
 	int res = -2;
 	emit unregisterUserSig(res, id);
@@ -714,6 +1153,8 @@ bool Server::unregisterUserDB(int id) {
 		return false;
 	}
 
+	ServerDB::dbwWorker->forgetLastChannel(iServerNum, id);
+
 	TransactionHolder th;
 
 	QSqlQuery &query = *th.qsqQuery;
@@ -809,6 +1250,7 @@ bool Server::isUserId(int id) {
 	return false;
 }
 
+// Synchronous; see TransactionHolder.
 QMap<int, QString> Server::getRegistration(int id) {
 	QMap<int, QString> info;
 	int res = -2;
@@ -843,6 +1285,40 @@ QMap<int, QString> Server::getRegistration(int id) {
 // -1 Wrong PW
 // -2 Anonymous
 
+// A user has at most one certificate hash stored, so caching a new one for
+// id replaces whatever was cached for it before.
+void Server::cacheUserHash(const QString &hash, int id) {
+	forgetUserHash(id);
+
+	// Drop index entries for hashes the cache has evicted once they
+	// outnumber the cache, which keeps the index bounded as well.
+	if (qhUserHashIndex.count() >= 2 * qhUserHashCache.maxCost()) {
+		QHash<int, QString>::iterator i = qhUserHashIndex.begin();
+		while (i != qhUserHashIndex.end()) {
+			if (qhUserHashCache.contains(i.value()))
+				++i;
+			else
+				i = qhUserHashIndex.erase(i);
+		}
+	}
+
+	qhUserHashCache.insert(hash, new int(id));
+	qhUserHashIndex.insert(id, hash);
+}
+
+void Server::forgetUserHash(int id) {
+	QHash<int, QString>::iterator i = qhUserHashIndex.find(id);
+	if (i == qhUserHashIndex.end())
+		return;
+
+	// The hash may have been evicted and cached again for someone else.
+	int *cached = qhUserHashCache.object(i.value());
+	if (cached && (*cached == id))
+		qhUserHashCache.remove(i.value());
+	qhUserHashIndex.erase(i);
+}
+
+// Synchronous; see TransactionHolder.
 int Server::authenticate(QString &name, const QString &pw, int sessionId, const QStringList &emails, const QString &certhash, bool bStrongCert, const QList<QSslCertificate> &certs) {
 	int res = -2;
 
@@ -875,7 +1351,10 @@ int Server::authenticate(QString &name, const QString &pw, int sessionId, const
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 
-	SQLPREP("SELECT `user_id`,`name`,`pw` FROM `%1users` WHERE `server_id` = ? AND LOWER(`name`) = LOWER(?)");
+	if (Meta::mp.qsDBDriver == "QSQLITE")
+		SQLPREP("SELECT `user_id`,`name`,`pw` FROM `%1users` WHERE `server_id` = ? AND `name` = ? COLLATE NOCASE");
+	else
+		SQLPREP("SELECT `user_id`,`name`,`pw` FROM `%1users` WHERE `server_id` = ? AND `lname` = LOWER(?)");
 	query.addBindValue(iServerNum);
 	query.addBindValue(name);
 	SQLEXEC();
@@ -893,15 +1372,25 @@ int Server::authenticate(QString &name, const QString &pw, int sessionId, const
 	}
 
 	// No password match. Try cert or email match, but only for non-SuperUser.
+	bool hashmatch = false;
 	if (!certhash.isEmpty() && (res < 0)) {
-		SQLPREP("SELECT `user_id` FROM `%1user_info` WHERE `server_id` = ? AND `key` = ? AND `value` = ?");
-		query.addBindValue(iServerNum);
-		query.addBindValue(ServerDB::User_Hash);
-		query.addBindValue(certhash);
-		SQLEXEC();
-		if (query.next()) {
-			res = query.value(0).toInt();
-		} else if (bStrongCert) {
+		int *cached = qhUserHashCache.object(certhash);
+		if (cached) {
+			res = *cached;
+			hashmatch = true;
+		} else {
+			SQLPREP("SELECT `user_id` FROM `%1user_info` WHERE `server_id` = ? AND `key` = ? AND `value` = ?");
+			query.addBindValue(iServerNum);
+			query.addBindValue(ServerDB::User_Hash);
+			query.addBindValue(certhash);
+			SQLEXEC();
+			if (query.next()) {
+				res = query.value(0).toInt();
+				hashmatch = true;
+				cacheUserHash(certhash, res);
+			}
+		}
+		if (! hashmatch && bStrongCert) {
 			foreach(const QString &email, emails) {
 				if (! email.isEmpty()) {
 					query.addBindValue(iServerNum);
@@ -929,11 +1418,15 @@ int Server::authenticate(QString &name, const QString &pw, int sessionId, const
 	}
 	if (! certhash.isEmpty() && (res > 0)) {
 		SQLPREP("REPLACE INTO `%1user_info` (`server_id`, `user_id`, `key`, `value`) VALUES (?, ?, ?, ?)");
-		query.addBindValue(iServerNum);
-		query.addBindValue(res);
-		query.addBindValue(ServerDB::User_Hash);
-		query.addBindValue(certhash);
-		SQLEXEC();
+		if (! hashmatch) {
+			// The user's previous certificate hash, if cached, no longer maps to them.
+			forgetUserHash(res);
+			query.addBindValue(iServerNum);
+			query.addBindValue(res);
+			query.addBindValue(ServerDB::User_Hash);
+			query.addBindValue(certhash);
+			SQLEXEC();
+		}
 		if (! emails.isEmpty()) {
 			query.addBindValue(iServerNum);
 			query.addBindValue(res);
@@ -961,10 +1454,16 @@ bool Server::setInfo(int id, const QMap<int, QString> &setinfo) {
 		int idmatch = getUserID(uname);
 		if ((idmatch >= 0) && (idmatch != id))
 			return false;
-		qhUserIDCache.remove(qhUserNameCache.value(id));
+		QString *oldname = qhUserNameCache.object(id);
+		if (oldname)
+			qhUserIDCache.remove(*oldname);
 		qhUserNameCache.remove(id);
 		qhUserIDCache.remove(info.value(ServerDB::User_Name));
 	}
+	if (info.contains(ServerDB::User_Hash)) {
+		forgetUserHash(id);
+		qhUserHashCache.remove(info.value(ServerDB::User_Hash));
+	}
 
 	emit setInfoSig(res, id, info);
 	if (res >= 0)
@@ -1023,11 +1522,9 @@ bool Server::setTexture(int id, const QByteArray &texture) {
 	if (id <= 0)
 		return false;
 
-	QByteArray tex;
-	if (texture.size() == 600 * 60 * 4)
-		tex = qCompress(texture);
-	else
-		tex = texture;
+	QByteArray tex = LegacyTexture::canonical(texture);
+
+	qhUserTextureCache.remove(id);
 
 	foreach(ServerUser *u, qhUsers) {
 		if (u->iId == id)
@@ -1079,13 +1576,14 @@ void ServerDB::setSUPW(int srvnum, const QString &pw) {
 }
 
 QString Server::getUserName(int id) {
-	if (qhUserNameCache.contains(id))
-		return qhUserNameCache.value(id);
+	QString *cached = qhUserNameCache.object(id);
+	if (cached)
+		return *cached;
 	QString name;
 	emit idToNameSig(name, id);
 	if (! name.isEmpty()) {
-		qhUserIDCache.insert(name, id);
-		qhUserNameCache.insert(id, name);
+		qhUserIDCache.insert(name, new int(id));
+		qhUserNameCache.insert(id, new QString(name));
 		return name;
 	}
 
@@ -1097,20 +1595,21 @@ QString Server::getUserName(int id) {
 	SQLEXEC();
 	if (query.next()) {
 		name = query.value(0).toString();
-		qhUserIDCache.insert(name, id);
-		qhUserNameCache.insert(id, name);
+		qhUserIDCache.insert(name, new int(id));
+		qhUserNameCache.insert(id, new QString(name));
 	}
 	return name;
 }
 
 int Server::getUserID(const QString &name) {
-	if (qhUserIDCache.contains(name))
-		return qhUserIDCache.value(name);
+	int *cached = qhUserIDCache.object(name);
+	if (cached)
+		return *cached;
 	int id = -2;
 	emit nameToIdSig(id, name);
 	if (id != -2) {
-		qhUserIDCache.insert(name, id);
-		qhUserNameCache.insert(id, name);
+		qhUserIDCache.insert(name, new int(id));
+		qhUserNameCache.insert(id, new QString(name));
 		return id;
 	}
 
@@ -1121,23 +1620,37 @@ int Server::getUserID(const QString &name) {
 	TransactionHolder th;
 
 	QSqlQuery &query = *th.qsqQuery;
-	SQLPREP("SELECT `user_id` FROM `%1users` WHERE `server_id` = ? AND LOWER(`name`) = LOWER(?)");
+	if (Meta::mp.qsDBDriver == "QSQLITE")
+		SQLPREP("SELECT `user_id` FROM `%1users` WHERE `server_id` = ? AND `name` = ? COLLATE NOCASE");
+	else
+		SQLPREP("SELECT `user_id` FROM `%1users` WHERE `server_id` = ? AND `lname` = LOWER(?)");
 	query.addBindValue(iServerNum);
 	query.addBindValue(name);
 	SQLEXEC();
 	if (query.next()) {
 		id = query.value(0).toInt();
-		qhUserIDCache.insert(name, id);
-		qhUserNameCache.insert(id, name);
+		qhUserIDCache.insert(name, new int(id));
+		qhUserNameCache.insert(id, new QString(name));
 	}
 	return id;
 }
 
+// Synchronous; see TransactionHolder.
 QByteArray Server::getUserTexture(int id) {
 	QByteArray qba;
 	emit idToTextureSig(qba, id);
 	if (! qba.isNull()) {
-		return qba;
+		return LegacyTexture::canonical(qba);
+	}
+
+	// Logins of registered users usually find their texture in the blob
+	// store, by the hash remembered from the last time it was loaded.
+	QByteArray *hash = qhUserTextureCache.object(id);
+	if (hash) {
+		if (hash->isEmpty())
+			return QByteArray();
+		if (meta->bsBlobs->find(*hash, qba))
+			return qba;
 	}
 
 	TransactionHolder th;
@@ -1149,15 +1662,26 @@ QByteArray Server::getUserTexture(int id) {
 	SQLEXEC();
 	if (query.next()) {
 		qba = query.value(0).toByteArray();
-		if (! qba.isEmpty())
-			if (qba.size() == 600 * 60 * 4)
-				qba = qCompress(qba);
+		// Rows written before textures were stored as PNG.
+		qba = LegacyTexture::canonical(qba);
+	}
+
+	if (qba.isEmpty()) {
+		qhUserTextureCache.insert(id, new QByteArray());
+	} else if (qba.length() >= 128) {
+		QByteArray *h = new QByteArray(sha1(qba));
+		qba = meta->bsBlobs->intern(*h, qba);
+		qhUserTextureCache.insert(id, h);
 	}
 	return qba;
 }
 
 void Server::addLink(Channel *c, Channel *l) {
 	c->link(l);
+	invalidateLinkedFanout(c);
+	invalidateJoinChannel(c->iId);
+	invalidateJoinChannel(l->iId);
+	refreshTargetCache(NULL, QSet<const Channel *>() << c << l);
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1177,7 +1701,11 @@ void Server::addLink(Channel *c, Channel *l) {
 }
 
 void Server::removeLink(Channel *c, Channel *l) {
+	invalidateLinkedFanout(c);
 	c->unlink(l);
+	invalidateJoinChannel(c->iId);
+	invalidateJoinChannel(l->iId);
+	refreshTargetCache(NULL, QSet<const Channel *>() << c << l);
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1240,6 +1768,9 @@ Channel *Server::addChannel(Channel *p, const QString &name, bool temporary, int
 	c->bTemporary = temporary;
 	c->iPosition = position;
 	qhChannels.insert(id, c);
+	invalidateFanout(c);
+	invalidateChannelIndex();
+	refreshTargetCache(NULL, QSet<const Channel *>() << p);
 	return c;
 }
 
@@ -1380,7 +1911,7 @@ void Server::readChannelPrivs(Channel *c) {
 		g->bInherit = query.value(2).toBool();
 		g->bInheritable = query.value(3).toBool();
 
-		QSqlQuery mem;
+		QSqlQuery mem(*ServerDB::connection());
 		mem.prepare(QString::fromLatin1("SELECT user_id, addit FROM %1group_members WHERE group_id = ?").arg(Meta::mp.qsDBPrefix));
 		mem.addBindValue(gid);
 		mem.exec();
@@ -1411,7 +1942,7 @@ void Server::readChannelPrivs(Channel *c) {
 void Server::readChannels(Channel *p) {
 	QList<Channel *> kids;
 	Channel *c;
-	QSqlQuery query;
+	QSqlQuery query(*ServerDB::connection());
 	int parentid = -1;
 
 	if (p) {
@@ -1436,6 +1967,7 @@ void Server::readChannels(Channel *p) {
 			if (! p)
 				c->setParent(this);
 			qhChannels.insert(c->iId, c);
+			invalidateFanout(c);
 			c->bInheritACL = query.value(2).toBool();
 			kids << c;
 		}
@@ -1473,24 +2005,17 @@ void Server::setLastChannel(const User *p) {
 	if (p->cChannel->bTemporary)
 		return;
 
-	TransactionHolder th;
-	QSqlQuery &query = *th.qsqQuery;
-
-	if (Meta::mp.qsDBDriver == "QSQLITE") {
-		SQLPREP("UPDATE `%1users` SET `lastchannel`=? WHERE `server_id` = ? AND `user_id` = ?");
-	} else {
-		SQLPREP("UPDATE `%1users` SET `lastchannel`=?, `last_active` = now() WHERE `server_id` = ? AND `user_id` = ?");
-	}
-	query.addBindValue(p->cChannel->iId);
-	query.addBindValue(iServerNum);
-	query.addBindValue(p->iId);
-	SQLEXEC();
+	ServerDB::dbwWorker->setLastChannel(iServerNum, p->iId, p->cChannel->iId);
 }
 
 int Server::readLastChannel(int id) {
 	if (id < 0)
 		return -1;
 
+	int cid;
+	if (ServerDB::dbwWorker->lastChannel(iServerNum, id, cid))
+		return qhChannels.contains(cid) ? cid : -1;
+
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 
@@ -1500,7 +2025,7 @@ int Server::readLastChannel(int id) {
 	SQLEXEC();
 
 	if (query.next()) {
-		int cid = query.value(0).toInt();
+		cid = query.value(0).toInt();
 		if (qhChannels.contains(cid))
 			return cid;
 	}
@@ -1562,9 +2087,13 @@ void Server::getBans() {
 		if (ban.isValid())
 			qlBans << ban;
 	}
+
+	biBans.rebuild(qlBans);
 }
 
 void Server::saveBans() {
+	biBans.rebuild(qlBans);
+
 	TransactionHolder th;
 
 	QSqlQuery &query = *th.qsqQuery;
@@ -1624,34 +2153,16 @@ void Server::setConf(const QString &key, const QVariant &value) {
 }
 
 void Server::dblog(const QString &str) const {
-	TransactionHolder th;
-	QSqlQuery &query = *th.qsqQuery;
-
 	// Is logging disabled?
 	if (Meta::mp.iLogDays < 0)
 		return;
 
-	// Once per hour
-	if (Meta::mp.iLogDays > 0) {
-		if (ServerDB::tLogClean.isElapsed(3600ULL * 1000000ULL)) {
-			QString qstr;
-			if (Meta::mp.qsDBDriver == "QSQLITE") {
-				qstr = QString::fromLatin1("msgtime < datetime('now','-%1 days')").arg(Meta::mp.iLogDays);
-			} else {
-				qstr = QString::fromLatin1("msgtime < now() - INTERVAL %1 day").arg(Meta::mp.iLogDays);
-			}
-			ServerDB::prepare(query, QString::fromLatin1("DELETE FROM %1slog WHERE ") + qstr);
-			SQLEXEC();
-		}
-	}
-
-	SQLPREP("INSERT INTO `%1slog` (`server_id`, `msg`) VALUES(?,?)");
-	query.addBindValue(iServerNum);
-	query.addBindValue(str);
-	SQLEXEC();
+	ServerDB::dbwWorker->log(iServerNum, str);
 }
 
 void ServerDB::wipeLogs() {
+	dbwWorker->flush();
+
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 
@@ -1659,6 +2170,8 @@ void ServerDB::wipeLogs() {
 }
 
 QList<QPair<unsigned int, QString> > ServerDB::getLog(int server_id, unsigned int offs_min, unsigned int offs_max) {
+	dbwWorker->flush();
+
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 
@@ -1678,6 +2191,8 @@ QList<QPair<unsigned int, QString> > ServerDB::getLog(int server_id, unsigned in
 }
 
 int ServerDB::getLogLen(int server_id) {
+	dbwWorker->flush();
+
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 
@@ -1768,6 +2283,8 @@ int ServerDB::addServer() {
 }
 
 void ServerDB::deleteServer(int server_id) {
+	dbwWorker->flush();
+
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
 	SQLPREP("DELETE FROM `%1servers` WHERE `server_id` = ?");
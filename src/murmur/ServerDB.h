@@ -31,13 +31,20 @@
 #ifndef MUMBLE_MURMUR_DATABASE_H_
 #define MUMBLE_MURMUR_DATABASE_H_
 
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
 #include <QtCore/QVariant>
+#include <QtCore/QWaitCondition>
 
+#include "Histogram.h"
 #include "Timer.h"
 
 class Channel;
 class User;
 class Connection;
+class ServerDBWorker;
 class QSqlDatabase;
 class QSqlQuery;
 
@@ -50,7 +57,11 @@ class ServerDB {
 		typedef QPair<unsigned int, QString> LogRecord;
 		static Timer tLogClean;
 		static QSqlDatabase *db;
+		static ServerDBWorker *dbwWorker;
 		static QString qsUpgradeSuffix;
+		static QString qsDatabaseName;
+		static QSqlDatabase *connection();
+		static QSqlDatabase addConnection(const QString &name);
 		static void setSUPW(int iServNum, const QString &pw);
 		static QList<int> getBootServers();
 		static QList<int> getAllServers();
@@ -66,8 +77,68 @@ class ServerDB {
 		static bool prepare(QSqlQuery &, const QString &, bool fatal = true, bool warn = true);
 		static bool exec(QSqlQuery &, const QString &str = QString(), bool fatal= true, bool warn = true);
 		static bool execBatch(QSqlQuery &, const QString &str = QString(), bool fatal= true);
+		static void getQueryTime(Histogram &);
 		// No copy; private declaration without implementation
 		ServerDB(const ServerDB &);
 };
 
+// Write-behind executor for non-critical writes. Last channel updates and
+// log lines are queued from any thread, coalesced, and committed in batches
+// on a separate connection so the event loop never waits on SQL for them.
+class ServerDBWorker : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(ServerDBWorker)
+	protected:
+		// Pending log lines kept in memory before lines start getting dropped.
+		static const int iLogCapacity = 8192;
+		// Rows per multi-row INSERT; also the queue size that triggers an early flush.
+		static const int iLogBatch = 128;
+		// Expired log entries deleted per retention purge step.
+		static const int iPurgeChunk = 1000;
+
+		QMutex qmQueue;
+		QWaitCondition qwcQueue, qwcWritten;
+		bool bStop, bFlush, bPurging;
+		quint64 uiQueued, uiWritten;
+		quint64 uiLogWritten, uiLogDropped, uiLogPurged;
+
+		// (server_id, user_id) -> channel_id. Repeated moves only keep the last one.
+		QHash<QPair<int, int>, int> qhLastChannel;
+		// Entries taken out for the batch that is currently being written.
+		QHash<QPair<int, int>, int> qhLastChannelWriting;
+
+		// Ring buffer of (server_id, msg), iLogCount entries starting at iLogHead.
+		QVector<QPair<int, QString> > qvLog;
+		int iLogHead, iLogCount;
+
+		QString qsConnection;
+
+		void run();
+		bool reconnect(QSqlDatabase &);
+		bool prepare(QSqlQuery &, const QString &);
+		bool exec(QSqlQuery &, bool batch = false);
+		int write(QSqlDatabase &, const QHash<QPair<int, int>, int> &lastchannel, const QList<QPair<int, QString> > &log);
+		int purge(QSqlDatabase &);
+		void yieldWriter();
+		void enqueued();
+	public:
+		// SQLite only allows one writer, so transactions on the main
+		// connection and the worker's batches serialize on this lock. The
+		// worker takes it for one statement of at most iLogBatch rows at a
+		// time (see write() and purge()).
+		QMutex qmSQLite;
+		bool bSQLite;
+
+		ServerDBWorker();
+		~ServerDBWorker();
+		void setLastChannel(int server_id, int user_id, int channel_id);
+		void forgetLastChannel(int server_id, int user_id);
+		bool lastChannel(int server_id, int user_id, int &channel_id);
+		void log(int server_id, const QString &msg);
+		void getStatistics(QMap<QString, qint64> &stats);
+		void flush();
+		void stop();
+};
+
 #endif
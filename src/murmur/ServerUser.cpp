@@ -50,6 +50,7 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 	uiVersion = 0;
 	bVerified = true;
 	iLastPermissionCheck = -1;
+	iTextBytes = 0;
 	
 	bOpus = false;
 }
@@ -58,33 +59,127 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 ServerUser::operator const QString() const {
 	return QString::fromLatin1("%1:%2(%3)").arg(qsName).arg(uiSession).arg(iId);
 }
-BandwidthRecord::BandwidthRecord() {
-	iRecNum = 0;
-	iSum = 0;
-	for (int i=0;i<N_BANDWIDTH_SLOTS;i++)
-		a_iBW[i] = 0;
+
+// True if a change to user p, or to the ACLs, groups, links or members of
+// one of the given channels, may change this target's listeners.
+bool WhisperTargetCache::dependsOn(const User *p, const QSet<const Channel *> &channels) const {
+	if (p) {
+		ServerUser *u = static_cast<ServerUser *>(const_cast<User *>(p));
+		if (qsChannel.contains(u) || qsDirect.contains(u) || qsSessions.contains(p->uiSession) || qsChannels.contains(p->cChannel))
+			return true;
+	}
+
+	foreach(const Channel *c, channels)
+		if (qsChannels.contains(c))
+			return true;
+
+	return false;
 }
 
-bool BandwidthRecord::addFrame(int size, int maxpersec) {
-	quint64 elapsed = a_qtWhen[iRecNum].elapsed();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+#define LOAD_ACQUIRE(x) static_cast<quint32>((x).loadAcquire())
+#else
+#define LOAD_ACQUIRE(x) static_cast<quint32>((x).fetchAndAddAcquire(0))
+#endif
 
-	if (elapsed == 0)
-		return false;
+TunnelRing::TunnelRing() {
+	pcBuffer = NULL;
+}
+
+TunnelRing::~TunnelRing() {
+	delete [] pcBuffer;
+}
+
+bool TunnelRing::push(const char *data, int len) {
+	QMutexLocker l(&qmProducer);
+
+	if (! pcBuffer)
+		pcBuffer = new char[Size];
 
-	int nsum = iSum-a_iBW[iRecNum]+size;
-	int bw = static_cast<int>((nsum * 1000000LL) / elapsed);
+	quint32 head = LOAD_ACQUIRE(qaiHead);
+	quint32 tail = LOAD_ACQUIRE(qaiTail);
+	quint32 need = static_cast<quint32>(len) + 6;
 
-	if (bw > maxpersec)
+	if ((Size - (head - tail)) < need)
 		return false;
 
-	a_iBW[iRecNum] = static_cast<unsigned short>(size);
-	a_qtWhen[iRecNum].restart();
+	unsigned char hdr[6];
+	qToBigEndian<quint16>(MessageHandler::UDPTunnel, & hdr[0]);
+	qToBigEndian<quint32>(len, & hdr[2]);
+
+	for (int i=0;i<6;++i)
+		pcBuffer[(head + i) & (Size - 1)] = static_cast<char>(hdr[i]);
+
+	quint32 offset = (head + 6) & (Size - 1);
+	quint32 first = qMin(static_cast<quint32>(len), Size - offset);
+	memcpy(pcBuffer + offset, data, first);
+	memcpy(pcBuffer, data + first, len - first);
+
+	qaiHead.fetchAndStoreRelease(static_cast<int>(head + need));
+	return true;
+}
+
+// Returns the number of contiguous bytes ready for the socket, starting at data.
+int TunnelRing::pending(const char *&data) {
+	quint32 head = LOAD_ACQUIRE(qaiHead);
+	quint32 tail = LOAD_ACQUIRE(qaiTail);
+
+	if (head == tail)
+		return 0;
+
+	quint32 offset = tail & (Size - 1);
+	data = pcBuffer + offset;
+	return static_cast<int>(qMin(head - tail, Size - offset));
+}
+
+void TunnelRing::consume(int len) {
+	qaiTail.fetchAndAddRelease(len);
+}
+
+BandwidthRecord::BandwidthRecord() {
+	iTokens = -1;
+	uiLastRefill = uiLastFrame = 0;
+	uiSecond = 0;
+	uiDroppedFrames = 0;
+	for (int i=0;i<N_BANDWIDTH_HISTORY;i++)
+		a_iBytes[i] = a_iDropped[i] = 0;
+}
+
+void BandwidthRecord::advance(quint64 second) {
+	if (second == uiSecond)
+		return;
+
+	quint64 gap = qMin(second - uiSecond, static_cast<quint64>(N_BANDWIDTH_HISTORY));
+	for (quint64 i=1;i<=gap;i++) {
+		int idx = static_cast<int>((uiSecond + i) % N_BANDWIDTH_HISTORY);
+		a_iBytes[idx] = a_iDropped[idx] = 0;
+	}
+	uiSecond = second;
+}
+
+bool BandwidthRecord::addFrame(int size, int maxpersec, int burstms) {
+	quint64 now = tFirst.elapsed();
+	qint64 capacity = static_cast<qint64>(maxpersec) * burstms * 1000LL;
+
+	if (iTokens < 0)
+		iTokens = capacity;
+	else
+		iTokens = qMin(capacity, iTokens + static_cast<qint64>(now - uiLastRefill) * maxpersec);
+	uiLastRefill = now;
+
+	advance(now / 1000000ULL);
+	int idx = static_cast<int>(uiSecond % N_BANDWIDTH_HISTORY);
 
-	iSum = nsum;
+	qint64 cost = static_cast<qint64>(size) * 1000000LL;
+	if (iTokens < cost) {
+		a_iDropped[idx] += size;
+		++uiDroppedFrames;
+		return false;
+	}
 
-	iRecNum++;
-	if (iRecNum == N_BANDWIDTH_SLOTS)
-		iRecNum = 0;
+	iTokens -= cost;
+	a_iBytes[idx] += size;
+	uiLastFrame = now;
 
 	return true;
 }
@@ -94,7 +189,7 @@ int BandwidthRecord::onlineSeconds() const {
 }
 
 int BandwidthRecord::idleSeconds() const {
-	quint64 iIdle = a_qtWhen[(iRecNum + N_BANDWIDTH_SLOTS - 1) % N_BANDWIDTH_SLOTS].elapsed();
+	quint64 iIdle = tFirst.elapsed() - uiLastFrame;
 	if (tIdleControl.elapsed() < iIdle)
 		iIdle = tIdleControl.elapsed();
 
@@ -105,26 +200,33 @@ void BandwidthRecord::resetIdleSeconds() {
 	tIdleControl.restart();
 }
 
+// Bytes per second accepted during the last full second.
 int BandwidthRecord::bandwidth() const {
-	int sum = 0;
-	int records = 0;
-	quint64 elapsed = 0ULL;
-
-	for (int i=1;i<N_BANDWIDTH_SLOTS;++i) {
-		int idx = (iRecNum + N_BANDWIDTH_SLOTS - i) % N_BANDWIDTH_SLOTS;
-		quint64 e = a_qtWhen[idx].elapsed();
-		if (e > 1000000ULL) {
-			break;
-		} else {
-			++records;
-			sum += a_iBW[idx];
-			elapsed = e;
-		}
-	}
+	quint64 now = tFirst.elapsed() / 1000000ULL;
 
-	if (elapsed < 250000ULL)
+	if ((now == 0) || (uiSecond + 1 < now))
 		return 0;
 
-	return static_cast<int>((sum * 1000000ULL) / elapsed);
+	return static_cast<int>(a_iBytes[(now - 1) % N_BANDWIDTH_HISTORY]);
 }
 
+// Fills in accepted and dropped bytes for each of the last full seconds,
+// oldest first.
+void BandwidthRecord::history(QList<int> &bytes, QList<int> &dropped) const {
+	quint64 now = tFirst.elapsed() / 1000000ULL;
+	quint64 first = (now > N_BANDWIDTH_HISTORY) ? now - N_BANDWIDTH_HISTORY : 0;
+
+	bytes.clear();
+	dropped.clear();
+
+	for (quint64 s=first;s<now;s++) {
+		if ((s > uiSecond) || (s + N_BANDWIDTH_HISTORY <= uiSecond)) {
+			bytes << 0;
+			dropped << 0;
+		} else {
+			int idx = static_cast<int>(s % N_BANDWIDTH_HISTORY);
+			bytes << static_cast<int>(a_iBytes[idx]);
+			dropped << static_cast<int>(a_iDropped[idx]);
+		}
+	}
+}
@@ -32,7 +32,11 @@
 #ifndef MUMBLE_MURMUR_SERVERUSER_H_
 #define MUMBLE_MURMUR_SERVERUSER_H_
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
 #include <QtCore/QStringList>
+#include <QtCore/QVector>
 
 #ifdef Q_OS_UNIX
 #include <sys/socket.h>
@@ -42,29 +46,60 @@
 
 #include "Connection.h"
 #include "Net.h"
+#include "TargetRequests.h"
 #include "Timer.h"
 #include "User.h"
 
-// Unfortunately, this needs to be "large enough" to hold
-// enough frames to account for both short-term and
-// long-term "maladjustments".
-
-#define N_BANDWIDTH_SLOTS 360
+// Number of seconds of per-user bandwidth history kept for RPC.
+#define N_BANDWIDTH_HISTORY 60
 
+// Voice rate limiter and bandwidth accounting for a single user. Speech is
+// limited by a token bucket refilled at the maximum rate, which can hold
+// "burst" milliseconds worth of speech. Every frame costs one clock read.
 struct BandwidthRecord {
-	int iRecNum;
-	int iSum;
 	Timer tFirst;
 	Timer tIdleControl;
-	unsigned short a_iBW[N_BANDWIDTH_SLOTS];
-	Timer a_qtWhen[N_BANDWIDTH_SLOTS];
+	// Bucket fill in bytes * 1000000, so refilling by elapsed microseconds
+	// times bytes per second needs no division. Negative until the first frame.
+	qint64 iTokens;
+	quint64 uiLastRefill;
+	quint64 uiLastFrame;
+
+	// Accepted and dropped bytes per second, indexed by second modulo
+	// N_BANDWIDTH_HISTORY. uiSecond is the newest second recorded.
+	quint64 uiSecond;
+	quint32 a_iBytes[N_BANDWIDTH_HISTORY];
+	quint32 a_iDropped[N_BANDWIDTH_HISTORY];
+	quint64 uiDroppedFrames;
 
 	BandwidthRecord();
-	bool addFrame(int size, int maxpersec);
+	bool addFrame(int size, int maxpersec, int burstms);
 	int onlineSeconds() const;
 	int idleSeconds() const;
 	void resetIdleSeconds();
 	int bandwidth() const;
+	void history(QList<int> &bytes, QList<int> &dropped) const;
+	void advance(quint64 second);
+};
+
+// Voice for a user without working UDP, already framed as UDPTunnel
+// messages. Voice threads append under qmProducer; the main thread is the
+// only consumer and never locks. The buffer is allocated on first use.
+struct TunnelRing {
+	enum { Size = 16384 };
+
+	char *pcBuffer;
+	QAtomicInt qaiHead;
+	QAtomicInt qaiTail;
+	// Set while a drain of this ring is pending on the main thread.
+	QAtomicInt qaiScheduled;
+	QMutex qmProducer;
+
+	TunnelRing();
+	~TunnelRing();
+	bool push(const char *data, int len);
+	int pending(const char *&data);
+	void consume(int len);
 };
 
 struct WhisperTarget {
@@ -78,6 +113,24 @@ struct WhisperTarget {
 	QList<WhisperTarget::Channel> qlChannels;
 };
 
+class ServerUser;
+
+// Resolved listeners of a whisper target, along with the channels and
+// sessions they were resolved from. An entry only needs to be rebuilt when
+// one of those changes.
+struct WhisperTargetCache {
+	QSet<ServerUser *> qsChannel;
+	QSet<ServerUser *> qsDirect;
+	QSet<const Channel *> qsChannels;
+	QSet<unsigned int> qsSessions;
+	bool dependsOn(const User *p, const QSet<const Channel *> &channels) const;
+};
+
+// A channel a speech fan-out was built from, with its fan-out generation
+// at the time.
+typedef QPair<Channel *, int> SpeakDep;
+typedef QList<SpeakDep> SpeakDeps;
+
 class Server;
 
 class ServerUser : public Connection, public User {
@@ -115,18 +168,42 @@ class ServerUser : public Connection, public User {
 		QStringList qslAccessTokens;
 
 		QMap<int, WhisperTarget> qmTargets;
-		typedef QPair<QSet<ServerUser *>, QSet<ServerUser *> > TargetCache;
-		QMap<int, TargetCache> qmTargetCache;
+		// Resolved by the main thread only; voice threads read the copy in
+		// the current UserSnapshot and ask for missing ones through
+		// trqTargets.
+		QMap<int, WhisperTargetCache> qmTargetCache;
+		TargetRequests trqTargets;
 		QMap<QString, QString> qmWhisperRedirect;
 
+		// Destinations of normal speech from this user's channel and the
+		// linked channels it may speak in, and the channels that was built
+		// from. Only the main thread touches these; it rebuilds them when
+		// any of those channels' fan-out generation changes and hands the
+		// voice threads a copy in each UserSnapshot. See Server::speakFanout.
+		typedef QVector<ServerUser *> SpeakCache;
+		SpeakCache qvSpeakCache;
+		SpeakDeps qlSpeakDeps;
+
 		int iLastPermissionCheck;
 		QMap<int, unsigned int> qmPermissionSent;
+
+		// This user's UserState as sent to joining clients, encoded once per
+		// kind of client (see Server::appendJoinUsers). Cleared whenever a
+		// UserState for this session is broadcast.
+		QByteArray qbaJoinState[3];
+		// Text messages held back while this user's socket is congested,
+		// see Server::deliverText.
+		QQueue<QByteArray> qqText;
+		qint64 iTextBytes;
 #ifdef Q_OS_UNIX
 		int sUdpSocket;
 #else
 		SOCKET sUdpSocket;
 #endif
 		BandwidthRecord bwr;
+		TunnelRing trTunnel;
+		// Serializes csCrypt between voice threads and the TCP tunnel path.
+		QMutex qmCrypt;
 		struct sockaddr_storage saiUdpAddress;
 		struct sockaddr_storage saiTcpLocalAddress;
 		ServerUser(Server *parent, QSslSocket *socket);
@@ -0,0 +1,68 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "TargetRequests.h"
+
+TargetRequests::TargetRequests() {
+}
+
+int TargetRequests::pending() {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+	return qaiPending.loadAcquire();
+#else
+	return qaiPending.fetchAndAddAcquire(0);
+#endif
+}
+
+bool TargetRequests::request(int target) {
+	if ((target < 1) || (target >= 0x1f))
+		return false;
+
+	const int bit = 1 << target;
+	forever {
+		int old = pending();
+		if (old & bit)
+			return false;
+		if (qaiPending.testAndSetOrdered(old, old | bit))
+			return true;
+	}
+}
+
+bool TargetRequests::isPending(int target) {
+	if ((target < 1) || (target >= 0x1f))
+		return false;
+	return (pending() & (1 << target)) != 0;
+}
+
+void TargetRequests::clear() {
+	qaiPending.fetchAndStoreOrdered(0);
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_TARGETREQUESTS_H_
+#define MUMBLE_MURMUR_TARGETREQUESTS_H_
+
+#include <QtCore/QAtomicInt>
+
+// Whisper targets of one user that a voice thread found missing from the
+// current UserSnapshot, as a bit per target id (1 to 30). Resolving a
+// target takes the users lock and ACL checks, so voice threads never do it.
+// The first miss of a target asks the main thread to resolve it, and
+// packets to it are dropped without asking again until the main thread has
+// published the result and cleared the request.
+class TargetRequests {
+	private:
+		Q_DISABLE_COPY(TargetRequests)
+	protected:
+		QAtomicInt qaiPending;
+		int pending();
+	public:
+		TargetRequests();
+		// Returns true if this is the first miss of target since the last
+		// clear(), in which case the caller has to post the request.
+		bool request(int target);
+		bool isPending(int target);
+		void clear();
+};
+
+#endif
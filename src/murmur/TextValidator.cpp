@@ -0,0 +1,293 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "TextValidator.h"
+
+static inline bool isSpace(QChar c) {
+	ushort u = c.unicode();
+	return (u == ' ') || (u == '\t') || (u == '\n') || (u == '\r');
+}
+
+// Code points XML allows in a document, for character references.
+static inline bool isXmlChar(uint u) {
+	if (u < 0x20)
+		return (u == 0x09) || (u == 0x0a) || (u == 0x0d);
+	if ((u >= 0xd800) && (u < 0xe000))
+		return false;
+	return (u != 0xfffe) && (u != 0xffff) && (u <= 0x10ffff);
+}
+
+// The same for a UTF-16 unit of literal text, where surrogates are the
+// halves of characters above 0xffff.
+static inline bool isXmlUnit(QChar c) {
+	const ushort u = c.unicode();
+	if (u < 0x20)
+		return (u == 0x09) || (u == 0x0a) || (u == 0x0d);
+	return (u != 0xfffe) && (u != 0xffff);
+}
+
+static inline bool isNameStart(QChar c) {
+	return c.isLetter() || (c == QLatin1Char('_')) || (c == QLatin1Char(':'));
+}
+
+static inline bool isNameChar(QChar c) {
+	return c.isLetterOrNumber() || (c == QLatin1Char('_')) || (c == QLatin1Char(':')) || (c == QLatin1Char('-')) || (c == QLatin1Char('.'));
+}
+
+static inline bool matches(const QChar *p, const QChar *end, const char *s) {
+	for (; *s; ++s, ++p)
+		if ((p >= end) || (p->unicode() != static_cast<uchar>(*s)))
+			return false;
+	return true;
+}
+
+static inline bool sameName(const QChar *a, int alen, const QChar *b, int blen) {
+	return (alen == blen) && (memcmp(a, b, alen * sizeof(QChar)) == 0);
+}
+
+// Returns the end of the name starting at p, or p if there is none.
+static inline const QChar *skipName(const QChar *p, const QChar *end) {
+	if ((p >= end) || ! isNameStart(*p))
+		return p;
+	++p;
+	while ((p < end) && isNameChar(*p))
+		++p;
+	return p;
+}
+
+static inline const QChar *skipSpace(const QChar *p, const QChar *end) {
+	while ((p < end) && isSpace(*p))
+		++p;
+	return p;
+}
+
+// p points at '&'. Returns the character after the terminating ';', or
+// NULL for anything but a predefined or numeric character reference.
+static const QChar *skipReference(const QChar *p, const QChar *end) {
+	++p;
+	if ((p < end) && (*p == QLatin1Char('#'))) {
+		++p;
+		bool hex = (p < end) && (*p == QLatin1Char('x'));
+		if (hex)
+			++p;
+		const QChar *digits = p;
+		uint value = 0;
+		while ((p < end) && (hex ? isxdigit(p->unicode()) && (p->unicode() < 0x80) : (p->unicode() >= '0') && (p->unicode() <= '9'))) {
+			const ushort d = p->unicode();
+			value = value * (hex ? 16 : 10) + ((d <= '9') ? (d - '0') : ((d | 0x20) - 'a' + 10));
+			if (value > 0x10ffff)
+				return NULL;
+			++p;
+		}
+		if ((p == digits) || (p >= end) || (*p != QLatin1Char(';')) || ! isXmlChar(value))
+			return NULL;
+		return p + 1;
+	}
+
+	static const char *entities[] = { "amp;", "lt;", "gt;", "quot;", "apos;", NULL };
+	for (int i=0; entities[i]; ++i)
+		if (matches(p, end, entities[i]))
+			return p + strlen(entities[i]);
+	return NULL;
+}
+
+// Returns the character after the first occurrence of s at or after p.
+static const QChar *skipPast(const QChar *p, const QChar *end, const char *s) {
+	while (p < end) {
+		if (matches(p, end, s))
+			return p + strlen(s);
+		++p;
+	}
+	return NULL;
+}
+
+TextValidator::Result TextValidator::check(const QString &text, int maxLength, int *length) {
+	const QChar *begin = text.constData();
+	const QChar *end = begin + text.length();
+	const QChar *p = begin;
+
+	// Characters inside <img src="..."> values, which are not counted.
+	int excluded = 0;
+	// Open elements as (offset, length) of their name in text.
+	QVarLengthArray<QPair<int, int>, 32> open;
+	// Start of the current run of literal text.
+	const QChar *run = begin;
+
+	Result res = Valid;
+
+	while (p < end) {
+		bool literal = false;
+		if (*p == QLatin1Char('&')) {
+			p = skipReference(p, end);
+			if (! p) {
+				res = Malformed;
+				break;
+			}
+		} else if (*p != QLatin1Char('<')) {
+			// "]]>" may not appear literally in text.
+			if (! isXmlUnit(*p) || ((*p == QLatin1Char('>')) && (p - run >= 2) && (p[-1] == QLatin1Char(']')) && (p[-2] == QLatin1Char(']')))) {
+				res = Malformed;
+				break;
+			}
+			++p;
+			literal = true;
+		} else if (matches(p, end, "</")) {
+			const QChar *name = p + 2;
+			const QChar *nend = skipName(name, end);
+			p = skipSpace(nend, end);
+			if ((nend == name) || (p >= end) || (*p != QLatin1Char('>')) || open.isEmpty()) {
+				res = Malformed;
+				break;
+			}
+			const QPair<int, int> &top = open.at(open.count() - 1);
+			if (! sameName(begin + top.first, top.second, name, static_cast<int>(nend - name))) {
+				res = Malformed;
+				break;
+			}
+			open.resize(open.count() - 1);
+			++p;
+		} else if (matches(p, end, "<!--")) {
+			p = skipPast(p + 4, end, "-->");
+		} else if (matches(p, end, "<![CDATA[")) {
+			p = skipPast(p + 9, end, "]]>");
+		} else if (matches(p, end, "<?")) {
+			p = skipPast(p + 2, end, "?>");
+		} else {
+			const QChar *name = p + 1;
+			const QChar *nend = skipName(name, end);
+			if (nend == name) {
+				res = Malformed;
+				break;
+			}
+			const int nlen = static_cast<int>(nend - name);
+			const bool img = (nlen == 3) && matches(name, nend, "img");
+			// Attribute names seen so far, as (offset, length) in text.
+			QVarLengthArray<QPair<int, int>, 8> attrs;
+
+			p = nend;
+			bool closed = false;
+			while (res == Valid) {
+				const QChar *ws = p;
+				p = skipSpace(p, end);
+				if (p >= end) {
+					res = Malformed;
+				} else if (*p == QLatin1Char('>')) {
+					open.append(QPair<int, int>(static_cast<int>(name - begin), nlen));
+					++p;
+					closed = true;
+				} else if (*p == QLatin1Char('/')) {
+					if ((p + 1 < end) && (p[1] == QLatin1Char('>'))) {
+						p += 2;
+						closed = true;
+					} else {
+						res = Malformed;
+					}
+				} else {
+					// Attribute: whitespace, name, '=', quoted value.
+					const QChar *aname = p;
+					const QChar *aend = skipName(aname, end);
+					if ((ws == p) || (aend == aname)) {
+						res = Malformed;
+						break;
+					}
+					for (int i=0;i<attrs.count();++i)
+						if (sameName(begin + attrs.at(i).first, attrs.at(i).second, aname, static_cast<int>(aend - aname)))
+							res = Malformed;
+					if (res != Valid)
+						break;
+					attrs.append(QPair<int, int>(static_cast<int>(aname - begin), static_cast<int>(aend - aname)));
+					p = skipSpace(aend, end);
+					if ((p >= end) || (*p != QLatin1Char('='))) {
+						res = Malformed;
+						break;
+					}
+					p = skipSpace(p + 1, end);
+					if ((p >= end) || ((*p != QLatin1Char('"')) && (*p != QLatin1Char('\'')))) {
+						res = Malformed;
+						break;
+					}
+					const QChar quote = *p++;
+					const QChar *value = p;
+					while ((p < end) && (*p != quote)) {
+						if (*p == QLatin1Char('<')) {
+							res = Malformed;
+							break;
+						} else if (*p == QLatin1Char('&')) {
+							p = skipReference(p, end);
+							if (! p) {
+								res = Malformed;
+								break;
+							}
+						} else if (! isXmlUnit(*p)) {
+							res = Malformed;
+							break;
+						} else {
+							++p;
+						}
+					}
+					if (res != Valid)
+						break;
+					if (p >= end) {
+						res = Malformed;
+						break;
+					}
+					if (img && ((aend - aname) == 3) && matches(aname, aend, "src"))
+						excluded += static_cast<int>(p - value);
+					++p;
+				}
+				if (closed)
+					break;
+			}
+			if (res != Valid)
+				break;
+		}
+
+		if (! p) {
+			res = Malformed;
+			break;
+		}
+		if (! literal)
+			run = p;
+		if ((maxLength > 0) && (static_cast<int>(p - begin) - excluded > maxLength)) {
+			res = TooLong;
+			break;
+		}
+	}
+
+	if ((res == Valid) && ! open.isEmpty())
+		res = Malformed;
+
+	if (length)
+		*length = p ? static_cast<int>(p - begin) - excluded : static_cast<int>(end - begin) - excluded;
+
+	return res;
+}
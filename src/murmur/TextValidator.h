@@ -0,0 +1,54 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_TEXTVALIDATOR_H_
+#define MUMBLE_MURMUR_TEXTVALIDATOR_H_
+
+#include <QtCore/QString>
+
+// Single pass check of the HTML subset clients send in text messages,
+// comments and channel descriptions. It accepts what QXmlStreamReader
+// accepts inside a <document> element (balanced tags, quoted and unique
+// attributes, the predefined and numeric entities, characters XML allows,
+// comments, CDATA) and measures the text length the way the message limits
+// want it: everything except the src attribute of <img> elements, so
+// embedded images only count against the image limit. Nothing is copied,
+// and the scan stops as soon as maxLength is exceeded. tests/TestTextValidator
+// checks it against the QXmlStreamReader based check it replaced.
+class TextValidator {
+	public:
+		enum Result { Valid, TooLong, Malformed };
+
+		// maxLength == 0 means no limit. If length is given, it receives
+		// the counted length up to the point where the scan stopped.
+		static Result check(const QString &text, int maxLength, int *length = NULL);
+};
+
+#endif
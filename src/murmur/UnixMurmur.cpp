@@ -107,6 +107,7 @@ void LimitTest::testLimits(QCoreApplication &a) {
 }
 
 extern QFile *qfLog;
+extern QMutex qmLog;
 
 int UnixMurmur::iHupFd[2];
 int UnixMurmur::iTermFd[2];
@@ -196,12 +197,14 @@ void UnixMurmur::handleSigHup() {
 			delete newlog;
 			qCritical("Failed to reopen logfile for writing, keeping old log");
 		} else {
-			QFile *oldlog = qfLog;
-
 			newlog->setTextModeEnabled(true);
+
+			QMutexLocker lock(&qmLog);
+			QFile *oldlog = qfLog;
 			qfLog = newlog;
 			oldlog->close();
 			delete oldlog;
+			lock.unlock();
 			qWarning("Log rotated successfully");
 		}
 	}
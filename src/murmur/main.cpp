@@ -38,6 +38,7 @@
 #include "ServerDB.h"
 #include "DBus.h"
 #include "Meta.h"
+#include "Metrics.h"
 #include "Version.h"
 #include "SSL.h"
 
@@ -46,6 +47,8 @@
 #endif
 
 QFile *qfLog = NULL;
+// Servers on control threads log concurrently with the main thread.
+QMutex qmLog(QMutex::Recursive);
 
 static bool bVerbose = false;
 #ifdef QT_NO_DEBUG
@@ -82,6 +85,8 @@ static void murmurMessageOutputQString(QtMsgType type, const QString &msg) {
 	}
 	QString m= QString::fromLatin1("<%1>%2 %3").arg(QChar::fromLatin1(c)).arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz")).arg(msg);
 
+	QMutexLocker lock(&qmLog);
+
 	if (! qfLog || ! qfLog->isOpen()) {
 #ifdef Q_OS_UNIX
 		if (! detach)
@@ -465,6 +470,9 @@ int main(int argc, char **argv) {
 	IceStart();
 #endif
 
+	if (! Meta::mp.qsMetrics.isEmpty())
+		new MetricsServer(Meta::mp.qsMetrics, meta);
+
 	meta->getOSInfo();
 
 	int major, minor, patch;
@@ -16,8 +16,8 @@ TARGET = murmur
 DBFILE  = murmur.db
 LANGUAGE	= C++
 FORMS =
-HEADERS *= Server.h ServerUser.h Meta.h
-SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp
+HEADERS *= Server.h ServerUser.h ServerDB.h Meta.h TextValidator.h BlobStore.h LegacyTexture.h BanIndex.h AttemptLimiter.h Metrics.h Histogram.h TargetRequests.h
+SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp TextValidator.cpp BlobStore.cpp LegacyTexture.cpp BanIndex.cpp AttemptLimiter.cpp Metrics.cpp Histogram.cpp TargetRequests.cpp
 
 DIST = DBus.h ServerDB.h ../../icons/murmur.ico Murmur.ice MurmurI.h MurmurIceWrapper.cpp murmur.plist
 PRECOMPILED_HEADER = murmur_pch.h
@@ -44,10 +44,12 @@ win32 {
   RESOURCES	*= murmur.qrc
   SOURCES *= Tray.cpp
   HEADERS *= Tray.h
-  LIBS *= -luser32
+  LIBS *= -luser32 -lzlib
 }
 
 unix {
+  LIBS *= -lz
+
   contains(UNAME, Linux) {
     LIBS *= -lcap
   }
@@ -0,0 +1,169 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Compares the ban lookup index and the attempt limiter with the linear
+// scans they replaced, with a large ban list and a connection flood from
+// random addresses.
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include "AttemptLimiter.h"
+#include "BanIndex.h"
+#include "Net.h"
+#include "Timer.h"
+
+static HostAddress randomV4() {
+	quint32 ip = (static_cast<quint32>(qrand()) << 16) ^ static_cast<quint32>(qrand());
+	return HostAddress(QHostAddress(ip));
+}
+
+static HostAddress randomV6() {
+	Q_IPV6ADDR a;
+	for (int i=0;i<16;++i)
+		a.c[i] = static_cast<quint8>(qrand());
+	a.c[0] = 0x20;
+	return HostAddress(a);
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	const int nbans = 50000;
+	const int nlookups = 1000000;
+	const int nattempts = 1000000;
+	const int tries = 10;
+	const quint64 window = 120ULL * 1000000ULL;
+
+	QList<Ban> bans;
+	for (int i=0;i<nbans;++i) {
+		Ban b;
+		switch (i % 3) {
+			case 0:
+				b.haAddress = randomV4();
+				b.iMask = 128;
+				break;
+			case 1:
+				b.haAddress = randomV4();
+				b.iMask = 120;
+				break;
+			default:
+				b.haAddress = randomV6();
+				b.iMask = 64;
+				break;
+		}
+		b.qdtStart = QDateTime::currentDateTime().toUTC();
+		b.iDuration = (i & 1) ? 3600 : 0;
+		bans << b;
+	}
+
+	QVector<HostAddress> lookups;
+	lookups.reserve(nlookups);
+	for (int i=0;i<nlookups;++i) {
+		if ((i % 10) == 0)
+			lookups << bans.at(qrand() % nbans).haAddress;
+		else
+			lookups << ((i & 1) ? randomV6() : randomV4());
+	}
+
+	Timer t;
+	BanIndex bi;
+	bi.rebuild(bans);
+	quint64 tbuild = t.elapsed();
+
+	// The linear scan is the slow one; sample it.
+	const int nlinear = nlookups / 100;
+	int hitlinear = 0;
+	t.restart();
+	for (int i=0;i<nlinear;++i) {
+		const HostAddress &ha = lookups.at(i);
+		foreach(const Ban &ban, bans) {
+			if (ban.haAddress.match(ha, ban.iMask)) {
+				++hitlinear;
+				break;
+			}
+		}
+	}
+	quint64 tlinear = t.elapsed();
+
+	int hitindex = 0, hitsample = 0;
+	t.restart();
+	for (int i=0;i<nlookups;++i) {
+		if (bi.match(lookups.at(i))) {
+			++hitindex;
+			if (i < nlinear)
+				++hitsample;
+		}
+	}
+	quint64 tindex = t.elapsed();
+
+	qWarning("%d bans, index built in %.2f ms, %d nodes", nbans, static_cast<double>(tbuild) / 1000., bi.nodes());
+	qWarning("linear  %9.3f us/lookup  %d/%d hits", static_cast<double>(tlinear) / nlinear, hitlinear, nlinear);
+	qWarning("index   %9.3f us/lookup  %d/%d hits (%d in sample)", static_cast<double>(tindex) / nlookups, hitindex, nlookups, hitsample);
+
+	// A flood of one-off addresses with a single persistent address mixed
+	// in every 100th attempt, all within one window.
+	QVector<QHostAddress> flood;
+	flood.reserve(nattempts);
+	const QHostAddress persistent(QLatin1String("192.0.2.1"));
+	for (int i=0;i<nattempts;++i)
+		flood << (((i % 100) == 0) ? persistent : randomV4().toAddress());
+
+	QHash<QHostAddress, QList<Timer> > qhAttempts;
+	int bannedold = -1;
+	t.restart();
+	for (int i=0;i<nattempts;++i) {
+		QList<Timer> &ql = qhAttempts[flood.at(i)];
+		ql.append(Timer());
+		while (! ql.isEmpty() && (ql.at(0).elapsed() > window))
+			ql.removeFirst();
+		if ((ql.count() > tries) && (bannedold < 0) && (flood.at(i) == persistent))
+			bannedold = i;
+	}
+	quint64 told = t.elapsed();
+
+	AttemptLimiter al;
+	int bannednew = -1;
+	quint64 now = 0;
+	t.restart();
+	for (int i=0;i<nattempts;++i) {
+		const HostAddress ha(flood.at(i));
+		if ((al.attempt(ha, now + i, window) > static_cast<quint32>(tries)) && (bannednew < 0) && (flood.at(i) == persistent))
+			bannednew = i;
+	}
+	quint64 tnew = t.elapsed();
+
+	qWarning("hash of lists  %7.3f us/attempt  %d addresses tracked, persistent address banned at attempt %d",
+	         static_cast<double>(told) / nattempts, qhAttempts.count(), bannedold);
+	qWarning("limiter        %7.3f us/attempt  %d slots, persistent address banned at attempt %d",
+	         static_cast<double>(tnew) / nattempts, al.capacity(), bannednew);
+
+	return 0;
+}
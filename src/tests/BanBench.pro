@@ -0,0 +1,13 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on release
+CONFIG -= app_bundle
+QT += network sql xml
+LANGUAGE = C++
+TARGET = BanBench
+SOURCES = BanBench.cpp BanIndex.cpp AttemptLimiter.cpp Net.cpp Timer.cpp
+HEADERS = BanIndex.h AttemptLimiter.h Net.h Timer.h
+VPATH += .. ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
+!win32 {
+	LIBS += -lcrypto
+}
@@ -24,9 +24,13 @@
 #include "PacketDataStream.h"
 #include "Timer.h"
 #include "Message.h"
+#include "MessageFrame.h"
 #include "CryptState.h"
 #include "Mumble.pb.h"
 
+// Control messages sent and received by all clients, for the message rate in the status line.
+static QAtomicInt qaiTcpMessages;
+
 class Client : public QThread {
 		Q_OBJECT
 	public:
@@ -42,8 +46,9 @@ class Client : public QThread {
 		void ping();
 		void sendVoice();
 		int numbytes;
-		int ptype;
+		unsigned int ptype;
 		QSslSocket *ssl;
+		MessageFrame mfSend;
 		Client(QObject *parent, QHostAddress srvaddr, unsigned short prt, bool send, bool tcponly);
 		void doUdp(const unsigned char *buffer, int size);
 		void sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType);
@@ -115,16 +120,11 @@ Client::~Client() {
 }
 
 void Client::sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
-	unsigned char uc[4096];
-	int len = msg.ByteSize();
-	Q_ASSERT(len < 4090);
-
-	* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(msgType));
-	* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-
-	msg.SerializeToArray(uc + 6, len);
+	if (! mfSend.encode(msg, msgType))
+		qFatal("Message too large");
 
-	ssl->write(reinterpret_cast<const char *>(uc), len + 6);
+	ssl->write(mfSend.constData(), mfSend.size());
+	qaiTcpMessages.fetchAndAddRelaxed(1);
 }
 
 void Client::ping() {
@@ -189,13 +189,12 @@ void Client::readyRead() {
 	forever {
 		int avail = ssl->bytesAvailable();
 		if (numbytes == -1) {
-			if (avail < 6)
+			if (avail < MessageFrame::HeaderSize)
 				break;
-			unsigned char b[6];
-			ssl->read(reinterpret_cast<char *>(b), 6);
+			unsigned char b[MessageFrame::HeaderSize];
+			ssl->read(reinterpret_cast<char *>(b), MessageFrame::HeaderSize);
 
-			ptype = qFromBigEndian(* reinterpret_cast<quint16 *>(& b[0]));
-			numbytes = qFromBigEndian(* reinterpret_cast<quint32 *>(& b[2]));
+			MessageFrame::readHeader(b, ptype, numbytes);
 
 			avail = ssl->bytesAvailable();
 		}
@@ -205,7 +204,7 @@ void Client::readyRead() {
 			unsigned char buff[65536];
 			Q_ASSERT(want < 65536);
 			ssl->read(reinterpret_cast<char *>(buff), want);
-
+			qaiTcpMessages.fetchAndAddRelaxed(1);
 
 			avail = ssl->bytesAvailable();
 
@@ -270,6 +269,7 @@ class Container : public QObject {
 		unsigned short port;
 		QTimer qtTick;
 		Timer tickPing, tickVoice, tickGo, tickSpawn;
+		int iMessagesSeen;
 		QList<Client *> speakers;
 		QList<Client *> clients;
 		Container(QHostAddress srvaddr, unsigned short port, int nsend, int nudp, int ntcp);
@@ -283,6 +283,7 @@ Container::Container(QHostAddress qha, unsigned short port, int numsend, int num
 	live = false;
 	forceping = false;
 	sent = 0;
+	iMessagesSeen = 0;
 
 	Timer t;
 
@@ -325,6 +326,11 @@ void Container::tick() {
 		} else {
 			qWarning("Spawned %3d/%3d", isender + iudplistener + itcplistener, numsender + numudplistener + numtcplistener);
 		}
+
+		int msgs = qaiTcpMessages.fetchAndAddRelaxed(0);
+		if (msgs != iMessagesSeen)
+			qWarning("TCP: %8d msgs", msgs - iMessagesSeen);
+		iMessagesSeen = msgs;
 	}
 
 	if (live && tickVoice.isElapsed(10000ULL)) {
@@ -0,0 +1,58 @@
+#include <QtCore>
+
+#include "Timer.h"
+#include "CryptState.h"
+
+#define ITER 200000
+
+static void bench(CryptState &cs, unsigned int len) {
+	unsigned char src[1024];
+	unsigned char dst[1024 + 4];
+	unsigned char plain[1024];
+
+	for (unsigned int i=0;i<len;i++)
+		src[i] = static_cast<unsigned char>(i);
+
+	Timer t;
+	for (int i=0;i<ITER;i++)
+		cs.encrypt(src, dst, len);
+	quint64 enc = t.elapsed();
+
+	// Rewind the decrypt IV every time so the same packet keeps passing the
+	// replay check.
+	unsigned char iv[AES_BLOCK_SIZE];
+	memcpy(iv, cs.encrypt_iv, AES_BLOCK_SIZE);
+	cs.encrypt(src, dst, len);
+	t.restart();
+	for (int i=0;i<ITER;i++) {
+		memcpy(cs.decrypt_iv, iv, AES_BLOCK_SIZE);
+		if (! cs.decrypt(dst, plain, len + 4))
+			qFatal("Decrypt failed");
+	}
+	quint64 dec = t.elapsed();
+
+	qWarning("%-7s %4u bytes: encrypt %7.1f MB/s  decrypt %7.1f MB/s", cs.bAESNI ? "AES-NI" : "generic", len, (ITER * len * 1.0) / enc, (ITER * len * 1.0) / dec);
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	const unsigned char rawkey[AES_BLOCK_SIZE] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+	const unsigned int sizes[] = { 16, 64, 128, 256, 512, 1000 };
+
+	CryptState cs;
+	cs.setKey(rawkey, rawkey, rawkey);
+
+	const bool aesni = cs.bAESNI;
+	if (! aesni)
+		qWarning("CPU has no AES-NI, only benchmarking the generic implementation");
+
+	for (unsigned int i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		cs.bAESNI = false;
+		bench(cs, sizes[i]);
+		if (aesni) {
+			cs.bAESNI = true;
+			bench(cs, sizes[i]);
+		}
+	}
+}
@@ -0,0 +1,139 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+#include <QtNetwork>
+
+#include "ACL.h"
+#include "Channel.h"
+#include "Group.h"
+#include "ServerUser.h"
+
+/*
+ * Checks what a channel move has to drop from the server's permission
+ * cache. Server::clearMovedACLCache drops the moved subtree's channels and
+ * everything cached for the users inside it; this does the same by hand.
+ */
+class TestACLCache : public QObject {
+		Q_OBJECT
+	protected:
+		Channel *cRoot;
+		Channel *cOpen;
+		Channel *cOther;
+		Channel *cMoved;
+		ServerUser *uUser;
+		ChanACL::ACLCache acCache;
+		ChanACL::CompiledCache ccCompiled;
+
+		bool textMessage(Channel *c);
+		void move(Channel *c, Channel *to);
+		void forgetChannel(Channel *c);
+		void forgetUser(User *p);
+	private slots:
+		void init();
+		void cleanup();
+		void subAcrossMove();
+		void subtreeOnly();
+};
+
+bool TestACLCache::textMessage(Channel *c) {
+	return ChanACL::hasPermission(uUser, c, ChanACL::TextMessage, &acCache, &ccCompiled);
+}
+
+void TestACLCache::move(Channel *c, Channel *to) {
+	c->cParent->removeChannel(c);
+	to->addChannel(c);
+}
+
+// What clearACLCache(Channel *) drops, for a channel with nothing below it.
+void TestACLCache::forgetChannel(Channel *c) {
+	delete ccCompiled.take(c);
+	foreach(ChanACL::ChanCache *h, acCache)
+		h->remove(c);
+}
+
+// What clearACLCache(User *) drops.
+void TestACLCache::forgetUser(User *p) {
+	delete acCache.take(p);
+}
+
+// Root
+//  +- Open: only users in a channel right below it may write to it ("~sub,0,1")
+//  +- Other
+//      +- Moved: where the user is
+void TestACLCache::init() {
+	cRoot = new Channel(0, QLatin1String("Root"));
+	cOpen = new Channel(1, QLatin1String("Open"));
+	cOther = new Channel(2, QLatin1String("Other"));
+	cMoved = new Channel(3, QLatin1String("Moved"));
+	cRoot->addChannel(cOpen);
+	cRoot->addChannel(cOther);
+	cOther->addChannel(cMoved);
+
+	ChanACL *a = new ChanACL(cOpen);
+	a->bApplyHere = true;
+	a->bApplySubs = false;
+	a->qsGroup = QLatin1String("all");
+	a->pAllow = ChanACL::None;
+	a->pDeny = ChanACL::TextMessage;
+
+	a = new ChanACL(cOpen);
+	a->bApplyHere = true;
+	a->bApplySubs = false;
+	a->qsGroup = QLatin1String("~sub,0,1");
+	a->pAllow = ChanACL::TextMessage;
+	a->pDeny = ChanACL::None;
+
+	uUser = new ServerUser(NULL, new QSslSocket());
+	uUser->iId = 5;
+	uUser->uiSession = 7;
+	cMoved->addUser(uUser);
+}
+
+void TestACLCache::cleanup() {
+	foreach(ChanACL::ChanCache *h, acCache)
+		delete h;
+	acCache.clear();
+	qDeleteAll(ccCompiled);
+	ccCompiled.clear();
+
+	uUser->cChannel->removeUser(uUser);
+	delete uUser;
+	delete cRoot;
+}
+
+// Moving the user's channel below Open puts the user in Open's "sub" group.
+// Open isn't in the moved subtree, so only dropping the user's own cache
+// gets that right.
+void TestACLCache::subAcrossMove() {
+	QVERIFY(! textMessage(cOpen));
+
+	move(cMoved, cOpen);
+	forgetChannel(cMoved);
+	QVERIFY(! textMessage(cOpen));
+
+	forgetUser(uUser);
+	QVERIFY(textMessage(cOpen));
+
+	// And back out again.
+	move(cMoved, cOther);
+	forgetChannel(cMoved);
+	forgetUser(uUser);
+	QVERIFY(! textMessage(cOpen));
+}
+
+// Users outside the moved subtree keep what they had cached.
+void TestACLCache::subtreeOnly() {
+	cOther->addUser(uUser);
+	QVERIFY(! textMessage(cOpen));
+
+	move(cMoved, cOpen);
+	forgetChannel(cMoved);
+	QVERIFY(acCache.contains(uUser));
+	QVERIFY(! textMessage(cOpen));
+
+	forgetUser(uUser);
+	QVERIFY(! textMessage(cOpen));
+}
+
+QTEST_MAIN(TestACLCache)
+#include "TestACLCache.moc"
@@ -0,0 +1,16 @@
+include(../mumble.pri)
+
+DEFINES *= MURMUR
+TEMPLATE = app
+CONFIG *= qt thread warn_on network qtestlib debug
+CONFIG -= app_bundle
+QT *= network sql xml
+LANGUAGE = C++
+TARGET = TestACLCache
+SOURCES *= TestACLCache.cpp ServerUser.cpp TargetRequests.cpp
+HEADERS *= ServerUser.h TargetRequests.h
+VPATH *= .. ../murmur
+INCLUDEPATH *= .. ../murmur ../mumble
+!win32 {
+	LIBS *= -lcrypto
+}
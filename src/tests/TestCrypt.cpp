@@ -12,6 +12,7 @@ class TestCrypt : public QObject {
 		void ivrecovery();
 		void reverserecovery();
 		void tamper();
+		void aesni();
 };
 
 void TestCrypt::reverserecovery() {
@@ -161,14 +162,14 @@ void TestCrypt::authcrypt() {
 		CryptState cs;
 		cs.setKey(rawkey, nonce, nonce);
 
-		unsigned char src[len];
+		unsigned char src[128];
 		for (int i=0;i<len;i++)
 			src[i] = (i + 1);
 
 		unsigned char enctag[AES_BLOCK_SIZE];
 		unsigned char dectag[AES_BLOCK_SIZE];
-		unsigned char encrypted[len];
-		unsigned char decrypted[len];
+		unsigned char encrypted[128];
+		unsigned char decrypted[128];
 
 		cs.ocb_encrypt(src, encrypted, len, nonce, enctag);
 		cs.ocb_decrypt(encrypted, decrypted, len, nonce, dectag);
@@ -190,8 +191,8 @@ void TestCrypt::tamper() {
 	const unsigned char msg[] = "It was a funky funky town!";
 	int len = sizeof(msg);
 
-	unsigned char encrypted[len+4];
-	unsigned char decrypted[len];
+	unsigned char encrypted[sizeof(msg)+4];
+	unsigned char decrypted[sizeof(msg)];
 	cs.encrypt(msg, encrypted, len);
 
 	for (int i=0;i<len*8;i++) {
@@ -202,5 +203,49 @@ void TestCrypt::tamper() {
 	QVERIFY(cs.decrypt(encrypted, decrypted, len+4));
 }
 
+void TestCrypt::aesni() {
+	if (! CryptState::hasAESNI())
+#if QT_VERSION >= 0x050000
+		QSKIP("CPU has no AES-NI");
+#else
+		QSKIP("CPU has no AES-NI", SkipAll);
+#endif
+
+	const unsigned char rawkey[AES_BLOCK_SIZE] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+	CryptState cs;
+	cs.setKey(rawkey, rawkey, rawkey);
+	QVERIFY(cs.bAESNI);
+
+	// The AES-NI path handles four blocks at a time, so cover several multiples of that.
+	for (int len=0;len<300;len++) {
+		unsigned char nonce[AES_BLOCK_SIZE];
+		for (int i=0;i<AES_BLOCK_SIZE;i++)
+			nonce[i] = static_cast<unsigned char>(len * 7 + i);
+
+		unsigned char src[300];
+		for (int i=0;i<len;i++)
+			src[i] = static_cast<unsigned char>(qrand());
+
+		unsigned char fasttag[AES_BLOCK_SIZE], slowtag[AES_BLOCK_SIZE];
+		unsigned char fastdectag[AES_BLOCK_SIZE], slowdectag[AES_BLOCK_SIZE];
+		unsigned char fast[300], slow[300];
+		unsigned char fastdec[300], slowdec[300];
+
+		cs.bAESNI = true;
+		cs.ocb_encrypt(src, fast, len, nonce, fasttag);
+		cs.ocb_decrypt(fast, fastdec, len, nonce, fastdectag);
+
+		cs.bAESNI = false;
+		cs.ocb_encrypt(src, slow, len, nonce, slowtag);
+		cs.ocb_decrypt(slow, slowdec, len, nonce, slowdectag);
+
+		QVERIFY(memcmp(fast, slow, len) == 0);
+		QVERIFY(memcmp(fasttag, slowtag, AES_BLOCK_SIZE) == 0);
+		QVERIFY(memcmp(fastdectag, slowdectag, AES_BLOCK_SIZE) == 0);
+		QVERIFY(memcmp(fastdec, src, len) == 0);
+		QVERIFY(memcmp(slowdec, src, len) == 0);
+	}
+}
+
 QTEST_MAIN(TestCrypt)
 #include "TestCrypt.moc"
@@ -0,0 +1,124 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+
+#include "Histogram.h"
+
+class TestLatencyHistogram : public QObject {
+		Q_OBJECT
+	private slots:
+		void buckets();
+		void buckets_data();
+		void bounds();
+		void overflow();
+		void percentile();
+		void since();
+};
+
+// The bucket a single value lands in.
+static int bucketOf(quint64 usec) {
+	LatencyHistogram h;
+	h.add(usec);
+	for (int i=0;i<LatencyHistogram::Buckets;++i)
+		if (h.uiBucket[i])
+			return i;
+	return -1;
+}
+
+void TestLatencyHistogram::buckets_data() {
+	QTest::addColumn<quint64>("usec");
+	QTest::addColumn<int>("bucket");
+
+	// Exact up to 2 * SubBuckets, then pairs share a bucket.
+	QTest::newRow("0") << Q_UINT64_C(0) << 0;
+	QTest::newRow("15") << Q_UINT64_C(15) << 15;
+	QTest::newRow("16") << Q_UINT64_C(16) << 16;
+	QTest::newRow("17") << Q_UINT64_C(17) << 16;
+	QTest::newRow("18") << Q_UINT64_C(18) << 17;
+	// Top of the first shifted range and the start of the next.
+	QTest::newRow("31") << Q_UINT64_C(31) << 23;
+	QTest::newRow("32") << Q_UINT64_C(32) << 24;
+	QTest::newRow("35") << Q_UINT64_C(35) << 24;
+	QTest::newRow("36") << Q_UINT64_C(36) << 25;
+	QTest::newRow("1023") << Q_UINT64_C(1023) << 63;
+	QTest::newRow("1024") << Q_UINT64_C(1024) << 64;
+}
+
+void TestLatencyHistogram::buckets() {
+	QFETCH(quint64, usec);
+	QFETCH(int, bucket);
+
+	QCOMPARE(bucketOf(usec), bucket);
+}
+
+// Every value is at most its bucket's upper bound and above the previous
+// bucket's, so the buckets tile the range without gaps.
+void TestLatencyHistogram::bounds() {
+	QCOMPARE(LatencyHistogram::upperBound(15), Q_UINT64_C(15));
+	QCOMPARE(LatencyHistogram::upperBound(16), Q_UINT64_C(17));
+	QCOMPARE(LatencyHistogram::upperBound(23), Q_UINT64_C(31));
+
+	for (quint64 v=0;v<100000;++v) {
+		const int b = bucketOf(v);
+		QVERIFY(LatencyHistogram::upperBound(b) >= v);
+		if (b > 0)
+			QVERIFY(LatencyHistogram::upperBound(b - 1) < v);
+	}
+}
+
+void TestLatencyHistogram::overflow() {
+	const int last = LatencyHistogram::Buckets - 1;
+	const quint64 top = LatencyHistogram::upperBound(last);
+
+	QCOMPARE(bucketOf(top), last);
+	QCOMPARE(bucketOf(top + 1), last);
+	QCOMPARE(bucketOf(Q_UINT64_C(1) << 40), last);
+	QCOMPARE(bucketOf(~Q_UINT64_C(0)), last);
+}
+
+void TestLatencyHistogram::percentile() {
+	LatencyHistogram h;
+	QCOMPARE(h.percentile(0.5), Q_UINT64_C(0));
+
+	for (quint64 v=1;v<=1000;++v)
+		h.add(v);
+	QCOMPARE(h.count(), Q_UINT64_C(1000));
+	QCOMPARE(h.uiMax, Q_UINT64_C(1000));
+	QCOMPARE(h.percentile(1.0), Q_UINT64_C(1000));
+
+	// Within the bucket resolution of the exact answer, never below it.
+	const double q[] = { 0.5, 0.9, 0.99 };
+	for (unsigned int i=0;i<sizeof(q)/sizeof(q[0]);++i) {
+		const quint64 exact = static_cast<quint64>(q[i] * 1000.0);
+		const quint64 p = h.percentile(q[i]);
+		QVERIFY(p >= exact);
+		QVERIFY(p <= exact + exact / LatencyHistogram::SubBuckets);
+	}
+
+	LatencyHistogram other;
+	other.add(5000);
+	h.merge(other);
+	QCOMPARE(h.count(), Q_UINT64_C(1001));
+	QCOMPARE(h.uiMax, Q_UINT64_C(5000));
+}
+
+void TestLatencyHistogram::since() {
+	LatencyHistogram h;
+	for (quint64 v=1;v<=1000;++v)
+		h.add(v);
+
+	const LatencyHistogram earlier = h;
+	QCOMPARE(h.since(earlier).count(), Q_UINT64_C(0));
+
+	for (int i=0;i<10;++i)
+		h.add(5000);
+
+	const LatencyHistogram delta = h.since(earlier);
+	QCOMPARE(delta.count(), Q_UINT64_C(10));
+	QCOMPARE(delta.uiSum, Q_UINT64_C(50000));
+	QCOMPARE(delta.uiMax, Q_UINT64_C(5000));
+	QCOMPARE(delta.percentile(0.5), Q_UINT64_C(5000));
+}
+
+QTEST_MAIN(TestLatencyHistogram)
+#include "TestLatencyHistogram.moc"
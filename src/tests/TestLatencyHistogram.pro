@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on qtestlib
+CONFIG -= app_bundle
+QT += network sql xml
+LANGUAGE = C++
+TARGET = TestLatencyHistogram
+SOURCES = TestLatencyHistogram.cpp Histogram.cpp
+HEADERS = Histogram.h
+VPATH += ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
@@ -0,0 +1,103 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+
+#include "LegacyTexture.h"
+
+class TestLegacyTexture : public QObject {
+		Q_OBJECT
+	private slots:
+		void roundtrip();
+		void legacyBomb();
+		void legacyShort();
+		void pngBomb();
+};
+
+// A 600x60 ARGB32 bitmap with a visible 20x10 block in the top left.
+static QByteArray bitmap() {
+	QByteArray raw(LegacyTexture::RawSize, 0);
+	uchar *p = reinterpret_cast<uchar *>(raw.data());
+	for (int y=0;y<10;++y)
+		for (int x=0;x<20;++x) {
+			uchar *px = p + (y * LegacyTexture::Width + x) * 4;
+			px[0] = static_cast<uchar>(x * 10);
+			px[1] = static_cast<uchar>(y * 20);
+			px[2] = 0x80;
+			px[3] = 0xff;
+		}
+	return raw;
+}
+
+// A legacy texture whose header claims RawSize but which inflates to len.
+static QByteArray legacy(int len) {
+	QByteArray qba = qCompress(QByteArray(len, 1), 9);
+	uchar *be = reinterpret_cast<uchar *>(qba.data());
+	qToBigEndian<quint32>(LegacyTexture::RawSize, be);
+	return qba;
+}
+
+// decodePNG doesn't check CRCs, so these are left zero.
+static void appendChunk(QByteArray &png, const char *type, const QByteArray &data) {
+	uchar be[4];
+	qToBigEndian<quint32>(data.size(), be);
+	png.append(reinterpret_cast<const char *>(be), 4);
+	png.append(type, 4);
+	png.append(data);
+	png.append(QByteArray(4, 0));
+}
+
+void TestLegacyTexture::roundtrip() {
+	const QByteArray raw = bitmap();
+	const QByteArray png = LegacyTexture::canonical(qCompress(raw));
+
+	QVERIFY(png.startsWith("\x89PNG"));
+	QCOMPARE(qUncompress(LegacyTexture::toLegacy(png)), raw);
+}
+
+// A few KB that would inflate to 16 times a legacy texture are left as they
+// are instead of being inflated and converted.
+void TestLegacyTexture::legacyBomb() {
+	const QByteArray bomb = legacy(LegacyTexture::RawSize * 16);
+
+	QVERIFY(bomb.size() < 64 * 1024);
+	QVERIFY(LegacyTexture::isLegacy(bomb));
+	QCOMPARE(LegacyTexture::canonical(bomb), bomb);
+}
+
+// Inflating to less than a full bitmap is rejected as well.
+void TestLegacyTexture::legacyShort() {
+	const QByteArray qba = legacy(LegacyTexture::RawSize - 1);
+
+	QCOMPARE(LegacyTexture::canonical(qba), qba);
+}
+
+// A 1x1 PNG whose image data inflates to megabytes can't be turned into a
+// legacy texture.
+void TestLegacyTexture::pngBomb() {
+	QByteArray ihdr(13, 0);
+	uchar *hd = reinterpret_cast<uchar *>(ihdr.data());
+	qToBigEndian<quint32>(1, hd);
+	qToBigEndian<quint32>(1, hd + 4);
+	hd[8] = 8;
+	hd[9] = 6;
+
+	QByteArray png("\x89PNG\r\n\x1a\n", 8);
+	appendChunk(png, "IHDR", ihdr);
+	appendChunk(png, "IDAT", qCompress(QByteArray(LegacyTexture::RawSize * 16, 0), 9).mid(4));
+	appendChunk(png, "IEND", QByteArray());
+
+	QVERIFY(LegacyTexture::toLegacy(png).isEmpty());
+
+	// The same image with the 5 bytes it should have decodes fine.
+	QByteArray ok("\x89PNG\r\n\x1a\n", 8);
+	appendChunk(ok, "IHDR", ihdr);
+	appendChunk(ok, "IDAT", qCompress(QByteArray("\0\x01\x02\x03\xff", 5), 9).mid(4));
+	appendChunk(ok, "IEND", QByteArray());
+
+	const QByteArray raw = qUncompress(LegacyTexture::toLegacy(ok));
+	QCOMPARE(raw.size(), static_cast<int>(LegacyTexture::RawSize));
+	QCOMPARE(static_cast<int>(static_cast<uchar>(raw.at(3))), 0xff);
+}
+
+QTEST_MAIN(TestLegacyTexture)
+#include "TestLegacyTexture.moc"
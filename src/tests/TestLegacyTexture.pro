@@ -0,0 +1,12 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on qtestlib
+CONFIG -= app_bundle
+QT += network sql xml
+LANGUAGE = C++
+TARGET = TestLegacyTexture
+SOURCES = TestLegacyTexture.cpp LegacyTexture.cpp
+HEADERS = LegacyTexture.h
+VPATH += ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
+unix:LIBS *= -lz
+win32:LIBS *= -lzlib
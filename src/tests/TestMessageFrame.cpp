@@ -0,0 +1,255 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+#include <QtNetwork>
+#include <stdlib.h>
+#include <new>
+
+#include "Connection.h"
+#include "Message.h"
+#include "MessageFrame.h"
+#include "Mumble.pb.h"
+
+/*
+ * Counts every heap allocation in this process, so the tests can check what
+ * the server's framing code costs per control message.
+ */
+static QAtomicInt qaiAllocs;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC {
+	qaiAllocs.fetchAndAddRelaxed(1);
+	void *p = malloc(size ? size : 1);
+	if (! p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size) THROW_BAD_ALLOC {
+	return operator new(size);
+}
+
+void operator delete(void *p) throw() {
+	free(p);
+}
+
+void operator delete[](void *p) throw() {
+	free(p);
+}
+
+static int allocs() {
+	return qaiAllocs.fetchAndAddRelaxed(0);
+}
+
+// Hands accepted sockets out as QSslSockets, like SslServer does, without starting encryption.
+class PlainServer : public QTcpServer {
+	public:
+		QSslSocket *qssAccepted;
+		PlainServer() : qssAccepted(NULL) {
+		}
+	protected:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+		void incomingConnection(qintptr v) {
+#else
+		void incomingConnection(int v) {
+#endif
+			qssAccepted = new QSslSocket();
+			qssAccepted->setSocketDescriptor(v);
+		}
+};
+
+// Reads only when asked to, so the test controls what is counted.
+class ManualConnection : public Connection {
+	public:
+		ManualConnection(QSslSocket *sock) : Connection(NULL, sock) {
+			disconnect(qtsSocket, SIGNAL(readyRead()), this, SLOT(socketRead()));
+		}
+		void read() {
+			socketRead();
+		}
+		QSslSocket *socket() const {
+			return qtsSocket;
+		}
+		int bufferCapacity() const {
+			return qbaReadBuffer.capacity();
+		}
+};
+
+class TestMessageFrame : public QObject {
+		Q_OBJECT
+	protected:
+		int iReceived;
+		int iBytes;
+		void fill(MumbleProto::TextMessage &msg, int len);
+		void transfer(QTcpSocket &client, ManualConnection &c, const QByteArray &qba);
+	protected slots:
+		void message(unsigned int type, const QByteArray &);
+	private slots:
+		void header();
+		void encode();
+		void socketRead();
+		void largeMessage();
+};
+
+void TestMessageFrame::fill(MumbleProto::TextMessage &msg, int len) {
+	msg.Clear();
+	msg.set_actor(1);
+	msg.add_channel_id(0);
+	msg.set_message(std::string(len, 'x'));
+}
+
+void TestMessageFrame::transfer(QTcpSocket &client, ManualConnection &c, const QByteArray &qba) {
+	client.write(qba);
+	while (client.bytesToWrite() > 0)
+		QVERIFY(client.waitForBytesWritten(5000));
+	while (c.socket()->bytesAvailable() < qba.size())
+		QVERIFY(c.socket()->waitForReadyRead(5000));
+}
+
+void TestMessageFrame::message(unsigned int type, const QByteArray &qba) {
+	if (type == MessageHandler::TextMessage) {
+		++iReceived;
+		iBytes += qba.size();
+	}
+}
+
+void TestMessageFrame::header() {
+	unsigned char b[MessageFrame::HeaderSize];
+	unsigned int type;
+	int len;
+
+	MessageFrame::writeHeader(b, MessageHandler::TextMessage, 0x123456);
+	MessageFrame::readHeader(b, type, len);
+	QCOMPARE(type, static_cast<unsigned int>(MessageHandler::TextMessage));
+	QCOMPARE(len, 0x123456);
+	QCOMPARE(static_cast<int>(b[0]), 0);
+	QCOMPARE(static_cast<int>(b[2]), 0);
+	QCOMPARE(static_cast<int>(b[3]), 0x12);
+}
+
+// Once a frame has held the largest message, encoding doesn't allocate.
+void TestMessageFrame::encode() {
+	MumbleProto::TextMessage large, small;
+	fill(large, 4000);
+	fill(small, 100);
+
+	MessageFrame mf;
+	QVERIFY(mf.encode(large, MessageHandler::TextMessage));
+	QCOMPARE(mf.size(), large.ByteSize() + MessageFrame::HeaderSize);
+
+	const int before = allocs();
+	for (int i=0;i<1000;++i) {
+		QVERIFY(mf.encode(small, MessageHandler::TextMessage));
+		QVERIFY(mf.encode(large, MessageHandler::TextMessage));
+	}
+	QCOMPARE(allocs() - before, 0);
+
+	unsigned int type;
+	int len;
+	MessageFrame::readHeader(reinterpret_cast<const unsigned char *>(mf.constData()), type, len);
+	QCOMPARE(type, static_cast<unsigned int>(MessageHandler::TextMessage));
+	QCOMPARE(len, large.ByteSize());
+
+	MumbleProto::TextMessage parsed;
+	QVERIFY(parsed.ParseFromArray(mf.constData() + MessageFrame::HeaderSize, len));
+	QCOMPARE(parsed.message().size(), large.message().size());
+}
+
+// Drives Connection::socketRead over a loopback socket and counts what it
+// allocates while splitting a batch of messages out of the receive buffer.
+void TestMessageFrame::socketRead() {
+	const int batch = 200;
+
+	PlainServer srv;
+	QVERIFY(srv.listen(QHostAddress::LocalHost));
+
+	QTcpSocket client;
+	client.connectToHost(QHostAddress::LocalHost, srv.serverPort());
+	QVERIFY(client.waitForConnected(5000));
+	QVERIFY(srv.waitForNewConnection(5000));
+	QVERIFY(srv.qssAccepted);
+
+	ManualConnection c(srv.qssAccepted);
+	connect(&c, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)), Qt::DirectConnection);
+
+	MumbleProto::TextMessage msg;
+	MessageFrame mf;
+
+	for (int round=0;round<2;++round) {
+		QByteArray qba;
+		for (int i=0;i<batch;++i) {
+			fill(msg, 50 + (i * 37) % 400);
+			QVERIFY(mf.encode(msg, MessageHandler::TextMessage));
+			qba.append(mf.constData(), mf.size());
+		}
+
+		transfer(client, c, qba);
+
+		iReceived = iBytes = 0;
+
+		const int before = allocs();
+		c.read();
+		const int used = allocs() - before;
+
+		QCOMPARE(iReceived, batch);
+		QCOMPARE(iBytes, qba.size() - batch * MessageFrame::HeaderSize);
+
+		// The first round sizes the connection's read buffer. After that,
+		// a QByteArray per message would show up as at least one per message.
+		if (round > 0)
+			QVERIFY2(used < batch, qPrintable(QString::fromLatin1("%1 allocations for %2 messages").arg(used).arg(batch)));
+	}
+}
+
+// A single large message mustn't leave its size pinned in the connection's
+// read buffer, while small ones keep reusing it.
+void TestMessageFrame::largeMessage() {
+	PlainServer srv;
+	QVERIFY(srv.listen(QHostAddress::LocalHost));
+
+	QTcpSocket client;
+	client.connectToHost(QHostAddress::LocalHost, srv.serverPort());
+	QVERIFY(client.waitForConnected(5000));
+	QVERIFY(srv.waitForNewConnection(5000));
+	QVERIFY(srv.qssAccepted);
+
+	ManualConnection c(srv.qssAccepted);
+	connect(&c, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)), Qt::DirectConnection);
+
+	MumbleProto::TextMessage msg;
+	MessageFrame mf;
+
+	fill(msg, 500);
+	QVERIFY(mf.encode(msg, MessageHandler::TextMessage));
+	const QByteArray small(mf.constData(), mf.size());
+
+	fill(msg, 1024 * 1024);
+	QVERIFY(mf.encode(msg, MessageHandler::TextMessage));
+	const QByteArray large(mf.constData(), mf.size());
+
+	iReceived = iBytes = 0;
+	transfer(client, c, small);
+	c.read();
+	QCOMPARE(iReceived, 1);
+	const int kept = c.bufferCapacity();
+	QVERIFY(kept >= small.size() - MessageFrame::HeaderSize);
+
+	transfer(client, c, large);
+	c.read();
+	QCOMPARE(iReceived, 2);
+	QCOMPARE(iBytes, small.size() + large.size() - 2 * MessageFrame::HeaderSize);
+	QVERIFY2(c.bufferCapacity() <= Connection::ReadBufferKeep, qPrintable(QString::number(c.bufferCapacity())));
+
+	transfer(client, c, small);
+	c.read();
+	QCOMPARE(iReceived, 3);
+	QVERIFY(c.bufferCapacity() <= Connection::ReadBufferKeep);
+}
+
+QTEST_MAIN(TestMessageFrame)
+#include "TestMessageFrame.moc"
@@ -0,0 +1,15 @@
+include(../mumble.pri)
+
+TEMPLATE = app
+CONFIG *= qt thread warn_on network qtestlib debug
+CONFIG -= app_bundle
+QT *= network xml
+LANGUAGE = C++
+TARGET = TestMessageFrame
+SOURCES *= TestMessageFrame.cpp
+HEADERS *= MessageFrame.h
+VPATH *= ..
+INCLUDEPATH *= .. ../murmur ../mumble
+!win32 {
+	LIBS *= -lcrypto
+}
@@ -0,0 +1,140 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+
+#include "TargetRequests.h"
+
+/*
+ * Plays the voice thread side of a whisper: a packet to a target missing
+ * from the published targets is dropped, and only the first miss posts a
+ * resolve to the main thread. Nothing here resolves a target.
+ */
+class Whisperer : public QThread {
+	public:
+		TargetRequests *trq;
+		QAtomicPointer<QSet<int> > *qapPublished;
+		int iTarget;
+		int iPackets;
+		QAtomicInt qaiDelivered;
+		QAtomicInt qaiPosted;
+
+		Whisperer(TargetRequests *t, QAtomicPointer<QSet<int> > *p, int target, int packets)
+			: trq(t), qapPublished(p), iTarget(target), iPackets(packets) {
+		}
+
+		void run() {
+			for (int i=0;i<iPackets;++i) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+				const QSet<int> *published = qapPublished->loadAcquire();
+#else
+				const QSet<int> *published = *qapPublished;
+#endif
+				if (published->contains(iTarget))
+					qaiDelivered.fetchAndAddRelaxed(1);
+				else if (trq->request(iTarget))
+					qaiPosted.fetchAndAddRelaxed(1);
+			}
+		}
+};
+
+class TestTargetRequests : public QObject {
+		Q_OBJECT
+	private slots:
+		void once();
+		void independent();
+		void range();
+		void beforePopulated();
+};
+
+static int count(QAtomicInt &v) {
+	return v.fetchAndAddRelaxed(0);
+}
+
+void TestTargetRequests::once() {
+	TargetRequests trq;
+
+	QVERIFY(! trq.isPending(3));
+	QVERIFY(trq.request(3));
+	QVERIFY(trq.isPending(3));
+	for (int i=0;i<100;++i)
+		QVERIFY(! trq.request(3));
+
+	trq.clear();
+	QVERIFY(! trq.isPending(3));
+	QVERIFY(trq.request(3));
+}
+
+void TestTargetRequests::independent() {
+	TargetRequests trq;
+
+	for (int t=1;t<31;++t)
+		QVERIFY(trq.request(t));
+	for (int t=1;t<31;++t) {
+		QVERIFY(trq.isPending(t));
+		QVERIFY(! trq.request(t));
+	}
+}
+
+// 0 is normal speech and 31 is loopback; neither is a whisper target.
+void TestTargetRequests::range() {
+	TargetRequests trq;
+
+	QVERIFY(! trq.request(0));
+	QVERIFY(! trq.request(31));
+	QVERIFY(! trq.request(-1));
+	QVERIFY(! trq.request(32));
+	QVERIFY(! trq.isPending(0));
+	QVERIFY(! trq.isPending(31));
+}
+
+// Whispers from several voice threads before the main thread has published
+// the target are all dropped, and exactly one resolve is posted. Once the
+// target is published and the request cleared, packets go through and
+// nothing more is asked for.
+void TestTargetRequests::beforePopulated() {
+	const int threads = 4;
+	const int packets = 10000;
+
+	TargetRequests trq;
+	QSet<int> empty, filled;
+	filled.insert(5);
+	QAtomicPointer<QSet<int> > published(&empty);
+
+	QList<Whisperer *> ql;
+	for (int i=0;i<threads;++i)
+		ql << new Whisperer(&trq, &published, 5, packets);
+	foreach(Whisperer *w, ql)
+		w->start();
+	foreach(Whisperer *w, ql)
+		QVERIFY(w->wait(10000));
+
+	int posted = 0;
+	foreach(Whisperer *w, ql) {
+		QCOMPARE(count(w->qaiDelivered), 0);
+		posted += count(w->qaiPosted);
+	}
+	QCOMPARE(posted, 1);
+	QVERIFY(trq.isPending(5));
+
+	// What the main thread does: resolve, publish, then clear the request.
+	published.fetchAndStoreOrdered(&filled);
+	trq.clear();
+
+	foreach(Whisperer *w, ql) {
+		w->qaiPosted.fetchAndStoreRelaxed(0);
+		w->start();
+	}
+	foreach(Whisperer *w, ql)
+		QVERIFY(w->wait(10000));
+
+	foreach(Whisperer *w, ql) {
+		QCOMPARE(count(w->qaiPosted), 0);
+		QCOMPARE(count(w->qaiDelivered), packets);
+	}
+	QVERIFY(! trq.isPending(5));
+
+	qDeleteAll(ql);
+}
+
+QTEST_MAIN(TestTargetRequests)
+#include "TestTargetRequests.moc"
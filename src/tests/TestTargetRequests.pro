@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on qtestlib
+CONFIG -= app_bundle
+QT += network sql xml
+LANGUAGE = C++
+TARGET = TestTargetRequests
+SOURCES = TestTargetRequests.cpp TargetRequests.cpp
+HEADERS = TargetRequests.h
+VPATH += ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
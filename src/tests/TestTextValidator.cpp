@@ -0,0 +1,155 @@
+#include <QtCore>
+#include <QtTest>
+#include <QtXml>
+#include <QObject>
+
+#include "TextValidator.h"
+
+// textmessagelength as shipped in murmur.ini.
+#define MAX_TEXT 5000
+
+// What Server::isTextAllowed did before TextValidator: parse the whole
+// message, write it back out without <img src> and measure the copy.
+static bool xmlAllowed(const QString &text, int maxLength) {
+	QString qsOut;
+	QXmlStreamReader qxsr(QString::fromLatin1("<document>%1</document>").arg(text));
+	QXmlStreamWriter qxsw(&qsOut);
+	while (! qxsr.atEnd()) {
+		switch (qxsr.readNext()) {
+			case QXmlStreamReader::Invalid:
+				return false;
+			case QXmlStreamReader::StartElement: {
+					if (qxsr.name() == QLatin1String("img")) {
+						qxsw.writeStartElement(qxsr.namespaceUri().toString(), qxsr.name().toString());
+						foreach(const QXmlStreamAttribute &a, qxsr.attributes())
+							if (a.name() != QLatin1String("src"))
+								qxsw.writeAttribute(a);
+					} else {
+						qxsw.writeCurrentToken(qxsr);
+					}
+				}
+				break;
+			default:
+				qxsw.writeCurrentToken(qxsr);
+				break;
+		}
+	}
+	return qsOut.length() <= maxLength;
+}
+
+static QString formatted(int paragraphs) {
+	QString s;
+	for (int i=0;i<paragraphs;++i)
+		s += QString::fromLatin1("<p>Raid tonight at <b>20:00</b> &amp; bring <i>consumables</i>. "
+		                         "Details on <a href=\"https://example.com/raid?id=%1&amp;x=1\">the forum</a>.<br/></p>").arg(i);
+	return s;
+}
+
+static QString image(int bytes) {
+	QByteArray raw(bytes, '\0');
+	for (int i=0;i<bytes;++i)
+		raw[i] = static_cast<char>(i * 31 + 7);
+	return QString::fromLatin1("<p>Look at this:</p><img src=\"data:image/png;base64,%1\" alt=\"screenshot\"/>").arg(QLatin1String(raw.toBase64()));
+}
+
+class TestTextValidator : public QObject {
+		Q_OBJECT
+	private slots:
+		void agrees_data();
+		void agrees();
+		void result();
+		void length();
+};
+
+// Lengths stay well clear of MAX_TEXT, as the old check measured the
+// re-serialized copy rather than the message itself.
+void TestTextValidator::agrees_data() {
+	QTest::addColumn<QString>("text");
+
+	// Valid
+	QTest::newRow("plain") << QString::fromLatin1("anyone up for a round?");
+	QTest::newRow("short html") << QString::fromLatin1("<b>anyone</b> up for a round?");
+	QTest::newRow("formatted") << formatted(20);
+	QTest::newRow("nested") << QString::fromLatin1("<p><b><i>x</i></b><br/><span style='color:#ff0000'>y</span></p>");
+	QTest::newRow("comment") << QString::fromLatin1("<!-- hidden --><b>x</b>");
+	QTest::newRow("cdata") << QString::fromLatin1("<![CDATA[<b>not a tag</b>]]>");
+	QTest::newRow("cdata end") << QString::fromLatin1("<![CDATA[a]]>>");
+	QTest::newRow("unicode") << QString::fromUtf8("caf\xc3\xa9 \xf0\x9f\x98\x80");
+
+	// Over the limit
+	QTest::newRow("long plain") << QString(MAX_TEXT * 2, QLatin1Char('x'));
+	QTest::newRow("long formatted") << formatted(60);
+	QTest::newRow("long with image") << formatted(60) + image(1024);
+
+	// Malformed or unbalanced
+	QTest::newRow("unclosed") << formatted(20) + QLatin1String("<b>unclosed");
+	QTest::newRow("crossed") << QString::fromLatin1("<b><i>x</b></i>");
+	QTest::newRow("stray close") << QString::fromLatin1("x</b>");
+	QTest::newRow("case") << QString::fromLatin1("<P>x</p>");
+	QTest::newRow("html br") << QString::fromLatin1("a<br>b");
+	QTest::newRow("unquoted") << QString::fromLatin1("<a href=x>y</a>");
+	QTest::newRow("no space") << QString::fromLatin1("<p a='1'b='2'>x</p>");
+	QTest::newRow("duplicate") << QString::fromLatin1("<a href=\"x\" href=\"y\">z</a>");
+	QTest::newRow("empty tag") << QString::fromLatin1("<>");
+	QTest::newRow("truncated") << QString::fromLatin1("<b");
+	QTest::newRow("doctype") << QString::fromLatin1("<!DOCTYPE x>");
+	QTest::newRow("control") << QString::fromLatin1("text\x01more");
+	QTest::newRow("cdata close") << QString::fromLatin1("<p>]]></p>");
+	QTest::newRow("lt in value") << QString::fromLatin1("<img src=\"a<b\"/>");
+
+	// Entities
+	QTest::newRow("predefined") << QString::fromLatin1("&lt;b&gt; &amp; &quot;hi&quot; &apos;x&apos;");
+	QTest::newRow("numeric") << QString::fromLatin1("&#65;&#x42;&#9;&#xA;&#x1F600;");
+	QTest::newRow("in value") << QString::fromLatin1("<a href=\"?a=1&amp;b=&#50;\">l</a>");
+	QTest::newRow("html entity") << QString::fromLatin1("a&nbsp;b");
+	QTest::newRow("nul") << QString::fromLatin1("&#0;");
+	QTest::newRow("surrogate") << QString::fromLatin1("&#xD800;");
+	QTest::newRow("too big") << QString::fromLatin1("&#x110000;");
+	QTest::newRow("no digits") << QString::fromLatin1("&#;");
+	QTest::newRow("unterminated") << QString::fromLatin1("&amp");
+	QTest::newRow("bare") << QString::fromLatin1("a & b");
+	QTest::newRow("bad in value") << QString::fromLatin1("<a href=\"?a=1&b=2\">l</a>");
+
+	// Images
+	QTest::newRow("remote img") << QString::fromLatin1("<img src=\"http://example.com/a.png\"/>");
+	QTest::newRow("data img") << image(12 * 1024);
+	QTest::newRow("large data img") << image(72 * 1024);
+	QTest::newRow("single quoted img") << QString::fromLatin1("<img src='data:image/png;base64,AAAA' alt=\"s\"/>");
+	QTest::newRow("img text") << formatted(20) + image(72 * 1024);
+}
+
+void TestTextValidator::agrees() {
+	QFETCH(QString, text);
+
+	QCOMPARE(TextValidator::check(text, MAX_TEXT) == TextValidator::Valid, xmlAllowed(text, MAX_TEXT));
+}
+
+void TestTextValidator::result() {
+	QCOMPARE(TextValidator::check(QString(), MAX_TEXT), TextValidator::Valid);
+	QCOMPARE(TextValidator::check(formatted(60), 0), TextValidator::Valid);
+	QCOMPARE(TextValidator::check(formatted(60), MAX_TEXT), TextValidator::TooLong);
+	QCOMPARE(TextValidator::check(QLatin1String("<b>x"), MAX_TEXT), TextValidator::Malformed);
+	QCOMPARE(TextValidator::check(QLatin1String("&nbsp;"), 0), TextValidator::Malformed);
+
+	// The scan stops at the limit, before it gets to the broken tag.
+	QCOMPARE(TextValidator::check(QString(100, QLatin1Char('x')) + QLatin1String("<b"), 50), TextValidator::TooLong);
+}
+
+void TestTextValidator::length() {
+	int len = -1;
+
+	QCOMPARE(TextValidator::check(QLatin1String("<b>abc</b>"), 0, &len), TextValidator::Valid);
+	QCOMPARE(len, 10);
+
+	// Only the src value of an <img> is left out.
+	QCOMPARE(TextValidator::check(QLatin1String("<img src=\"0123456789\"/>"), 0, &len), TextValidator::Valid);
+	QCOMPARE(len, 13);
+	QCOMPARE(TextValidator::check(QLatin1String("<a src=\"0123456789\"/>"), 0, &len), TextValidator::Valid);
+	QCOMPARE(len, 21);
+
+	QCOMPARE(TextValidator::check(QString::fromLatin1("0123456789"), 10, &len), TextValidator::Valid);
+	QCOMPARE(TextValidator::check(QString::fromLatin1("0123456789a"), 10, &len), TextValidator::TooLong);
+}
+
+QTEST_MAIN(TestTextValidator)
+#include "TestTextValidator.moc"
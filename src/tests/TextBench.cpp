@@ -0,0 +1,116 @@
+#include <QtCore>
+#include <QtXml>
+
+#include "TextValidator.h"
+#include "Timer.h"
+
+// textmessagelength as shipped in murmur.ini.
+#define MAX_TEXT 5000
+
+// What Server::isTextAllowed did before TextValidator: parse the whole
+// message, write it back out without <img src> and measure the copy.
+static bool xmlAllowed(const QString &text, int maxLength) {
+	QString qsOut;
+	QXmlStreamReader qxsr(QString::fromLatin1("<document>%1</document>").arg(text));
+	QXmlStreamWriter qxsw(&qsOut);
+	while (! qxsr.atEnd()) {
+		switch (qxsr.readNext()) {
+			case QXmlStreamReader::Invalid:
+				return false;
+			case QXmlStreamReader::StartElement: {
+					if (qxsr.name() == QLatin1String("img")) {
+						qxsw.writeStartElement(qxsr.namespaceUri().toString(), qxsr.name().toString());
+						foreach(const QXmlStreamAttribute &a, qxsr.attributes())
+							if (a.name() != QLatin1String("src"))
+								qxsw.writeAttribute(a);
+					} else {
+						qxsw.writeCurrentToken(qxsr);
+					}
+				}
+				break;
+			default:
+				qxsw.writeCurrentToken(qxsr);
+				break;
+		}
+	}
+	return qsOut.length() <= maxLength;
+}
+
+static QString formatted(int paragraphs) {
+	QString s;
+	for (int i=0;i<paragraphs;++i)
+		s += QString::fromLatin1("<p>Raid tonight at <b>20:00</b> &amp; bring <i>consumables</i>. "
+		                         "Details on <a href=\"https://example.com/raid?id=%1&amp;x=1\">the forum</a>.<br/></p>").arg(i);
+	return s;
+}
+
+static QString image(int bytes) {
+	QByteArray raw(bytes, '\0');
+	for (int i=0;i<bytes;++i)
+		raw[i] = static_cast<char>(qrand());
+	return QString::fromLatin1("<p>Look at this:</p><img src=\"data:image/png;base64,%1\" alt=\"screenshot\"/>").arg(QLatin1String(raw.toBase64()));
+}
+
+struct Corpus {
+	const char *name;
+	QString text;
+	int iter;
+};
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	QList<Corpus> corpora;
+	Corpus c;
+
+	c.name = "short html";
+	c.text = QLatin1String("<b>anyone</b> up for a round?");
+	c.iter = 100000;
+	corpora << c;
+
+	c.name = "formatted 4k";
+	c.text = formatted(30);
+	c.iter = 10000;
+	corpora << c;
+
+	c.name = "image 16k";
+	c.text = image(12 * 1024);
+	c.iter = 2000;
+	corpora << c;
+
+	c.name = "image 96k";
+	c.text = image(72 * 1024);
+	c.iter = 200;
+	corpora << c;
+
+	c.name = "over text limit";
+	c.text = formatted(60);
+	c.iter = 10000;
+	corpora << c;
+
+	c.name = "malformed";
+	c.text = formatted(20) + QLatin1String("<b>unclosed");
+	c.iter = 10000;
+	corpora << c;
+
+	foreach(const Corpus &cor, corpora) {
+		Timer t;
+		bool oldok = false, newok = false;
+
+		t.restart();
+		for (int i=0;i<cor.iter;++i)
+			oldok = xmlAllowed(cor.text, MAX_TEXT);
+		quint64 told = t.elapsed();
+
+		t.restart();
+		for (int i=0;i<cor.iter;++i)
+			newok = (TextValidator::check(cor.text, MAX_TEXT) == TextValidator::Valid);
+		quint64 tnew = t.elapsed();
+
+		qWarning("%-16s %7d chars  xml %8.2f us  validator %8.2f us  %s/%s", cor.name, cor.text.length(),
+		         static_cast<double>(told) / cor.iter, static_cast<double>(tnew) / cor.iter,
+		         oldok ? "ok" : "reject", newok ? "ok" : "reject");
+	}
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on release
+CONFIG -= app_bundle
+QT += network sql xml
+LANGUAGE = C++
+TARGET = TextBench
+SOURCES = TextBench.cpp TextValidator.cpp Timer.cpp
+HEADERS = TextValidator.h Timer.h
+VPATH += .. ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
+!win32 {
+	LIBS += -lcrypto
+}